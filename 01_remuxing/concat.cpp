@@ -0,0 +1,233 @@
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavutil/avutil.h>
+}
+#include "defer.h"
+#include "fmt/format.h"
+#include "logging.h"
+#include "remuxing.h"
+#include "timestamp.h"
+
+#include <cstring>
+#include <future>
+#include <vector>
+
+static AVFormatContext *open_concat_input(const std::string& filename, const ProbeOptions& probe)
+{
+    AVFormatContext *fmt_ctx = nullptr;
+    if (open_input(&fmt_ctx, filename, nullptr, nullptr, probe) < 0) {
+        LOG(ERROR) << "failed to open the " << filename << " file.";
+        return nullptr;
+    }
+
+    return fmt_ctx;
+}
+
+// the audio / video / subtitle streams in the order of the input file
+static std::vector<int> select_streams(const AVFormatContext *fmt_ctx)
+{
+    std::vector<int> streams{};
+    for (unsigned int i = 0; i < fmt_ctx->nb_streams; i++) {
+        const auto type = fmt_ctx->streams[i]->codecpar->codec_type;
+        if (type == AVMEDIA_TYPE_VIDEO || type == AVMEDIA_TYPE_AUDIO || type == AVMEDIA_TYPE_SUBTITLE) {
+            streams.push_back(static_cast<int>(i));
+        }
+    }
+    return streams;
+}
+
+static int channels(const AVCodecParameters *params)
+{
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57, 28, 100)
+    return params->ch_layout.nb_channels;
+#else
+    return params->channels;
+#endif
+}
+
+// the packets are copied without re-encoding, so the streams must be decodable by the decoder
+// initialized with the parameters of the first input file, empty if compatible
+static std::string incompatible(const AVCodecParameters *first, const AVCodecParameters *params,
+                                bool global_header)
+{
+    if (first->codec_type != params->codec_type || first->codec_id != params->codec_id) {
+        return fmt::format("codec '{}' != '{}'", avcodec_get_name(params->codec_id),
+                           avcodec_get_name(first->codec_id));
+    }
+
+    if (first->codec_type == AVMEDIA_TYPE_VIDEO &&
+        (first->width != params->width || first->height != params->height)) {
+        return fmt::format("video size {}x{} != {}x{}", params->width, params->height, first->width,
+                           first->height);
+    }
+
+    if (first->codec_type == AVMEDIA_TYPE_AUDIO &&
+        (first->sample_rate != params->sample_rate || channels(first) != channels(params))) {
+        return fmt::format("audio {}Hz/{}ch != {}Hz/{}ch", params->sample_rate, channels(params),
+                           first->sample_rate, channels(first));
+    }
+
+    // the global header (e.g. 'avcC' of mp4) is written once with the extradata of the first input,
+    // formats carrying the parameter sets in-band (e.g. mpegts) can switch them in the stream
+    const bool same_extradata =
+        first->extradata_size == params->extradata_size &&
+        (first->extradata_size == 0 ||
+         std::memcmp(first->extradata, params->extradata, first->extradata_size) == 0);
+    if (!same_extradata && global_header) {
+        return "extradata differs, but the output format only has a global header";
+    }
+
+    return {};
+}
+
+int remux_concat(const std::vector<std::string>& in_filenames, const std::string& out_filename,
+                 const ProbeOptions& probe, const InterleaveOptions& interleave)
+{
+    // the first input decides the output streams
+    AVFormatContext *decoder_fmt_ctx = open_concat_input(in_filenames[0], probe);
+    if (!decoder_fmt_ctx) return -1;
+    defer(avformat_close_input(&decoder_fmt_ctx));
+
+    AVFormatContext *encoder_fmt_ctx = nullptr;
+    if (avformat_alloc_output_context2(&encoder_fmt_ctx, nullptr, nullptr, out_filename.c_str()) < 0) {
+        LOG(ERROR) << "[CONCAT] failed to alloc the output context: " << out_filename;
+        return -1;
+    }
+    defer(avformat_free_context(encoder_fmt_ctx));
+
+    const bool global_header = encoder_fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER;
+
+    const auto first_streams = select_streams(decoder_fmt_ctx);
+    if (first_streams.empty()) {
+        LOG(ERROR) << "[CONCAT] no stream can be copied.";
+        return -1;
+    }
+
+    for (const auto idx : first_streams) {
+        AVStream *encode_stream = avformat_new_stream(encoder_fmt_ctx, nullptr);
+        if (!encode_stream ||
+            avcodec_parameters_copy(encode_stream->codecpar, decoder_fmt_ctx->streams[idx]->codecpar) < 0) {
+            LOG(ERROR) << "[CONCAT] failed to add the output stream.";
+            return -1;
+        }
+        encode_stream->codecpar->codec_tag = 0;
+    }
+
+    if (!(encoder_fmt_ctx->oformat->flags & AVFMT_NOFILE)) {
+        if (avio_open(&encoder_fmt_ctx->pb, out_filename.c_str(), AVIO_FLAG_WRITE) < 0) {
+            LOG(ERROR) << "[CONCAT] failed to open the output file: " << out_filename;
+            return -1;
+        }
+    }
+    defer(if (!(encoder_fmt_ctx->oformat->flags & AVFMT_NOFILE)) avio_closep(&encoder_fmt_ctx->pb));
+
+    if (avformat_write_header(encoder_fmt_ctx, nullptr) < 0) {
+        LOG(ERROR) << "[CONCAT] failed to write the header to the output file.";
+        return -1;
+    }
+    av_dump_format(encoder_fmt_ctx, 0, out_filename.c_str(), 1);
+
+    Interleaver interleaver(encoder_fmt_ctx, interleave);
+
+    std::vector<int64_t> last_dts(encoder_fmt_ctx->nb_streams, AV_NOPTS_VALUE);
+    int64_t offset = 0; // AV_TIME_BASE, where the current input starts in the output
+
+    AVPacket *packet = av_packet_alloc();
+    defer(av_packet_free(&packet));
+
+    for (size_t i = 0; i < in_filenames.size(); i++) {
+        // open and probe the next input while copying the current one
+        std::future<AVFormatContext *> next{};
+        if (i + 1 < in_filenames.size()) {
+            next = std::async(std::launch::async, open_concat_input, in_filenames[i + 1], probe);
+        }
+        // closed on the early returns, taken by the switch to the next input otherwise
+        defer(if (next.valid()) {
+            AVFormatContext *ctx = next.get();
+            avformat_close_input(&ctx);
+        });
+
+        // map the streams of the current input to the output streams
+        const auto streams = select_streams(decoder_fmt_ctx);
+        std::vector<int> stream_mapping(decoder_fmt_ctx->nb_streams, -1);
+        for (size_t j = 0; j < std::min(streams.size(), first_streams.size()); j++) {
+            const auto reason = incompatible(encoder_fmt_ctx->streams[j]->codecpar,
+                                             decoder_fmt_ctx->streams[streams[j]]->codecpar, global_header);
+            if (!reason.empty()) {
+                LOG(ERROR) << fmt::format("[CONCAT] {}: stream #{} is incompatible, {}", in_filenames[i],
+                                          streams[j], reason);
+                return -1;
+            }
+            stream_mapping[streams[j]] = static_cast<int>(j);
+        }
+        if (streams.size() != first_streams.size()) {
+            LOG(WARNING) << fmt::format("[CONCAT] {}: {} streams, {} expected", in_filenames[i],
+                                        streams.size(), first_streams.size());
+        }
+
+        const int64_t start =
+            decoder_fmt_ctx->start_time == AV_NOPTS_VALUE ? 0 : decoder_fmt_ctx->start_time;
+        int64_t end         = offset;
+        int64_t fixed_dts   = 0;
+
+        LOG(INFO) << fmt::format("[CONCAT] {}: offset = {:.3f}s", in_filenames[i], offset / 1000000.0);
+
+        while (av_read_frame(decoder_fmt_ctx, packet) >= 0) {
+            const int out_idx = stream_mapping[packet->stream_index];
+            if (out_idx < 0) {
+                av_packet_unref(packet);
+                continue;
+            }
+
+            const AVRational in_time_base = decoder_fmt_ctx->streams[packet->stream_index]->time_base;
+            const AVRational out_time_base = encoder_fmt_ctx->streams[out_idx]->time_base;
+
+            // shift the timestamps by the end of the previous inputs
+            const int64_t shift = av_rescale_q(offset - start, AV_TIME_BASE_Q, in_time_base);
+            if (packet->pts != AV_NOPTS_VALUE) packet->pts += shift;
+            if (packet->dts != AV_NOPTS_VALUE) packet->dts += shift;
+
+            if (packet->pts != AV_NOPTS_VALUE) {
+                end = std::max(end,
+                               av_rescale_q(packet->pts + packet->duration, in_time_base, AV_TIME_BASE_Q));
+            }
+
+            av_packet_rescale_ts(packet, in_time_base, out_time_base);
+            packet->stream_index = out_idx;
+            packet->pos          = -1;
+
+            // the delayed dts of the B-frames at the beginning may overlap with the previous input
+            if (fix_monotonic_dts(packet, last_dts[out_idx])) fixed_dts++;
+
+            if (interleaver.write(packet) < 0) {
+                LOG(ERROR) << "[CONCAT] failed to write frame.";
+                return -1;
+            }
+        }
+
+        if (fixed_dts > 0) {
+            LOG(WARNING) << fmt::format("[CONCAT] {}: {} non-monotonic dts are adjusted", in_filenames[i],
+                                        fixed_dts);
+        }
+
+        offset = end;
+
+        // switch to the next input
+        avformat_close_input(&decoder_fmt_ctx);
+        if (next.valid()) {
+            decoder_fmt_ctx = next.get();
+            if (!decoder_fmt_ctx) return -1;
+        }
+    }
+
+    if (interleaver.flush() < 0) {
+        LOG(ERROR) << "[CONCAT] failed to write frame.";
+        return -1;
+    }
+    av_write_trailer(encoder_fmt_ctx);
+    interleaver.log_stats(out_filename);
+
+    LOG(INFO) << fmt::format("[CONCAT] {} inputs -> {}, duration = {:.3f}s", in_filenames.size(),
+                             out_filename, offset / 1000000.0);
+    return 0;
+}
@@ -0,0 +1,212 @@
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavutil/avutil.h>
+}
+#include "boundedqueue.h"
+#include "defer.h"
+#include "fmt/format.h"
+#include "logging.h"
+#include "remuxing.h"
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+// one output file, the packets are written by its own thread
+struct Muxer
+{
+    explicit Muxer(size_t queue_size)
+        : queue(queue_size, [](AVPacket **packet) { av_packet_free(packet); })
+    {}
+
+    ~Muxer()
+    {
+        if (fmt_ctx && !(fmt_ctx->oformat->flags & AVFMT_NOFILE)) avio_closep(&fmt_ctx->pb);
+        avformat_free_context(fmt_ctx);
+    }
+
+    std::string filename{};
+    AVFormatContext *fmt_ctx{ nullptr };
+    std::vector<int> stream_mapping{}; // input stream index -> output stream index
+
+    BoundedQueue<AVPacket *> queue;
+    std::thread thread{};
+
+    std::atomic<bool> failed{ false };
+    int64_t packets{ 0 };
+    int64_t blocked{ 0 }; // how many times the demuxer waited for this muxer
+};
+
+static int open_muxer(Muxer& muxer, const AVFormatContext *decoder_fmt_ctx)
+{
+    if (avformat_alloc_output_context2(&muxer.fmt_ctx, nullptr, nullptr, muxer.filename.c_str()) < 0) {
+        LOG(ERROR) << "can not alloc the output context : " << muxer.filename;
+        return -1;
+    }
+
+    muxer.stream_mapping.assign(decoder_fmt_ctx->nb_streams, -1);
+    int stream_idx = 0;
+    for (unsigned int i = 0; i < decoder_fmt_ctx->nb_streams; i++) {
+        AVCodecParameters *decode_params = decoder_fmt_ctx->streams[i]->codecpar;
+        if (decode_params->codec_type != AVMEDIA_TYPE_VIDEO &&
+            decode_params->codec_type != AVMEDIA_TYPE_AUDIO &&
+            decode_params->codec_type != AVMEDIA_TYPE_SUBTITLE) {
+            continue;
+        }
+
+        // e.g. the mpegts can not carry the 'ass' subtitles of a mkv file
+        const int supported =
+            avformat_query_codec(muxer.fmt_ctx->oformat, decode_params->codec_id, FF_COMPLIANCE_NORMAL);
+        if (supported == 0) {
+            LOG(WARNING) << fmt::format("[{}] ignore the stream #{}, '{}' is not supported", muxer.filename,
+                                        i, avcodec_get_name(decode_params->codec_id));
+            continue;
+        }
+
+        AVStream *encode_stream = avformat_new_stream(muxer.fmt_ctx, nullptr);
+        if (!encode_stream || avcodec_parameters_copy(encode_stream->codecpar, decode_params) < 0) {
+            LOG(ERROR) << "can not add the stream #" << i << " to the output file : " << muxer.filename;
+            return -1;
+        }
+
+        // the tags are container specific
+        encode_stream->codecpar->codec_tag = 0;
+
+        muxer.stream_mapping[i] = stream_idx++;
+    }
+
+    if (!(muxer.fmt_ctx->oformat->flags & AVFMT_NOFILE)) {
+        if (avio_open(&muxer.fmt_ctx->pb, muxer.filename.c_str(), AVIO_FLAG_WRITE) < 0) {
+            LOG(ERROR) << "can not open the output file : " << muxer.filename;
+            return -1;
+        }
+    }
+
+    if (avformat_write_header(muxer.fmt_ctx, nullptr) < 0) {
+        LOG(ERROR) << "can not write header to the output file : " << muxer.filename;
+        return -1;
+    }
+
+    av_dump_format(muxer.fmt_ctx, 0, muxer.filename.c_str(), 1);
+    return 0;
+}
+
+static void mux_thread(Muxer& muxer, const InterleaveOptions& interleave)
+{
+    LOG(INFO) << "[MUXER THREAD @ " << std::this_thread::get_id() << "] " << muxer.filename << " START";
+    defer(LOG(INFO) << "[MUXER THREAD @ " << std::this_thread::get_id() << "] " << muxer.filename
+                    << " EXITED");
+
+    Interleaver interleaver(muxer.fmt_ctx, interleave);
+
+    while (auto packet = muxer.queue.pop()) {
+        // take the ownership of the buffer reference, and free the packet itself
+        const int ret = interleaver.write(packet.value());
+        av_packet_free(&packet.value());
+
+        if (ret < 0) {
+            LOG(ERROR) << "[" << muxer.filename << "] failed to write frame";
+            // stop receiving packets, the others keep going
+            muxer.failed = true;
+            muxer.queue.close();
+            muxer.queue.clear();
+            break;
+        }
+        muxer.packets++;
+    }
+
+    if (!muxer.failed && interleaver.flush() < 0) {
+        LOG(ERROR) << "[" << muxer.filename << "] failed to write frame";
+        muxer.failed = true;
+    }
+
+    if (!muxer.failed) {
+        av_write_trailer(muxer.fmt_ctx);
+        interleaver.log_stats(muxer.filename);
+    }
+
+    if (!(muxer.fmt_ctx->oformat->flags & AVFMT_NOFILE)) {
+        avio_closep(&muxer.fmt_ctx->pb);
+    }
+}
+
+int remux_fanout(const std::string& in_filename, const std::vector<std::string>& out_filenames,
+                 size_t queue_size, const ProbeOptions& probe, const InterleaveOptions& interleave)
+{
+    // input, opened only once for all the outputs
+    AVFormatContext *decoder_fmt_ctx = nullptr;
+    if (open_input(&decoder_fmt_ctx, in_filename, nullptr, nullptr, probe) < 0) {
+        LOG(ERROR) << "can not open the input file : " << in_filename;
+        return -1;
+    }
+    defer(avformat_close_input(&decoder_fmt_ctx));
+    av_dump_format(decoder_fmt_ctx, 0, in_filename.c_str(), 0);
+
+    // outputs
+    std::vector<std::unique_ptr<Muxer>> muxers{};
+    for (const auto& filename : out_filenames) {
+        auto muxer      = std::make_unique<Muxer>(queue_size);
+        muxer->filename = filename;
+        if (open_muxer(*muxer, decoder_fmt_ctx) < 0) {
+            return -1;
+        }
+        muxers.emplace_back(std::move(muxer));
+    }
+
+    for (auto& muxer : muxers) {
+        muxer->thread = std::thread([&muxer, &interleave]() { mux_thread(*muxer, interleave); });
+    }
+
+    // demux once, and dispatch the packets to every muxer
+    AVPacket *packet = av_packet_alloc();
+    defer(av_packet_free(&packet));
+    while (av_read_frame(decoder_fmt_ctx, packet) >= 0) {
+        const AVStream *decode_stream = decoder_fmt_ctx->streams[packet->stream_index];
+
+        for (auto& muxer : muxers) {
+            const int stream_idx = muxer->stream_mapping[packet->stream_index];
+            if (stream_idx < 0 || muxer->failed) continue;
+
+            // new reference to the same buffer, the packet data is not copied, a failure stops this muxer
+            // only, the same as a write error
+            AVPacket *ref = av_packet_alloc();
+            if (!ref || av_packet_ref(ref, packet) < 0) {
+                LOG(ERROR) << "[" << muxer->filename << "] failed to reference the packet";
+                av_packet_free(&ref);
+                muxer->failed = true;
+                muxer->queue.close();
+                muxer->queue.clear();
+                continue;
+            }
+
+            ref->stream_index = stream_idx;
+            ref->pos          = -1;
+            av_packet_rescale_ts(ref, decode_stream->time_base,
+                                 muxer->fmt_ctx->streams[stream_idx]->time_base);
+
+            // a slow muxer only blocks the demuxer when its own queue is full
+            if (muxer->queue.full()) muxer->blocked++;
+            if (!muxer->queue.push(ref)) {
+                av_packet_free(&ref);
+            }
+        }
+
+        av_packet_unref(packet);
+    }
+
+    for (auto& muxer : muxers) {
+        muxer->queue.close();
+    }
+
+    int ret = 0;
+    for (auto& muxer : muxers) {
+        if (muxer->thread.joinable()) muxer->thread.join();
+
+        LOG(INFO) << fmt::format("[{}] packets = {}, blocked = {}, {}", muxer->filename, muxer->packets,
+                                 muxer->blocked, muxer->failed ? "FAILED" : "OK");
+        ret = muxer->failed ? -1 : ret;
+    }
+
+    return ret;
+}
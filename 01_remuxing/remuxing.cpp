@@ -2,30 +2,28 @@ extern "C" {
 #include <libavformat/avformat.h>
 #include <libavutil/avutil.h>
 }
+#include "argsparser.h"
+#include "logging.h"
+#include "remuxing.h"
+
 #include <map>
 
-int main(int argc, char *argv[])
+int remux(const std::string& in, const std::string& out, const ProbeOptions& probe,
+          const InterleaveOptions& interleave)
 {
-    if (argc < 3) {
-        printf("remux <input> <output>\n");
-        return -1;
-    }
-
-    const char *in_filename  = argv[1];
-    const char *out_filename = argv[2];
+    const char *in_filename  = in.c_str();
+    const char *out_filename = out.c_str();
 
     // input
+    //
+    // the stream information is restored from the cache if the file has been probed before,
+    // otherwise avformat_find_stream_info() is called with the bounded 'probesize' and 'analyzeduration'
     AVFormatContext *decoder_fmt_ctx = nullptr;
-    if (avformat_open_input(&decoder_fmt_ctx, in_filename, nullptr, nullptr) < 0) {
+    if (open_input(&decoder_fmt_ctx, in, nullptr, nullptr, probe) < 0) {
         fprintf(stderr, "failed to open the %s file.\n", in_filename);
         return -1;
     }
 
-    if (avformat_find_stream_info(decoder_fmt_ctx, nullptr) < 0) {
-        fprintf(stderr, "not find stream info.\n");
-        return -1;
-    }
-
     av_dump_format(decoder_fmt_ctx, 0, in_filename, 0);
 
     // output
@@ -79,6 +77,10 @@ int main(int argc, char *argv[])
 
     av_dump_format(encoder_fmt_ctx, 0, out_filename, 1);
 
+    // the packets are buffered by the interleaver until they can be written in the dts order,
+    // but no longer than 'max_delay' and no more than 'max_bytes'
+    Interleaver interleaver(encoder_fmt_ctx, interleave);
+
     // copy streams
     AVPacket *packet     = av_packet_alloc();
     int64_t frame_number = 0;
@@ -108,12 +110,18 @@ int main(int argc, char *argv[])
         packet->stream_index = stream_mapping[packet->stream_index];
         // write the packet to the output file
         // this function will take the owership of the packet, and packet will be blank
-        if (av_interleaved_write_frame(encoder_fmt_ctx, packet) != 0) {
+        if (interleaver.write(packet) < 0) {
             fprintf(stderr, "failed to write frame.\n");
             return -1;
         }
     }
 
+    if (interleaver.flush() < 0) {
+        fprintf(stderr, "failed to write frame.\n");
+        return -1;
+    }
+    interleaver.log_stats(out);
+
     // write the trailer to the output file and close it
     av_write_trailer(encoder_fmt_ctx);
     if (encoder_fmt_ctx && !(encoder_fmt_ctx->oformat->flags & AVFMT_NOFILE))
@@ -126,4 +134,72 @@ int main(int argc, char *argv[])
     avformat_free_context(encoder_fmt_ctx);
 
     return 0;
-}
\ No newline at end of file
+}
+
+int main(int argc, char *argv[])
+{
+    Logger::init(argv[0]);
+
+    args::parser parser("remux -i <input> [-i <input> ...] -o <output> [-o <output> ...] "
+                        "[--segment <seconds> --playlist <hls|dash|all>]");
+    parser.add("-i", std::vector<std::string>{}, "input files, concatenated if more than one");
+    parser.add("-o", std::vector<std::string>{}, "output files, or output directory of the segments");
+    parser.add("--segment", 0.0, "target duration of the fragmented mp4 segments in seconds, 0: disabled");
+    parser.add("--playlist", "hls", "playlist of the segments: hls, dash or all");
+    parser.add("--queue", 64, "max number of the queued packets of each output");
+    parser.add("--probesize", 0, "max bytes read while probing the input, 0: default");
+    parser.add("--analyzeduration", 0, "max microseconds analyzed while probing the input, 0: default");
+    parser.add("--probecache", "", "directory of the stream information cache, empty: disabled");
+    parser.add("--maxdelay", 10.0, "max seconds of the packets buffered for interleaving");
+    parser.add("--maxbytes", 64 * 1024 * 1024, "max bytes of the packets buffered for interleaving");
+    parser.parse(argc, argv);
+
+    const ProbeOptions probe{
+        .probesize       = parser.get<int64_t>("probesize", 0),
+        .analyzeduration = parser.get<int64_t>("analyzeduration", 0),
+        .cache_dir       = parser.get<std::string>("probecache", ""),
+    };
+
+    const InterleaveOptions interleave{
+        .max_delay = static_cast<int64_t>(parser.get<double>("maxdelay", 10.0) * AV_TIME_BASE),
+        .max_bytes = parser.get<int64_t>("maxbytes", 64 * 1024 * 1024),
+    };
+
+    const auto in_filenames  = parser.get<std::vector<std::string>>("i", {});
+    const auto out_filenames = parser.get<std::vector<std::string>>("o", {});
+    if (in_filenames.empty() || out_filenames.empty()) {
+        LOG(ERROR) << parser.help();
+        return -1;
+    }
+
+    if (in_filenames.size() > 1) {
+        if (out_filenames.size() > 1) {
+            LOG(ERROR) << "only one output file is supported while concatenating";
+            return -1;
+        }
+        return remux_concat(in_filenames, out_filenames[0], probe, interleave);
+    }
+
+    const auto& in_filename = in_filenames[0];
+
+    if (out_filenames.size() > 1) {
+        return remux_fanout(in_filename, out_filenames, parser.get<int64_t>("queue", 64), probe,
+                            interleave);
+    }
+
+    const auto& out_filename = out_filenames[0];
+
+    if (const auto duration = parser.get<double>("segment", 0.0); duration > 0) {
+        const auto playlist = parser.get<std::string>("playlist", "hls");
+
+        return remux_segments(in_filename, out_filename,
+                              SegmentOptions{
+                                  .duration = duration,
+                                  .hls      = playlist == "hls" || playlist == "all",
+                                  .dash     = playlist == "dash" || playlist == "all",
+                              },
+                              probe, interleave);
+    }
+
+    return remux(in_filename, out_filename, probe, interleave);
+}
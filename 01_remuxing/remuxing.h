@@ -0,0 +1,36 @@
+#ifndef _01_REMUXING_H
+#define _01_REMUXING_H
+
+#include <string>
+#include <vector>
+#include "interleaver.h"
+#include "probe.h"
+
+struct SegmentOptions
+{
+    double duration{ 6.0 };     // target duration of each segment in seconds
+    bool hls{ true };           // write the 'index.m3u8' playlist
+    bool dash{ false };         // write the 'manifest.mpd' playlist
+};
+
+// copy all the audio / video / subtitle streams of the input file to the output file
+int remux(const std::string& in_filename, const std::string& out_filename, const ProbeOptions& probe = {},
+          const InterleaveOptions& interleave = {});
+
+// copy the audio / video streams of the input file to keyframe-aligned fragmented MP4 segments
+// and write the HLS / DASH playlists of them to the output directory
+int remux_segments(const std::string& in_filename, const std::string& out_dir,
+                   const SegmentOptions& options, const ProbeOptions& probe = {},
+                   const InterleaveOptions& interleave = {});
+
+// demux the input file once, and copy the packets to every output file by their own threads
+int remux_fanout(const std::string& in_filename, const std::vector<std::string>& out_filenames,
+                 size_t queue_size, const ProbeOptions& probe = {},
+                 const InterleaveOptions& interleave = {});
+
+// concatenate the input files into the output file without re-encoding, the next input file is opened
+// and probed while copying the current one
+int remux_concat(const std::vector<std::string>& in_filenames, const std::string& out_filename,
+                 const ProbeOptions& probe = {}, const InterleaveOptions& interleave = {});
+
+#endif //!_01_REMUXING_H
@@ -0,0 +1,321 @@
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavutil/avutil.h>
+}
+#include "defer.h"
+#include "fmt/format.h"
+#include "logging.h"
+#include "remuxing.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+struct Segment
+{
+    std::string name;
+    int64_t start;      // ms
+    int64_t duration;   // ms
+    uintmax_t size;     // bytes
+};
+
+static std::string segment_name(size_t idx) { return fmt::format("seg_{:05d}.m4s", idx); }
+
+// the muxer writes to a temporary file, and the file is renamed after it is completed,
+// so that the readers never see a partial segment or playlist
+static fs::path temporary_path(const fs::path& path) { return fs::path(path).concat(".tmp"); }
+
+static int open_segment(AVFormatContext *fmt_ctx, const fs::path& path)
+{
+    return avio_open(&fmt_ctx->pb, temporary_path(path).string().c_str(), AVIO_FLAG_WRITE);
+}
+
+static int close_segment(AVFormatContext *fmt_ctx, const fs::path& path)
+{
+    avio_closep(&fmt_ctx->pb);
+
+    std::error_code ec;
+    fs::rename(temporary_path(path), path, ec);
+    return ec ? AVERROR(EIO) : 0;
+}
+
+// the partial segment is removed, not left in the output directory
+static void discard_segment(AVFormatContext *fmt_ctx, const fs::path& path)
+{
+    avio_closep(&fmt_ctx->pb);
+
+    std::error_code ec;
+    fs::remove(temporary_path(path), ec);
+}
+
+static bool write_atomically(const fs::path& path, const std::string& content)
+{
+    std::error_code ec;
+    bool written = false;
+    {
+        std::ofstream file(temporary_path(path), std::ios::binary | std::ios::trunc);
+        written = file && (file << content) && file.flush();
+    }
+
+    if (written) fs::rename(temporary_path(path), path, ec);
+    if (!written || ec) {
+        fs::remove(temporary_path(path), ec);
+        return false;
+    }
+    return true;
+}
+
+static std::string hls_playlist(const std::vector<Segment>& segments, double target, bool ended)
+{
+    // the segments are cut at keyframes, so they may be longer than the target duration
+    auto target_ms = static_cast<int64_t>(target * 1000);
+    for (const auto& segment : segments) {
+        target_ms = std::max(target_ms, segment.duration);
+    }
+
+    std::string str = "#EXTM3U\n#EXT-X-VERSION:7\n";
+    str += fmt::format("#EXT-X-TARGETDURATION:{}\n", (target_ms + 999) / 1000);
+    str += "#EXT-X-MEDIA-SEQUENCE:0\n";
+    str += "#EXT-X-PLAYLIST-TYPE:EVENT\n";
+    str += "#EXT-X-INDEPENDENT-SEGMENTS\n";
+    str += "#EXT-X-MAP:URI=\"init.mp4\"\n";
+    for (const auto& segment : segments) {
+        str += fmt::format("#EXTINF:{:.3f},\n{}\n", segment.duration / 1000.0, segment.name);
+    }
+    if (ended) str += "#EXT-X-ENDLIST\n";
+
+    return str;
+}
+
+static std::string dash_manifest(const std::vector<Segment>& segments, double target,
+                                 const AVCodecParameters *params)
+{
+    int64_t duration = 0;
+    uintmax_t size   = 0;
+    for (const auto& segment : segments) {
+        duration += segment.duration;
+        size += segment.size;
+    }
+    const int64_t bandwidth = duration > 0 ? static_cast<int64_t>(size * 8 * 1000 / duration) : 0;
+
+    std::string str = "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n";
+    str += fmt::format(
+        "<MPD xmlns=\"urn:mpeg:dash:schema:mpd:2011\" profiles=\"urn:mpeg:dash:profile:isoff-live:2011\" "
+        "type=\"static\" mediaPresentationDuration=\"PT{:.3f}S\" minBufferTime=\"PT{:.1f}S\">\n",
+        duration / 1000.0, target);
+    str += "  <Period start=\"PT0S\">\n";
+    str += "    <AdaptationSet segmentAlignment=\"true\">\n";
+    if (params->codec_type == AVMEDIA_TYPE_VIDEO) {
+        str += fmt::format(
+            "      <Representation id=\"0\" mimeType=\"video/mp4\" bandwidth=\"{}\" width=\"{}\" height=\"{}\">\n",
+            bandwidth, params->width, params->height);
+    }
+    else {
+        str += fmt::format("      <Representation id=\"0\" mimeType=\"audio/mp4\" bandwidth=\"{}\">\n",
+                           bandwidth);
+    }
+    str += "        <SegmentTemplate timescale=\"1000\" initialization=\"init.mp4\" "
+           "media=\"seg_$Number%05d$.m4s\" startNumber=\"0\">\n";
+    str += "          <SegmentTimeline>\n";
+    for (const auto& segment : segments) {
+        str += fmt::format("            <S t=\"{}\" d=\"{}\"/>\n", segment.start, segment.duration);
+    }
+    str += "          </SegmentTimeline>\n";
+    str += "        </SegmentTemplate>\n";
+    str += "      </Representation>\n";
+    str += "    </AdaptationSet>\n";
+    str += "  </Period>\n";
+    str += "</MPD>\n";
+
+    return str;
+}
+
+int remux_segments(const std::string& in_filename, const std::string& out_dir,
+                   const SegmentOptions& options, const ProbeOptions& probe,
+                   const InterleaveOptions& interleave)
+{
+    // input
+    AVFormatContext *decoder_fmt_ctx = nullptr;
+    if (open_input(&decoder_fmt_ctx, in_filename, nullptr, nullptr, probe) < 0) {
+        LOG(ERROR) << "[SEGMENT] failed to open the input file: " << in_filename;
+        return -1;
+    }
+    defer(avformat_close_input(&decoder_fmt_ctx));
+    av_dump_format(decoder_fmt_ctx, 0, in_filename.c_str(), 0);
+
+    const fs::path dir{ out_dir };
+    std::error_code ec;
+    fs::create_directories(dir, ec);
+    if (ec) {
+        LOG(ERROR) << "[SEGMENT] can not create the output directory: " << out_dir;
+        return -1;
+    }
+
+    // output
+    //
+    // the fragments of the mp4 muxer are only flushed when we ask for it ('frag_custom'), so that every
+    // segment file starts with a 'moof' box, and the 'moov' box goes to the initialization segment
+    AVFormatContext *encoder_fmt_ctx = nullptr;
+    if (avformat_alloc_output_context2(&encoder_fmt_ctx, nullptr, "mp4", nullptr) < 0) {
+        LOG(ERROR) << "[SEGMENT] failed to alloc the mp4 output context";
+        return -1;
+    }
+    defer(avformat_free_context(encoder_fmt_ctx));
+
+    // map streams, only audio and video streams are supported by the fragmented mp4
+    std::vector<int> stream_mapping(decoder_fmt_ctx->nb_streams, -1);
+    int stream_idx = 0;
+    for (unsigned int i = 0; i < decoder_fmt_ctx->nb_streams; i++) {
+        AVCodecParameters *decode_params = decoder_fmt_ctx->streams[i]->codecpar;
+        if (decode_params->codec_type != AVMEDIA_TYPE_VIDEO &&
+            decode_params->codec_type != AVMEDIA_TYPE_AUDIO) {
+            continue;
+        }
+
+        const int supported =
+            avformat_query_codec(encoder_fmt_ctx->oformat, decode_params->codec_id, FF_COMPLIANCE_NORMAL);
+        if (supported != 1) {
+            LOG(WARNING) << "[SEGMENT] ignore the stream #" << i << ", '"
+                         << avcodec_get_name(decode_params->codec_id) << "' is not supported by mp4";
+            continue;
+        }
+
+        AVStream *encode_stream = avformat_new_stream(encoder_fmt_ctx, nullptr);
+        if (!encode_stream || avcodec_parameters_copy(encode_stream->codecpar, decode_params) < 0) {
+            LOG(ERROR) << "[SEGMENT] failed to add the output stream";
+            return -1;
+        }
+
+        // let the muxer choose the tag, e.g. 'hvc1' for the hevc stream from a mkv file
+        encode_stream->codecpar->codec_tag = 0;
+        encode_stream->time_base           = decoder_fmt_ctx->streams[i]->time_base;
+
+        stream_mapping[i] = stream_idx++;
+    }
+    if (stream_idx == 0) {
+        LOG(ERROR) << "[SEGMENT] no stream can be segmented";
+        return -1;
+    }
+
+    // the segments are cut at the keyframes of the reference stream, the video stream if there is one
+    int ref_stream_idx = av_find_best_stream(decoder_fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+    for (int i = 0; ref_stream_idx < 0 || stream_mapping[ref_stream_idx] < 0; i++) {
+        ref_stream_idx = i;
+    }
+    const AVStream *ref_stream = decoder_fmt_ctx->streams[ref_stream_idx];
+
+    AVDictionary *muxer_options = nullptr;
+    av_dict_set(&muxer_options, "movflags", "+frag_custom+empty_moov+default_base_moof+skip_trailer", 0);
+    defer(av_dict_free(&muxer_options));
+
+    // the initialization segment: 'ftyp' + 'moov'
+    if (open_segment(encoder_fmt_ctx, dir / "init.mp4") < 0) {
+        LOG(ERROR) << "[SEGMENT] failed to open the initialization segment";
+        return -1;
+    }
+    if (avformat_write_header(encoder_fmt_ctx, &muxer_options) < 0 ||
+        close_segment(encoder_fmt_ctx, dir / "init.mp4") < 0) {
+        LOG(ERROR) << "[SEGMENT] failed to write the initialization segment";
+        discard_segment(encoder_fmt_ctx, dir / "init.mp4");
+        return -1;
+    }
+
+    av_dump_format(encoder_fmt_ctx, 0, out_dir.c_str(), 1);
+
+    Interleaver interleaver(encoder_fmt_ctx, interleave);
+
+    std::vector<Segment> segments{};
+    int64_t segment_start = AV_NOPTS_VALUE; // ms
+    int64_t segment_end   = AV_NOPTS_VALUE; // ms
+
+    const auto write_playlists = [&](bool ended) {
+        if (options.hls &&
+            !write_atomically(dir / "index.m3u8", hls_playlist(segments, options.duration, ended))) {
+            LOG(ERROR) << "[SEGMENT] failed to write the hls playlist";
+        }
+        if (options.dash && ended &&
+            !write_atomically(dir / "manifest.mpd",
+                              dash_manifest(segments, options.duration, ref_stream->codecpar))) {
+            LOG(ERROR) << "[SEGMENT] failed to write the dash manifest";
+        }
+    };
+
+    const auto finish_segment = [&](int64_t end, bool last) {
+        const auto name = segment_name(segments.size());
+
+        // drain the interleaving queue, the buffered packets belong to the current segment, then
+        // flush the last fragment ('mfra' box is skipped) or force the muxer to write out the fragment
+        if (interleaver.flush() < 0 ||
+            (last ? av_write_trailer(encoder_fmt_ctx) : av_write_frame(encoder_fmt_ctx, nullptr)) < 0 ||
+            close_segment(encoder_fmt_ctx, dir / name) < 0) {
+            LOG(ERROR) << "[SEGMENT] failed to write the segment " << name;
+            discard_segment(encoder_fmt_ctx, dir / name);
+            return -1;
+        }
+
+        segments.push_back({ name, segment_start, end - segment_start, fs::file_size(dir / name, ec) });
+        LOG(INFO) << fmt::format("[SEGMENT] {}: start = {:.3f}s, duration = {:.3f}s, size = {}", name,
+                                 segments.back().start / 1000.0, segments.back().duration / 1000.0,
+                                 segments.back().size);
+
+        write_playlists(last);
+        segment_start = end;
+        return 0;
+    };
+
+    if (open_segment(encoder_fmt_ctx, dir / segment_name(0)) < 0) {
+        LOG(ERROR) << "[SEGMENT] failed to open the segment " << segment_name(0);
+        return -1;
+    }
+
+    const auto target_ms = static_cast<int64_t>(options.duration * 1000);
+
+    AVPacket *packet = av_packet_alloc();
+    defer(av_packet_free(&packet));
+    while (av_read_frame(decoder_fmt_ctx, packet) >= 0) {
+        const int in_stream_idx = packet->stream_index;
+        if (stream_mapping[in_stream_idx] < 0) {
+            av_packet_unref(packet);
+            continue;
+        }
+
+        if (in_stream_idx == ref_stream_idx && packet->pts != AV_NOPTS_VALUE) {
+            const int64_t pts = av_rescale_q(packet->pts, ref_stream->time_base, { 1, 1000 });
+            const int64_t end = pts + av_rescale_q(packet->duration, ref_stream->time_base, { 1, 1000 });
+
+            if (segment_start == AV_NOPTS_VALUE) segment_start = pts;
+
+            // cut before the keyframe once the current segment reaches the target duration
+            if ((packet->flags & AV_PKT_FLAG_KEY) && pts - segment_start >= target_ms) {
+                if (finish_segment(pts, false) < 0) return -1;
+                if (open_segment(encoder_fmt_ctx, dir / segment_name(segments.size())) < 0) {
+                    LOG(ERROR) << "[SEGMENT] failed to open the segment " << segment_name(segments.size());
+                    return -1;
+                }
+            }
+
+            segment_end = std::max(segment_end, end);
+        }
+
+        AVStream *encode_stream = encoder_fmt_ctx->streams[stream_mapping[in_stream_idx]];
+        av_packet_rescale_ts(packet, decoder_fmt_ctx->streams[in_stream_idx]->time_base,
+                             encode_stream->time_base);
+        packet->stream_index = encode_stream->index;
+        packet->pos          = -1;
+
+        if (interleaver.write(packet) < 0) {
+            LOG(ERROR) << "[SEGMENT] failed to write the packet";
+            discard_segment(encoder_fmt_ctx, dir / segment_name(segments.size()));
+            return -1;
+        }
+    }
+
+    if (finish_segment(segment_end, true) < 0) return -1;
+    interleaver.log_stats(out_dir);
+
+    LOG(INFO) << fmt::format("[SEGMENT] {} segments are written to '{}'", segments.size(), out_dir);
+    return 0;
+}
@@ -0,0 +1,539 @@
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavfilter/avfilter.h>
+#include <libavfilter/buffersink.h>
+#include <libavfilter/buffersrc.h>
+#include <libavformat/avformat.h>
+#include <libavutil/avutil.h>
+#include <libavutil/time.h>
+}
+#include "defer.h"
+#include "fmt/format.h"
+#include "logging.h"
+#include "transcoding.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+    // the scenes and the keyframes of the video stream, in its time base
+    struct Analysis
+    {
+        int stream_idx{ -1 };
+        AVRational time_base{ 1, AV_TIME_BASE };
+        int64_t first_pts{ AV_NOPTS_VALUE };
+        int64_t last_pts{ AV_NOPTS_VALUE };
+        int64_t frames{ 0 };
+        std::vector<int64_t> cuts{};      // the first frames of the scenes, except the first scene
+        std::vector<int64_t> keyframes{}; // where the decoding of the scenes starts
+    };
+
+    struct Trial
+    {
+        int crf{};
+        int64_t bytes{ 0 };
+        double quality{ NAN };
+    };
+
+    std::string buffer_args(const AVFrame *frame, AVRational time_base)
+    {
+        return fmt::format("video_size={}x{}:pix_fmt={}:time_base={}/{}:pixel_aspect={}/{}", frame->width,
+                           frame->height, frame->format, time_base.num, time_base.den,
+                           frame->sample_aspect_ratio.num, std::max(1, frame->sample_aspect_ratio.den));
+    }
+
+    // the graph with the buffersrcs linked to the labels of 'names', and one buffersink linked to [out],
+    // the buffersrcs are created with the parameters of the first frame
+    AVFilterGraph *create_graph(const std::string& descr, const std::vector<std::string>& names,
+                                const AVFrame *frame, AVRational time_base,
+                                std::vector<AVFilterContext *>& srcs, AVFilterContext **sink)
+    {
+        AVFilterGraph *graph = avfilter_graph_alloc();
+        if (!graph) return nullptr;
+
+        const auto args = buffer_args(frame, time_base);
+
+        AVFilterInOut *sources = nullptr;
+        AVFilterInOut *sinks   = avfilter_inout_alloc();
+        defer(avfilter_inout_free(&sources); avfilter_inout_free(&sinks));
+
+        srcs.assign(names.size(), nullptr);
+        for (size_t i = names.size(); i-- > 0;) {
+            if (avfilter_graph_create_filter(&srcs[i], avfilter_get_by_name("buffer"), names[i].c_str(),
+                                             args.c_str(), nullptr, graph) < 0) {
+                LOG(ERROR) << "[ADAPTIVE] failed to create the buffersrc: " << args;
+                avfilter_graph_free(&graph);
+                return nullptr;
+            }
+
+            AVFilterInOut *source = avfilter_inout_alloc();
+            source->name          = av_strdup(names[i].c_str());
+            source->filter_ctx    = srcs[i];
+            source->pad_idx       = 0;
+            source->next          = sources;
+            sources               = source;
+        }
+
+        if (avfilter_graph_create_filter(sink, avfilter_get_by_name("buffersink"), "out", nullptr, nullptr,
+                                         graph) < 0) {
+            LOG(ERROR) << "[ADAPTIVE] failed to create the buffersink.";
+            avfilter_graph_free(&graph);
+            return nullptr;
+        }
+        sinks->name       = av_strdup("out");
+        sinks->filter_ctx = *sink;
+        sinks->pad_idx    = 0;
+        sinks->next       = nullptr;
+
+        if (avfilter_graph_parse_ptr(graph, descr.c_str(), &sinks, &sources, nullptr) < 0 ||
+            avfilter_graph_config(graph, nullptr) < 0) {
+            LOG(ERROR) << "[ADAPTIVE] failed to create the filter graph: " << descr;
+            avfilter_graph_free(&graph);
+            return nullptr;
+        }
+        return graph;
+    }
+
+    // decode the video stream once, detect the scene cuts by 'scdet' on the downscaled frames,
+    // and collect the keyframes
+    std::optional<Analysis> analyze(const std::string& filename, const TranscodeOptions& options,
+                                    const AdaptiveOptions& adaptive)
+    {
+        AVFormatContext *fmt_ctx = nullptr;
+        if (open_input(&fmt_ctx, filename, nullptr, nullptr, options.probe) < 0) return std::nullopt;
+        defer(avformat_close_input(&fmt_ctx));
+
+        Analysis analysis{};
+        analysis.stream_idx = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+        if (analysis.stream_idx < 0) {
+            LOG(ERROR) << "[ADAPTIVE] can not find the video stream.";
+            return std::nullopt;
+        }
+        const AVStream *stream = fmt_ctx->streams[analysis.stream_idx];
+        analysis.time_base     = stream->time_base;
+
+        AVCodecContext *decoder_ctx = open_decoder(stream);
+        if (!decoder_ctx) return std::nullopt;
+        defer(avcodec_free_context(&decoder_ctx));
+
+        AVPacket *packet = av_packet_alloc();
+        AVFrame *frame   = av_frame_alloc();
+        AVFrame *scored  = av_frame_alloc();
+        defer(av_packet_free(&packet); av_frame_free(&frame); av_frame_free(&scored));
+
+        // created with the first frame
+        AVFilterGraph *graph = nullptr;
+        std::vector<AVFilterContext *> srcs{};
+        AVFilterContext *sink = nullptr;
+        defer(avfilter_graph_free(&graph));
+
+        const auto descr = fmt::format("[in]scale=320:-2,scdet=threshold={}[out]", adaptive.threshold);
+
+        std::vector<int64_t> cuts{};
+        const auto filter = [&](AVFrame *decoded) {
+            if (decoded) {
+                if (!graph) graph = create_graph(descr, { "in" }, decoded, stream->time_base, srcs, &sink);
+                if (!graph) return -1;
+
+                analysis.frames++;
+                if (analysis.first_pts == AV_NOPTS_VALUE) analysis.first_pts = decoded->pts;
+                analysis.last_pts = std::max(analysis.last_pts, decoded->pts);
+            }
+            if (!graph) return 0;
+
+            if (av_buffersrc_add_frame(srcs[0], decoded) < 0) return -1;
+
+            while (true) {
+                const int ret = av_buffersink_get_frame(sink, scored);
+                if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) return 0;
+                if (ret < 0) return ret;
+
+                if (av_dict_get(scored->metadata, "lavfi.scd.time", nullptr, 0) &&
+                    scored->pts != analysis.first_pts) {
+                    cuts.push_back(scored->pts);
+                }
+                av_frame_unref(scored);
+            }
+        };
+
+        const auto decode = [&](const AVPacket *input) {
+            // skip the corrupted packets
+            if (avcodec_send_packet(decoder_ctx, input) < 0) return 0;
+
+            while (true) {
+                const int ret = avcodec_receive_frame(decoder_ctx, frame);
+                if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) return 0;
+                if (ret < 0) return ret;
+
+                frame->pts = frame->best_effort_timestamp;
+                if (frame->pts == AV_NOPTS_VALUE) {
+                    av_frame_unref(frame);
+                    continue;
+                }
+
+                // the filters take the reference
+                if (const int err = filter(frame); err < 0) return err;
+            }
+        };
+
+        int ret = 0;
+        while (ret >= 0 && av_read_frame(fmt_ctx, packet) >= 0) {
+            if (packet->stream_index == analysis.stream_idx) {
+                if (packet->flags & AV_PKT_FLAG_KEY) {
+                    const int64_t pts = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+                    if (pts != AV_NOPTS_VALUE) analysis.keyframes.push_back(pts);
+                }
+                ret = decode(packet);
+            }
+            av_packet_unref(packet);
+        }
+        if (ret >= 0) ret = decode(nullptr);
+        if (ret >= 0) ret = filter(nullptr);
+
+        if (ret < 0 || analysis.frames == 0 || analysis.keyframes.empty()) {
+            LOG(ERROR) << "[ADAPTIVE] failed to analyze the video stream.";
+            return std::nullopt;
+        }
+
+        std::sort(analysis.keyframes.begin(), analysis.keyframes.end());
+        analysis.keyframes.erase(std::unique(analysis.keyframes.begin(), analysis.keyframes.end()),
+                                 analysis.keyframes.end());
+
+        // the short scenes are merged into the previous ones, the flashes and the fast cuts are not worth
+        // an encoder of their own
+        const int64_t min_scene = av_rescale_q(static_cast<int64_t>(adaptive.min_scene * AV_TIME_BASE),
+                                               AV_TIME_BASE_Q, analysis.time_base);
+        std::sort(cuts.begin(), cuts.end());
+        int64_t last = analysis.first_pts;
+        for (const auto cut : cuts) {
+            if (cut - last >= min_scene) {
+                analysis.cuts.push_back(cut);
+                last = cut;
+            }
+        }
+        if (!analysis.cuts.empty() && analysis.last_pts - analysis.cuts.back() < min_scene) {
+            analysis.cuts.pop_back();
+        }
+
+        LOG(INFO) << fmt::format("[ADAPTIVE] {} frames, {} scene cuts detected, {} scenes", analysis.frames,
+                                 cuts.size(), analysis.cuts.size() + 1);
+        return analysis;
+    }
+
+    // the mean quality of the distorted frames against the reference ones, pushed in pairs
+    class QualityMeter
+    {
+    public:
+        QualityMeter() = default;
+        QualityMeter(const QualityMeter&) = delete;
+        QualityMeter& operator=(const QualityMeter&) = delete;
+        ~QualityMeter()
+        {
+            avfilter_graph_free(&graph_);
+            av_frame_free(&frame_);
+        }
+
+        int open(const std::string& metric, const AVFrame *frame)
+        {
+            key_    = metric == "psnr" ? "lavfi.psnr.psnr_avg" : "lavfi.ssim.All";
+
+            if (!(frame_ = av_frame_alloc())) return AVERROR(ENOMEM);
+
+            const auto descr = fmt::format("[main][ref]{}[out]", metric == "psnr" ? "psnr" : "ssim");
+            graph_ = create_graph(descr, { "main", "ref" }, frame, { 1, AV_TIME_BASE }, srcs_, &sink_);
+            return graph_ ? 0 : -1;
+        }
+
+        // nullptr: the end of the frames
+        int push(AVFrame *distorted, AVFrame *reference, int64_t idx)
+        {
+            if (distorted) {
+                distorted->pts = reference->pts = idx;
+                if (av_buffersrc_add_frame_flags(srcs_[0], distorted, AV_BUFFERSRC_FLAG_KEEP_REF) < 0 ||
+                    av_buffersrc_add_frame_flags(srcs_[1], reference, AV_BUFFERSRC_FLAG_KEEP_REF) < 0)
+                    return -1;
+            }
+            else if (av_buffersrc_add_frame(srcs_[0], nullptr) < 0 ||
+                     av_buffersrc_add_frame(srcs_[1], nullptr) < 0) {
+                return -1;
+            }
+
+            while (true) {
+                const int ret = av_buffersink_get_frame(sink_, frame_);
+                if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) return 0;
+                if (ret < 0) return ret;
+
+                if (const auto entry = av_dict_get(frame_->metadata, key_, nullptr, 0); entry) {
+                    // the identical frames are infinite in psnr
+                    sum_ += std::min(100.0, std::strtod(entry->value, nullptr));
+                    count_++;
+                }
+                av_frame_unref(frame_);
+            }
+        }
+
+        double mean() const { return count_ > 0 ? sum_ / count_ : NAN; }
+
+    private:
+        const char *key_{ nullptr };
+
+        AVFilterGraph *graph_{ nullptr };
+        std::vector<AVFilterContext *> srcs_{};
+        AVFilterContext *sink_{ nullptr };
+        AVFrame *frame_{ nullptr };
+
+        double sum_{ 0.0 };
+        int64_t count_{ 0 };
+    };
+
+    // encode the frames with the crf, decode the packets, and measure them against the frames
+    std::optional<Trial> trial_encode(const std::vector<AVFrame *>& frames,
+                                      const AVCodecContext *decoder_ctx, AVRational framerate,
+                                      const TranscodeOptions& options, const std::string& metric, int crf)
+    {
+        TranscodeOptions trial_options = options;
+        trial_options.crf              = crf;
+        trial_options.bitrate          = 0;
+        trial_options.threads          = 1;
+
+        AVCodecContext *encoder_ctx = open_video_encoder(decoder_ctx, framerate, trial_options, false);
+        if (!encoder_ctx) return std::nullopt;
+        defer(avcodec_free_context(&encoder_ctx));
+
+        // the decoder of the encoded packets
+        AVCodecContext *checker_ctx = nullptr;
+        defer(avcodec_free_context(&checker_ctx));
+        {
+            AVCodecParameters *par = avcodec_parameters_alloc();
+            defer(avcodec_parameters_free(&par));
+
+            const auto decoder = avcodec_find_decoder(encoder_ctx->codec_id);
+            if (!decoder || !par || avcodec_parameters_from_context(par, encoder_ctx) < 0 ||
+                !(checker_ctx = avcodec_alloc_context3(decoder)) ||
+                avcodec_parameters_to_context(checker_ctx, par) < 0) {
+                LOG(ERROR) << "[ADAPTIVE] can not create the decoder of "
+                           << avcodec_get_name(encoder_ctx->codec_id);
+                return std::nullopt;
+            }
+            checker_ctx->thread_count = 1;
+            if (avcodec_open2(checker_ctx, decoder, nullptr) < 0) return std::nullopt;
+        }
+
+        QualityMeter meter{};
+        if (meter.open(metric, frames[0]) < 0) return std::nullopt;
+
+        AVPacket *packet   = av_packet_alloc();
+        AVFrame *distorted = av_frame_alloc();
+        defer(av_packet_free(&packet); av_frame_free(&distorted));
+
+        Trial trial{ .crf = crf };
+        size_t checked = 0;
+
+        const auto check = [&](const AVPacket *input) {
+            if (avcodec_send_packet(checker_ctx, input) < 0) return -1;
+
+            while (true) {
+                const int ret = avcodec_receive_frame(checker_ctx, distorted);
+                if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) return 0;
+                if (ret < 0) return ret;
+
+                if (checked < frames.size()) {
+                    const int err = meter.push(distorted, frames[checked], static_cast<int64_t>(checked));
+                    if (err < 0) return err;
+                }
+                checked++;
+                av_frame_unref(distorted);
+            }
+        };
+
+        const auto encode = [&](const AVFrame *frame) {
+            if (avcodec_send_frame(encoder_ctx, frame) < 0) return -1;
+
+            while (true) {
+                const int ret = avcodec_receive_packet(encoder_ctx, packet);
+                if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) return 0;
+                if (ret < 0) return ret;
+
+                trial.bytes += packet->size;
+                const int err = check(packet);
+                av_packet_unref(packet);
+                if (err < 0) return err;
+            }
+        };
+
+        for (const auto frame : frames) {
+            frame->pict_type = AV_PICTURE_TYPE_NONE;
+            if (encode(frame) < 0) return std::nullopt;
+        }
+        if (encode(nullptr) < 0 || check(nullptr) < 0 || meter.push(nullptr, nullptr, 0) < 0) {
+            return std::nullopt;
+        }
+
+        trial.quality = meter.mean();
+        return trial;
+    }
+
+    // decode the frames in [from, to) of the scene, and trial-encode them with every crf candidate
+    std::vector<Trial> trial_scene(const std::string& filename, const TranscodeOptions& options,
+                                   const AdaptiveOptions& adaptive, int stream_idx, int64_t from,
+                                   int64_t to)
+    {
+        AVFormatContext *fmt_ctx = nullptr;
+        if (open_input(&fmt_ctx, filename, nullptr, nullptr, options.probe) < 0) return {};
+        defer(avformat_close_input(&fmt_ctx));
+
+        AVStream *stream            = fmt_ctx->streams[stream_idx];
+        AVCodecContext *decoder_ctx = open_decoder(stream, 1);
+        if (!decoder_ctx) return {};
+        defer(avcodec_free_context(&decoder_ctx));
+
+        if (av_seek_frame(fmt_ctx, stream_idx, from, AVSEEK_FLAG_BACKWARD) < 0) return {};
+
+        std::vector<AVFrame *> frames{};
+        defer(for (auto& frame : frames) av_frame_free(&frame));
+
+        AVPacket *packet = av_packet_alloc();
+        AVFrame *frame   = av_frame_alloc();
+        defer(av_packet_free(&packet); av_frame_free(&frame));
+
+        bool done         = false;
+        const auto decode = [&](const AVPacket *input) {
+            if (avcodec_send_packet(decoder_ctx, input) < 0) return;
+
+            while (!done && avcodec_receive_frame(decoder_ctx, frame) >= 0) {
+                const int64_t pts = frame->best_effort_timestamp;
+                if (pts >= to) done = true;
+                // renumbered in the time base of the encoder
+                if (pts != AV_NOPTS_VALUE && pts >= from && pts < to) {
+                    AVFrame *cloned = av_frame_clone(frame);
+                    if (cloned) cloned->pts = static_cast<int64_t>(frames.size());
+                    frames.push_back(cloned);
+                }
+                av_frame_unref(frame);
+            }
+        };
+
+        while (!done && av_read_frame(fmt_ctx, packet) >= 0) {
+            if (packet->stream_index == stream_idx) decode(packet);
+            av_packet_unref(packet);
+        }
+        if (!done) decode(nullptr);
+
+        if (frames.empty() || std::find(frames.begin(), frames.end(), nullptr) != frames.end()) return {};
+
+        const AVRational framerate = av_guess_frame_rate(fmt_ctx, stream, nullptr);
+
+        std::vector<Trial> trials{};
+        for (const auto crf : adaptive.crfs) {
+            if (auto trial = trial_encode(frames, decoder_ctx, framerate, options, adaptive.metric, crf)) {
+                trials.push_back(trial.value());
+            }
+        }
+        return trials;
+    }
+
+    // the highest crf meeting the target, otherwise the lowest one
+    int select_crf(std::vector<Trial> trials, double target, int fallback)
+    {
+        if (trials.empty()) return fallback;
+
+        std::sort(trials.begin(), trials.end(), [](const auto& a, const auto& b) { return a.crf > b.crf; });
+        for (const auto& trial : trials) {
+            if (!std::isnan(trial.quality) && trial.quality >= target) return trial.crf;
+        }
+        return trials.back().crf;
+    }
+} // namespace
+
+//  decode once: scdet --> scene cuts            +-> [scene 0: sample x crfs -> decode -> ssim] --+
+//               keyframes                    ---+-> [scene 1: sample x crfs -> decode -> ssim] --+--> crfs
+//                                               +-> [scene 2: sample x crfs -> decode -> ssim] --+
+//
+//  --> transcode_scenes(): the scenes are transcoded concurrently, each with its own crf
+//
+// The trial encodes are single-threaded and run one scene per core. The highest crf whose sample meets
+// the target is chosen, the rate control of the final encode is still crf, so the sample only has to
+// predict the quality of the scene, not its bitrate.
+int transcode_adaptive(const std::string& in_filename, const std::string& out_filename,
+                       const TranscodeOptions& options, const AdaptiveOptions& adaptive)
+{
+    const int64_t start_time = av_gettime_relative();
+
+    if (adaptive.crfs.empty()) {
+        LOG(ERROR) << "[ADAPTIVE] no crf candidate.";
+        return -1;
+    }
+
+    // 1. scenes
+    const auto analysis = analyze(in_filename, options, adaptive);
+    if (!analysis) return -1;
+
+    const auto& cuts = analysis->cuts;
+    std::vector<Scene> scenes(cuts.size() + 1);
+    for (size_t i = 0; i < scenes.size(); i++) {
+        scenes[i].start = i == 0 ? AV_NOPTS_VALUE : cuts[i - 1];
+        scenes[i].end   = i == cuts.size() ? AV_NOPTS_VALUE : cuts[i];
+        scenes[i].crf   = options.crf;
+    }
+
+    LOG(INFO) << fmt::format("[ADAPTIVE] analyzed in {:.3f}s",
+                             (av_gettime_relative() - start_time) / 1000000.0);
+
+    // 2. trial encodes, one scene per core
+    const int64_t half = av_rescale_q(static_cast<int64_t>(adaptive.sample * AV_TIME_BASE / 2),
+                                      AV_TIME_BASE_Q, analysis->time_base);
+
+    std::atomic<size_t> next{ 0 };
+    const auto worker = [&]() {
+        for (size_t i = next++; i < scenes.size(); i = next++) {
+            auto& scene       = scenes[i];
+            const int64_t s   = scene.start == AV_NOPTS_VALUE ? analysis->first_pts : scene.start;
+            const int64_t e   = scene.end == AV_NOPTS_VALUE ? analysis->last_pts + 1 : scene.end;
+            const int64_t mid = s + (e - s) / 2;
+            const auto trials = trial_scene(in_filename, options, adaptive, analysis->stream_idx,
+                                            std::max(s, mid - half), std::min(e, mid + half));
+            if (trials.empty()) {
+                LOG(WARNING) << fmt::format("[ADAPTIVE] #{}: the trial encodes failed, crf {}", i,
+                                            scene.crf);
+                continue;
+            }
+
+            scene.crf = select_crf(trials, adaptive.target, options.crf);
+
+            std::string summary{};
+            for (const auto& trial : trials) {
+                summary += fmt::format(" {}:{:.4f}/{}KiB", trial.crf, trial.quality, trial.bytes / 1024);
+            }
+            LOG(INFO) << fmt::format("[ADAPTIVE] #{}: {:.3f}s - {:.3f}s,{} -> crf {}", i,
+                                     s * av_q2d(analysis->time_base), e * av_q2d(analysis->time_base),
+                                     summary, scene.crf);
+        }
+    };
+
+    const size_t jobs = std::min<size_t>(scenes.size(), std::max(1u, std::thread::hardware_concurrency()));
+    std::vector<std::thread> workers{};
+    for (size_t i = 0; i < jobs; i++) {
+        workers.emplace_back(worker);
+    }
+    for (auto& thread : workers) {
+        thread.join();
+    }
+
+    LOG(INFO) << fmt::format("[ADAPTIVE] {} scenes, {} {} >= {}, trial-encoded in {:.3f}s", scenes.size(),
+                             adaptive.crfs.size(), adaptive.metric, adaptive.target,
+                             (av_gettime_relative() - start_time) / 1000000.0);
+
+    // 3. the scenes with their crfs, concurrently
+    const int ret = transcode_scenes(in_filename, out_filename, options, scenes, analysis->keyframes,
+                                     analysis->stream_idx, 0.0);
+
+    LOG(INFO) << fmt::format("[ADAPTIVE] {:.3f}s", (av_gettime_relative() - start_time) / 1000000.0);
+    return ret;
+}
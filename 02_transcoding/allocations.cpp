@@ -0,0 +1,74 @@
+#include "transcoding.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+
+// Built into the transcode_bench target only, the transcode target keeps the allocator of glibc.
+//
+// The allocation functions of glibc are replaced for the whole process, the libraries (FFmpeg, x264, ...)
+// call these functions as well. The replacements forward to the __libc_* entry points exported by glibc.
+static std::atomic<int64_t> allocations{ 0 };
+
+int64_t allocation_count() { return allocations.load(std::memory_order_relaxed); }
+
+extern "C" {
+void *__libc_malloc(size_t);
+void *__libc_calloc(size_t, size_t);
+void *__libc_realloc(void *, size_t);
+void *__libc_memalign(size_t, size_t);
+void *__libc_valloc(size_t);
+void *__libc_pvalloc(size_t);
+
+void *malloc(size_t size) noexcept
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) noexcept
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) noexcept
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t alignment, size_t size) noexcept
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) noexcept
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_memalign(alignment, size);
+}
+
+void *valloc(size_t size) noexcept
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_valloc(size);
+}
+
+void *pvalloc(size_t size) noexcept
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_pvalloc(size);
+}
+
+// av_malloc() allocates by posix_memalign()
+int posix_memalign(void **ptr, size_t alignment, size_t size) noexcept
+{
+    if (alignment % sizeof(void *) || (alignment & (alignment - 1))) return EINVAL;
+
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    *ptr = __libc_memalign(alignment, size);
+    return *ptr ? 0 : ENOMEM;
+}
+}
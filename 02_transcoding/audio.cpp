@@ -0,0 +1,244 @@
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavfilter/buffersink.h>
+#include <libavfilter/buffersrc.h>
+#include <libavformat/avformat.h>
+#include <libavutil/avutil.h>
+#include <libavutil/channel_layout.h>
+}
+#include "audio.h"
+#include "defer.h"
+#include "fmt/format.h"
+#include "logging.h"
+
+#include <cstdlib>
+
+namespace
+{
+    // the supported sample rate closest to the input one
+    int select_sample_rate(const AVCodec *encoder, int sample_rate)
+    {
+        if (!encoder->supported_samplerates) return sample_rate;
+
+        int selected = encoder->supported_samplerates[0];
+        for (auto ptr = encoder->supported_samplerates; *ptr; ptr++) {
+            if (std::abs(*ptr - sample_rate) < std::abs(selected - sample_rate)) selected = *ptr;
+        }
+        return selected;
+    }
+
+    std::string channel_layout_str(const AVCodecContext *ctx)
+    {
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57, 28, 100)
+        char buffer[64]{};
+        av_channel_layout_describe(&ctx->ch_layout, buffer, sizeof(buffer));
+        return buffer;
+#else
+        const uint64_t layout =
+            ctx->channel_layout ? ctx->channel_layout : av_get_default_channel_layout(ctx->channels);
+        return fmt::format("0x{:x}", layout);
+#endif
+    }
+} // namespace
+
+AudioTranscoder::~AudioTranscoder()
+{
+    avfilter_graph_free(&filter_graph_);
+    avcodec_free_context(&decoder_ctx_);
+    avcodec_free_context(&encoder_ctx_);
+
+    av_frame_free(&frame_);
+    av_frame_free(&filtered_frame_);
+    av_packet_free(&packet_);
+}
+
+int AudioTranscoder::open(const AVStream *stream, AVFormatContext *fmt_ctx, const TranscodeOptions& options)
+{
+    fmt_ctx_ = fmt_ctx;
+
+    // the audio is cheap to decode, one thread is enough
+    if (decoder_ctx_ = open_decoder(stream, 1); !decoder_ctx_) return -1;
+
+    // encoder
+    auto encoder = avcodec_find_encoder_by_name(options.audio_encoder.c_str());
+    if (!encoder || encoder->type != AVMEDIA_TYPE_AUDIO) {
+        LOG(ERROR) << "can not find the audio encoder: " << options.audio_encoder;
+        return -1;
+    }
+
+    if (encoder_ctx_ = avcodec_alloc_context3(encoder); !encoder_ctx_) {
+        LOG(ERROR) << "failed to allocate encoder context.";
+        return -1;
+    }
+
+    encoder_ctx_->sample_rate = select_sample_rate(encoder, decoder_ctx_->sample_rate);
+    encoder_ctx_->sample_fmt  = encoder->sample_fmts ? encoder->sample_fmts[0] : decoder_ctx_->sample_fmt;
+    encoder_ctx_->bit_rate    = options.audio_bitrate;
+    encoder_ctx_->time_base   = { 1, encoder_ctx_->sample_rate };
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57, 28, 100)
+    av_channel_layout_default(&encoder_ctx_->ch_layout, decoder_ctx_->ch_layout.nb_channels);
+#else
+    encoder_ctx_->channels       = decoder_ctx_->channels;
+    encoder_ctx_->channel_layout = av_get_default_channel_layout(decoder_ctx_->channels);
+#endif
+
+    if (fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER) encoder_ctx_->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+    if (avcodec_open2(encoder_ctx_, encoder, nullptr) < 0) {
+        LOG(ERROR) << "can not open the audio encoder.";
+        return -1;
+    }
+
+    // output stream
+    AVStream *out_stream = avformat_new_stream(fmt_ctx, nullptr);
+    if (!out_stream) {
+        LOG(ERROR) << "failed to create an audio stream.";
+        return -1;
+    }
+    stream_idx_ = out_stream->index;
+
+    out_stream->time_base = encoder_ctx_->time_base;
+    if (avcodec_parameters_from_context(out_stream->codecpar, encoder_ctx_) < 0) {
+        LOG(ERROR) << "failed to copy parameters to the output stream.";
+        return -1;
+    }
+    av_dict_copy(&out_stream->metadata, stream->metadata, 0);
+    out_stream->disposition = stream->disposition;
+
+    frame_          = av_frame_alloc();
+    filtered_frame_ = av_frame_alloc();
+    packet_         = av_packet_alloc();
+    if (!frame_ || !filtered_frame_ || !packet_) return AVERROR(ENOMEM);
+
+    return create_filters(stream);
+}
+
+int AudioTranscoder::create_filters(const AVStream *stream)
+{
+    if (filter_graph_ = avfilter_graph_alloc(); !filter_graph_) return AVERROR(ENOMEM);
+
+    const auto src_args =
+        fmt::format("time_base={}/{}:sample_rate={}:sample_fmt={}:channel_layout={}", stream->time_base.num,
+                    stream->time_base.den, decoder_ctx_->sample_rate,
+                    av_get_sample_fmt_name(decoder_ctx_->sample_fmt), channel_layout_str(decoder_ctx_));
+
+    if (avfilter_graph_create_filter(&buffersrc_ctx_, avfilter_get_by_name("abuffer"), "in",
+                                     src_args.c_str(), nullptr, filter_graph_) < 0 ||
+        avfilter_graph_create_filter(&buffersink_ctx_, avfilter_get_by_name("abuffersink"), "out", nullptr,
+                                     nullptr, filter_graph_) < 0) {
+        LOG(ERROR) << "failed to create the audio buffersrc / buffersink: " << src_args;
+        return -1;
+    }
+
+    AVFilterContext *aformat_ctx = nullptr;
+    const auto aformat_args =
+        fmt::format("sample_fmts={}:sample_rates={}:channel_layouts={}",
+                    av_get_sample_fmt_name(encoder_ctx_->sample_fmt), encoder_ctx_->sample_rate,
+                    channel_layout_str(encoder_ctx_));
+    if (avfilter_graph_create_filter(&aformat_ctx, avfilter_get_by_name("aformat"), "aformat",
+                                     aformat_args.c_str(), nullptr, filter_graph_) < 0) {
+        LOG(ERROR) << "failed to create the aformat filter: " << aformat_args;
+        return -1;
+    }
+
+    if (avfilter_link(buffersrc_ctx_, 0, aformat_ctx, 0) < 0 ||
+        avfilter_link(aformat_ctx, 0, buffersink_ctx_, 0) < 0 ||
+        avfilter_graph_config(filter_graph_, nullptr) < 0) {
+        LOG(ERROR) << "failed to configure the audio filters.";
+        return -1;
+    }
+
+    // most of the encoders accept the frames of the fixed size only
+    if (!(encoder_ctx_->codec->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE)) {
+        av_buffersink_set_frame_size(buffersink_ctx_, encoder_ctx_->frame_size);
+    }
+
+    LOG(INFO) << fmt::format("[AUDIO] {} {}Hz {} -> {} {}Hz {}, {} kbps", decoder_ctx_->codec->name,
+                             decoder_ctx_->sample_rate, channel_layout_str(decoder_ctx_),
+                             encoder_ctx_->codec->name, encoder_ctx_->sample_rate,
+                             channel_layout_str(encoder_ctx_), encoder_ctx_->bit_rate / 1000);
+    return 0;
+}
+
+int AudioTranscoder::transcode(const AVPacket *packet, const writer_t& write)
+{
+    // skip the corrupted packets
+    if (avcodec_send_packet(decoder_ctx_, packet) < 0) {
+        LOG(WARNING) << "[AUDIO] failed to send the packet to the decoder.";
+        return 0;
+    }
+
+    while (true) {
+        const int ret = avcodec_receive_frame(decoder_ctx_, frame_);
+        if (ret == AVERROR(EAGAIN)) return 0;
+        if (ret == AVERROR_EOF) break;
+        if (ret < 0) {
+            LOG(ERROR) << "[AUDIO] decoding error.";
+            return ret;
+        }
+
+        frame_->pts   = frame_->best_effort_timestamp;
+        const int err = filter(frame_, write);
+        av_frame_unref(frame_);
+        if (err < 0) return err;
+    }
+
+    // flush the filters and the encoder
+    if (const int ret = filter(nullptr, write); ret < 0) return ret;
+    return encode(nullptr, write);
+}
+
+int AudioTranscoder::filter(const AVFrame *frame, const writer_t& write)
+{
+    // nullptr: the end of the stream
+    if (av_buffersrc_write_frame(buffersrc_ctx_, frame) < 0) {
+        LOG(ERROR) << "[AUDIO] failed to send the frame to the filters.";
+        return -1;
+    }
+
+    while (true) {
+        const int ret = av_buffersink_get_frame(buffersink_ctx_, filtered_frame_);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) return 0;
+        if (ret < 0) {
+            LOG(ERROR) << "[AUDIO] failed to get the frame from the filters.";
+            return ret;
+        }
+
+        if (filtered_frame_->pts != AV_NOPTS_VALUE) {
+            filtered_frame_->pts = av_rescale_q(filtered_frame_->pts,
+                                                av_buffersink_get_time_base(buffersink_ctx_),
+                                                encoder_ctx_->time_base);
+        }
+
+        const int err = encode(filtered_frame_, write);
+        av_frame_unref(filtered_frame_);
+        if (err < 0) return err;
+        frames_++;
+    }
+}
+
+int AudioTranscoder::encode(const AVFrame *frame, const writer_t& write)
+{
+    if (avcodec_send_frame(encoder_ctx_, frame) < 0) {
+        LOG(ERROR) << "[AUDIO] failed to send the frame to the encoder.";
+        return -1;
+    }
+
+    while (true) {
+        const int ret = avcodec_receive_packet(encoder_ctx_, packet_);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) return 0;
+        if (ret < 0) {
+            LOG(ERROR) << "[AUDIO] encoding error.";
+            return ret;
+        }
+
+        packet_->stream_index = stream_idx_;
+        av_packet_rescale_ts(packet_, encoder_ctx_->time_base, fmt_ctx_->streams[stream_idx_]->time_base);
+
+        // 'write' takes the reference
+        if (const int err = write(packet_); err < 0) {
+            av_packet_unref(packet_);
+            return err;
+        }
+    }
+}
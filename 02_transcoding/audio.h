@@ -0,0 +1,56 @@
+#ifndef _02_AUDIO_H
+#define _02_AUDIO_H
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavfilter/avfilter.h>
+#include <libavformat/avformat.h>
+}
+#include <functional>
+#include "transcoding.h"
+
+// decoder --> aformat (sample format, rate, layout and frame size of the encoder) --> encoder
+//
+// the audio stream is transcoded on its own stage, the encoded packets are passed to 'write' in the time
+// base of the output stream, with the index of the output stream
+class AudioTranscoder
+{
+public:
+    using writer_t = std::function<int(AVPacket *)>;
+
+    AudioTranscoder() = default;
+    AudioTranscoder(const AudioTranscoder&) = delete;
+    AudioTranscoder& operator=(const AudioTranscoder&) = delete;
+    ~AudioTranscoder();
+
+    // open the decoder, the filters and the encoder, and add the output stream to 'fmt_ctx'
+    int open(const AVStream *stream, AVFormatContext *fmt_ctx, const TranscodeOptions& options);
+
+    // nullptr: flush the decoder, the filters and the encoder
+    int transcode(const AVPacket *packet, const writer_t& write);
+
+    int64_t frames() const { return frames_; }
+
+private:
+    int create_filters(const AVStream *stream);
+    int filter(const AVFrame *frame, const writer_t& write);
+    int encode(const AVFrame *frame, const writer_t& write);
+
+    AVCodecContext *decoder_ctx_{ nullptr };
+    AVCodecContext *encoder_ctx_{ nullptr };
+
+    AVFilterGraph *filter_graph_{ nullptr };
+    AVFilterContext *buffersrc_ctx_{ nullptr };
+    AVFilterContext *buffersink_ctx_{ nullptr };
+
+    AVFormatContext *fmt_ctx_{ nullptr };
+    int stream_idx_{ -1 };
+
+    AVFrame *frame_{ nullptr };
+    AVFrame *filtered_frame_{ nullptr };
+    AVPacket *packet_{ nullptr };
+
+    int64_t frames_{ 0 };
+};
+
+#endif //!_02_AUDIO_H
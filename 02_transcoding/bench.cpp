@@ -0,0 +1,509 @@
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/avutil.h>
+#include <libavutil/time.h>
+}
+#include "defer.h"
+#include "fmt/format.h"
+#include "logging.h"
+#include "transcoding.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <optional>
+#include <sstream>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+namespace fs = std::filesystem;
+
+namespace
+{
+    struct ThreadTime
+    {
+        int tid{};
+        std::string name{};
+        double cpu{ 0.0 }; // seconds
+    };
+
+    // cpu time of every thread alive, from /proc/self/task/<tid>/stat
+    std::map<int, ThreadTime> thread_times()
+    {
+        std::map<int, ThreadTime> threads{};
+#ifdef __linux__
+        const double ticks = static_cast<double>(sysconf(_SC_CLK_TCK));
+
+        std::error_code ec;
+        for (const auto& entry : fs::directory_iterator("/proc/self/task", ec)) {
+            std::ifstream stat(entry.path() / "stat");
+            std::string line{};
+            if (!std::getline(stat, line)) continue;
+
+            // the name in () may contain spaces, the fields are counted after it
+            const auto open  = line.find('(');
+            const auto close = line.rfind(')');
+            if (open == std::string::npos || close == std::string::npos) continue;
+
+            std::istringstream fields(line.substr(close + 2));
+            std::string field{};
+            int64_t utime = 0, stime = 0;
+            // state(3) ... utime(14) stime(15)
+            for (int i = 3; i <= 15 && fields >> field; i++) {
+                if (i == 14) utime = std::strtoll(field.c_str(), nullptr, 10);
+                if (i == 15) stime = std::strtoll(field.c_str(), nullptr, 10);
+            }
+
+            const int tid = std::atoi(entry.path().filename().c_str());
+            threads[tid]  = {
+                .tid  = tid,
+                .name = line.substr(open + 1, close - open - 1),
+                .cpu  = (utime + stime) / ticks,
+            };
+        }
+#endif
+        return threads;
+    }
+
+    // seconds, including the threads exited
+    double process_cpu_time()
+    {
+#ifdef __linux__
+        rusage usage{};
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+               (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000000.0;
+#else
+        return 0.0;
+#endif
+    }
+
+    // the peak resident set size is reset before every run, kB
+    void reset_peak_rss()
+    {
+#ifdef __linux__
+        std::ofstream("/proc/self/clear_refs") << "5";
+#endif
+    }
+
+    int64_t peak_rss()
+    {
+#ifdef __linux__
+        std::ifstream status("/proc/self/status");
+        for (std::string line; std::getline(status, line);) {
+            if (line.starts_with("VmHWM:")) return std::strtoll(line.c_str() + 6, nullptr, 10);
+        }
+#endif
+        return 0;
+    }
+
+    // allocations of the whole process so far, < 0: not counted, counted by transcode_bench only
+    int64_t allocations()
+    {
+#ifdef COUNT_ALLOCATIONS
+        return allocation_count();
+#else
+        return -1;
+#endif
+    }
+
+    struct Sample
+    {
+        int64_t frames{ 0 };
+        double wall{ 0.0 }; // seconds
+        double cpu{ 0.0 };  // seconds of all the threads
+        int64_t peak_rss{ 0 };
+        int64_t allocations{ -1 }; // < 0: not counted
+        std::vector<ThreadTime> threads{}; // cpu time of the threads in this run
+    };
+
+    // started by the constructor, stopped before the codecs are closed, so that their threads are counted
+    class Meter
+    {
+    public:
+        Meter()
+        {
+            reset_peak_rss();
+            threads_     = thread_times();
+            cpu_         = process_cpu_time();
+            allocations_ = allocations();
+            start_       = av_gettime_relative();
+        }
+
+        Sample stop(int64_t frames) const
+        {
+            Sample sample{
+                .frames      = frames,
+                .wall        = (av_gettime_relative() - start_) / 1000000.0,
+                .cpu         = process_cpu_time() - cpu_,
+                .peak_rss    = peak_rss(),
+                .allocations = allocations_ < 0 ? -1 : allocations() - allocations_,
+            };
+
+            for (auto [tid, thread] : thread_times()) {
+                if (const auto it = threads_.find(tid); it != threads_.end()) thread.cpu -= it->second.cpu;
+                if (thread.cpu > 0) sample.threads.push_back(thread);
+            }
+            std::sort(sample.threads.begin(), sample.threads.end(),
+                      [](const auto& a, const auto& b) { return a.cpu > b.cpu; });
+            return sample;
+        }
+
+    private:
+        std::map<int, ThreadTime> threads_{};
+        double cpu_{ 0.0 };
+        int64_t allocations_{ 0 };
+        int64_t start_{ 0 };
+    };
+
+    struct Input
+    {
+        ~Input()
+        {
+            avcodec_free_context(&decoder_ctx);
+            avformat_close_input(&fmt_ctx);
+        }
+
+        int open(const std::string& filename, const ProbeOptions& probe)
+        {
+            if (open_input(&fmt_ctx, filename, nullptr, nullptr, probe) < 0) return -1;
+
+            stream_idx = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+            if (stream_idx < 0) return -1;
+
+            stream    = fmt_ctx->streams[stream_idx];
+            framerate = av_guess_frame_rate(fmt_ctx, stream, nullptr);
+
+            decoder_ctx = open_decoder(stream);
+            return decoder_ctx ? 0 : -1;
+        }
+
+        // calls 'f' for every decoded frame until it returns non-zero, or the 'limit' is reached
+        template<class F> int decode(int64_t limit, F&& f)
+        {
+            AVPacket *packet = av_packet_alloc();
+            AVFrame *frame   = av_frame_alloc();
+            defer(av_packet_free(&packet); av_frame_free(&frame));
+
+            int64_t decoded = 0;
+            bool done       = false;
+
+            const auto receive = [&]() {
+                while (!done) {
+                    const int ret = avcodec_receive_frame(decoder_ctx, frame);
+                    if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) return 0;
+                    if (ret < 0) return ret;
+
+                    const int err = f(frame);
+                    av_frame_unref(frame);
+                    if (err < 0) return err;
+
+                    done = err > 0 || (limit > 0 && ++decoded >= limit);
+                }
+                return 0;
+            };
+
+            int ret = 0;
+            while (!done && ret >= 0 && av_read_frame(fmt_ctx, packet) >= 0) {
+                if (packet->stream_index == stream_idx && avcodec_send_packet(decoder_ctx, packet) >= 0) {
+                    ret = receive();
+                }
+                av_packet_unref(packet);
+            }
+
+            if (ret >= 0 && !done && avcodec_send_packet(decoder_ctx, nullptr) >= 0) ret = receive();
+            return ret;
+        }
+
+        int64_t encoder_pts(const AVFrame *frame, const AVCodecContext *encoder_ctx) const
+        {
+            const int64_t pts = frame->best_effort_timestamp;
+            return pts == AV_NOPTS_VALUE ? AV_NOPTS_VALUE
+                                         : av_rescale_q(pts, stream->time_base, encoder_ctx->time_base);
+        }
+
+        AVFormatContext *fmt_ctx{ nullptr };
+        AVCodecContext *decoder_ctx{ nullptr };
+        AVStream *stream{ nullptr };
+        int stream_idx{ -1 };
+        AVRational framerate{};
+    };
+
+    // the packets are dropped, the muxer is not measured
+    int encode(AVCodecContext *encoder_ctx, AVFrame *frame, AVPacket *packet)
+    {
+        if (avcodec_send_frame(encoder_ctx, frame) < 0) return -1;
+
+        while (true) {
+            const int ret = avcodec_receive_packet(encoder_ctx, packet);
+            if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) return 0;
+            if (ret < 0) return ret;
+            av_packet_unref(packet);
+        }
+    }
+
+    std::optional<Sample> decode_only(const std::string& filename, const TranscodeOptions& options,
+                                      int64_t limit)
+    {
+        Input input{};
+        if (input.open(filename, options.probe) < 0) return std::nullopt;
+
+        int64_t frames = 0;
+        const Meter meter{};
+        const int ret = input.decode(limit, [&](AVFrame *) {
+            frames++;
+            return 0;
+        });
+        if (ret < 0) return std::nullopt;
+        return meter.stop(frames);
+    }
+
+    std::optional<Sample> encode_only(const Input& input, const std::vector<AVFrame *>& frames,
+                                      const TranscodeOptions& options)
+    {
+        AVCodecContext *encoder_ctx =
+            open_video_encoder(input.decoder_ctx, input.framerate, options, false);
+        if (!encoder_ctx) return std::nullopt;
+        defer(avcodec_free_context(&encoder_ctx));
+
+        AVPacket *packet = av_packet_alloc();
+        defer(av_packet_free(&packet));
+
+        const Meter meter{};
+        for (const auto& frame : frames) {
+            frame->pict_type = AV_PICTURE_TYPE_NONE;
+            frame->pts       = input.encoder_pts(frame, encoder_ctx);
+            if (encode(encoder_ctx, frame, packet) < 0) return std::nullopt;
+        }
+        if (encode(encoder_ctx, nullptr, packet) < 0) return std::nullopt;
+
+        return meter.stop(static_cast<int64_t>(frames.size()));
+    }
+
+    std::optional<Sample> full_transcode(const std::string& filename, const TranscodeOptions& options,
+                                         int64_t limit)
+    {
+        Input input{};
+        if (input.open(filename, options.probe) < 0) return std::nullopt;
+
+        AVCodecContext *encoder_ctx =
+            open_video_encoder(input.decoder_ctx, input.framerate, options, false);
+        if (!encoder_ctx) return std::nullopt;
+        defer(avcodec_free_context(&encoder_ctx));
+
+        AVPacket *packet = av_packet_alloc();
+        defer(av_packet_free(&packet));
+
+        int64_t frames = 0;
+        const Meter meter{};
+        const int ret = input.decode(limit, [&](AVFrame *frame) {
+            frame->pict_type = AV_PICTURE_TYPE_NONE;
+            frame->pts       = input.encoder_pts(frame, encoder_ctx);
+            frames++;
+            return encode(encoder_ctx, frame, packet);
+        });
+        if (ret < 0 || encode(encoder_ctx, nullptr, packet) < 0) return std::nullopt;
+
+        return meter.stop(frames);
+    }
+
+    struct Stat
+    {
+        double mean{ 0.0 };
+        double stddev{ 0.0 };
+    };
+
+    template<class F> Stat stat(const std::vector<Sample>& samples, F&& f)
+    {
+        Stat s{};
+        if (samples.empty()) return s;
+
+        for (const auto& sample : samples) s.mean += f(sample);
+        s.mean /= samples.size();
+
+        for (const auto& sample : samples) s.stddev += (f(sample) - s.mean) * (f(sample) - s.mean);
+        s.stddev = samples.size() > 1 ? std::sqrt(s.stddev / (samples.size() - 1)) : 0.0;
+        return s;
+    }
+
+    struct Result
+    {
+        std::string mode{};
+        std::string preset{};
+        int threads{ 0 };
+        std::vector<Sample> samples{};
+
+        Stat fps, realtime, cpu, peak_rss, allocations;
+        bool counted{ false }; // the allocations
+
+        void summarize(double framerate)
+        {
+            fps      = stat(samples, [](const Sample& s) { return s.frames / s.wall; });
+            realtime = stat(samples, [=](const Sample& s) { return s.frames / framerate / s.wall; });
+            cpu      = stat(samples, [](const Sample& s) { return s.cpu / s.wall; });
+            peak_rss = stat(samples, [](const Sample& s) { return static_cast<double>(s.peak_rss); });
+            counted     = !samples.empty() && samples.back().allocations >= 0;
+            allocations = stat(samples, [](const Sample& s) {
+                return s.allocations / std::max<double>(1, s.frames);
+            });
+        }
+    };
+
+    std::string escape(const std::string& str)
+    {
+        std::string escaped{};
+        for (const char c : str) {
+            if (c == '"' || c == '\\') escaped += '\\';
+            if (static_cast<unsigned char>(c) < 0x20) {
+                escaped += fmt::format("\\u{:04x}", static_cast<int>(c));
+                continue;
+            }
+            escaped += c;
+        }
+        return escaped;
+    }
+
+    std::string to_json(const std::string& filename, const Input& input, const TranscodeOptions& options,
+                        const std::vector<Result>& results)
+    {
+        const auto stat_json = [](const Stat& s) {
+            return fmt::format("{{ \"mean\": {:.4f}, \"stddev\": {:.4f} }}", s.mean, s.stddev);
+        };
+
+        std::string json = fmt::format("{{\n  \"input\": \"{}\",\n  \"width\": {},\n  \"height\": {},\n"
+                                       "  \"framerate\": {:.3f},\n  \"encoder\": \"{}\",\n  \"results\": [",
+                                       escape(filename), input.decoder_ctx->width,
+                                       input.decoder_ctx->height, av_q2d(input.framerate),
+                                       escape(options.encoder));
+
+        for (size_t i = 0; i < results.size(); i++) {
+            const auto& r = results[i];
+
+            // the threads of the last run
+            std::string threads{};
+            if (!r.samples.empty()) {
+                const auto& last = r.samples.back();
+                for (size_t j = 0; j < last.threads.size(); j++) {
+                    threads += fmt::format("{}\n        {{ \"tid\": {}, \"name\": \"{}\", \"cpu\": {:.3f}, "
+                                           "\"utilization\": {:.3f} }}",
+                                           j ? "," : "", last.threads[j].tid, escape(last.threads[j].name),
+                                           last.threads[j].cpu, last.threads[j].cpu / last.wall);
+                }
+            }
+
+            json += fmt::format("{}\n    {{\n      \"mode\": \"{}\",\n      \"preset\": \"{}\",\n"
+                                "      \"threads\": {},\n      \"runs\": {},\n      \"frames\": {},\n"
+                                "      \"fps\": {},\n      \"realtime\": {},\n      \"cpu\": {},\n"
+                                "      \"peak_rss_kb\": {},\n      \"allocations_per_frame\": {},\n"
+                                "      \"thread_cpu\": [{}\n      ]\n    }}",
+                                i ? "," : "", r.mode, escape(r.preset), r.threads, r.samples.size(),
+                                r.samples.empty() ? 0 : r.samples.back().frames, stat_json(r.fps),
+                                stat_json(r.realtime), stat_json(r.cpu), stat_json(r.peak_rss),
+                                r.counted ? stat_json(r.allocations) : "null", threads);
+        }
+
+        return json + "\n  ]\n}\n";
+    }
+
+    void log_result(const Result& r)
+    {
+        LOG(INFO) << fmt::format("[BENCH] {:>9} {:>9} threads = {:>2}: {:>8.2f} +/- {:<6.2f} fps, "
+                                 "{:>6.2f}x realtime, cpu = {:>5.2f} cores, peak rss = {:>7.0f} kB, "
+                                 "allocations = {:>8} / frame",
+                                 r.mode, r.preset.empty() ? "default" : r.preset, r.threads, r.fps.mean,
+                                 r.fps.stddev, r.realtime.mean, r.cpu.mean, r.peak_rss.mean,
+                                 r.counted ? fmt::format("{:.1f}", r.allocations.mean) : "n/a");
+
+        if (r.samples.empty()) return;
+        const auto& last = r.samples.back();
+        for (const auto& thread : last.threads) {
+            if (thread.cpu / last.wall < 0.01) continue;
+            LOG(INFO) << fmt::format("[BENCH]        {:>16} #{:<7}: {:>7.3f}s, {:>5.1f}%", thread.name,
+                                     thread.tid, thread.cpu, thread.cpu * 100 / last.wall);
+        }
+    }
+} // namespace
+
+// Every case runs 'repeat' times:
+//   decode:    demux and decode only
+//   encode:    encode the frames decoded in advance and held in memory, the decoder is not measured
+//   transcode: demux, decode and encode, the packets are dropped instead of muxed
+// the encode and transcode cases are repeated for every preset and thread count swept.
+//
+// The cpu time of every thread is sampled from /proc and the peak rss is reset before every run, so these
+// are measured on Linux only. The allocations are counted by the transcode_bench target only.
+int benchmark(const std::string& in_filename, const TranscodeOptions& options, const BenchOptions& bench)
+{
+    // the frames for the encode-only runs
+    Input input{};
+    if (input.open(in_filename, options.probe) < 0) {
+        LOG(ERROR) << "can not open the input file: " << in_filename;
+        return -1;
+    }
+
+    std::vector<AVFrame *> frames{};
+    defer(for (auto& frame : frames) av_frame_free(&frame));
+    const int ret = input.decode(bench.frames, [&](AVFrame *frame) {
+        frames.push_back(av_frame_clone(frame));
+        return frames.back() ? 0 : AVERROR(ENOMEM);
+    });
+    if (ret < 0 || frames.empty()) {
+        LOG(ERROR) << "[BENCH] failed to decode the input.";
+        return -1;
+    }
+
+    const auto presets = bench.presets.empty() ? std::vector<std::string>{ options.preset } : bench.presets;
+    const auto threads = bench.threads.empty() ? std::vector<int>{ options.threads } : bench.threads;
+    const int64_t limit = static_cast<int64_t>(frames.size());
+
+    LOG(INFO) << fmt::format("[BENCH] {}, {}x{}, {} frames, {} runs per case", in_filename,
+                             input.decoder_ctx->width, input.decoder_ctx->height, limit, bench.repeat);
+
+    std::vector<Result> results{};
+    const auto run = [&](Result result, auto&& f) {
+        for (int i = 0; i < std::max(1, bench.repeat); i++) {
+            const auto sample = f();
+            if (!sample) {
+                LOG(ERROR) << "[BENCH] " << result.mode << " failed";
+                return false;
+            }
+            result.samples.push_back(sample.value());
+        }
+
+        result.summarize(av_q2d(input.framerate));
+        log_result(result);
+        results.push_back(std::move(result));
+        return true;
+    };
+
+    if (!run({ .mode = "decode" }, [&]() { return decode_only(in_filename, options, limit); })) return -1;
+
+    for (const auto& preset : presets) {
+        for (const auto& count : threads) {
+            auto case_options    = options;
+            case_options.preset  = preset;
+            case_options.threads = count;
+
+            if (!run({ .mode = "encode", .preset = preset, .threads = count },
+                     [&]() { return encode_only(input, frames, case_options); }) ||
+                !run({ .mode = "transcode", .preset = preset, .threads = count },
+                     [&]() { return full_transcode(in_filename, case_options, limit); })) {
+                return -1;
+            }
+        }
+    }
+
+    if (!bench.json.empty()) {
+        std::ofstream(bench.json, std::ios::trunc) << to_json(in_filename, input, options, results);
+        LOG(INFO) << "[BENCH] results are written to " << bench.json;
+    }
+    return 0;
+}
@@ -0,0 +1,399 @@
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/avutil.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/time.h>
+}
+#include "defer.h"
+#include "fmt/format.h"
+#include "logging.h"
+#include "timestamp.h"
+#include "transcoding.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <optional>
+
+namespace fs = std::filesystem;
+
+namespace
+{
+    // key=value per line, rewritten after every segment
+    struct Checkpoint
+    {
+        std::string input{};
+        std::string settings{};         // the segments can be concatenated only with the same encoder
+        std::string extradata{};        // hex of the global header, the same for all the segments
+        int64_t segments{ 0 };          // the segments written completely
+        int64_t next{ AV_NOPTS_VALUE }; // pts of the first frame of the next segment, input time base
+        int64_t frames{ 0 };            // frames in the written segments
+        bool finished{ false };         // all the segments are written, only the output is left
+    };
+
+    std::optional<Checkpoint> load(const fs::path& path)
+    {
+        std::ifstream in(path);
+        if (!in) return std::nullopt;
+
+        std::map<std::string, std::string> values{};
+        for (std::string line; std::getline(in, line);) {
+            if (const auto pos = line.find('='); pos != std::string::npos) {
+                values[line.substr(0, pos)] = line.substr(pos + 1);
+            }
+        }
+
+        const auto integer = [&](const std::string& key, int64_t fallback) {
+            return values.contains(key) ? std::strtoll(values[key].c_str(), nullptr, 10) : fallback;
+        };
+
+        return Checkpoint{
+            .input     = values["input"],
+            .settings  = values["settings"],
+            .extradata = values["extradata"],
+            .segments  = integer("segments", 0),
+            .next      = integer("next", AV_NOPTS_VALUE),
+            .frames    = integer("frames", 0),
+            .finished  = integer("finished", 0) != 0,
+        };
+    }
+
+    // write a temporary file and rename it, a crash never leaves a broken checkpoint
+    bool save(const fs::path& path, const Checkpoint& checkpoint)
+    {
+        const auto tmp = fs::path(path.string() + ".tmp");
+        {
+            std::ofstream out(tmp, std::ios::trunc);
+            out << "input=" << checkpoint.input << "\n"
+                << "settings=" << checkpoint.settings << "\n"
+                << "extradata=" << checkpoint.extradata << "\n"
+                << "segments=" << checkpoint.segments << "\n"
+                << "next=" << checkpoint.next << "\n"
+                << "frames=" << checkpoint.frames << "\n"
+                << "finished=" << (checkpoint.finished ? 1 : 0) << "\n";
+            if (!out.flush()) return false;
+        }
+
+        std::error_code ec;
+        fs::rename(tmp, path, ec);
+        return !ec;
+    }
+
+    fs::path segment_path(const fs::path& checkpoint, int64_t index)
+    {
+        return fmt::format("{}.seg{:05d}", checkpoint.string(), index);
+    }
+
+    std::string hex(const uint8_t *data, int size)
+    {
+        std::string str{};
+        for (int i = 0; i < size; i++) {
+            str += fmt::format("{:02x}", data[i]);
+        }
+        return str;
+    }
+
+    // the threads are not included, they do not change the format of the stream
+    std::string encoder_settings(const AVCodecContext *ctx, const TranscodeOptions& options)
+    {
+        return fmt::format("{} preset={} crf={} maxrate={} {}x{} {} {}/{}", options.encoder, options.preset,
+                           options.crf, options.maxrate, ctx->width, ctx->height,
+                           av_get_pix_fmt_name(ctx->pix_fmt), ctx->time_base.num, ctx->time_base.den);
+    }
+
+    // a forced keyframe at the beginning of a segment
+    struct Boundary
+    {
+        int64_t pts{};    // encoder time base
+        int64_t input{};  // pts in the input stream time base
+        int64_t frames{}; // frames before it
+    };
+} // namespace
+
+//  input --> decode --> encode --> segment 0 | segment 1 | ... | segment N --> concat --> output
+//                                          ^ checkpoint
+//
+// The output can not be appended after a crash, e.g. the index of a mp4 file is written at the end, so the
+// encoded packets are written to the segment files first. Every 'interval' seconds a keyframe is forced,
+// the GOPs are closed, so the encoder outputs all the packets before the keyframe first. Once the keyframe
+// is received, the segment is complete: it is closed and the checkpoint is updated with the number of the
+// segments and the pts of the keyframe.
+//
+// After a restart, the input is seeked to the keyframe recorded in the checkpoint, the frames before it are
+// dropped, and a new segment begins with a forced keyframe. The output is written after all the segments
+// are, the timestamps of the input are kept, so the segments are concatenated without re-encoding.
+int transcode_resumable(const std::string& in_filename, const std::string& out_filename,
+                        const TranscodeOptions& options, const CheckpointOptions& checkpoint_options)
+{
+    const int64_t start_time = av_gettime_relative();
+    const fs::path path      = checkpoint_options.filename;
+
+    // input
+    AVFormatContext *decoder_fmt_ctx = nullptr;
+    if (open_input(&decoder_fmt_ctx, in_filename, nullptr, nullptr, options.probe) < 0) {
+        LOG(ERROR) << "can not open the input file: " << in_filename;
+        return -1;
+    }
+    defer(avformat_close_input(&decoder_fmt_ctx));
+
+    const int video_stream_idx =
+        av_find_best_stream(decoder_fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+    if (video_stream_idx < 0) {
+        LOG(ERROR) << "can not find the video stream.";
+        return -1;
+    }
+    AVStream *decode_stream = decoder_fmt_ctx->streams[video_stream_idx];
+
+    AVCodecContext *decoder_ctx = open_decoder(decode_stream);
+    if (!decoder_ctx) return -1;
+    defer(avcodec_free_context(&decoder_ctx));
+
+    // output, opened after all the segments are written
+    AVFormatContext *encoder_fmt_ctx = nullptr;
+    if (avformat_alloc_output_context2(&encoder_fmt_ctx, nullptr, nullptr, out_filename.c_str()) < 0) {
+        LOG(ERROR) << "failed to alloc output-context memory.";
+        return -1;
+    }
+    defer(avformat_free_context(encoder_fmt_ctx));
+
+    auto segment_options       = options;
+    segment_options.closed_gop = true;
+
+    const AVRational framerate  = av_guess_frame_rate(decoder_fmt_ctx, decode_stream, nullptr);
+    AVCodecContext *encoder_ctx = open_video_encoder(decoder_ctx, framerate, segment_options,
+                                                     encoder_fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER);
+    if (!encoder_ctx) return -1;
+    defer(avcodec_free_context(&encoder_ctx));
+
+    // the checkpoint
+    Checkpoint checkpoint{
+        .input     = fs::absolute(in_filename).string(),
+        .settings  = encoder_settings(encoder_ctx, options),
+        .extradata = hex(encoder_ctx->extradata, encoder_ctx->extradata_size),
+    };
+
+    if (const auto saved = load(path); saved) {
+        if (saved->input != checkpoint.input || saved->settings != checkpoint.settings ||
+            saved->extradata != checkpoint.extradata) {
+            LOG(ERROR) << "[CHECKPOINT] " << path << " is created by another input or encoder settings: "
+                       << saved->input << ", " << saved->settings << ", remove it to start over";
+            return -1;
+        }
+
+        checkpoint = saved.value();
+        LOG(INFO) << fmt::format("[CHECKPOINT] resume from segment #{}, {} frames, at {:.3f}s",
+                                 checkpoint.segments, checkpoint.frames,
+                                 checkpoint.next == AV_NOPTS_VALUE
+                                     ? 0.0
+                                     : checkpoint.next * av_q2d(decode_stream->time_base));
+    }
+
+    const auto to_encoder_tb = [&](int64_t ts) {
+        return av_rescale_q(ts, decode_stream->time_base, encoder_ctx->time_base);
+    };
+    const int64_t interval = std::max<int64_t>(
+        1, av_rescale_q(static_cast<int64_t>(checkpoint_options.interval * AV_TIME_BASE), AV_TIME_BASE_Q,
+                        decode_stream->time_base));
+
+    // 1. encode the rest of the segments
+    if (!checkpoint.finished) {
+        if (checkpoint.next != AV_NOPTS_VALUE &&
+            av_seek_frame(decoder_fmt_ctx, video_stream_idx, checkpoint.next, AVSEEK_FLAG_BACKWARD) < 0) {
+            LOG(ERROR) << "[CHECKPOINT] failed to seek to " << checkpoint.next;
+            return -1;
+        }
+
+        // the segment being written is discarded on crash
+        std::ofstream out(segment_path(path, checkpoint.segments), std::ios::binary | std::ios::trunc);
+        if (!out) {
+            LOG(ERROR) << "[CHECKPOINT] can not open " << segment_path(path, checkpoint.segments);
+            return -1;
+        }
+
+        std::deque<Boundary> boundaries{};
+        int64_t segment_start = AV_NOPTS_VALUE;
+        int64_t frames        = checkpoint.frames;
+
+        const auto close_segment = [&](int64_t next, int64_t written) {
+            out.close();
+            if (!out) return false;
+
+            checkpoint.segments++;
+            checkpoint.next   = next;
+            checkpoint.frames = written;
+            if (!save(path, checkpoint)) {
+                LOG(ERROR) << "[CHECKPOINT] failed to save " << path;
+                return false;
+            }
+
+            LOG(INFO) << fmt::format("[CHECKPOINT] segment #{}: {} frames, {:.3f}s",
+                                     checkpoint.segments - 1, written,
+                                     (av_gettime_relative() - start_time) / 1000000.0);
+            return true;
+        };
+
+        AVPacket *packet  = av_packet_alloc();
+        AVPacket *encoded = av_packet_alloc();
+        AVFrame *frame    = av_frame_alloc();
+        defer(av_packet_free(&packet); av_packet_free(&encoded); av_frame_free(&frame));
+
+        const auto encode = [&](const AVFrame *input) {
+            if (avcodec_send_frame(encoder_ctx, input) < 0) {
+                LOG(ERROR) << "[CHECKPOINT] failed to send the frame to the encoder.";
+                return -1;
+            }
+
+            while (true) {
+                const int ret = avcodec_receive_packet(encoder_ctx, encoded);
+                if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) return 0;
+                if (ret < 0) return ret;
+
+                // all the packets of the previous segment have been received
+                if (!boundaries.empty() && (encoded->flags & AV_PKT_FLAG_KEY) &&
+                    encoded->pts >= boundaries.front().pts) {
+                    const auto boundary = boundaries.front();
+                    boundaries.pop_front();
+
+                    if (!close_segment(boundary.input, boundary.frames)) return -1;
+
+                    out.open(segment_path(path, checkpoint.segments), std::ios::binary | std::ios::trunc);
+                }
+
+                const bool written = write_packet(out, encoded);
+                av_packet_unref(encoded);
+                if (!written) {
+                    LOG(ERROR) << "[CHECKPOINT] failed to write the segment #" << checkpoint.segments;
+                    return -1;
+                }
+            }
+        };
+
+        const auto process = [&](AVFrame *decoded) {
+            const int64_t pts = decoded->best_effort_timestamp;
+
+            // written before the checkpoint
+            if (pts == AV_NOPTS_VALUE) return 0;
+            if (checkpoint.next != AV_NOPTS_VALUE && pts < checkpoint.next) return 0;
+
+            // every segment begins with a keyframe
+            decoded->pict_type = AV_PICTURE_TYPE_NONE;
+            if (segment_start == AV_NOPTS_VALUE) {
+                decoded->pict_type = AV_PICTURE_TYPE_I;
+                segment_start      = pts;
+            }
+            else if (pts >= segment_start + interval) {
+                decoded->pict_type = AV_PICTURE_TYPE_I;
+                segment_start      = pts;
+                boundaries.push_back({ .pts = to_encoder_tb(pts), .input = pts, .frames = frames });
+            }
+
+            frames++;
+            decoded->pts = to_encoder_tb(pts);
+            return encode(decoded);
+        };
+
+        const auto decode = [&](const AVPacket *input) {
+            // skip the corrupted packets
+            if (avcodec_send_packet(decoder_ctx, input) < 0) return 0;
+
+            while (true) {
+                const int ret = avcodec_receive_frame(decoder_ctx, frame);
+                if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) return 0;
+                if (ret < 0) return ret;
+
+                const int err = process(frame);
+                av_frame_unref(frame);
+                if (err < 0) return err;
+            }
+        };
+
+        int ret = 0;
+        while (ret >= 0 && av_read_frame(decoder_fmt_ctx, packet) >= 0) {
+            if (packet->stream_index == video_stream_idx) ret = decode(packet);
+            av_packet_unref(packet);
+        }
+
+        if (ret >= 0) ret = decode(nullptr);
+        if (ret >= 0) ret = encode(nullptr);
+
+        if (ret < 0) {
+            LOG(ERROR) << "[CHECKPOINT] failed to transcode, resume from " << path;
+            return -1;
+        }
+
+        // the last segment
+        checkpoint.finished = true;
+        if (!close_segment(AV_NOPTS_VALUE, frames)) return -1;
+    }
+
+    // 2. concatenate the segments
+    AVStream *encode_stream = avformat_new_stream(encoder_fmt_ctx, nullptr);
+    if (!encode_stream || avcodec_parameters_from_context(encode_stream->codecpar, encoder_ctx) < 0) {
+        LOG(ERROR) << "failed to create the video stream.";
+        return -1;
+    }
+    encode_stream->time_base = decode_stream->time_base;
+
+    if (!(encoder_fmt_ctx->oformat->flags & AVFMT_NOFILE)) {
+        if (avio_open(&encoder_fmt_ctx->pb, out_filename.c_str(), AVIO_FLAG_WRITE) < 0) {
+            LOG(ERROR) << "failed to open the output file: " << out_filename;
+            return -1;
+        }
+    }
+    defer(if (!(encoder_fmt_ctx->oformat->flags & AVFMT_NOFILE)) avio_closep(&encoder_fmt_ctx->pb));
+
+    if (avformat_write_header(encoder_fmt_ctx, nullptr) < 0) {
+        LOG(ERROR) << "failed to write header to the output file.";
+        return -1;
+    }
+
+    Interleaver interleaver(encoder_fmt_ctx, options.interleave);
+
+    int64_t last_dts = AV_NOPTS_VALUE;
+    int64_t fixed    = 0;
+
+    AVPacket *packet = av_packet_alloc();
+    defer(av_packet_free(&packet));
+    for (int64_t i = 0; i < checkpoint.segments; i++) {
+        std::ifstream in(segment_path(path, i), std::ios::binary);
+        if (!in) {
+            LOG(ERROR) << "[CHECKPOINT] can not open " << segment_path(path, i);
+            return -1;
+        }
+
+        while (in.peek() != EOF && read_packet(in, packet)) {
+            packet->stream_index = 0;
+            av_packet_rescale_ts(packet, encoder_ctx->time_base, encode_stream->time_base);
+
+            // the encoder restarted after a checkpoint may extrapolate the first dts differently
+            if (fix_monotonic_dts(packet, last_dts)) fixed++;
+
+            if (interleaver.write(packet) < 0) {
+                LOG(ERROR) << "[CHECKPOINT] failed to write the packet to the output file.";
+                return -1;
+            }
+        }
+    }
+
+    if (interleaver.flush() < 0) return -1;
+    av_write_trailer(encoder_fmt_ctx);
+
+    if (fixed > 0) LOG(WARNING) << "[CHECKPOINT] " << fixed << " non-monotonic dts are adjusted";
+
+    // done, the segments and the checkpoint are not needed anymore
+    for (int64_t i = 0; i < checkpoint.segments; i++) {
+        std::error_code ec;
+        fs::remove(segment_path(path, i), ec);
+    }
+    std::error_code ec;
+    fs::remove(path, ec);
+
+    const double elapsed = (av_gettime_relative() - start_time) / 1000000.0;
+    LOG(INFO) << fmt::format("[CHECKPOINT] frames: {}, segments: {}, {:.3f}s", checkpoint.frames,
+                             checkpoint.segments, elapsed);
+    return 0;
+}
@@ -0,0 +1,159 @@
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/avutil.h>
+}
+#include "defer.h"
+#include "logging.h"
+#include "transcoding.h"
+
+#include <algorithm>
+#include <climits>
+#include <fstream>
+#include <istream>
+#include <iterator>
+#include <ostream>
+
+AVCodecContext *open_decoder(const AVStream *stream, int threads)
+{
+    auto decoder = avcodec_find_decoder(stream->codecpar->codec_id);
+    if (!decoder) {
+        LOG(ERROR) << "failed to find the decoder: " << avcodec_get_name(stream->codecpar->codec_id);
+        return nullptr;
+    }
+
+    AVCodecContext *decoder_ctx = avcodec_alloc_context3(decoder);
+    if (!decoder_ctx) {
+        LOG(ERROR) << "failed to allocate decoder context.";
+        return nullptr;
+    }
+
+    if (avcodec_parameters_to_context(decoder_ctx, stream->codecpar) < 0) {
+        LOG(ERROR) << "failed to copy parameters.";
+        avcodec_free_context(&decoder_ctx);
+        return nullptr;
+    }
+
+    decoder_ctx->pkt_timebase = stream->time_base;
+    decoder_ctx->thread_count = threads;
+
+    if (avcodec_open2(decoder_ctx, decoder, nullptr) < 0) {
+        LOG(ERROR) << "can not open the decoder.";
+        avcodec_free_context(&decoder_ctx);
+        return nullptr;
+    }
+
+    return decoder_ctx;
+}
+
+AVCodecContext *open_video_encoder(const AVCodecContext *decoder_ctx, AVRational framerate,
+                                   const TranscodeOptions& options, bool global_header, int pass)
+{
+    return open_video_encoder(decoder_ctx->width, decoder_ctx->height, decoder_ctx->pix_fmt,
+                              decoder_ctx->sample_aspect_ratio, framerate, options, global_header, pass);
+}
+
+AVCodecContext *open_video_encoder(int width, int height, AVPixelFormat pix_fmt, AVRational sar,
+                                   AVRational framerate, const TranscodeOptions& options,
+                                   bool global_header, int pass)
+{
+    auto encoder = avcodec_find_encoder_by_name(options.encoder.c_str());
+    if (!encoder) {
+        LOG(ERROR) << "can not find the encoder: " << options.encoder;
+        return nullptr;
+    }
+
+    AVCodecContext *encoder_ctx = avcodec_alloc_context3(encoder);
+    if (!encoder_ctx) {
+        LOG(ERROR) << "failed to allocate encoder context.";
+        return nullptr;
+    }
+
+    AVDictionary *encoder_options = nullptr;
+    defer(av_dict_free(&encoder_options));
+    if (options.bitrate <= 0) av_dict_set_int(&encoder_options, "crf", options.crf, 0);
+    if (!options.preset.empty()) av_dict_set(&encoder_options, "preset", options.preset.c_str(), 0);
+    if (options.threads > 0)
+        av_dict_set_int(&encoder_options, "threads", options.threads, 0);
+    else
+        av_dict_set(&encoder_options, "threads", "auto", 0);
+    if (options.closed_gop) av_dict_set(&encoder_options, "forced-idr", "1", 0);
+    if (options.stitchable) av_dict_set(&encoder_options, "x264-params", "stitchable=1", 0);
+
+    encoder_ctx->height              = height;
+    encoder_ctx->width               = width;
+    encoder_ctx->pix_fmt             = pix_fmt;
+    encoder_ctx->sample_aspect_ratio = sar;
+    encoder_ctx->framerate           = framerate;
+    encoder_ctx->time_base           = av_inv_q(framerate);
+
+    if (options.gop > 0) encoder_ctx->gop_size = options.gop;
+    if (options.bitrate > 0) encoder_ctx->bit_rate = options.bitrate;
+
+    // capped crf
+    if (options.maxrate > 0) {
+        encoder_ctx->rc_max_rate    = options.maxrate;
+        encoder_ctx->rc_buffer_size = static_cast<int>(std::min<int64_t>(options.maxrate * 2, INT_MAX));
+    }
+
+    if (global_header) encoder_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    if (options.closed_gop) encoder_ctx->flags |= AV_CODEC_FLAG_CLOSED_GOP;
+
+    // two-pass, libx264 reads and writes the stats file itself, the others take the stats from 'stats_in'
+    // and return them by 'stats_out', which are written by the caller
+    if (pass == 1) encoder_ctx->flags |= AV_CODEC_FLAG_PASS1;
+    if (pass == 2) {
+        encoder_ctx->flags |= AV_CODEC_FLAG_PASS2;
+
+        std::ifstream in(options.passlog, std::ios::binary);
+        const std::string stats{ std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>() };
+        if (!in || stats.empty()) {
+            LOG(ERROR) << "failed to read the stats of the first pass: " << options.passlog;
+            avcodec_free_context(&encoder_ctx);
+            return nullptr;
+        }
+        encoder_ctx->stats_in = av_strdup(stats.c_str());
+    }
+    if (pass) av_dict_set(&encoder_options, "stats", options.passlog.c_str(), 0);
+
+    const int ret = avcodec_open2(encoder_ctx, encoder, &encoder_options);
+    // parsed by the encoders on opening
+    av_freep(&encoder_ctx->stats_in);
+    if (ret < 0) {
+        LOG(ERROR) << "can not open the encoder.";
+        avcodec_free_context(&encoder_ctx);
+        return nullptr;
+    }
+
+    return encoder_ctx;
+}
+
+bool write_packet(std::ostream& out, const AVPacket *packet)
+{
+    out.write(reinterpret_cast<const char *>(&packet->pts), sizeof(packet->pts));
+    out.write(reinterpret_cast<const char *>(&packet->dts), sizeof(packet->dts));
+    out.write(reinterpret_cast<const char *>(&packet->duration), sizeof(packet->duration));
+    out.write(reinterpret_cast<const char *>(&packet->flags), sizeof(packet->flags));
+    out.write(reinterpret_cast<const char *>(&packet->size), sizeof(packet->size));
+    out.write(reinterpret_cast<const char *>(packet->data), packet->size);
+    return !!out;
+}
+
+bool read_packet(std::istream& in, AVPacket *packet)
+{
+    int64_t pts = 0, dts = 0, duration = 0;
+    int flags = 0, size = 0;
+
+    in.read(reinterpret_cast<char *>(&pts), sizeof(pts));
+    in.read(reinterpret_cast<char *>(&dts), sizeof(dts));
+    in.read(reinterpret_cast<char *>(&duration), sizeof(duration));
+    in.read(reinterpret_cast<char *>(&flags), sizeof(flags));
+    in.read(reinterpret_cast<char *>(&size), sizeof(size));
+    if (!in || size < 0 || av_new_packet(packet, size) < 0) return false;
+
+    packet->pts      = pts;
+    packet->dts      = dts;
+    packet->duration = duration;
+    packet->flags    = flags;
+    return !!in.read(reinterpret_cast<char *>(packet->data), size);
+}
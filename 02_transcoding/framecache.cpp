@@ -0,0 +1,287 @@
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+}
+#include "fmt/format.h"
+#include "framecache.h"
+#include "logging.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+    // the linesizes of the cached frames, and the alignment of their offsets
+    constexpr int LINESIZE_ALIGN = 32;
+    constexpr int64_t OFFSET_ALIGN = 64;
+
+    // the cached buffer is owned by the mapping
+    void unowned(void *, uint8_t *) {}
+} // namespace
+
+FrameCache::~FrameCache()
+{
+    close();
+
+    if (!records_.empty()) {
+        LOG(INFO) << fmt::format("[CACHE] {} frames, {:.2f} MiB", records_.size(),
+                                 used_ / (1024.0 * 1024.0));
+    }
+}
+
+int FrameCache::open()
+{
+    const auto size = options_.size;
+    if (size <= 0) return -1;
+
+#ifdef _WIN32
+    // removed once closed, the pages are flushed lazily
+    file_ = CreateFileA(options_.filename.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+                        FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, nullptr);
+    if (file_ == INVALID_HANDLE_VALUE) {
+        file_ = nullptr;
+        LOG(ERROR) << "[CACHE] failed to create the cache file: " << options_.filename;
+        return -1;
+    }
+
+    mapping_ = CreateFileMappingW(file_, nullptr, PAGE_READWRITE, static_cast<DWORD>(size >> 32),
+                                  static_cast<DWORD>(size & 0xffffffff), nullptr);
+    if (!mapping_ ||
+        !(data_ = static_cast<uint8_t *>(MapViewOfFile(mapping_, FILE_MAP_ALL_ACCESS, 0, 0, 0)))) {
+        LOG(ERROR) << "[CACHE] failed to map the cache file: " << options_.filename;
+        close();
+        return -1;
+    }
+#else
+    fd_ = ::open(options_.filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd_ < 0) {
+        LOG(ERROR) << "[CACHE] failed to create the cache file: " << options_.filename;
+        return -1;
+    }
+
+    // the file is removed once closed, even if the process is killed
+    ::unlink(options_.filename.c_str());
+
+    // sparse, the disk is allocated by the frames written
+    if (::ftruncate(fd_, size) < 0) {
+        LOG(ERROR) << "[CACHE] failed to reserve " << size << " bytes for the cache file";
+        close();
+        return -1;
+    }
+
+    void *data = ::mmap(nullptr, static_cast<size_t>(size), PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (data == MAP_FAILED) {
+        LOG(ERROR) << "[CACHE] failed to map the cache file: " << options_.filename;
+        close();
+        return -1;
+    }
+    data_ = static_cast<uint8_t *>(data);
+#endif
+
+    LOG(INFO) << fmt::format("[CACHE] {}, {:.0f} MiB, eviction: {}", options_.filename,
+                             size / (1024.0 * 1024.0),
+                             options_.eviction == CacheEviction::keep ? "keep" : "drop");
+    return 0;
+}
+
+void FrameCache::close()
+{
+#ifdef _WIN32
+    if (data_) UnmapViewOfFile(data_);
+    if (mapping_) CloseHandle(mapping_);
+    if (file_) CloseHandle(file_);
+    mapping_ = nullptr;
+    file_    = nullptr;
+#else
+    if (data_) ::munmap(data_, static_cast<size_t>(options_.size));
+    if (fd_ >= 0) ::close(fd_);
+    fd_ = -1;
+#endif
+    data_ = nullptr;
+}
+
+bool FrameCache::put(const AVFrame *frame)
+{
+    if (!data_ || full_) return false;
+
+    const auto format = static_cast<AVPixelFormat>(frame->format);
+    const int size    = av_image_get_buffer_size(format, frame->width, frame->height, LINESIZE_ALIGN);
+    if (size < 0) return false;
+
+    const int64_t offset = (used_ + OFFSET_ALIGN - 1) / OFFSET_ALIGN * OFFSET_ALIGN;
+    if (offset + size > options_.size) {
+        full_ = true;
+
+        if (options_.eviction == CacheEviction::drop) {
+            LOG(INFO) << fmt::format("[CACHE] full after {} frames, dropped", records_.size());
+            records_.clear();
+            used_ = 0;
+            close();
+        }
+        else {
+            LOG(INFO) << fmt::format("[CACHE] full after {} frames, the rest is decoded on every pass",
+                                     records_.size());
+        }
+        return false;
+    }
+
+    if (av_image_copy_to_buffer(data_ + offset, size, frame->data, frame->linesize, format, frame->width,
+                                frame->height, LINESIZE_ALIGN) < 0) {
+        return false;
+    }
+
+    records_.push_back({
+        .pts             = frame->pts,
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57, 30, 100)
+        .duration        = frame->duration,
+#else
+        .duration        = frame->pkt_duration,
+#endif
+        .width           = frame->width,
+        .height          = frame->height,
+        .format          = frame->format,
+        .sar             = frame->sample_aspect_ratio,
+        .color_range     = frame->color_range,
+        .color_space     = frame->colorspace,
+        .color_primaries = frame->color_primaries,
+        .color_trc       = frame->color_trc,
+        .offset          = offset,
+        .size            = size,
+    });
+    used_ = offset + size;
+    return true;
+}
+
+int FrameCache::get(size_t idx, AVFrame *frame) const
+{
+    if (idx >= records_.size()) return AVERROR_EOF;
+
+    const auto& record = records_[idx];
+    uint8_t *data      = data_ + record.offset;
+
+    frame->buf[0] = av_buffer_create(data, static_cast<int>(record.size), unowned, nullptr,
+                                     AV_BUFFER_FLAG_READONLY);
+    if (!frame->buf[0]) return AVERROR(ENOMEM);
+
+    if (av_image_fill_arrays(frame->data, frame->linesize, data, static_cast<AVPixelFormat>(record.format),
+                             record.width, record.height, LINESIZE_ALIGN) < 0) {
+        av_frame_unref(frame);
+        return AVERROR(EINVAL);
+    }
+
+    frame->extended_data       = frame->data;
+    frame->pts                 = record.pts;
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57, 30, 100)
+    frame->duration            = record.duration;
+#else
+    frame->pkt_duration        = record.duration;
+#endif
+    frame->width               = record.width;
+    frame->height              = record.height;
+    frame->format              = record.format;
+    frame->sample_aspect_ratio = record.sar;
+    frame->color_range         = record.color_range;
+    frame->colorspace          = record.color_space;
+    frame->color_primaries     = record.color_primaries;
+    frame->color_trc           = record.color_trc;
+    return 0;
+}
+
+int FrameSource::read(AVFrame *frame)
+{
+    // replay
+    if (cache_ && !filling_) {
+        if (next_ < cache_->frames()) {
+            if (const int ret = cache_->get(next_++, frame); ret < 0) return ret;
+            stats_.replayed++;
+            return 0;
+        }
+
+        if (cache_->complete()) return AVERROR_EOF;
+    }
+
+    while (true) {
+        if (const int ret = decode(frame); ret < 0) {
+            if (ret == AVERROR_EOF && filling_ && cache_) cache_->set_complete();
+            return ret;
+        }
+
+        // replayed from the cache in this pass
+        if (skip_to_ != AV_NOPTS_VALUE && frame->pts != AV_NOPTS_VALUE && frame->pts <= skip_to_) {
+            av_frame_unref(frame);
+            continue;
+        }
+
+        stats_.decoded++;
+        if (filling_ && cache_) cache_->put(frame);
+        return 0;
+    }
+}
+
+int FrameSource::rewind()
+{
+    filling_ = false;
+    next_    = 0;
+
+    if (cache_ && cache_->frames() > 0) {
+        if (cache_->complete()) return 0;
+
+        // the frames not cached are decoded after the cached ones are replayed
+        skip_to_ = cache_->last_pts();
+        return seek(skip_to_);
+    }
+
+    skip_to_ = AV_NOPTS_VALUE;
+    return seek(AV_NOPTS_VALUE);
+}
+
+int FrameSource::decode(AVFrame *frame)
+{
+    if (!packet_ && !(packet_ = av_packet_alloc())) return AVERROR(ENOMEM);
+
+    while (true) {
+        const int ret = avcodec_receive_frame(decoder_ctx_, frame);
+        if (ret >= 0) {
+            frame->pts = frame->best_effort_timestamp;
+            return 0;
+        }
+        if (ret != AVERROR(EAGAIN)) return ret;
+
+        // the end of the input, flush the decoder
+        if (av_read_frame(fmt_ctx_, packet_) < 0) {
+            if (draining_) return AVERROR_EOF;
+
+            draining_ = true;
+            avcodec_send_packet(decoder_ctx_, nullptr);
+            continue;
+        }
+
+        // skip the corrupted packets
+        if (packet_->stream_index == stream_idx_ && avcodec_send_packet(decoder_ctx_, packet_) < 0) {
+            LOG(WARNING) << "[CACHE] failed to send the packet to the decoder.";
+        }
+        av_packet_unref(packet_);
+    }
+}
+
+int FrameSource::seek(int64_t pts)
+{
+    const AVStream *stream = fmt_ctx_->streams[stream_idx_];
+    if (pts == AV_NOPTS_VALUE) pts = stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+
+    if (av_seek_frame(fmt_ctx_, stream_idx_, pts, AVSEEK_FLAG_BACKWARD) < 0) {
+        LOG(ERROR) << "[CACHE] failed to seek to " << pts;
+        return -1;
+    }
+
+    avcodec_flush_buffers(decoder_ctx_);
+    draining_ = false;
+    return 0;
+}
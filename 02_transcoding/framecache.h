@@ -0,0 +1,139 @@
+#ifndef _02_FRAMECACHE_H
+#define _02_FRAMECACHE_H
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+#include <cstdint>
+#include <string>
+#include <vector>
+
+enum class CacheEviction
+{
+    keep, // the cached frames are kept, the frames beyond the size are decoded again on every pass
+    drop, // the whole cache is dropped once it is full, every pass decodes the input
+};
+
+struct FrameCacheOptions
+{
+    std::string filename{};                       // the spill file, empty: no cache
+    int64_t size{ 4ll * 1024 * 1024 * 1024 };     // max bytes of the cached frames
+    CacheEviction eviction{ CacheEviction::keep };
+};
+
+// Decoded frames spilled to a memory-mapped file, uncompressed.
+//
+// The frames are appended on the first pass and replayed on the later ones without decoding. The file is
+// reserved with the size of the cache but sparse, the disk is used only by the frames written. The frames
+// replayed reference the mapping without copying, so the cache must outlive the encoders using them.
+class FrameCache
+{
+public:
+    explicit FrameCache(const FrameCacheOptions& options) : options_(options) {}
+    FrameCache(const FrameCache&) = delete;
+    FrameCache& operator=(const FrameCache&) = delete;
+    ~FrameCache();
+
+    int open();
+
+    // false: the frame is not cached, and will not be, the cache is full or dropped
+    bool put(const AVFrame *frame);
+
+    // the idx-th cached frame, read-only
+    int get(size_t idx, AVFrame *frame) const;
+
+    size_t frames() const { return records_.size(); }
+    int64_t bytes() const { return used_; }
+
+    // pts of the last cached frame
+    int64_t last_pts() const { return records_.empty() ? AV_NOPTS_VALUE : records_.back().pts; }
+
+    // all the frames of the stream are cached
+    bool complete() const { return complete_; }
+    void set_complete() { complete_ = !full_; }
+
+private:
+    struct Record
+    {
+        int64_t pts{ AV_NOPTS_VALUE };
+        int64_t duration{ 0 };
+        int width{};
+        int height{};
+        int format{};
+        AVRational sar{ 0, 1 };
+        AVColorRange color_range{ AVCOL_RANGE_UNSPECIFIED };
+        AVColorSpace color_space{ AVCOL_SPC_UNSPECIFIED };
+        AVColorPrimaries color_primaries{ AVCOL_PRI_UNSPECIFIED };
+        AVColorTransferCharacteristic color_trc{ AVCOL_TRC_UNSPECIFIED };
+        int64_t offset{};
+        int64_t size{};
+    };
+
+    void close();
+
+    FrameCacheOptions options_{};
+    std::vector<Record> records_{};
+
+    uint8_t *data_{ nullptr };
+    int64_t used_{ 0 };
+    bool full_{ false };
+    bool complete_{ false };
+
+#ifdef _WIN32
+    void *file_{ nullptr };
+    void *mapping_{ nullptr };
+#else
+    int fd_{ -1 };
+#endif
+};
+
+// The frames of the video stream for every pass of a multi-pass encoding.
+//
+// The first pass decodes the input and fills the cache. The later passes replay the cached frames, then
+// seek the input to the first frame not cached, and decode the rest. Without a cache, every pass decodes.
+class FrameSource
+{
+public:
+    struct Stats
+    {
+        int64_t decoded{ 0 };  // frames decoded in all the passes
+        int64_t replayed{ 0 }; // frames replayed from the cache in all the passes
+    };
+
+    // 'cache' may be nullptr
+    FrameSource(AVFormatContext *fmt_ctx, int stream_idx, AVCodecContext *decoder_ctx, FrameCache *cache)
+        : fmt_ctx_(fmt_ctx), stream_idx_(stream_idx), decoder_ctx_(decoder_ctx), cache_(cache)
+    {}
+
+    FrameSource(const FrameSource&) = delete;
+    FrameSource& operator=(const FrameSource&) = delete;
+    ~FrameSource() { av_packet_free(&packet_); }
+
+    // 0: a frame, AVERROR_EOF: the end of this pass
+    int read(AVFrame *frame);
+
+    // start the next pass from the first frame
+    int rewind();
+
+    Stats stats() const { return stats_; }
+
+private:
+    int decode(AVFrame *frame);
+    int seek(int64_t pts);
+
+    AVFormatContext *fmt_ctx_{ nullptr };
+    int stream_idx_{ -1 };
+    AVCodecContext *decoder_ctx_{ nullptr };
+    FrameCache *cache_{ nullptr };
+
+    AVPacket *packet_{ nullptr };
+    bool filling_{ true };              // the first pass, the decoded frames are cached
+    bool draining_{ false };            // the decoder is flushed
+    size_t next_{ 0 };                  // the next frame replayed from the cache
+    int64_t skip_to_{ AV_NOPTS_VALUE }; // the decoded frames up to this pts are cached, dropped
+
+    Stats stats_{};
+};
+
+#endif //!_02_FRAMECACHE_H
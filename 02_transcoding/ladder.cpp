@@ -0,0 +1,464 @@
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavfilter/avfilter.h>
+#include <libavfilter/buffersink.h>
+#include <libavfilter/buffersrc.h>
+#include <libavformat/avformat.h>
+#include <libavutil/avutil.h>
+#include <libavutil/time.h>
+}
+#include "boundedqueue.h"
+#include "defer.h"
+#include "fmt/format.h"
+#include "logging.h"
+#include "transcoding.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace
+{
+    // one rendition: buffersink --frames--> encoder --packets--> muxer
+    struct Output
+    {
+        explicit Output(const Rendition& r, size_t queue_size)
+            : rendition(r), frames(queue_size, [](AVFrame **frame) { av_frame_free(frame); })
+        {}
+
+        ~Output()
+        {
+            avcodec_free_context(&encoder_ctx);
+            if (fmt_ctx && !(fmt_ctx->oformat->flags & AVFMT_NOFILE)) avio_closep(&fmt_ctx->pb);
+            avformat_free_context(fmt_ctx);
+        }
+
+        Rendition rendition{};
+
+        AVFilterContext *sink{ nullptr };
+        AVCodecContext *encoder_ctx{ nullptr };
+        AVFormatContext *fmt_ctx{ nullptr };
+
+        BoundedQueue<AVFrame *> frames;
+        std::thread thread{};
+
+        int64_t first_pts{ AV_NOPTS_VALUE }; // AV_TIME_BASE
+        int64_t segments{ 0 };               // the keyframes forced at the segment boundaries
+
+        bool failed{ false };
+        int64_t encoded{ 0 };
+        int64_t keyframes{ 0 };
+        int64_t bytes{ 0 };
+        int64_t elapsed{ 0 };
+    };
+
+    // [in]split=N[s0][s1]...;[s0]scale=-2:H0[out0];[s1]scale=-2:H1[out1];...
+    std::string ladder_descr(const std::vector<std::unique_ptr<Output>>& outputs)
+    {
+        std::string descr = fmt::format("[in]split={}", outputs.size());
+        for (size_t i = 0; i < outputs.size(); i++) {
+            descr += fmt::format("[s{}]", i);
+        }
+
+        for (size_t i = 0; i < outputs.size(); i++) {
+            descr += fmt::format(";[s{}]scale=-2:{}[out{}]", i, outputs[i]->rendition.height, i);
+        }
+        return descr;
+    }
+
+    AVFilterGraph *create_ladder_graph(AVFormatContext *fmt_ctx, AVStream *stream,
+                                       const AVCodecContext *decoder_ctx, AVFilterContext **src,
+                                       std::vector<std::unique_ptr<Output>>& outputs)
+    {
+        AVFilterGraph *graph = avfilter_graph_alloc();
+        if (!graph) return nullptr;
+
+        const AVRational fr    = av_guess_frame_rate(fmt_ctx, stream, nullptr);
+        const AVRational sar   = decoder_ctx->sample_aspect_ratio;
+        const std::string args = fmt::format(
+            "video_size={}x{}:pix_fmt={}:time_base={}/{}:pixel_aspect={}/{}:frame_rate={}/{}",
+            decoder_ctx->width, decoder_ctx->height, static_cast<int>(decoder_ctx->pix_fmt),
+            stream->time_base.num, stream->time_base.den, sar.num, std::max(1, sar.den), fr.num, fr.den);
+
+        if (avfilter_graph_create_filter(src, avfilter_get_by_name("buffer"), "in", args.c_str(), nullptr,
+                                         graph) < 0) {
+            LOG(ERROR) << "[LADDER] failed to create the buffersrc: " << args;
+            avfilter_graph_free(&graph);
+            return nullptr;
+        }
+
+        // the labels in the description are linked to the buffersrc and the buffersinks by name
+        AVFilterInOut *sources = avfilter_inout_alloc();
+        sources->name          = av_strdup("in");
+        sources->filter_ctx    = *src;
+        sources->pad_idx       = 0;
+        sources->next          = nullptr;
+
+        AVFilterInOut *sinks = nullptr;
+        for (size_t i = outputs.size(); i-- > 0;) {
+            const auto name = fmt::format("out{}", i);
+            if (avfilter_graph_create_filter(&outputs[i]->sink, avfilter_get_by_name("buffersink"),
+                                             name.c_str(), nullptr, nullptr, graph) < 0) {
+                LOG(ERROR) << "[LADDER] failed to create the buffersink.";
+                avfilter_inout_free(&sources);
+                avfilter_inout_free(&sinks);
+                avfilter_graph_free(&graph);
+                return nullptr;
+            }
+
+            AVFilterInOut *sink = avfilter_inout_alloc();
+            sink->name          = av_strdup(name.c_str());
+            sink->filter_ctx    = outputs[i]->sink;
+            sink->pad_idx       = 0;
+            sink->next          = sinks;
+            sinks               = sink;
+        }
+        defer(avfilter_inout_free(&sources); avfilter_inout_free(&sinks));
+
+        const auto descr = ladder_descr(outputs);
+        LOG(INFO) << "[LADDER] filters: " << descr;
+
+        if (avfilter_graph_parse_ptr(graph, descr.c_str(), &sinks, &sources, nullptr) < 0 ||
+            avfilter_graph_config(graph, nullptr) < 0) {
+            LOG(ERROR) << "[LADDER] failed to create the filter graph: " << descr;
+            avfilter_graph_free(&graph);
+            return nullptr;
+        }
+
+        return graph;
+    }
+
+    int open_output(Output& output, const TranscodeOptions& options, AVRational framerate)
+    {
+        const auto& filename = output.rendition.filename;
+        if (avformat_alloc_output_context2(&output.fmt_ctx, nullptr, nullptr, filename.c_str()) < 0) {
+            LOG(ERROR) << "failed to alloc output-context memory.";
+            return -1;
+        }
+
+        AVStream *stream = avformat_new_stream(output.fmt_ctx, nullptr);
+        if (!stream) {
+            LOG(ERROR) << "failed to create a video stream.";
+            return -1;
+        }
+
+        auto rendition_options    = options;
+        rendition_options.maxrate = output.rendition.maxrate;
+
+        output.encoder_ctx = open_video_encoder(
+            av_buffersink_get_w(output.sink), av_buffersink_get_h(output.sink),
+            static_cast<AVPixelFormat>(av_buffersink_get_format(output.sink)),
+            av_buffersink_get_sample_aspect_ratio(output.sink), framerate, rendition_options,
+            output.fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER);
+        if (!output.encoder_ctx) return -1;
+
+        stream->time_base = av_buffersink_get_time_base(output.sink);
+        if (avcodec_parameters_from_context(stream->codecpar, output.encoder_ctx) < 0) {
+            LOG(ERROR) << "failed to copy parameters to the output stream.";
+            return -1;
+        }
+
+        if (!(output.fmt_ctx->oformat->flags & AVFMT_NOFILE)) {
+            if (avio_open(&output.fmt_ctx->pb, filename.c_str(), AVIO_FLAG_WRITE) < 0) {
+                LOG(ERROR) << "failed to open the output file: " << filename;
+                return -1;
+            }
+        }
+
+        if (avformat_write_header(output.fmt_ctx, nullptr) < 0) {
+            LOG(ERROR) << "failed to write header to the output file: " << filename;
+            return -1;
+        }
+
+        av_dump_format(output.fmt_ctx, 0, filename.c_str(), 1);
+        return 0;
+    }
+
+    // runs on the thread of the rendition, until the frame queue is closed and drained
+    void encode_rendition(Output& output, const InterleaveOptions& interleave_options)
+    {
+        const int64_t start = av_gettime_relative();
+        defer(output.elapsed = av_gettime_relative() - start);
+
+        AVCodecContext *encoder_ctx = output.encoder_ctx;
+
+        Interleaver interleaver(output.fmt_ctx, interleave_options);
+
+        AVPacket *packet = av_packet_alloc();
+        defer(av_packet_free(&packet));
+
+        const auto encode = [&](const AVFrame *frame) {
+            if (avcodec_send_frame(encoder_ctx, frame) < 0) {
+                LOG(ERROR) << "[LADDER] failed to send the frame to the encoder.";
+                return -1;
+            }
+
+            while (true) {
+                const int ret = avcodec_receive_packet(encoder_ctx, packet);
+                if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+                    return 0;
+                }
+                else if (ret < 0) {
+                    LOG(ERROR) << "[LADDER] encoding error.";
+                    return ret;
+                }
+
+                if (packet->flags & AV_PKT_FLAG_KEY) output.keyframes++;
+                output.bytes += packet->size;
+
+                packet->stream_index = 0;
+                av_packet_rescale_ts(packet, encoder_ctx->time_base, output.fmt_ctx->streams[0]->time_base);
+                if (interleaver.write(packet) < 0) {
+                    LOG(ERROR) << "[LADDER] failed to write the packet to the output file.";
+                    return -1;
+                }
+            }
+        };
+
+        while (auto frame = output.frames.pop()) {
+            const int ret = encode(frame.value());
+            av_frame_free(&frame.value());
+            if (ret < 0) {
+                output.failed = true;
+                output.frames.close();
+                return;
+            }
+            output.encoded++;
+        }
+
+        // flush the encoder
+        if (encode(nullptr) < 0 || interleaver.flush() < 0) {
+            output.failed = true;
+            return;
+        }
+
+        av_write_trailer(output.fmt_ctx);
+    }
+} // namespace
+
+std::optional<Rendition> parse_rendition(const std::string& spec, const std::string& out_filename)
+{
+    int height = 0, kbps = 0;
+    if (std::sscanf(spec.c_str(), "%d:%d", &height, &kbps) < 1 || height <= 0 || kbps < 0) {
+        return std::nullopt;
+    }
+
+    const fs::path path = out_filename;
+    const auto filename = path.parent_path() /
+                          fmt::format("{}_{}p{}", path.stem().string(), height, path.extension().string());
+
+    return Rendition{
+        .height   = height,
+        .maxrate  = static_cast<int64_t>(kbps) * 1000,
+        .filename = filename.string(),
+    };
+}
+
+//                                   +--> scale --> encode --> mux (1080p)
+//  demux --> decode --> split ------+--> scale --> encode --> mux (720p)
+//                                   +--> scale --> encode --> mux (...)
+//
+// the input is decoded and scaled once on this thread, every rendition is encoded and muxed on its own
+// thread. The keyframes are forced at the same pts in every rendition every 'segment' seconds, and the
+// forced keyframes are IDR frames of closed GOPs, so the renditions can be cut into segments at the same
+// positions and the players can switch between them at any segment boundary.
+int transcode_ladder(const std::string& in_filename, const TranscodeOptions& options,
+                     const LadderOptions& ladder)
+{
+    const int64_t start_time = av_gettime_relative();
+
+    if (ladder.renditions.empty()) {
+        LOG(ERROR) << "[LADDER] no renditions.";
+        return -1;
+    }
+
+    // input
+    AVFormatContext *decoder_fmt_ctx = nullptr;
+    if (open_input(&decoder_fmt_ctx, in_filename, nullptr, nullptr, options.probe) < 0) {
+        LOG(ERROR) << "can not open the input file: " << in_filename;
+        return -1;
+    }
+    defer(avformat_close_input(&decoder_fmt_ctx));
+
+    const int video_stream_idx =
+        av_find_best_stream(decoder_fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+    if (video_stream_idx < 0) {
+        LOG(ERROR) << "can not find the video stream.";
+        return -1;
+    }
+    AVStream *decode_stream = decoder_fmt_ctx->streams[video_stream_idx];
+
+    AVCodecContext *decoder_ctx = open_decoder(decode_stream);
+    if (!decoder_ctx) return -1;
+    defer(avcodec_free_context(&decoder_ctx));
+
+    av_dump_format(decoder_fmt_ctx, 0, in_filename.c_str(), 0);
+
+    std::vector<std::unique_ptr<Output>> outputs{};
+    for (const auto& rendition : ladder.renditions) {
+        if (rendition.height > decoder_ctx->height) {
+            LOG(WARNING) << fmt::format("[LADDER] {}p is upscaled from {}p", rendition.height,
+                                        decoder_ctx->height);
+        }
+        outputs.emplace_back(std::make_unique<Output>(rendition, options.queue_size));
+    }
+
+    // filters: one buffersrc, one buffersink per rendition
+    AVFilterContext *src = nullptr;
+    AVFilterGraph *filter_graph =
+        create_ladder_graph(decoder_fmt_ctx, decode_stream, decoder_ctx, &src, outputs);
+    if (!filter_graph) return -1;
+    defer(avfilter_graph_free(&filter_graph));
+
+    // outputs, the keyframes are aligned by pts instead of the frame count, the renditions share
+    // the encoder options but the threads
+    const AVRational framerate = av_guess_frame_rate(decoder_fmt_ctx, decode_stream, nullptr);
+
+    auto rendition_options       = options;
+    rendition_options.closed_gop = true;
+    rendition_options.gop = std::max(1, static_cast<int>(ladder.segment * av_q2d(framerate) + 0.5));
+    if (options.threads <= 0) {
+        const int cores           = static_cast<int>(std::thread::hardware_concurrency());
+        rendition_options.threads = std::max(1, cores / static_cast<int>(outputs.size()));
+    }
+
+    for (auto& output : outputs) {
+        if (open_output(*output, rendition_options, framerate) < 0) return -1;
+    }
+
+    // encode and mux the renditions
+    for (auto& output : outputs) {
+        output->thread = std::thread(encode_rendition, std::ref(*output), std::cref(options.interleave));
+    }
+
+    bool failed = false;
+    defer({
+        for (auto& output : outputs) {
+            output->frames.close();
+            if (output->thread.joinable()) output->thread.join();
+        }
+    });
+
+    const int64_t segment = std::max<int64_t>(1, static_cast<int64_t>(ladder.segment * AV_TIME_BASE));
+
+    AVFrame *filtered_frame = av_frame_alloc();
+    defer(av_frame_free(&filtered_frame));
+
+    // pull the scaled frames from every buffersink, and queue them to the encoders
+    const auto dispatch = [&]() {
+        for (auto& output : outputs) {
+            while (true) {
+                const int ret = av_buffersink_get_frame(output->sink, filtered_frame);
+                if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) break;
+                if (ret < 0) {
+                    LOG(ERROR) << "[LADDER] failed to get the frame from the buffersink.";
+                    return ret;
+                }
+
+                // every rendition gets the same frames, so the same frames are forced to be keyframes:
+                // the first frame at or after each segment boundary
+                filtered_frame->pict_type = AV_PICTURE_TYPE_NONE;
+                if (filtered_frame->pts != AV_NOPTS_VALUE) {
+                    const AVRational time_base = av_buffersink_get_time_base(output->sink);
+                    const int64_t pts = av_rescale_q(filtered_frame->pts, time_base, AV_TIME_BASE_Q);
+                    if (output->first_pts == AV_NOPTS_VALUE) output->first_pts = pts;
+
+                    const int64_t index = (pts - output->first_pts) / segment;
+                    if (index >= output->segments) {
+                        filtered_frame->pict_type = AV_PICTURE_TYPE_I;
+                        output->segments          = index + 1;
+                    }
+
+                    filtered_frame->pts = av_rescale_q(filtered_frame->pts, time_base,
+                                                       output->encoder_ctx->time_base);
+                }
+
+                AVFrame *queued = av_frame_alloc();
+                av_frame_move_ref(queued, filtered_frame);
+                if (!output->frames.push(queued)) {
+                    av_frame_free(&queued);
+                    return AVERROR_EXIT;
+                }
+            }
+        }
+        return 0;
+    };
+
+    AVPacket *packet = av_packet_alloc();
+    defer(av_packet_free(&packet));
+    AVFrame *frame = av_frame_alloc();
+    defer(av_frame_free(&frame));
+
+    // ATTENTION: the packets and frames are not one-to-one correspondence.
+    const auto decode = [&](const AVPacket *pkt) {
+        // skip the corrupted packets
+        if (avcodec_send_packet(decoder_ctx, pkt) < 0) {
+            LOG(WARNING) << "[LADDER] failed to send the packet to the decoder.";
+            return 0;
+        }
+
+        while (true) {
+            int ret = avcodec_receive_frame(decoder_ctx, frame);
+            if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+                return 0;
+            }
+            else if (ret < 0) {
+                LOG(ERROR) << "[LADDER] decoding error.";
+                return ret;
+            }
+
+            frame->pts = frame->best_effort_timestamp;
+            if ((ret = av_buffersrc_add_frame_flags(src, frame, AV_BUFFERSRC_FLAG_PUSH)) < 0) {
+                LOG(ERROR) << "[LADDER] failed to send the frame to the filters.";
+                return ret;
+            }
+
+            if ((ret = dispatch()) < 0) return ret;
+        }
+    };
+
+    while (!failed && av_read_frame(decoder_fmt_ctx, packet) >= 0) {
+        if (packet->stream_index == video_stream_idx && decode(packet) < 0) failed = true;
+        av_packet_unref(packet);
+    }
+
+    // flush the decoder and the filters
+    if (!failed) {
+        if (decode(nullptr) < 0 || av_buffersrc_add_frame_flags(src, nullptr, 0) < 0 || dispatch() < 0) {
+            failed = true;
+        }
+    }
+    const int64_t decoded = decoder_ctx->frame_number;
+
+    for (auto& output : outputs) {
+        output->frames.close();
+        output->thread.join();
+        if (output->failed) failed = true;
+    }
+
+    if (failed) return -1;
+
+    const double elapsed = (av_gettime_relative() - start_time) / 1000000.0;
+    const double duration =
+        decode_stream->duration != AV_NOPTS_VALUE
+            ? decode_stream->duration * av_q2d(decode_stream->time_base)
+            : static_cast<double>(decoder_fmt_ctx->duration) / AV_TIME_BASE;
+
+    for (const auto& output : outputs) {
+        LOG(INFO) << fmt::format("[LADDER] {:>4}p {}x{}: frames = {}, keyframes = {}, {:.0f} kbps, "
+                                 "{:.3f}s, {}",
+                                 output->rendition.height, output->encoder_ctx->width,
+                                 output->encoder_ctx->height, output->encoded, output->keyframes,
+                                 duration > 0 ? output->bytes * 8 / duration / 1000 : 0.0,
+                                 output->elapsed / 1000000.0, output->rendition.filename);
+    }
+    LOG(INFO) << fmt::format("[LADDER] decoded frames: {}, renditions: {}, {:.3f}s, {:.2f} fps", decoded,
+                             outputs.size(), elapsed, decoded / elapsed);
+    return 0;
+}
@@ -0,0 +1,153 @@
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavutil/frame.h>
+#include <libavutil/mathematics.h>
+}
+#include "fmt/format.h"
+#include "logging.h"
+#include "normalizer.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+    int64_t duration_of(const AVFrame *frame)
+    {
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57, 30, 100)
+        return frame->duration;
+#else
+        return frame->pkt_duration;
+#endif
+    }
+
+    void set_duration(AVFrame *frame, int64_t duration)
+    {
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57, 30, 100)
+        frame->duration = duration;
+#else
+        frame->pkt_duration = duration;
+#endif
+    }
+} // namespace
+
+FpsMode parse_fps_mode(const std::string& mode, const AVOutputFormat *oformat)
+{
+    if (mode == "cfr") return FpsMode::cfr;
+    if (mode == "vfr") return FpsMode::vfr;
+    if (mode == "passthrough") return FpsMode::passthrough;
+
+    if (mode != "auto") LOG(WARNING) << "[FPS] unknown mode '" << mode << "', auto is used";
+
+    // e.g. the raw streams have no timestamps to keep
+    if (oformat->flags & AVFMT_NOTIMESTAMPS) return FpsMode::passthrough;
+    return (oformat->flags & AVFMT_VARIABLE_FPS) ? FpsMode::vfr : FpsMode::cfr;
+}
+
+const char *fps_mode_name(FpsMode mode)
+{
+    switch (mode) {
+    case FpsMode::cfr: return "cfr";
+    case FpsMode::vfr: return "vfr";
+    case FpsMode::passthrough: return "passthrough";
+    default: return "unknown";
+    }
+}
+
+FrameRateNormalizer::FrameRateNormalizer(FpsMode mode, AVRational time_base, AVRational framerate)
+    : mode_(mode), time_base_(time_base), enc_time_base_(av_inv_q(framerate))
+{
+    last_ = av_frame_alloc();
+}
+
+int FrameRateNormalizer::push(AVFrame *frame, const std::function<int(AVFrame *)>& encode)
+{
+    if (!frame) return encode(nullptr);
+
+    stats_.input++;
+
+    if (mode_ == FpsMode::passthrough) {
+        if (frame->pts != AV_NOPTS_VALUE) frame->pts = av_rescale_q(frame->pts, time_base_, enc_time_base_);
+        stats_.output++;
+        return encode(frame);
+    }
+
+    // the timestamp and the duration in the encoder time base, not rounded
+    const double scale        = av_q2d(time_base_) / av_q2d(enc_time_base_);
+    const int64_t in_duration = duration_of(frame);
+
+    double pts      = frame->pts == AV_NOPTS_VALUE ? static_cast<double>(next_pts_) : frame->pts * scale;
+    double duration = in_duration > 0 ? in_duration * scale : 1.0;
+
+    if (next_pts_ == AV_NOPTS_VALUE) {
+        next_pts_ = frame->pts == AV_NOPTS_VALUE ? 0 : std::llrint(pts);
+        if (frame->pts == AV_NOPTS_VALUE) pts = 0.0;
+    }
+
+    // delta0: how far the frame starts after the next slot, delta: how far it ends after the next slot
+    double delta0 = pts - static_cast<double>(next_pts_);
+    double delta  = delta0 + duration;
+
+    // starts a little before the next slot but covers it: moved to the slot
+    if (delta0 < 0 && delta > 0) {
+        pts = static_cast<double>(next_pts_);
+        duration += delta0;
+        delta0 = 0;
+    }
+
+    int64_t frames = 1; // times the frame is sent
+    int64_t gap    = 0; // times the previous frame is repeated before it, cfr only
+    if (mode_ == FpsMode::cfr) {
+        if (delta < -1.1) {
+            frames = 0;
+        }
+        else if (delta > 1.1) {
+            frames = std::llrint(delta);
+            if (delta0 > 1.1) gap = std::min(frames, static_cast<int64_t>(std::llrint(delta0 - 0.6)));
+        }
+        // no previous frame to fill the gap with, e.g. the stream starts late
+        if (!last_->buf[0]) gap = 0;
+    }
+    else {
+        if (delta <= -0.6) {
+            frames = 0;
+        }
+        else if (delta > 0.6) {
+            next_pts_ = std::llrint(pts);
+        }
+    }
+
+    if (frames == 0) stats_.dropped++;
+
+    // the duplicated frames are new references to the same buffers, and never keyframes
+    const auto send = [&](AVFrame *f, bool duplicated) {
+        f->pts       = next_pts_++;
+        f->pict_type = duplicated ? AV_PICTURE_TYPE_P : AV_PICTURE_TYPE_NONE;
+        set_duration(f, mode_ == FpsMode::cfr ? 1 : std::max<int64_t>(1, std::llrint(duration)));
+
+        stats_.output++;
+        if (duplicated) stats_.duplicated++;
+        return encode(f);
+    };
+
+    for (int64_t i = 0; i < gap; i++) {
+        if (const int ret = send(last_, true); ret < 0) return ret;
+    }
+    for (int64_t i = gap; i < frames; i++) {
+        if (const int ret = send(frame, i > gap); ret < 0) return ret;
+    }
+
+    // the latest frame, even if dropped, fills the gap before the next one
+    if (mode_ == FpsMode::cfr) {
+        av_frame_unref(last_);
+        if (const int ret = av_frame_ref(last_, frame); ret < 0) return ret;
+    }
+    return 0;
+}
+
+std::string FrameRateNormalizer::str() const
+{
+    return fmt::format("[FPS] {}, {}/{}, input frames: {}, output frames: {}, dropped: {}, duplicated: {}",
+                       fps_mode_name(mode_), enc_time_base_.den, enc_time_base_.num, stats_.input,
+                       stats_.output, stats_.dropped, stats_.duplicated);
+}
@@ -0,0 +1,65 @@
+#ifndef _02_NORMALIZER_H
+#define _02_NORMALIZER_H
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavutil/frame.h>
+}
+#include <cstdint>
+#include <functional>
+#include <string>
+
+enum class FpsMode
+{
+    cfr,         // one frame every 1 / framerate, the frames are dropped and duplicated to keep the rate
+    vfr,         // the timestamps are kept, the frames on the same slot as the previous one are dropped
+    passthrough, // the timestamps are rescaled only, nothing is dropped or duplicated
+};
+
+// "auto": cfr if the output format can not store the variable frame rate, otherwise vfr
+FpsMode parse_fps_mode(const std::string& mode, const AVOutputFormat *oformat);
+
+const char *fps_mode_name(FpsMode mode);
+
+// Timestamps of the decoded frames to the encoder.
+//
+// The frames are in the time base of the input stream, the encoder works in 1 / framerate. Every frame
+// is decided to be sent to the encoder 0 (dropped), 1 or more (duplicated) times with the pts of the
+// output slots it covers. The duplicated frames reference the buffers of the frame, nothing is copied,
+// and are never keyframes, so the encoder codes them as the cheap skipped blocks of the previous frame.
+class FrameRateNormalizer
+{
+public:
+    struct Stats
+    {
+        int64_t input{ 0 };      // frames received
+        int64_t output{ 0 };     // frames sent to the encoder
+        int64_t dropped{ 0 };
+        int64_t duplicated{ 0 };
+    };
+
+    FrameRateNormalizer(FpsMode mode, AVRational time_base, AVRational framerate);
+    FrameRateNormalizer(const FrameRateNormalizer&) = delete;
+    FrameRateNormalizer& operator=(const FrameRateNormalizer&) = delete;
+    ~FrameRateNormalizer() { av_frame_free(&last_); }
+
+    // send the frame to 'encode' as many times as it is decided, the pts is in the encoder time base,
+    // nullptr: the end of the stream, 'encode' is called with nullptr to flush the encoder
+    int push(AVFrame *frame, const std::function<int(AVFrame *)>& encode);
+
+    Stats stats() const { return stats_; }
+
+    std::string str() const;
+
+private:
+    FpsMode mode_{ FpsMode::cfr };
+    AVRational time_base_{};      // of the input frames
+    AVRational enc_time_base_{};  // 1 / framerate
+
+    int64_t next_pts_{ AV_NOPTS_VALUE }; // the next output slot, in the encoder time base
+    AVFrame *last_{ nullptr };           // the previous frame, duplicated into the gaps before the next one
+
+    Stats stats_{};
+};
+
+#endif //!_02_NORMALIZER_H
@@ -0,0 +1,450 @@
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavcodec/bsf.h>
+#include <libavformat/avformat.h>
+#include <libavutil/avutil.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/time.h>
+}
+#include "audio.h"
+#include "defer.h"
+#include "fmt/format.h"
+#include "logging.h"
+#include "transcoding.h"
+
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <vector>
+
+// AV_PROFILE_* since FFmpeg 6.1, the FF_PROFILE_* ones are removed in 7.0
+#ifndef AV_PROFILE_H264_HIGH
+#define AV_PROFILE_H264_BASELINE             FF_PROFILE_H264_BASELINE
+#define AV_PROFILE_H264_CONSTRAINED_BASELINE FF_PROFILE_H264_CONSTRAINED_BASELINE
+#define AV_PROFILE_H264_MAIN                 FF_PROFILE_H264_MAIN
+#define AV_PROFILE_H264_HIGH                 FF_PROFILE_H264_HIGH
+#define AV_PROFILE_HEVC_MAIN                 FF_PROFILE_HEVC_MAIN
+#define AV_PROFILE_VP9_0                     FF_PROFILE_VP9_0
+#define AV_PROFILE_AV1_MAIN                  FF_PROFILE_AV1_MAIN
+#endif
+
+namespace
+{
+    // the window of the peak bitrate, the same as the rate control buffer of the capped crf
+    constexpr double PEAK_WINDOW = 2.0;
+
+    // by demuxing the video stream without decoding
+    struct BitrateStats
+    {
+        int64_t packets{ 0 };
+        int64_t bytes{ 0 };
+        double duration{ 0.0 };   // seconds
+        int64_t average{ 0 };     // bits per second
+        int64_t peak{ 0 };        // bits per second over the PEAK_WINDOW
+        int64_t max_gop{ 0 };     // max packets from a keyframe to the next one
+    };
+
+    BitrateStats scan_bitrate(AVFormatContext *fmt_ctx, int stream_idx)
+    {
+        const AVRational time_base = fmt_ctx->streams[stream_idx]->time_base;
+
+        BitrateStats stats{};
+        int64_t first = AV_NOPTS_VALUE, last = AV_NOPTS_VALUE, gop = 0;
+
+        // the packets in the window, in the decoding order, which is close enough for the bitrate
+        std::deque<std::pair<int64_t, int>> window{};
+        int64_t window_bytes = 0;
+        const int64_t span   = av_rescale_q(static_cast<int64_t>(PEAK_WINDOW * AV_TIME_BASE),
+                                            AV_TIME_BASE_Q, time_base);
+
+        AVPacket *packet = av_packet_alloc();
+        defer(av_packet_free(&packet));
+        while (av_read_frame(fmt_ctx, packet) >= 0) {
+            defer(av_packet_unref(packet));
+            if (packet->stream_index != stream_idx) continue;
+
+            stats.packets++;
+            stats.bytes += packet->size;
+
+            if (packet->flags & AV_PKT_FLAG_KEY) {
+                stats.max_gop = std::max(stats.max_gop, gop);
+                gop           = 0;
+            }
+            gop++;
+
+            const int64_t ts = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+            if (ts == AV_NOPTS_VALUE) continue;
+
+            if (first == AV_NOPTS_VALUE) first = ts;
+            last = std::max(last, ts + packet->duration);
+
+            window.emplace_back(ts, packet->size);
+            window_bytes += packet->size;
+            while (!window.empty() && window.front().first <= ts - span) {
+                window_bytes -= window.front().second;
+                window.pop_front();
+            }
+            if (ts - first >= span) {
+                stats.peak = std::max(stats.peak, static_cast<int64_t>(window_bytes * 8 / PEAK_WINDOW));
+            }
+        }
+        stats.max_gop = std::max(stats.max_gop, gop);
+
+        if (first != AV_NOPTS_VALUE && last > first) {
+            stats.duration = (last - first) * av_q2d(time_base);
+            stats.average  = static_cast<int64_t>(stats.bytes * 8 / stats.duration);
+        }
+        // shorter than the window
+        if (stats.peak == 0) stats.peak = stats.average;
+        return stats;
+    }
+
+    struct RuleContext
+    {
+        const AVCodecParameters *par{};
+        const AVCodec *encoder{};
+        const AVOutputFormat *oformat{};
+        const TranscodeOptions& options;
+        const BitrateStats& stats;
+    };
+
+    // std::nullopt: passed, otherwise the reason of the re-encoding
+    struct Rule
+    {
+        const char *name{};
+        std::function<std::optional<std::string>(const RuleContext&)> check{};
+    };
+
+    std::string profile_name(const AVCodecParameters *par)
+    {
+        const char *name = avcodec_profile_name(par->codec_id, par->profile);
+        return name ? name : fmt::format("{}", par->profile);
+    }
+
+    // the profiles decoded everywhere: 8-bit 4:2:0, no interlaced coding tools beyond the High profile
+    bool widely_supported(const AVCodecParameters *par)
+    {
+        switch (par->codec_id) {
+        case AV_CODEC_ID_H264:
+            return par->profile == AV_PROFILE_H264_BASELINE ||
+                   par->profile == AV_PROFILE_H264_CONSTRAINED_BASELINE ||
+                   par->profile == AV_PROFILE_H264_MAIN || par->profile == AV_PROFILE_H264_HIGH;
+        case AV_CODEC_ID_HEVC: return par->profile == AV_PROFILE_HEVC_MAIN;
+        case AV_CODEC_ID_VP9:  return par->profile == AV_PROFILE_VP9_0;
+        case AV_CODEC_ID_AV1:  return par->profile == AV_PROFILE_AV1_MAIN;
+        default:               return true;
+        }
+    }
+
+    const std::vector<Rule>& rules()
+    {
+        static const std::vector<Rule> rules{
+            {
+                "codec",
+                [](const RuleContext& ctx) -> std::optional<std::string> {
+                    if (ctx.par->codec_id == ctx.encoder->id) return std::nullopt;
+                    return fmt::format("{} != {}", avcodec_get_name(ctx.par->codec_id), ctx.encoder->name);
+                },
+            },
+            {
+                "profile",
+                [](const RuleContext& ctx) -> std::optional<std::string> {
+                    const auto& profiles = ctx.options.passthrough.profiles;
+                    const auto name      = profile_name(ctx.par);
+                    const bool accepted  = profiles.empty()
+                                               ? widely_supported(ctx.par)
+                                               : std::find(profiles.begin(), profiles.end(), name) !=
+                                                     profiles.end();
+                    if (accepted) return std::nullopt;
+                    return fmt::format("profile '{}' is not accepted", name);
+                },
+            },
+            {
+                "pixel format",
+                [](const RuleContext& ctx) -> std::optional<std::string> {
+                    const auto pix_fmt = static_cast<AVPixelFormat>(ctx.par->format);
+                    if (!ctx.encoder->pix_fmts) return std::nullopt;
+                    for (auto ptr = ctx.encoder->pix_fmts; *ptr != AV_PIX_FMT_NONE; ptr++) {
+                        if (*ptr == pix_fmt) return std::nullopt;
+                    }
+                    const char *name = av_get_pix_fmt_name(pix_fmt);
+                    return fmt::format("{} is not produced by {}", name ? name : "unknown",
+                                       ctx.encoder->name);
+                },
+            },
+            {
+                "resolution",
+                [](const RuleContext& ctx) -> std::optional<std::string> {
+                    const auto& limits = ctx.options.passthrough;
+                    if ((limits.max_width <= 0 || ctx.par->width <= limits.max_width) &&
+                        (limits.max_height <= 0 || ctx.par->height <= limits.max_height))
+                        return std::nullopt;
+                    return fmt::format("{}x{} exceeds {}x{}", ctx.par->width, ctx.par->height,
+                                       limits.max_width, limits.max_height);
+                },
+            },
+            {
+                "bitrate",
+                [](const RuleContext& ctx) -> std::optional<std::string> {
+                    // the target bitrate of the abr with a tolerance of 10%
+                    const auto target = ctx.options.bitrate;
+                    if (target > 0 && ctx.stats.average > target * 11 / 10) {
+                        return fmt::format("average {} kbps > {} kbps", ctx.stats.average / 1000,
+                                           target / 1000);
+                    }
+                    return std::nullopt;
+                },
+            },
+            {
+                "maxrate",
+                [](const RuleContext& ctx) -> std::optional<std::string> {
+                    const auto maxrate = ctx.options.maxrate;
+                    if (maxrate > 0 && ctx.stats.peak > maxrate) {
+                        return fmt::format("peak {} kbps over {}s > {} kbps", ctx.stats.peak / 1000,
+                                           PEAK_WINDOW, maxrate / 1000);
+                    }
+                    return std::nullopt;
+                },
+            },
+            {
+                "gop",
+                [](const RuleContext& ctx) -> std::optional<std::string> {
+                    const auto gop = ctx.options.gop;
+                    if (gop > 0 && ctx.stats.max_gop > gop) {
+                        return fmt::format("{} frames between the keyframes > {}", ctx.stats.max_gop, gop);
+                    }
+                    return std::nullopt;
+                },
+            },
+            {
+                "container",
+                [](const RuleContext& ctx) -> std::optional<std::string> {
+                    if (avformat_query_codec(ctx.oformat, ctx.par->codec_id, FF_COMPLIANCE_NORMAL) != 0)
+                        return std::nullopt;
+                    return fmt::format("{} is not accepted by {}", avcodec_get_name(ctx.par->codec_id),
+                                       ctx.oformat->name);
+                },
+            },
+        };
+        return rules;
+    }
+
+    // the bitstream filter converting the packets of the input container to the output one
+    const char *select_bsf(const AVCodecParameters *par, const AVOutputFormat *oformat)
+    {
+        const bool global_header = oformat->flags & AVFMT_GLOBALHEADER;
+
+        switch (par->codec_id) {
+        // avcC / hvcC in the extradata: the NAL units are length-prefixed, the formats without
+        // a global header, e.g. mpegts and the raw streams, take the start codes of Annex B
+        case AV_CODEC_ID_H264:
+            return !global_header && par->extradata_size > 0 && par->extradata[0] == 1 ? "h264_mp4toannexb"
+                                                                                        : "null";
+        case AV_CODEC_ID_HEVC:
+            return !global_header && par->extradata_size > 0 && par->extradata[0] == 1 ? "hevc_mp4toannexb"
+                                                                                        : "null";
+        // ADTS headers in every packet, the formats with a global header take the AudioSpecificConfig
+        case AV_CODEC_ID_AAC: return global_header && par->extradata_size == 0 ? "aac_adtstoasc" : "null";
+        default:              return "null";
+        }
+    }
+
+    AVBSFContext *open_bsf(const AVStream *stream, const AVOutputFormat *oformat)
+    {
+        const char *name = select_bsf(stream->codecpar, oformat);
+        const auto bsf   = av_bsf_get_by_name(name);
+
+        AVBSFContext *bsf_ctx = nullptr;
+        if (!bsf || av_bsf_alloc(bsf, &bsf_ctx) < 0) {
+            LOG(ERROR) << "[PASSTHROUGH] can not find the bitstream filter: " << name;
+            return nullptr;
+        }
+
+        if (avcodec_parameters_copy(bsf_ctx->par_in, stream->codecpar) < 0) {
+            av_bsf_free(&bsf_ctx);
+            return nullptr;
+        }
+        bsf_ctx->time_base_in = stream->time_base;
+
+        if (av_bsf_init(bsf_ctx) < 0) {
+            LOG(ERROR) << "[PASSTHROUGH] failed to initialize the bitstream filter: " << name;
+            av_bsf_free(&bsf_ctx);
+            return nullptr;
+        }
+
+        if (std::string(name) != "null") {
+            LOG(INFO) << fmt::format("[PASSTHROUGH] #{}: {}", stream->index, name);
+        }
+        return bsf_ctx;
+    }
+} // namespace
+
+bool can_passthrough(const std::string& in_filename, const std::string& out_filename,
+                     const TranscodeOptions& options)
+{
+    const int64_t start_time = av_gettime_relative();
+
+    const auto encoder = avcodec_find_encoder_by_name(options.encoder.c_str());
+    const auto oformat = av_guess_format(nullptr, out_filename.c_str(), nullptr);
+    if (!encoder || !oformat) return false;
+
+    AVFormatContext *fmt_ctx = nullptr;
+    if (open_input(&fmt_ctx, in_filename, nullptr, nullptr, options.probe) < 0) return false;
+    defer(avformat_close_input(&fmt_ctx));
+
+    const int stream_idx = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+    if (stream_idx < 0) return false;
+
+    const auto stats = scan_bitrate(fmt_ctx, stream_idx);
+    LOG(INFO) << fmt::format("[PASSTHROUGH] {} packets, {:.3f}s, average {} kbps, peak {} kbps, "
+                             "max gop {}, scanned in {:.3f}s",
+                             stats.packets, stats.duration, stats.average / 1000, stats.peak / 1000,
+                             stats.max_gop, (av_gettime_relative() - start_time) / 1000000.0);
+
+    const RuleContext ctx{
+        .par     = fmt_ctx->streams[stream_idx]->codecpar,
+        .encoder = encoder,
+        .oformat = oformat,
+        .options = options,
+        .stats   = stats,
+    };
+
+    // all the rules are evaluated, for the log
+    bool passed = true;
+    for (const auto& rule : rules()) {
+        const auto reason = rule.check(ctx);
+        LOG(INFO) << fmt::format("[PASSTHROUGH] {:>12}: {}", rule.name, reason.value_or("ok"));
+        passed = passed && !reason;
+    }
+    return passed;
+}
+
+// the video stream and the streams copied by plan_streams() are filtered by their bitstream filters and
+// written as they are, the audio streams to be encoded are still encoded
+int transcode_passthrough(const std::string& in_filename, const std::string& out_filename,
+                          const TranscodeOptions& options)
+{
+    const int64_t start_time = av_gettime_relative();
+
+    AVFormatContext *decoder_fmt_ctx = nullptr;
+    if (open_input(&decoder_fmt_ctx, in_filename, nullptr, nullptr, options.probe) < 0) {
+        LOG(ERROR) << "can not open the input file: " << in_filename;
+        return -1;
+    }
+    defer(avformat_close_input(&decoder_fmt_ctx));
+
+    const int video_stream_idx =
+        av_find_best_stream(decoder_fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+    if (video_stream_idx < 0) {
+        LOG(ERROR) << "can not find the video stream.";
+        return -1;
+    }
+
+    AVFormatContext *encoder_fmt_ctx = nullptr;
+    if (avformat_alloc_output_context2(&encoder_fmt_ctx, nullptr, nullptr, out_filename.c_str()) < 0) {
+        LOG(ERROR) << "failed to alloc output-context memory.";
+        return -1;
+    }
+    defer(avformat_free_context(encoder_fmt_ctx));
+
+    auto policies = plan_streams(decoder_fmt_ctx, encoder_fmt_ctx->oformat, video_stream_idx, options);
+    policies[video_stream_idx] = StreamPolicy::copy;
+
+    std::vector<int> stream_mapping(policies.size(), -1);
+    std::vector<AVBSFContext *> bsfs(policies.size(), nullptr);
+    std::vector<std::unique_ptr<AudioTranscoder>> audio_transcoders(policies.size());
+    defer(for (auto& bsf : bsfs) av_bsf_free(&bsf));
+
+    for (size_t i = 0; i < policies.size(); i++) {
+        const AVStream *stream = decoder_fmt_ctx->streams[i];
+
+        if (policies[i] == StreamPolicy::copy) {
+            if (bsfs[i] = open_bsf(stream, encoder_fmt_ctx->oformat); !bsfs[i]) return -1;
+
+            AVStream *copied = add_copy_stream(encoder_fmt_ctx, stream);
+            if (!copied || avcodec_parameters_copy(copied->codecpar, bsfs[i]->par_out) < 0) return -1;
+            copied->codecpar->codec_tag = 0;
+            copied->time_base           = bsfs[i]->time_base_out;
+            stream_mapping[i]           = copied->index;
+        }
+        else if (policies[i] == StreamPolicy::encode) {
+            audio_transcoders[i] = std::make_unique<AudioTranscoder>();
+            if (audio_transcoders[i]->open(stream, encoder_fmt_ctx, options) < 0) return -1;
+            stream_mapping[i] = static_cast<int>(encoder_fmt_ctx->nb_streams) - 1;
+        }
+    }
+
+    if (!(encoder_fmt_ctx->oformat->flags & AVFMT_NOFILE)) {
+        if (avio_open(&encoder_fmt_ctx->pb, out_filename.c_str(), AVIO_FLAG_WRITE) < 0) {
+            LOG(ERROR) << "failed to open the output file: " << out_filename;
+            return -1;
+        }
+    }
+    defer(if (!(encoder_fmt_ctx->oformat->flags & AVFMT_NOFILE)) avio_closep(&encoder_fmt_ctx->pb));
+
+    if (avformat_write_header(encoder_fmt_ctx, nullptr) < 0) {
+        LOG(ERROR) << "failed to write header to the output file.";
+        return -1;
+    }
+
+    Interleaver interleaver(encoder_fmt_ctx, options.interleave);
+    const auto write = [&](AVPacket *packet) { return interleaver.write(packet); };
+
+    int64_t packets = 0;
+
+    AVPacket *packet = av_packet_alloc();
+    AVPacket *output = av_packet_alloc();
+    defer(av_packet_free(&packet); av_packet_free(&output));
+
+    // nullptr: flush the bitstream filter
+    const auto copy = [&](size_t idx, AVPacket *input) {
+        if (av_bsf_send_packet(bsfs[idx], input) < 0) {
+            LOG(ERROR) << "[PASSTHROUGH] failed to send the packet to the bitstream filter.";
+            return -1;
+        }
+
+        while (true) {
+            const int ret = av_bsf_receive_packet(bsfs[idx], output);
+            if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) return 0;
+            if (ret < 0) return ret;
+
+            AVStream *out_stream = encoder_fmt_ctx->streams[stream_mapping[idx]];
+            output->stream_index = out_stream->index;
+            output->pos          = -1;
+            av_packet_rescale_ts(output, bsfs[idx]->time_base_out, out_stream->time_base);
+
+            if (const int err = write(output); err < 0) return err;
+            packets++;
+        }
+    };
+
+    int ret = 0;
+    while (ret >= 0 && av_read_frame(decoder_fmt_ctx, packet) >= 0) {
+        const auto idx = static_cast<size_t>(packet->stream_index);
+        if (idx < policies.size() && bsfs[idx]) {
+            ret = copy(idx, packet);
+        }
+        else if (idx < policies.size() && audio_transcoders[idx]) {
+            ret = audio_transcoders[idx]->transcode(packet, write);
+        }
+        av_packet_unref(packet);
+    }
+
+    // flush the bitstream filters and the audio encoders
+    for (size_t i = 0; ret >= 0 && i < policies.size(); i++) {
+        if (bsfs[i]) ret = copy(i, nullptr);
+        if (ret >= 0 && audio_transcoders[i]) ret = audio_transcoders[i]->transcode(nullptr, write);
+    }
+
+    if (ret < 0 || interleaver.flush() < 0) {
+        LOG(ERROR) << "[PASSTHROUGH] failed to write the packets to the output file.";
+        return -1;
+    }
+    av_write_trailer(encoder_fmt_ctx);
+
+    const double elapsed = (av_gettime_relative() - start_time) / 1000000.0;
+    LOG(INFO) << fmt::format("[PASSTHROUGH] packets copied: {}, {:.3f}s", packets, elapsed);
+    return 0;
+}
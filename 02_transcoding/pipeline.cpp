@@ -0,0 +1,419 @@
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/avutil.h>
+#include <libavutil/time.h>
+}
+#include "audio.h"
+#include "boundedqueue.h"
+#include "defer.h"
+#include "fmt/format.h"
+#include "logging.h"
+#include "transcoding.h"
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace
+{
+    // how long a stage is busy, and how long it waits for its input / output queues
+    struct StageStats
+    {
+        const char *name{};
+        int64_t count{ 0 };
+        int64_t wait_input{ 0 };  // us
+        int64_t wait_output{ 0 }; // us
+        int64_t elapsed{ 0 };     // us
+
+        template<class F> auto wait_for_input(F&& f) { return timed(wait_input, std::forward<F>(f)); }
+        template<class F> auto wait_for_output(F&& f) { return timed(wait_output, std::forward<F>(f)); }
+
+        template<class F> static auto timed(int64_t& acc, F&& f)
+        {
+            const int64_t start = av_gettime_relative();
+            auto ret            = f();
+            acc += av_gettime_relative() - start;
+            return ret;
+        }
+
+        std::string str() const
+        {
+            const int64_t busy = elapsed - wait_input - wait_output;
+            return fmt::format("[PIPELINE] {:>6}: {:>6}, busy = {:>7.3f}s, wait input = {:>7.3f}s, "
+                               "wait output = {:>7.3f}s",
+                               name, count, busy / 1000000.0, wait_input / 1000000.0,
+                               wait_output / 1000000.0);
+        }
+    };
+} // namespace
+
+//  demux --packets--> decode --frames--> encode --packets--> mux
+//    |                                                    ^
+//    +----------------------------- copy -----------------+
+//    |                                                    |
+//    +--packets--> audio: decode / aformat / encode ------+
+//
+// every stage runs on its own thread, and the queues between them are bounded, so that a fast stage
+// waits for the slow one instead of buffering the whole file. The decoder and the encoder work at the
+// same time, and the I/O of the demuxer and the muxer never stalls the encoder.
+//
+// the other streams are copied, encoded or dropped by the policies of plan_streams(), the audio streams
+// are encoded on their own stage, so the video never waits for the audio encoder.
+int transcode_pipeline(const std::string& in_filename, const std::string& out_filename,
+                       const TranscodeOptions& options)
+{
+    const int64_t start_time = av_gettime_relative();
+
+    // input
+    AVFormatContext *decoder_fmt_ctx = nullptr;
+    if (open_input(&decoder_fmt_ctx, in_filename, nullptr, nullptr, options.probe) < 0) {
+        LOG(ERROR) << "can not open the input file: " << in_filename;
+        return -1;
+    }
+    defer(avformat_close_input(&decoder_fmt_ctx));
+
+    const int video_stream_idx =
+        av_find_best_stream(decoder_fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+    if (video_stream_idx < 0) {
+        LOG(ERROR) << "can not find the video stream.";
+        return -1;
+    }
+    AVStream *decode_stream = decoder_fmt_ctx->streams[video_stream_idx];
+
+    // the decoder runs frame threads while the encoder works on the other cores
+    AVCodecContext *decoder_ctx = open_decoder(decode_stream);
+    if (!decoder_ctx) return -1;
+    defer(avcodec_free_context(&decoder_ctx));
+
+    av_dump_format(decoder_fmt_ctx, 0, in_filename.c_str(), 0);
+
+    // output
+    AVFormatContext *encoder_fmt_ctx = nullptr;
+    if (avformat_alloc_output_context2(&encoder_fmt_ctx, nullptr, nullptr, out_filename.c_str()) < 0) {
+        LOG(ERROR) << "failed to alloc output-context memory.";
+        return -1;
+    }
+    defer(avformat_free_context(encoder_fmt_ctx));
+
+    const AVRational framerate  = options.framerate.num > 0
+                                      ? options.framerate
+                                      : av_guess_frame_rate(decoder_fmt_ctx, decode_stream, nullptr);
+    AVCodecContext *encoder_ctx = open_video_encoder(decoder_ctx, framerate, options,
+                                                     encoder_fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER);
+    if (!encoder_ctx) return -1;
+    defer(avcodec_free_context(&encoder_ctx));
+
+    // output streams in the order of the input streams
+    const auto policies =
+        plan_streams(decoder_fmt_ctx, encoder_fmt_ctx->oformat, video_stream_idx, options);
+
+    std::vector<int> stream_mapping(policies.size(), -1);
+    std::vector<std::unique_ptr<AudioTranscoder>> audio_transcoders(policies.size());
+    AVStream *encode_stream = nullptr;
+    for (size_t i = 0; i < policies.size(); i++) {
+        const AVStream *stream = decoder_fmt_ctx->streams[i];
+
+        if (policies[i] == StreamPolicy::copy) {
+            const auto copied = add_copy_stream(encoder_fmt_ctx, stream);
+            if (!copied) return -1;
+            stream_mapping[i] = copied->index;
+        }
+        else if (policies[i] == StreamPolicy::encode && static_cast<int>(i) != video_stream_idx) {
+            audio_transcoders[i] = std::make_unique<AudioTranscoder>();
+            if (audio_transcoders[i]->open(stream, encoder_fmt_ctx, options) < 0) return -1;
+            stream_mapping[i] = static_cast<int>(encoder_fmt_ctx->nb_streams) - 1;
+        }
+        else if (policies[i] == StreamPolicy::encode) {
+            if (encode_stream = avformat_new_stream(encoder_fmt_ctx, nullptr); !encode_stream) {
+                LOG(ERROR) << "failed to create a video stream.";
+                return -1;
+            }
+
+            encode_stream->time_base = decode_stream->time_base;
+            if (avcodec_parameters_from_context(encode_stream->codecpar, encoder_ctx) < 0) {
+                LOG(ERROR) << "failed to copy parameters to the output stream.";
+                return -1;
+            }
+            stream_mapping[i] = encode_stream->index;
+        }
+    }
+
+    if (!(encoder_fmt_ctx->oformat->flags & AVFMT_NOFILE)) {
+        if (avio_open(&encoder_fmt_ctx->pb, out_filename.c_str(), AVIO_FLAG_WRITE) < 0) {
+            LOG(ERROR) << "failed to open the output file: " << out_filename;
+            return -1;
+        }
+    }
+    defer(if (!(encoder_fmt_ctx->oformat->flags & AVFMT_NOFILE)) avio_closep(&encoder_fmt_ctx->pb));
+
+    if (avformat_write_header(encoder_fmt_ctx, nullptr) < 0) {
+        LOG(ERROR) << "failed to write header to the output file.";
+        return -1;
+    }
+
+    av_dump_format(encoder_fmt_ctx, 0, out_filename.c_str(), 1);
+
+    // queues between the stages
+    const auto free_packet = [](AVPacket **packet) { av_packet_free(packet); };
+    BoundedQueue<AVPacket *> packets(options.queue_size, free_packet);
+    BoundedQueue<AVFrame *> frames(options.queue_size, [](AVFrame **frame) { av_frame_free(frame); });
+    BoundedQueue<AVPacket *> encoded(options.queue_size, free_packet);
+    // ~50 packets per second for most of the audio codecs, the audio stage never blocks the demuxer
+    // while the video stages are busy
+    BoundedQueue<AVPacket *> audio_packets(options.queue_size * 16, free_packet);
+
+    std::atomic<bool> failed{ false };
+    const auto stop = [&]() {
+        failed = true;
+        packets.close();
+        audio_packets.close();
+        frames.close();
+        encoded.close();
+    };
+
+    // the demuxer (copy), the video encoder and the audio stage write to the muxer
+    std::atomic<int> producers{ 3 };
+    const auto producer_done = [&]() {
+        if (--producers == 0) encoded.close();
+    };
+
+    StageStats demux_stats{ .name = "demux" };
+    StageStats decode_stats{ .name = "decode" };
+    StageStats encode_stats{ .name = "encode" };
+    StageStats audio_stats{ .name = "audio" };
+    StageStats mux_stats{ .name = "mux" };
+
+    // demux
+    std::thread demux_thread([&]() {
+        const int64_t start = av_gettime_relative();
+        defer(demux_stats.elapsed = av_gettime_relative() - start);
+        defer(packets.close(); audio_packets.close(); producer_done());
+
+        while (true) {
+            AVPacket *packet = av_packet_alloc();
+            const int ret =
+                demux_stats.wait_for_input([&]() { return av_read_frame(decoder_fmt_ctx, packet); });
+            if (ret < 0) {
+                av_packet_free(&packet);
+                break;
+            }
+
+            // the streams found after opening the input are dropped
+            const int idx = packet->stream_index;
+            const auto policy =
+                idx < static_cast<int>(policies.size()) ? policies[idx] : StreamPolicy::drop;
+
+            BoundedQueue<AVPacket *> *queue = nullptr;
+            if (idx == video_stream_idx) {
+                queue = &packets;
+            }
+            else if (policy == StreamPolicy::encode) {
+                queue = &audio_packets;
+            }
+            else if (policy == StreamPolicy::copy) {
+                const AVStream *in_stream  = decoder_fmt_ctx->streams[idx];
+                const AVStream *out_stream = encoder_fmt_ctx->streams[stream_mapping[idx]];
+                av_packet_rescale_ts(packet, in_stream->time_base, out_stream->time_base);
+                packet->stream_index = out_stream->index;
+                packet->pos          = -1;
+                queue                = &encoded;
+            }
+
+            if (!queue) {
+                av_packet_free(&packet);
+                continue;
+            }
+
+            if (!demux_stats.wait_for_output([&]() { return queue->push(packet); })) {
+                av_packet_free(&packet);
+                break;
+            }
+            demux_stats.count++;
+        }
+    });
+
+    // decode
+    std::thread decode_thread([&]() {
+        const int64_t start = av_gettime_relative();
+        defer(decode_stats.elapsed = av_gettime_relative() - start);
+        defer(frames.close());
+
+        AVFrame *frame = av_frame_alloc();
+        defer(av_frame_free(&frame));
+
+        // ATTENTION: the packets and frames are not one-to-one correspondence.
+        const auto decode = [&](const AVPacket *packet) {
+            // skip the corrupted packets
+            if (avcodec_send_packet(decoder_ctx, packet) < 0) {
+                LOG(WARNING) << "[PIPELINE] failed to send the packet to the decoder.";
+                return 0;
+            }
+
+            while (true) {
+                const int ret = avcodec_receive_frame(decoder_ctx, frame);
+                if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+                    return 0;
+                }
+                else if (ret < 0) {
+                    LOG(ERROR) << "[PIPELINE] decoding error.";
+                    return ret;
+                }
+
+                AVFrame *queued = av_frame_alloc();
+                av_frame_move_ref(queued, frame);
+                if (!decode_stats.wait_for_output([&]() { return frames.push(queued); })) {
+                    av_frame_free(&queued);
+                    return AVERROR_EXIT;
+                }
+                decode_stats.count++;
+            }
+        };
+
+        while (auto packet = decode_stats.wait_for_input([&]() { return packets.pop(); })) {
+            const int ret = decode(packet.value());
+            av_packet_free(&packet.value());
+            if (ret < 0) {
+                if (ret != AVERROR_EXIT) stop();
+                return;
+            }
+        }
+
+        // flush the decoder
+        if (!failed && decode(nullptr) < 0) stop();
+    });
+
+    // encode
+    FrameRateNormalizer normalizer(parse_fps_mode(options.fps_mode, encoder_fmt_ctx->oformat),
+                                   decode_stream->time_base, framerate);
+    std::thread encode_thread([&]() {
+        const int64_t start = av_gettime_relative();
+        defer(encode_stats.elapsed = av_gettime_relative() - start);
+        defer(producer_done());
+
+        AVPacket *packet = av_packet_alloc();
+        defer(av_packet_free(&packet));
+
+        const auto encode = [&](const AVFrame *frame) {
+            if (avcodec_send_frame(encoder_ctx, frame) < 0) {
+                LOG(ERROR) << "[PIPELINE] failed to send the frame to the encoder.";
+                return -1;
+            }
+            // after the fps mode, the frames dropped are not counted and the duplicated ones are
+            if (frame) encode_stats.count++;
+
+            while (true) {
+                const int ret = avcodec_receive_packet(encoder_ctx, packet);
+                if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+                    return 0;
+                }
+                else if (ret < 0) {
+                    LOG(ERROR) << "[PIPELINE] encoding error.";
+                    return ret;
+                }
+
+                AVPacket *queued = av_packet_alloc();
+                av_packet_move_ref(queued, packet);
+                queued->stream_index = encode_stream->index;
+                av_packet_rescale_ts(queued, encoder_ctx->time_base, encode_stream->time_base);
+                if (!encode_stats.wait_for_output([&]() { return encoded.push(queued); })) {
+                    av_packet_free(&queued);
+                    return AVERROR_EXIT;
+                }
+            }
+        };
+
+        while (auto frame = encode_stats.wait_for_input([&]() { return frames.pop(); })) {
+            // to the encoder time base 1 / framerate, dropped or duplicated by the fps mode, the picture
+            // types are cleared, let the encoder decide them
+            frame.value()->pts = frame.value()->best_effort_timestamp;
+
+            const int ret = normalizer.push(frame.value(), encode);
+            av_frame_free(&frame.value());
+            if (ret < 0) {
+                if (ret != AVERROR_EXIT) stop();
+                return;
+            }
+        }
+
+        // flush the encoder
+        if (!failed && normalizer.push(nullptr, encode) < 0) stop();
+    });
+
+    // audio, all the encoded audio streams on one thread
+    std::thread audio_thread([&]() {
+        const int64_t start = av_gettime_relative();
+        defer(audio_stats.elapsed = av_gettime_relative() - start);
+        defer(producer_done());
+
+        const auto write = [&](AVPacket *packet) {
+            AVPacket *queued = av_packet_alloc();
+            av_packet_move_ref(queued, packet);
+            if (!audio_stats.wait_for_output([&]() { return encoded.push(queued); })) {
+                av_packet_free(&queued);
+                return AVERROR_EXIT;
+            }
+            return 0;
+        };
+
+        while (auto packet = audio_stats.wait_for_input([&]() { return audio_packets.pop(); })) {
+            const auto& transcoder = audio_transcoders[packet.value()->stream_index];
+            const int ret          = transcoder->transcode(packet.value(), write);
+            av_packet_free(&packet.value());
+            if (ret < 0) {
+                if (ret != AVERROR_EXIT) stop();
+                return;
+            }
+            audio_stats.count++;
+        }
+
+        // flush the decoders and the encoders
+        for (const auto& transcoder : audio_transcoders) {
+            if (transcoder && !failed && transcoder->transcode(nullptr, write) < 0) {
+                stop();
+                return;
+            }
+        }
+    });
+
+    // mux, on this thread
+    {
+        const int64_t start = av_gettime_relative();
+        Interleaver interleaver(encoder_fmt_ctx, options.interleave);
+
+        // the packets are in the time base of the output streams
+        while (auto packet = mux_stats.wait_for_input([&]() { return encoded.pop(); })) {
+            const int ret = interleaver.write(packet.value());
+            av_packet_free(&packet.value());
+            if (ret < 0) {
+                LOG(ERROR) << "[PIPELINE] failed to write the packet to the output file.";
+                stop();
+                break;
+            }
+            mux_stats.count++;
+        }
+
+        if (!failed && interleaver.flush() < 0) stop();
+        interleaver.log_stats(out_filename);
+        mux_stats.elapsed = av_gettime_relative() - start;
+    }
+
+    demux_thread.join();
+    decode_thread.join();
+    encode_thread.join();
+    audio_thread.join();
+
+    if (failed) return -1;
+
+    av_write_trailer(encoder_fmt_ctx);
+
+    const double elapsed = (av_gettime_relative() - start_time) / 1000000.0;
+    for (const auto& stats : { demux_stats, decode_stats, encode_stats, audio_stats, mux_stats }) {
+        LOG(INFO) << stats.str();
+    }
+    LOG(INFO) << fmt::format("[PIPELINE] decoded frames: {}, encoded frames: {}, {:.3f}s, {:.2f} fps",
+                             decode_stats.count, encode_stats.count, elapsed, encode_stats.count / elapsed);
+    LOG(INFO) << normalizer.str();
+    return 0;
+}
@@ -0,0 +1,443 @@
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/avutil.h>
+#include <libavutil/time.h>
+}
+#include "defer.h"
+#include "fmt/format.h"
+#include "logging.h"
+#include "timestamp.h"
+#include "transcoding.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace
+{
+    // frames in [start, end) belong to the chunk, the timestamps are in the time base of the input stream
+    struct Chunk
+    {
+        ~Chunk()
+        {
+            avcodec_free_context(&encoder_ctx);
+            avcodec_free_context(&decoder_ctx);
+            avformat_close_input(&fmt_ctx);
+
+            std::error_code ec;
+            fs::remove(filename, ec);
+        }
+
+        int index{};
+        int crf{};
+        int64_t start{ AV_NOPTS_VALUE }; // the first keyframe, AV_NOPTS_VALUE: the beginning of the file
+        int64_t end{ AV_NOPTS_VALUE };   // the first keyframe of the next chunk, AV_NOPTS_VALUE: the end
+        int64_t seek{ AV_NOPTS_VALUE };  // the keyframe where the decoding starts, <= start
+
+        AVFormatContext *fmt_ctx{ nullptr };
+        AVCodecContext *decoder_ctx{ nullptr };
+        AVCodecContext *encoder_ctx{ nullptr };
+
+        fs::path filename{}; // the encoded packets of this chunk
+        std::thread thread{};
+
+        bool failed{ false };
+        int64_t frames{ 0 }; // frames in [start, end)
+        int64_t warmup{ 0 }; // frames encoded only for the rate control, and dropped
+        int64_t elapsed{ 0 };
+    };
+
+    // the keyframes closest to the evenly divided positions
+    std::vector<int64_t> select_cuts(const std::vector<int64_t>& keyframes, int chunks, int64_t duration)
+    {
+        std::vector<int64_t> cuts{};
+        for (int i = 1; i < chunks; i++) {
+            const int64_t target = keyframes.front() + duration * i / chunks;
+            const auto closer    = [=](int64_t a, int64_t b) {
+                return std::abs(a - target) < std::abs(b - target);
+            };
+            const auto it = std::min_element(keyframes.begin(), keyframes.end(), closer);
+
+            // the first keyframe is the beginning of the first chunk
+            if (it != keyframes.begin() && (cuts.empty() || *it > cuts.back())) {
+                cuts.push_back(*it);
+            }
+        }
+        return cuts;
+    }
+
+    void transcode_chunk(Chunk& chunk, int stream_idx, int64_t overlap)
+    {
+        const int64_t start_time = av_gettime_relative();
+        defer(chunk.elapsed = av_gettime_relative() - start_time);
+
+        const AVStream *stream      = chunk.fmt_ctx->streams[stream_idx];
+        AVCodecContext *encoder_ctx = chunk.encoder_ctx;
+
+        std::ofstream out(chunk.filename, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            LOG(ERROR) << "[SPLIT] can not open " << chunk.filename;
+            chunk.failed = true;
+            return;
+        }
+
+        if (chunk.seek != AV_NOPTS_VALUE &&
+            av_seek_frame(chunk.fmt_ctx, stream_idx, chunk.seek, AVSEEK_FLAG_BACKWARD) < 0) {
+            LOG(ERROR) << "[SPLIT] #" << chunk.index << " failed to seek to " << chunk.seek;
+            chunk.failed = true;
+            return;
+        }
+
+        // the frames after the chunk are encoded for the lookahead of the rate control
+        const int64_t stop = chunk.end == AV_NOPTS_VALUE ? AV_NOPTS_VALUE : chunk.end + overlap;
+
+        const auto to_encoder_tb = [&](int64_t ts) {
+            return ts == AV_NOPTS_VALUE ? AV_NOPTS_VALUE
+                                        : av_rescale_q(ts, stream->time_base, encoder_ctx->time_base);
+        };
+        const int64_t encoder_start = to_encoder_tb(chunk.start);
+        const int64_t encoder_end   = to_encoder_tb(chunk.end);
+
+        AVPacket *packet  = av_packet_alloc();
+        AVPacket *encoded = av_packet_alloc();
+        AVFrame *frame    = av_frame_alloc();
+        defer(av_packet_free(&packet); av_packet_free(&encoded); av_frame_free(&frame));
+
+        // only the packets in [start, end) are kept
+        const auto encode = [&](const AVFrame *input) {
+            if (avcodec_send_frame(encoder_ctx, input) < 0) return -1;
+
+            while (true) {
+                const int ret = avcodec_receive_packet(encoder_ctx, encoded);
+                if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) return 0;
+                if (ret < 0) return ret;
+
+                const bool keep = (encoder_start == AV_NOPTS_VALUE || encoded->pts >= encoder_start) &&
+                                  (encoder_end == AV_NOPTS_VALUE || encoded->pts < encoder_end);
+                if (keep && !write_packet(out, encoded)) return -1;
+                av_packet_unref(encoded);
+            }
+        };
+
+        bool done         = false;
+        bool start_forced = chunk.start == AV_NOPTS_VALUE;
+        bool end_forced   = chunk.end == AV_NOPTS_VALUE;
+
+        const auto process = [&](AVFrame *decoded) {
+            const int64_t pts = decoded->best_effort_timestamp;
+
+            // the leading frames referring to the frames before the keyframe
+            if (pts == AV_NOPTS_VALUE || (chunk.seek != AV_NOPTS_VALUE && pts < chunk.seek)) return 0;
+
+            if (stop != AV_NOPTS_VALUE && pts >= stop) {
+                done = true;
+                return 0;
+            }
+
+            const bool in_chunk = (chunk.start == AV_NOPTS_VALUE || pts >= chunk.start) &&
+                                  (chunk.end == AV_NOPTS_VALUE || pts < chunk.end);
+            if (in_chunk)
+                chunk.frames++;
+            else
+                chunk.warmup++;
+
+            // the chunk starts and ends with the IDR frames, so that no frame in the chunk
+            // refers to the frames out of it
+            decoded->pict_type = AV_PICTURE_TYPE_NONE;
+            if (!start_forced && pts >= chunk.start) {
+                decoded->pict_type = AV_PICTURE_TYPE_I;
+                start_forced       = true;
+            }
+            if (!end_forced && pts >= chunk.end) {
+                decoded->pict_type = AV_PICTURE_TYPE_I;
+                end_forced         = true;
+            }
+
+            decoded->pts = to_encoder_tb(pts);
+            return encode(decoded);
+        };
+
+        const auto decode = [&](const AVPacket *input) {
+            if (avcodec_send_packet(chunk.decoder_ctx, input) < 0) return 0;
+
+            while (!done) {
+                const int ret = avcodec_receive_frame(chunk.decoder_ctx, frame);
+                if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) return 0;
+                if (ret < 0) return ret;
+
+                const int err = process(frame);
+                av_frame_unref(frame);
+                if (err < 0) return err;
+            }
+            return 0;
+        };
+
+        int ret = 0;
+        while (!done && ret >= 0 && av_read_frame(chunk.fmt_ctx, packet) >= 0) {
+            if (packet->stream_index == stream_idx) ret = decode(packet);
+            av_packet_unref(packet);
+        }
+
+        if (ret >= 0 && !done) ret = decode(nullptr);
+        if (ret >= 0) ret = encode(nullptr);
+
+        if (ret < 0 || !out.flush()) {
+            LOG(ERROR) << "[SPLIT] #" << chunk.index << " failed to transcode";
+            chunk.failed = true;
+        }
+    }
+} // namespace
+
+std::vector<int64_t> scan_keyframes(const std::string& filename, const ProbeOptions& probe,
+                                    int& stream_idx)
+{
+    AVFormatContext *fmt_ctx = nullptr;
+    if (open_input(&fmt_ctx, filename, nullptr, nullptr, probe) < 0) return {};
+    defer(avformat_close_input(&fmt_ctx));
+
+    stream_idx = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+    if (stream_idx < 0) return {};
+
+    std::vector<int64_t> keyframes{};
+
+    AVPacket *packet = av_packet_alloc();
+    defer(av_packet_free(&packet));
+    while (av_read_frame(fmt_ctx, packet) >= 0) {
+        if (packet->stream_index == stream_idx && (packet->flags & AV_PKT_FLAG_KEY)) {
+            const int64_t pts = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+            if (pts != AV_NOPTS_VALUE) keyframes.push_back(pts);
+        }
+        av_packet_unref(packet);
+    }
+
+    std::sort(keyframes.begin(), keyframes.end());
+    keyframes.erase(std::unique(keyframes.begin(), keyframes.end()), keyframes.end());
+    return keyframes;
+}
+
+//                 +-> [chunk 0: decode -> encode] --> tmp 0 --+
+//  keyframes ---- +-> [chunk 1: decode -> encode] --> tmp 1 --+--> concat in order --> mux
+//                 +-> [chunk 2: decode -> encode] --> tmp 2 --+
+//
+// Every chunk starts with an IDR frame of the output, decoded from the keyframe of the input before it,
+// the GOPs are closed, so the encoded chunks can be concatenated without re-encoding. The timestamps of
+// the input are kept, and the decoding timestamps of the encoder are continuous across the chunks as well,
+// since they lag behind the presentation timestamps by the same reorder delay in every chunk. At most one
+// chunk per core is transcoded at a time.
+//
+// With an overlap, each chunk also encodes the frames around it and drops them, so that the rate control
+// sees the same neighborhood as a single encoder.
+int transcode_scenes(const std::string& in_filename, const std::string& out_filename,
+                     const TranscodeOptions& options, const std::vector<Scene>& scenes,
+                     const std::vector<int64_t>& keyframes, int stream_idx, double overlap_seconds)
+{
+    const int64_t start_time = av_gettime_relative();
+
+    if (scenes.empty() || keyframes.empty()) return -1;
+
+    // at most one chunk per core is transcoded at a time, the later chunks wait for the earlier ones
+    const size_t cores = std::max(1u, std::thread::hardware_concurrency());
+    const size_t jobs  = std::min(scenes.size(), cores);
+
+    // every chunk has its own demuxer, decoder and encoder, and the encoders with different rate control
+    // settings write the same parameter sets
+    TranscodeOptions chunk_options = options;
+    chunk_options.closed_gop       = true;
+    chunk_options.stitchable       = true;
+    if (options.threads <= 0) chunk_options.threads = static_cast<int>(std::max<size_t>(1, cores / jobs));
+
+    AVFormatContext *encoder_fmt_ctx = nullptr;
+    if (avformat_alloc_output_context2(&encoder_fmt_ctx, nullptr, nullptr, out_filename.c_str()) < 0) {
+        LOG(ERROR) << "failed to alloc output-context memory.";
+        return -1;
+    }
+    defer(avformat_free_context(encoder_fmt_ctx));
+    const bool global_header = encoder_fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER;
+
+    std::vector<std::unique_ptr<Chunk>> chunks{};
+    for (size_t i = 0; i < scenes.size(); i++) {
+        auto chunk      = std::make_unique<Chunk>();
+        chunk->index    = static_cast<int>(i);
+        chunk->crf      = scenes[i].crf;
+        chunk->start    = scenes[i].start;
+        chunk->end      = scenes[i].end;
+        chunk->filename = fmt::format("{}.chunk{}.tmp", out_filename, i);
+        chunks.emplace_back(std::move(chunk));
+    }
+
+    // the chunks are opened on their own threads when they start, except the first one for the header
+    const auto open_chunk = [&](Chunk& chunk) {
+        if (open_input(&chunk.fmt_ctx, in_filename, nullptr, nullptr, options.probe) < 0) return false;
+
+        AVStream *stream      = chunk.fmt_ctx->streams[stream_idx];
+        const int64_t overlap = av_rescale_q(static_cast<int64_t>(overlap_seconds * AV_TIME_BASE),
+                                             AV_TIME_BASE_Q, stream->time_base);
+
+        // decoding starts from the keyframe before the overlap
+        if (chunk.start != AV_NOPTS_VALUE) {
+            const auto it = std::upper_bound(keyframes.begin(), keyframes.end(), chunk.start - overlap);
+            chunk.seek    = it == keyframes.begin() ? keyframes.front() : *std::prev(it);
+        }
+
+        chunk.decoder_ctx = open_decoder(stream, 1);
+        if (!chunk.decoder_ctx) return false;
+
+        TranscodeOptions scene_options = chunk_options;
+        scene_options.crf              = chunk.crf;
+        const AVRational framerate     = av_guess_frame_rate(chunk.fmt_ctx, stream, nullptr);
+        chunk.encoder_ctx = open_video_encoder(chunk.decoder_ctx, framerate, scene_options, global_header);
+        return chunk.encoder_ctx != nullptr;
+    };
+
+    if (!open_chunk(*chunks[0])) return -1;
+
+    const AVStream *stream = chunks[0]->fmt_ctx->streams[stream_idx];
+    const int64_t overlap  = av_rescale_q(static_cast<int64_t>(overlap_seconds * AV_TIME_BASE),
+                                          AV_TIME_BASE_Q, stream->time_base);
+
+    // 1. output, the parameter sets are the same for all the encoders
+    const AVCodecContext *encoder_ctx = chunks[0]->encoder_ctx;
+    const std::string header = encoder_ctx->extradata
+                                   ? std::string(reinterpret_cast<const char *>(encoder_ctx->extradata),
+                                                 encoder_ctx->extradata_size)
+                                   : std::string{};
+
+    AVStream *encode_stream = avformat_new_stream(encoder_fmt_ctx, nullptr);
+    if (!encode_stream || avcodec_parameters_from_context(encode_stream->codecpar, encoder_ctx) < 0) {
+        LOG(ERROR) << "failed to create the video stream.";
+        return -1;
+    }
+    encode_stream->time_base = stream->time_base;
+
+    if (!(encoder_fmt_ctx->oformat->flags & AVFMT_NOFILE)) {
+        if (avio_open(&encoder_fmt_ctx->pb, out_filename.c_str(), AVIO_FLAG_WRITE) < 0) {
+            LOG(ERROR) << "failed to open the output file: " << out_filename;
+            return -1;
+        }
+    }
+    defer(if (!(encoder_fmt_ctx->oformat->flags & AVFMT_NOFILE)) avio_closep(&encoder_fmt_ctx->pb));
+
+    if (avformat_write_header(encoder_fmt_ctx, nullptr) < 0) {
+        LOG(ERROR) << "failed to write header to the output file.";
+        return -1;
+    }
+
+    // 2. transcode the chunks concurrently, 'jobs' at a time
+    const auto start = [&](size_t i) {
+        if (i >= chunks.size()) return;
+
+        chunks[i]->thread = std::thread([&chunk = *chunks[i], &open_chunk, stream_idx, overlap]() {
+            if (chunk.index > 0 && !open_chunk(chunk)) {
+                LOG(ERROR) << "[SPLIT] #" << chunk.index << " failed to open";
+                chunk.failed = true;
+                return;
+            }
+            transcode_chunk(chunk, stream_idx, overlap);
+        });
+    };
+    for (size_t i = 0; i < jobs; i++) start(i);
+
+    // 3. concatenate the chunks in order, while the later chunks are still being transcoded
+    Interleaver interleaver(encoder_fmt_ctx, options.interleave);
+
+    int ret          = 0;
+    int64_t last_dts = AV_NOPTS_VALUE;
+    int64_t fixed    = 0;
+    int64_t frames   = 0;
+
+    AVPacket *packet = av_packet_alloc();
+    defer(av_packet_free(&packet));
+    for (size_t i = 0; i < chunks.size(); i++) {
+        auto& chunk = chunks[i];
+        chunk->thread.join();
+        start(i + jobs);
+
+        if (chunk->failed || ret < 0) {
+            ret = -1;
+            continue;
+        }
+
+        const AVCodecContext *ctx = chunk->encoder_ctx;
+        if (header.size() != static_cast<size_t>(ctx->extradata ? ctx->extradata_size : 0) ||
+            (!header.empty() && std::memcmp(ctx->extradata, header.data(), header.size()) != 0)) {
+            LOG(WARNING) << "[SPLIT] #" << chunk->index << " the global header of the encoder is different";
+        }
+
+        std::ifstream in(chunk->filename, std::ios::binary);
+        int64_t packets = 0;
+        while (in.peek() != EOF && read_packet(in, packet)) {
+            packet->stream_index = 0;
+            av_packet_rescale_ts(packet, chunk->encoder_ctx->time_base, encode_stream->time_base);
+
+            // should not happen unless the encoder extrapolates the first dts differently
+            if (fix_monotonic_dts(packet, last_dts)) fixed++;
+
+            if (interleaver.write(packet) < 0) {
+                LOG(ERROR) << "[SPLIT] failed to write the packet to the output file.";
+                ret = -1;
+                break;
+            }
+            packets++;
+        }
+
+        frames += chunk->frames;
+        const double elapsed = std::max<int64_t>(1, chunk->elapsed) / 1000000.0;
+        LOG(INFO) << fmt::format("[SPLIT] #{}: crf = {}, frames = {}, warmup = {}, packets = {}, {:.3f}s, "
+                                 "{:.2f} fps",
+                                 chunk->index, chunk->crf, chunk->frames, chunk->warmup, packets, elapsed,
+                                 (chunk->frames + chunk->warmup) / elapsed);
+
+        // the temporary file is removed once it is written
+        chunk.reset();
+    }
+
+    if (ret < 0 || interleaver.flush() < 0) return -1;
+
+    av_write_trailer(encoder_fmt_ctx);
+
+    if (fixed > 0) LOG(WARNING) << "[SPLIT] " << fixed << " non-monotonic dts are adjusted";
+
+    const double elapsed = (av_gettime_relative() - start_time) / 1000000.0;
+    LOG(INFO) << fmt::format("[SPLIT] frames: {}, {:.3f}s, {:.2f} fps", frames, elapsed, frames / elapsed);
+    return 0;
+}
+
+int transcode_split(const std::string& in_filename, const std::string& out_filename,
+                    const TranscodeOptions& options, const SplitOptions& split)
+{
+    const int64_t start_time = av_gettime_relative();
+
+    // 1. keyframes
+    int stream_idx       = -1;
+    const auto keyframes = scan_keyframes(in_filename, options.probe, stream_idx);
+    if (stream_idx < 0 || keyframes.empty()) {
+        LOG(ERROR) << "[SPLIT] can not find the keyframes of the video stream.";
+        return -1;
+    }
+
+    // 2. cut points
+    const auto cuts = select_cuts(keyframes, split.chunks, keyframes.back() - keyframes.front());
+    LOG(INFO) << fmt::format("[SPLIT] {} keyframes, {} chunks, scanned in {:.3f}s", keyframes.size(),
+                             cuts.size() + 1, (av_gettime_relative() - start_time) / 1000000.0);
+
+    // 3. the chunks with the same crf
+    std::vector<Scene> scenes{};
+    for (size_t i = 0; i <= cuts.size(); i++) {
+        scenes.push_back({
+            .start = i == 0 ? AV_NOPTS_VALUE : cuts[i - 1],
+            .end   = i == cuts.size() ? AV_NOPTS_VALUE : cuts[i],
+            .crf   = options.crf,
+        });
+    }
+
+    return transcode_scenes(in_filename, out_filename, options, scenes, keyframes, stream_idx,
+                            split.overlap);
+}
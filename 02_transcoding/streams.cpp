@@ -0,0 +1,117 @@
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/avutil.h>
+}
+#include "fmt/format.h"
+#include "logging.h"
+#include "transcoding.h"
+
+#include <algorithm>
+
+namespace
+{
+    // false: the output format rejects the codec, the codecs it can not tell (< 0) are accepted and tried
+    bool accepts(const AVOutputFormat *oformat, AVCodecID codec_id)
+    {
+        return avformat_query_codec(oformat, codec_id, FF_COMPLIANCE_NORMAL) != 0;
+    }
+
+    bool wanted_language(const AVStream *stream, const std::vector<std::string>& languages)
+    {
+        if (languages.empty()) return true;
+
+        // the untagged streams are kept
+        const auto tag = av_dict_get(stream->metadata, "language", nullptr, 0);
+        return !tag || std::find(languages.begin(), languages.end(), tag->value) != languages.end();
+    }
+
+    const char *policy_str(StreamPolicy policy)
+    {
+        switch (policy) {
+        case StreamPolicy::copy:   return "copy";
+        case StreamPolicy::encode: return "encode";
+        default:                   return "drop";
+        }
+    }
+} // namespace
+
+std::vector<StreamPolicy> plan_streams(const AVFormatContext *fmt_ctx, const AVOutputFormat *oformat,
+                                       int video_stream_idx, const TranscodeOptions& options)
+{
+    std::vector<StreamPolicy> policies(fmt_ctx->nb_streams, StreamPolicy::drop);
+
+    for (unsigned int i = 0; i < fmt_ctx->nb_streams; i++) {
+        const AVStream *stream = fmt_ctx->streams[i];
+        const auto codec_id    = stream->codecpar->codec_id;
+
+        auto& policy = policies[i];
+        switch (stream->codecpar->codec_type) {
+        // the other video streams, e.g. the cover pictures, are dropped
+        case AVMEDIA_TYPE_VIDEO:
+            if (static_cast<int>(i) == video_stream_idx) policy = StreamPolicy::encode;
+            break;
+
+        case AVMEDIA_TYPE_AUDIO:
+            if (options.audio == "drop" || !wanted_language(stream, options.languages)) break;
+
+            if (options.audio == "encode" || !accepts(oformat, codec_id)) {
+                if (options.audio == "copy") {
+                    LOG(WARNING) << fmt::format("[STREAMS] #{}: {} is not accepted by {}, encoded", i,
+                                                avcodec_get_name(codec_id), oformat->name);
+                }
+                policy = StreamPolicy::encode;
+            }
+            else {
+                policy = StreamPolicy::copy;
+            }
+            break;
+
+        // no subtitle encoder here, the text subtitles can not be converted to the other formats
+        case AVMEDIA_TYPE_SUBTITLE:
+            if (options.subtitle == "drop" || !wanted_language(stream, options.languages)) break;
+
+            if (accepts(oformat, codec_id)) {
+                policy = StreamPolicy::copy;
+            }
+            else if (options.subtitle == "copy") {
+                LOG(WARNING) << fmt::format("[STREAMS] #{}: {} is not accepted by {}, dropped", i,
+                                            avcodec_get_name(codec_id), oformat->name);
+            }
+            break;
+
+        // data, attachments
+        default: break;
+        }
+
+        const auto language = av_dict_get(stream->metadata, "language", nullptr, 0);
+        LOG(INFO) << fmt::format("[STREAMS] #{}: {:>8} {:>10} {:>3} -> {}", i,
+                                 av_get_media_type_string(stream->codecpar->codec_type),
+                                 avcodec_get_name(codec_id), language ? language->value : "",
+                                 policy_str(policy));
+    }
+
+    return policies;
+}
+
+AVStream *add_copy_stream(AVFormatContext *fmt_ctx, const AVStream *stream)
+{
+    AVStream *out_stream = avformat_new_stream(fmt_ctx, nullptr);
+    if (!out_stream) {
+        LOG(ERROR) << "failed to create the output stream.";
+        return nullptr;
+    }
+
+    if (avcodec_parameters_copy(out_stream->codecpar, stream->codecpar) < 0) {
+        LOG(ERROR) << "failed to copy the codec parameters.";
+        return nullptr;
+    }
+
+    // the codec tag of the input container may be invalid in the output one
+    out_stream->codecpar->codec_tag = 0;
+    out_stream->time_base           = stream->time_base;
+    out_stream->disposition         = stream->disposition;
+    av_dict_copy(&out_stream->metadata, stream->metadata, 0);
+
+    return out_stream;
+}
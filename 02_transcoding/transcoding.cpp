@@ -3,35 +3,92 @@ extern "C" {
 #include <libavformat/avformat.h>
 #include <libavutil/avutil.h>
 #include <libavutil/opt.h>
+#include <libavutil/parseutils.h>
+#include <libavutil/time.h>
 #include <libavutil/timestamp.h>
 }
+#include "argsparser.h"
+#include "defer.h"
+#include "fmt/format.h"
+#include "logging.h"
+#include "transcoding.h"
 
-int main(int argc, char *argv[])
+#include <fstream>
+#include <memory>
+
+namespace
 {
-    if (argc < 3) {
-        printf("transcode <input> <output>");
-        return -1;
+    // the first pass of the two-pass encoding, the packets are dropped, only the stats are kept
+    int first_pass(FrameSource& source, FrameRateNormalizer& normalizer, const AVCodecContext *decoder_ctx,
+                   AVRational framerate, const TranscodeOptions& options)
+    {
+        const int64_t start_time = av_gettime_relative();
+
+        AVCodecContext *encoder_ctx = open_video_encoder(decoder_ctx, framerate, options, false, 1);
+        if (!encoder_ctx) return -1;
+        defer(avcodec_free_context(&encoder_ctx));
+
+        AVFrame *frame   = av_frame_alloc();
+        AVPacket *packet = av_packet_alloc();
+        defer(av_frame_free(&frame); av_packet_free(&packet));
+        if (!frame || !packet) return AVERROR(ENOMEM);
+
+        // libx264 writes its own stats file, the other encoders return the stats with every packet
+        std::string stats{};
+        const auto encode = [&](const AVFrame *f) {
+            int ret = avcodec_send_frame(encoder_ctx, f);
+            while (ret >= 0) {
+                ret = avcodec_receive_packet(encoder_ctx, packet);
+                if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) return 0;
+                if (ret < 0) break;
+
+                if (encoder_ctx->stats_out) stats += encoder_ctx->stats_out;
+                av_packet_unref(packet);
+            }
+            LOG(ERROR) << "[2PASS] encoding error.";
+            return ret;
+        };
+
+        // the same frames as the second pass
+        int ret = 0;
+        while ((ret = source.read(frame)) >= 0) {
+            ret = normalizer.push(frame, encode);
+            av_frame_unref(frame);
+            if (ret < 0) return ret;
+        }
+        if (ret != AVERROR_EOF || normalizer.push(nullptr, encode) < 0) return -1;
+
+        if (!stats.empty()) {
+            std::ofstream out(options.passlog, std::ios::binary);
+            if (!(out << stats)) {
+                LOG(ERROR) << "[2PASS] failed to write the stats to " << options.passlog;
+                return -1;
+            }
+        }
+
+        LOG(INFO) << fmt::format("[2PASS] first pass: {} frames, {:.3f}s", source.stats().decoded,
+                                 (av_gettime_relative() - start_time) / 1000000.0);
+        return 0;
     }
+} // namespace
+
+int transcode(const std::string& in, const std::string& out, const TranscodeOptions& options)
+{
+    const char *in_filename  = in.c_str();
+    const char *out_filename = out.c_str();
 
-    const char *in_filename  = argv[1];
-    const char *out_filename = argv[2];
+    const int64_t start_time = av_gettime_relative();
 
     //
     // input
     //
-    // open input file
+    // open input file and find stream information, limited or cached by the probe options
     AVFormatContext *decoder_fmt_ctx = nullptr;
-    if (avformat_open_input(&decoder_fmt_ctx, in_filename, nullptr, nullptr) < 0) {
+    if (open_input(&decoder_fmt_ctx, in, nullptr, nullptr, options.probe) < 0) {
         fprintf(stderr, "can not open the input file: %s.\n", in_filename);
         return -1;
     }
 
-    // find stream information
-    if (avformat_find_stream_info(decoder_fmt_ctx, nullptr) < 0) {
-        fprintf(stderr, "can not find the stream information.\n");
-        return -1;
-    }
-
     // find the video stream
     int video_stream_idx = av_find_best_stream(decoder_fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
     if (video_stream_idx < 0) {
@@ -72,6 +129,14 @@ int main(int argc, char *argv[])
            decoder_ctx->time_base.den, decoder_fmt_ctx->streams[video_stream_idx]->time_base.num,
            decoder_fmt_ctx->streams[video_stream_idx]->time_base.den);
 
+    // the frames of every pass, replayed from the cache after the first one if enabled
+    std::unique_ptr<FrameCache> cache{};
+    if (!options.cache.filename.empty()) {
+        cache = std::make_unique<FrameCache>(options.cache);
+        if (cache->open() < 0) return -1;
+    }
+    FrameSource source(decoder_fmt_ctx, video_stream_idx, decoder_ctx, cache.get());
+
     //
     // output
     //
@@ -81,47 +146,38 @@ int main(int argc, char *argv[])
         return -1;
     }
 
-    if (avformat_new_stream(encoder_fmt_ctx, nullptr) == nullptr) {
-        fprintf(stderr, "failed to create a video stream.\n");
-        return -1;
+    // the timestamps of the frames to the encoder time base 1 / framerate
+    const AVRational framerate =
+        options.framerate.num > 0
+            ? options.framerate
+            : av_guess_frame_rate(decoder_fmt_ctx, decoder_fmt_ctx->streams[video_stream_idx], nullptr);
+    const FpsMode fps_mode = parse_fps_mode(options.fps_mode, encoder_fmt_ctx->oformat);
+
+    // the first pass only analyzes the frames, nothing is written
+    if (options.passes > 1) {
+        FrameRateNormalizer normalizer(fps_mode, decoder_fmt_ctx->streams[video_stream_idx]->time_base,
+                                       framerate);
+        if (first_pass(source, normalizer, decoder_ctx, framerate, options) < 0 || source.rewind() < 0)
+            return -1;
     }
 
-    // find the libx264 encoder for H264 media type.
-    auto encoder = avcodec_find_encoder_by_name("libx264");
-    if (!encoder) {
-        fprintf(stderr, "can not find the libx264 encoder.\n");
+    if (avformat_new_stream(encoder_fmt_ctx, nullptr) == nullptr) {
+        fprintf(stderr, "failed to create a video stream.\n");
         return -1;
     }
 
-    AVCodecContext *encoder_ctx = avcodec_alloc_context3(encoder);
+    // the encoder with the options, and the stats of the first pass
+    const bool global_header    = encoder_fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER;
+    AVCodecContext *encoder_ctx =
+        open_video_encoder(decoder_ctx, framerate, options, global_header, options.passes > 1 ? 2 : 0);
     if (!encoder_ctx) {
-        fprintf(stderr, "failed to allocate encoder context.\n");
+        fprintf(stderr, "can not open the %s encoder.\n", options.encoder.c_str());
         return -1;
     }
 
-    // some options
-    AVDictionary *encoder_options = nullptr;
-    av_dict_set(&encoder_options, "crf", "23", AV_DICT_DONT_OVERWRITE);
-    av_dict_set(&encoder_options, "threads", "auto", AV_DICT_DONT_OVERWRITE);
-
-    // encoder parameters
-    encoder_ctx->height  = decoder_ctx->height;
-    encoder_ctx->width   = decoder_ctx->width;
-    encoder_ctx->pix_fmt = decoder_ctx->pix_fmt;
-
-    encoder_ctx->sample_aspect_ratio = decoder_ctx->sample_aspect_ratio;
-    encoder_ctx->framerate =
-        av_guess_frame_rate(decoder_fmt_ctx, decoder_fmt_ctx->streams[video_stream_idx], nullptr);
-
     // time base
-    encoder_ctx->time_base                 = av_inv_q(encoder_ctx->framerate);
     encoder_fmt_ctx->streams[0]->time_base = decoder_fmt_ctx->streams[video_stream_idx]->time_base;
 
-    if (avcodec_open2(encoder_ctx, encoder, &encoder_options) < 0) {
-        fprintf(stderr, "can not open the encoder.\n");
-        return -1;
-    }
-
     if (avcodec_parameters_from_context(encoder_fmt_ctx->streams[0]->codecpar, encoder_ctx) < 0) {
         fprintf(stderr, "failed to copy parameters to encoder context.\n");
         return -1;
@@ -145,82 +201,83 @@ int main(int argc, char *argv[])
            encoder_ctx->time_base.num, encoder_ctx->time_base.den,
            encoder_fmt_ctx->streams[0]->time_base.num, encoder_fmt_ctx->streams[0]->time_base.den);
 
-    AVPacket *in_packet  = av_packet_alloc();
+    // write the packets in the dts order with bounded buffering
+    Interleaver interleaver(encoder_fmt_ctx, options.interleave);
+
     AVPacket *out_packet = av_packet_alloc();
     AVFrame *in_frame    = av_frame_alloc();
-    while (av_read_frame(decoder_fmt_ctx, in_packet) >= 0) {
-        if (in_packet->stream_index != video_stream_idx) {
-            av_packet_unref(in_packet);
-            continue;
-        }
 
-        //
-        // decoding
-        //
-        // send packets to decoder
-        // ATTENTION: the packets and frames are not one-to-one correspondence.
-        int ret = avcodec_send_packet(decoder_ctx, in_packet);
+    //
+    // encoding
+    //
+    // send frames to encoder, nullptr: flush the encoder
+    // ATTENTION: the packets and frames are not one-to-one correspondence.
+    const auto encode = [&](const AVFrame *frame) {
+        int ret = avcodec_send_frame(encoder_ctx, frame);
         while (ret >= 0) {
-            av_frame_unref(in_frame);
-            // receive frames from the decoder
-            ret = avcodec_receive_frame(decoder_ctx, in_frame);
+            av_packet_unref(out_packet);
+            // receive packets from the encoder
+            ret = avcodec_receive_packet(encoder_ctx, out_packet);
             if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
                 break;
             }
             else if (ret < 0) {
-                fprintf(stderr, "decoding error.\n");
+                fprintf(stderr, "encoding error.\n");
                 return ret;
             }
 
-            // clear the picture type, let the encoder decide it type
-            in_frame->pict_type = AV_PICTURE_TYPE_NONE;
+            out_packet->stream_index = 0;
+            av_packet_rescale_ts(out_packet, encoder_ctx->time_base,
+                                 encoder_fmt_ctx->streams[0]->time_base);
+            printf(" -- [ENCODING] packet = %4d, pts = %6ld, dts = %6ld, duration = %ld\n",
+                   encoder_ctx->frame_number, out_packet->pts, out_packet->dts, out_packet->duration);
 
-            //
-            // encoding
-            //
-            // send frames to encoder
-            // ATTENTION: the packets and frames are not one-to-one correspondence.
-            ret = avcodec_send_frame(encoder_ctx, in_frame);
-            while (ret >= 0) {
-                av_packet_unref(out_packet);
-                // receive packets from the encoder
-                ret = avcodec_receive_packet(encoder_ctx, out_packet);
-                if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-                    break;
-                }
-                else if (ret < 0) {
-                    fprintf(stderr, "encoding error.\n");
-                    return ret;
-                }
-
-                out_packet->stream_index = 0;
-                av_packet_rescale_ts(out_packet, decoder_fmt_ctx->streams[video_stream_idx]->time_base,
-                                     encoder_fmt_ctx->streams[0]->time_base);
-                printf(" -- [ENCODING] packet = %4d, pts = %6ld, dts = %6ld, duration = %ld\n",
-                       encoder_ctx->frame_number, out_packet->pts, out_packet->dts, out_packet->duration);
-
-                if (av_interleaved_write_frame(encoder_fmt_ctx, out_packet) != 0) {
-                    fprintf(stderr, "failed to write the packet to the output file.\n");
-                    return -1;
-                }
+            if (interleaver.write(out_packet) < 0) {
+                fprintf(stderr, "failed to write the packet to the output file.\n");
+                return -1;
             }
         }
-        av_packet_unref(in_packet);
+        return 0;
+    };
+
+    //
+    // decoding, or replaying the frames cached by the first pass
+    //
+    // dropped or duplicated to the frame rate, the picture types are cleared, let the encoder decide them
+    FrameRateNormalizer normalizer(fps_mode, decoder_fmt_ctx->streams[video_stream_idx]->time_base,
+                                   framerate);
+
+    int ret = 0;
+    while ((ret = source.read(in_frame)) >= 0) {
+        ret = normalizer.push(in_frame, encode);
+        av_frame_unref(in_frame);
+        if (ret < 0) return ret;
     }
+    if (ret != AVERROR_EOF) {
+        fprintf(stderr, "decoding error.\n");
+        return ret;
+    }
+    if (normalizer.push(nullptr, encode) < 0) return -1;
 
-    printf("\n[TRANSCODING] decoded frames: %d, encoded frames: %d\n", decoder_ctx->frame_number,
-           encoder_ctx->frame_number);
+    const auto stats     = source.stats();
+    const double elapsed = (av_gettime_relative() - start_time) / 1000000.0;
+    printf("\n[TRANSCODING] decoded frames: %ld, replayed frames: %ld, encoded frames: %d, %.3fs, "
+           "%.2f fps\n",
+           stats.decoded, stats.replayed, encoder_ctx->frame_number, elapsed,
+           encoder_ctx->frame_number / elapsed);
+    printf("%s\n", normalizer.str().c_str());
 
-    av_packet_free(&in_packet);
     av_packet_free(&out_packet);
     av_frame_free(&in_frame);
 
+    if (interleaver.flush() < 0) {
+        fprintf(stderr, "failed to write the packet to the output file.\n");
+        return -1;
+    }
     av_write_trailer(encoder_fmt_ctx);
     if (encoder_fmt_ctx && !(encoder_fmt_ctx->oformat->flags & AVFMT_NOFILE))
         avio_closep(&encoder_fmt_ctx->pb);
 
-    av_dict_free(&encoder_options);
-
     avformat_close_input(&decoder_fmt_ctx);
     avformat_free_context(encoder_fmt_ctx);
 
@@ -228,4 +285,199 @@ int main(int argc, char *argv[])
     avcodec_free_context(&encoder_ctx);
 
     return 0;
-}
\ No newline at end of file
+}
+
+int main(int argc, char *argv[])
+{
+    Logger::init(argv[0]);
+
+    args::parser parser("transcode -i <input> -o <output> [--serial]");
+    parser.add("-i", "", "the input file");
+    parser.add("-o", "", "the output file");
+    parser.add("--encoder", "libx264", "the video encoder");
+    parser.add("--preset", "", "preset of the encoder, empty: default");
+    parser.add("--crf", 23, "constant rate factor of the encoder");
+    parser.add("--bitrate", 0, "bitrate of the encoder in bits per second, replaces the crf, 0: crf");
+    parser.add("--maxrate", 0, "max bitrate of the encoder in bits per second, 0: unlimited");
+    parser.add("--threads", 0, "threads of the encoder, 0: auto");
+    parser.add("--queue", 8, "max packets / frames queued between the pipeline stages");
+    parser.add("--fpsmode", "auto", "frame rate: auto, cfr (drop / duplicate), vfr, passthrough");
+    parser.add("--fps", "", "frame rate of the encoder, e.g. 25 or 30000/1001, empty: the input's");
+    parser.add("--audio", "auto", "audio streams: auto, copy, encode, drop");
+    parser.add("--subtitle", "auto", "subtitle streams: auto, copy, drop");
+    parser.add("--aencoder", "aac", "the audio encoder");
+    parser.add("--abitrate", 128000, "bitrate of the audio encoder");
+    parser.add("--lang", std::vector<std::string>{}, "keep the audio / subtitles of the languages only");
+    parser.add("--passes", 1, "2: two-pass encoding with the --bitrate, on one thread");
+    parser.add("--passlog", "ffmpeg2pass-0.log", "the stats file of the two-pass encoding");
+    parser.add("--cache", "", "spill the decoded frames to the file, replayed by the later passes");
+    parser.add("--cachesize", 4096, "max MiB of the frames in the --cache");
+    parser.add("--eviction", "keep", "the --cache is full: keep the cached frames, or drop the cache");
+    parser.add("--passthrough", false, "copy the video stream if re-encoding adds no value");
+    parser.add("--maxwidth", 0, "max width of the video copied by --passthrough, 0: any");
+    parser.add("--maxheight", 0, "max height of the video copied by --passthrough, 0: any");
+    parser.add("--profiles", std::vector<std::string>{}, "profiles copied by --passthrough, e.g. High");
+    parser.add("--serial", false, "transcode on one thread, to compare with the pipeline");
+    parser.add("--split", 0, "cut the input into N chunks at the keyframes, transcoded concurrently");
+    parser.add("--overlap", 0.0, "seconds encoded around each chunk for the rate control of --split");
+    parser.add("--checkpoint", "", "checkpoint file, resume from it if it exists");
+    parser.add("--interval", 60.0, "seconds of the input between two checkpoints");
+    parser.add("--ladder", std::vector<std::string>{},
+               "renditions HEIGHT[:KBPS] decoded once and encoded concurrently, e.g. --ladder 1080:5000");
+    parser.add("--segment", 2.0, "seconds between the keyframes aligned across the renditions of --ladder");
+    parser.add("--adaptive", false, "choose the crf of every scene by the trial encodes");
+    parser.add("--scenecut", 10.0, "scene change threshold of --adaptive, [0, 100]");
+    parser.add("--minscene", 2.0, "min seconds of a scene of --adaptive");
+    parser.add("--sample", 2.0, "seconds of every scene trial-encoded by --adaptive");
+    parser.add("--crfs", std::vector<int64_t>{ 18, 22, 26, 30, 34 }, "crf candidates of --adaptive");
+    parser.add("--metric", "ssim", "quality metric of --adaptive: ssim, psnr");
+    parser.add("--target", 0.98, "min quality of --adaptive, ssim: [0, 1], psnr: dB");
+    parser.add("--bench", false, "measure the decoding, encoding and transcoding, no output");
+    parser.add("--repeat", 3, "runs of every case of --bench");
+    parser.add("--frames", 300, "frames of every run of --bench, 0: all");
+    parser.add("--presets", std::vector<std::string>{}, "presets swept by --bench");
+    parser.add("--threadcounts", std::vector<int64_t>{}, "encoder threads swept by --bench");
+    parser.add("--json", "", "write the results of --bench to the json file");
+    parser.parse(argc, argv);
+
+    const auto in_filename  = parser.get<std::string>("i", "");
+    const auto out_filename = parser.get<std::string>("o", "");
+    const auto bench        = parser.get<bool>("bench", false);
+    if (in_filename.empty() || (out_filename.empty() && !bench)) {
+        LOG(ERROR) << parser.help();
+        return -1;
+    }
+
+    AVRational framerate{ 0, 1 };
+    if (const auto fps = parser.get<std::string>("fps", ""); !fps.empty()) {
+        if (av_parse_video_rate(&framerate, fps.c_str()) < 0) {
+            LOG(ERROR) << "invalid frame rate: " << fps;
+            return -1;
+        }
+    }
+
+    const TranscodeOptions options{
+        .encoder       = parser.get<std::string>("encoder", "libx264"),
+        .preset        = parser.get<std::string>("preset", ""),
+        .crf           = static_cast<int>(parser.get<int64_t>("crf", 23)),
+        .bitrate       = parser.get<int64_t>("bitrate", 0),
+        .threads       = static_cast<int>(parser.get<int64_t>("threads", 0)),
+        .maxrate       = parser.get<int64_t>("maxrate", 0),
+        .queue_size    = static_cast<size_t>(parser.get<int64_t>("queue", 8)),
+        .fps_mode      = parser.get<std::string>("fpsmode", "auto"),
+        .framerate     = framerate,
+        .passes        = static_cast<int>(parser.get<int64_t>("passes", 1)),
+        .passlog       = parser.get<std::string>("passlog", "ffmpeg2pass-0.log"),
+        .cache =
+            {
+                .filename = parser.get<std::string>("cache", ""),
+                .size     = parser.get<int64_t>("cachesize", 4096) * 1024 * 1024,
+                .eviction = parser.get<std::string>("eviction", "keep") == "drop" ? CacheEviction::drop
+                                                                                   : CacheEviction::keep,
+            },
+        .audio         = parser.get<std::string>("audio", "auto"),
+        .subtitle      = parser.get<std::string>("subtitle", "auto"),
+        .audio_encoder = parser.get<std::string>("aencoder", "aac"),
+        .audio_bitrate = parser.get<int64_t>("abitrate", 128000),
+        .languages     = parser.get<std::vector<std::string>>("lang", {}),
+        .passthrough =
+            {
+                .enabled    = parser.get<bool>("passthrough", false),
+                .max_width  = static_cast<int>(parser.get<int64_t>("maxwidth", 0)),
+                .max_height = static_cast<int>(parser.get<int64_t>("maxheight", 0)),
+                .profiles   = parser.get<std::vector<std::string>>("profiles", {}),
+            },
+    };
+
+    // the modes are exclusive, --passthrough falls back to the mode given when the video is re-encoded, and
+    // the two-pass encoding is of the serial mode
+    const auto specs  = parser.get<std::vector<std::string>>("ladder", {});
+    const bool serial = parser.get<bool>("serial", false) || options.passes > 1;
+
+    std::vector<std::string> modes{};
+    const auto mode = [&](bool given, const char *flag) {
+        if (given) modes.emplace_back(flag);
+    };
+    mode(bench, "--bench");
+    mode(!specs.empty(), "--ladder");
+    mode(parser.get<bool>("adaptive", false), "--adaptive");
+    mode(!parser.get<std::string>("checkpoint", "").empty(), "--checkpoint");
+    mode(parser.get<int64_t>("split", 0) > 1, "--split");
+    mode(serial, options.passes > 1 ? "--passes" : "--serial");
+    mode(options.passthrough.enabled && (bench || !specs.empty()), "--passthrough");
+    if (modes.size() > 1) {
+        std::string names{};
+        for (const auto& flag : modes) names += (names.empty() ? "" : ", ") + flag;
+        LOG(ERROR) << "conflicting modes: " << names << ", only one of them can be given";
+        return -1;
+    }
+
+    if (bench) {
+        const auto threads = parser.get<std::vector<int64_t>>("threadcounts", {});
+        return benchmark(in_filename, options,
+                         {
+                             .repeat  = static_cast<int>(parser.get<int64_t>("repeat", 3)),
+                             .frames  = parser.get<int64_t>("frames", 300),
+                             .presets = parser.get<std::vector<std::string>>("presets", {}),
+                             .threads = std::vector<int>(threads.begin(), threads.end()),
+                             .json    = parser.get<std::string>("json", ""),
+                         });
+    }
+
+    if (!specs.empty()) {
+        LadderOptions ladder{ .segment = parser.get<double>("segment", 2.0) };
+        for (const auto& spec : specs) {
+            const auto rendition = parse_rendition(spec, out_filename);
+            if (!rendition) {
+                LOG(ERROR) << "invalid rendition: " << spec << ", HEIGHT[:KBPS] expected";
+                return -1;
+            }
+            ladder.renditions.push_back(rendition.value());
+        }
+        return transcode_ladder(in_filename, options, ladder);
+    }
+
+    if (options.passthrough.enabled && can_passthrough(in_filename, out_filename, options)) {
+        return transcode_passthrough(in_filename, out_filename, options);
+    }
+
+    if (parser.get<bool>("adaptive", false)) {
+        const auto crfs = parser.get<std::vector<int64_t>>("crfs", { 18, 22, 26, 30, 34 });
+        return transcode_adaptive(in_filename, out_filename, options,
+                                  {
+                                      .threshold = parser.get<double>("scenecut", 10.0),
+                                      .min_scene = parser.get<double>("minscene", 2.0),
+                                      .sample    = parser.get<double>("sample", 2.0),
+                                      .crfs      = std::vector<int>(crfs.begin(), crfs.end()),
+                                      .metric    = parser.get<std::string>("metric", "ssim"),
+                                      .target    = parser.get<double>("target", 0.98),
+                                  });
+    }
+
+    if (const auto checkpoint = parser.get<std::string>("checkpoint", ""); !checkpoint.empty()) {
+        return transcode_resumable(in_filename, out_filename, options,
+                                   {
+                                       .filename = checkpoint,
+                                       .interval = parser.get<double>("interval", 60.0),
+                                   });
+    }
+
+    if (const auto chunks = parser.get<int64_t>("split", 0); chunks > 1) {
+        return transcode_split(in_filename, out_filename, options,
+                               {
+                                   .chunks  = static_cast<int>(chunks),
+                                   .overlap = parser.get<double>("overlap", 0.0),
+                               });
+    }
+
+    if (options.passes > 1 && options.bitrate <= 0) {
+        LOG(ERROR) << "the two-pass encoding needs the --bitrate";
+        return -1;
+    }
+
+    if (serial) {
+        return transcode(in_filename, out_filename, options);
+    }
+
+    return transcode_pipeline(in_filename, out_filename, options);
+}
@@ -0,0 +1,206 @@
+#ifndef _02_TRANSCODING_H
+#define _02_TRANSCODING_H
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+#include <iosfwd>
+#include <optional>
+#include <string>
+#include <vector>
+#include "framecache.h"
+#include "interleaver.h"
+#include "normalizer.h"
+#include "probe.h"
+
+// the video stream is copied instead of re-encoded if it already matches the encoder, the bitrate
+// limits (TranscodeOptions::bitrate, maxrate), the gop size and these rules
+struct PassthroughOptions
+{
+    bool enabled{ false };
+    int max_width{ 0 };                  // 0: any
+    int max_height{ 0 };                 // 0: any
+    std::vector<std::string> profiles{}; // avcodec_profile_name(), empty: the 8-bit 4:2:0 ones
+};
+
+struct TranscodeOptions
+{
+    std::string encoder{ "libx264" };
+    std::string preset{};       // empty: the default preset of the encoder
+    int crf{ 23 };
+    int64_t bitrate{ 0 };       // bits per second, replaces the crf, 0: crf
+    int threads{ 0 };           // threads of the encoder, 0: auto
+    bool closed_gop{ false };   // no frame references across the keyframes, the forced keyframes are IDR
+    int gop{ 0 };               // max frames between two keyframes, 0: default of the encoder
+    int64_t maxrate{ 0 };       // bits per second, caps the crf with a buffer of 2 seconds, 0: unlimited
+    bool stitchable{ false };   // the same headers with any rate control settings, for the concatenation
+    size_t queue_size{ 8 };     // max packets / frames queued between two stages
+
+    // the serial and pipeline modes, the frames are dropped / duplicated by parse_fps_mode() to the
+    // frame rate of the encoder
+    std::string fps_mode{ "auto" }; // auto, cfr, vfr, passthrough
+    AVRational framerate{ 0, 1 };   // of the encoder, 0: guessed from the input stream
+
+    // serial mode only, the first pass analyzes the frames and writes the stats to the pass log,
+    // the second one encodes with them, the decoded frames are replayed from the cache if enabled
+    int passes{ 1 };
+    std::string passlog{ "ffmpeg2pass-0.log" };
+    FrameCacheOptions cache{};
+
+    // the other streams, in the pipeline mode only, 'auto' copies the stream if the output format accepts
+    // its codec, otherwise the audio is encoded and the subtitles are dropped
+    std::string audio{ "auto" };    // auto, copy, encode, drop
+    std::string subtitle{ "auto" }; // auto, copy, drop
+    std::string audio_encoder{ "aac" };
+    int64_t audio_bitrate{ 128000 };
+    std::vector<std::string> languages{}; // drop the audio / subtitles tagged with the other languages
+    PassthroughOptions passthrough{};
+    ProbeOptions probe{};
+    InterleaveOptions interleave{};
+};
+
+struct SplitOptions
+{
+    int chunks{ 1 };            // transcoded concurrently, cut at the keyframes
+    double overlap{ 0.0 };      // seconds encoded before and after each chunk only for the rate control
+};
+
+// a part of the video stream transcoded with its own crf, [start, end) in the time base of the input
+// stream, AV_NOPTS_VALUE: the beginning / the end of the stream
+struct Scene
+{
+    int64_t start{ AV_NOPTS_VALUE };
+    int64_t end{ AV_NOPTS_VALUE };
+    int crf{ 23 };
+};
+
+struct AdaptiveOptions
+{
+    double threshold{ 10.0 };         // scene change score of 'scdet', [0, 100]
+    double min_scene{ 2.0 };          // seconds, the shorter scenes are merged into the previous ones
+    double sample{ 2.0 };             // seconds trial-encoded in the middle of every scene
+    std::vector<int> crfs{ 18, 22, 26, 30, 34 };
+    std::string metric{ "ssim" };     // ssim, psnr
+    double target{ 0.98 };            // the min quality, ssim: [0, 1], psnr: dB
+};
+
+struct CheckpointOptions
+{
+    std::string filename{};     // the checkpoint, the encoded segments are written next to it
+    double interval{ 60.0 };    // seconds of the input in a segment, checkpointed once it is written
+};
+
+struct BenchOptions
+{
+    int repeat{ 3 };                    // runs of every case, for the mean and the standard deviation
+    int64_t frames{ 300 };              // frames of every run, kept in memory for encoding only, 0: all
+    std::vector<std::string> presets{}; // swept, empty: the preset of the TranscodeOptions
+    std::vector<int> threads{};         // encoder threads swept, empty: the threads of the TranscodeOptions
+    std::string json{};                 // the results for the comparison in CI, empty: logged only
+};
+
+struct Rendition
+{
+    int height{};               // the width is scaled to keep the aspect ratio
+    int64_t maxrate{ 0 };       // bits per second, 0: unlimited
+    std::string filename{};
+};
+
+struct LadderOptions
+{
+    std::vector<Rendition> renditions{};
+    double segment{ 2.0 };      // seconds between the keyframes forced at the same pts in every rendition
+};
+
+enum class StreamPolicy
+{
+    drop,
+    copy,
+    encode,
+};
+
+// the policy of every stream of the input, the video stream 'video_stream_idx' is always encoded
+std::vector<StreamPolicy> plan_streams(const AVFormatContext *fmt_ctx, const AVOutputFormat *oformat,
+                                       int video_stream_idx, const TranscodeOptions& options);
+
+// add a stream with the parameters of the input stream to the output, for the stream copy
+AVStream *add_copy_stream(AVFormatContext *fmt_ctx, const AVStream *stream);
+
+// the encoded packets spilled to a file until they can be muxed: pts, dts, duration, flags, size, data
+bool write_packet(std::ostream& out, const AVPacket *packet);
+bool read_packet(std::istream& in, AVPacket *packet);
+
+// "HEIGHT[:KBPS]", e.g. "720:2800", the rendition is written to "<stem>_<HEIGHT>p<extension>"
+std::optional<Rendition> parse_rendition(const std::string& spec, const std::string& out_filename);
+
+// open the decoder of the stream, 0 threads: auto
+AVCodecContext *open_decoder(const AVStream *stream, int threads = 0);
+
+// open the video encoder for the frames decoded by the decoder,
+// the time base of the encoder is 1 / framerate
+// pass 1 / 2: the pass of a two-pass encoding, the stats are written to / read from the pass log
+AVCodecContext *open_video_encoder(const AVCodecContext *decoder_ctx, AVRational framerate,
+                                   const TranscodeOptions& options, bool global_header, int pass = 0);
+
+AVCodecContext *open_video_encoder(int width, int height, AVPixelFormat pix_fmt, AVRational sar,
+                                   AVRational framerate, const TranscodeOptions& options,
+                                   bool global_header, int pass = 0);
+
+// inspect the codec parameters and the bitrate of the best video stream by the passthrough rules,
+// true: re-encoding adds no value, the stream can be copied
+bool can_passthrough(const std::string& in_filename, const std::string& out_filename,
+                     const TranscodeOptions& options);
+
+// copy the best video stream through the bitstream filter needed by the output format, e.g.
+// h264_mp4toannexb, the other streams are copied or encoded as in the pipeline
+int transcode_passthrough(const std::string& in_filename, const std::string& out_filename,
+                          const TranscodeOptions& options);
+
+// decode and encode the best video stream on one thread, in one or two passes
+int transcode(const std::string& in_filename, const std::string& out_filename,
+              const TranscodeOptions& options);
+
+// demux, decode, encode and mux the best video stream on their own threads, connected by bounded queues
+int transcode_pipeline(const std::string& in_filename, const std::string& out_filename,
+                       const TranscodeOptions& options);
+
+// cut the input at the keyframes into chunks, transcode the chunks concurrently with their own decoders
+// and encoders, and concatenate the encoded chunks in order
+int transcode_split(const std::string& in_filename, const std::string& out_filename,
+                    const TranscodeOptions& options, const SplitOptions& split);
+
+// pts of the keyframes of the best video stream 'stream_idx', by demuxing the file without decoding
+std::vector<int64_t> scan_keyframes(const std::string& filename, const ProbeOptions& probe,
+                                    int& stream_idx);
+
+// transcode the scenes of the video stream 'stream_idx' concurrently, each with its own decoder and
+// encoder, the decoding of a scene starts from the keyframe before it, and concatenate them in order
+int transcode_scenes(const std::string& in_filename, const std::string& out_filename,
+                     const TranscodeOptions& options, const std::vector<Scene>& scenes,
+                     const std::vector<int64_t>& keyframes, int stream_idx, double overlap);
+
+// detect the scene cuts, trial-encode a sample of every scene with the crf candidates, and transcode the
+// scenes concurrently, each with the highest crf meeting the quality target
+int transcode_adaptive(const std::string& in_filename, const std::string& out_filename,
+                       const TranscodeOptions& options, const AdaptiveOptions& adaptive);
+
+// transcode the best video stream in segments, and checkpoint after every segment is written, so that
+// the transcoding resumes from the last checkpoint after a restart
+int transcode_resumable(const std::string& in_filename, const std::string& out_filename,
+                        const TranscodeOptions& options, const CheckpointOptions& checkpoint);
+
+// measure the decode-only, encode-only (from the decoded frames in memory) and full transcode runs
+int benchmark(const std::string& in_filename, const TranscodeOptions& options, const BenchOptions& bench);
+
+#ifdef COUNT_ALLOCATIONS
+// the allocations of the process so far, by the malloc() and its friends replaced in allocations.cpp
+int64_t allocation_count();
+#endif
+
+// decode the best video stream once, scale it into the renditions with one filter graph, and encode
+// the renditions concurrently, each to its own output file
+int transcode_ladder(const std::string& in_filename, const TranscodeOptions& options,
+                     const LadderOptions& ladder);
+
+#endif //!_02_TRANSCODING_H
@@ -8,18 +8,35 @@ extern "C" {
 #include <libavfilter/buffersrc.h>
 #include <libavdevice/avdevice.h>
 }
+#include "argsparser.h"
 #include "logging.h"
 #include "defer.h"
+#include "filterstage.h"
 #include "fmt/format.h"
 
+#include <memory>
+#include <thread>
+
 int main(int argc, char* argv[])
 {
     Logger::init(argv[0]);
 
-    CHECK(argc >= 3) << "filter <input> <output>";
+    args::parser parser("filter -i <input> -o <output> [--vf vflip] [--threads 0] [--stage]");
+    parser.add("-i", "", "the input file");
+    parser.add("-o", "", "the output file");
+    parser.add("--vf", "vflip", "the filter graph, e.g. scale=1280:-2,vflip");
+    parser.add("--threads", 0, "slice threads of the filter graph, 0: auto, 1: no threading");
+    parser.add("--stage", false, "run the filter graph on its own thread");
+    parser.add("--queue", 8, "max frames queued before and after the filter thread of --stage");
+    parser.parse(argc, argv);
+
+    const auto in = parser.get<std::string>("i", "");
+    const auto out = parser.get<std::string>("o", "");
+    const auto descr = parser.get<std::string>("vf", "vflip");
+    CHECK(!in.empty() && !out.empty()) << parser.help();
 
-    const char * in_filename = argv[1];
-    const char * out_filename = argv[2];
+    const char * in_filename = in.c_str();
+    const char * out_filename = out.c_str();
 
     AVFormatContext* decoder_fmt_ctx = nullptr;
     CHECK(avformat_open_input(&decoder_fmt_ctx, in_filename, nullptr, nullptr) >= 0);
@@ -59,12 +76,13 @@ int main(int argc, char* argv[])
     CHECK_NOTNULL(filter_graph);
     defer(avfilter_graph_free(&filter_graph));
 
+    // before any filter is created
+    set_filter_threads(filter_graph, static_cast<int>(parser.get<int64_t>("threads", 0)));
+
     const AVFilter *buffersrc = avfilter_get_by_name("buffer");
     CHECK_NOTNULL(buffersrc);
     const AVFilter *buffersink = avfilter_get_by_name("buffersink");
     CHECK_NOTNULL(buffersink);
-    const AVFilter *vflip_filter = avfilter_get_by_name("vflip");
-    CHECK_NOTNULL(vflip_filter);
 
     AVStream* video_stream = decoder_fmt_ctx->streams[video_stream_idx];
     AVRational fr = av_guess_frame_rate(decoder_fmt_ctx, video_stream, nullptr);
@@ -78,21 +96,31 @@ int main(int argc, char* argv[])
 
     AVFilterContext *src_filter_ctx = nullptr;
     AVFilterContext *sink_filter_ctx = nullptr;
-    AVFilterContext *vflip_filter_ctx = nullptr;
 
     CHECK(avfilter_graph_create_filter(&src_filter_ctx, buffersrc, "src", args.c_str(), nullptr, filter_graph) >= 0);
     enum AVPixelFormat pix_fmts[] = { AV_PIX_FMT_YUV420P, AV_PIX_FMT_NONE };
     CHECK(avfilter_graph_create_filter(&sink_filter_ctx, buffersink, "sink", nullptr, nullptr, filter_graph) >= 0);
     CHECK(av_opt_set_int_list(sink_filter_ctx, "pix_fmts", pix_fmts, AV_PIX_FMT_NONE, AV_OPT_SEARCH_CHILDREN) >= 0);
-    CHECK (avfilter_graph_create_filter(&vflip_filter_ctx, vflip_filter, "vflip", nullptr, nullptr, filter_graph) >= 0);
 
-    CHECK(avfilter_link(src_filter_ctx, 0, vflip_filter_ctx, 0) == 0);
-    CHECK(avfilter_link(vflip_filter_ctx, 0, sink_filter_ctx, 0) == 0);
+    // src -> [in] descr [out] -> sink
+    AVFilterInOut *outputs = avfilter_inout_alloc();
+    AVFilterInOut *inputs = avfilter_inout_alloc();
+    defer(avfilter_inout_free(&outputs); avfilter_inout_free(&inputs));
+    CHECK(outputs && inputs);
 
+    outputs->name = av_strdup("in");
+    outputs->filter_ctx = src_filter_ctx;
+    inputs->name = av_strdup("out");
+    inputs->filter_ctx = sink_filter_ctx;
+
+    CHECK(avfilter_graph_parse_ptr(filter_graph, descr.c_str(), &inputs, &outputs, nullptr) >= 0);
     CHECK(avfilter_graph_config(filter_graph, nullptr) >= 0);
     char * graph = avfilter_graph_dump(filter_graph, nullptr);
     CHECK_NOTNULL(graph);
     LOG(INFO) << "filter graph >>>> \n" << graph;
+    av_free(graph);
+    LOG(INFO) << fmt::format("[FILTER] threads = {}, stage = {}", filter_graph->nb_threads,
+                             parser.get<bool>("stage", false));
     // @}
 
     LOG(INFO) << fmt::format("[FILTER] {:>3d}x{:>3d}, framerate = {}/{}, timebase = {}/{}",
@@ -122,9 +150,9 @@ int main(int argc, char* argv[])
     av_dict_set(&encoder_options, "threads", "auto", AV_DICT_DONT_OVERWRITE);
     defer(av_dict_free(&encoder_options));
 
-    // encoder codec params
-    encoder_ctx->height = decoder_ctx->height;
-    encoder_ctx->width = decoder_ctx->width;
+    // encoder codec params, the size of the filtered frames
+    encoder_ctx->height = av_buffersink_get_h(sink_filter_ctx);
+    encoder_ctx->width = av_buffersink_get_w(sink_filter_ctx);
     encoder_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
 
     encoder_ctx->sample_aspect_ratio = av_buffersink_get_sample_aspect_ratio(sink_filter_ctx);
@@ -158,9 +186,103 @@ int main(int argc, char* argv[])
     AVFrame * in_frame = av_frame_alloc();
     AVPacket* out_packet = av_packet_alloc();
     AVFrame * filtered_frame = av_frame_alloc();
+    defer(av_packet_free(&in_packet); av_frame_free(&in_frame));
+    defer(av_packet_free(&out_packet); av_frame_free(&filtered_frame));
+
+    // encoding, nullptr: flush the encoder
+    const auto encode = [&](AVFrame *frame) {
+        if (frame) frame->pict_type = AV_PICTURE_TYPE_NONE;
+
+        int ret = avcodec_send_frame(encoder_ctx, frame);
+        while(ret >= 0) {
+            av_packet_unref(out_packet);
+            ret = avcodec_receive_packet(encoder_ctx, out_packet);
+            if(ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+                break;
+            } else if(ret < 0) {
+                fprintf(stderr, "encoder: avcodec_receive_packet()\n");
+                return -1;
+            }
+
+            out_packet->stream_index = 0;
+            // the frames are in the time base of the sink, e.g. changed by fps
+            av_packet_rescale_ts(out_packet, av_buffersink_get_time_base(sink_filter_ctx), encoder_fmt_ctx->streams[0]->time_base);
+            LOG(INFO) << fmt::format("[ENCODING] frame = {:>4d}, pts = {:>6d}, dts = {:>6d}, size = {:>6d}",
+                                     encoder_ctx->frame_number, out_packet->pts, out_packet->dts, out_packet->size);
+
+            if (av_interleaved_write_frame(encoder_fmt_ctx, out_packet) != 0) {
+                LOG(ERROR) << "encoder: av_interleaved_write_frame()";
+                return -1;
+            }
+        }
+        return 0;
+    };
+
+    // --stage: decode -> [queue] -> filter thread -> [queue] -> encode thread
+    std::unique_ptr<FilterStage> stage{};
+    std::thread encode_thread;
+    if (parser.get<bool>("stage", false)) {
+        const auto queue_size = static_cast<size_t>(parser.get<int64_t>("queue", 8));
+        stage = std::make_unique<FilterStage>(std::vector{ src_filter_ctx }, sink_filter_ctx, queue_size);
+        stage->start();
+
+        encode_thread = std::thread([&]() {
+            while (auto frame = stage->pop()) {
+                const int ret = encode(frame.value());
+                av_frame_free(&frame.value());
+                if (ret < 0) {
+                    stage->stop();
+                    return;
+                }
+            }
+            encode(nullptr);
+        });
+    }
+
+    // filtering, nullptr: EOF of the input
+    const auto filter = [&](AVFrame *frame) {
+        if (stage) {
+            AVFrame *queued = nullptr;
+            if (frame && (!(queued = av_frame_alloc()) || av_frame_ref(queued, frame) < 0)) {
+                av_frame_free(&queued);
+                return AVERROR(ENOMEM);
+            }
+
+            if (!stage->push(0, queued)) {
+                av_frame_free(&queued);
+                return AVERROR_EXIT;
+            }
+            return 0;
+        }
 
-    while(av_read_frame(decoder_fmt_ctx, in_packet) >= 0 && decoder_ctx->frame_number < 200) {
+        int ret = av_buffersrc_add_frame_flags(src_filter_ctx, frame, AV_BUFFERSRC_FLAG_PUSH);
+        if (ret < 0) {
+            fprintf(stderr, "av_buffersrc_add_frame_flags()\n");
+            return ret;
+        }
+        while(ret >= 0) {
+            av_frame_unref(filtered_frame);
+            ret = av_buffersink_get_frame_flags(sink_filter_ctx, filtered_frame, AV_BUFFERSINK_FLAG_NO_REQUEST);
+            if (ret == AVERROR(EAGAIN)) {
+                break;
+            }
+            else if (ret == AVERROR_EOF) {
+                return encode(nullptr);
+            }
+            else if (ret < 0) {
+                fprintf(stderr, "av_buffersink_get_frame_flags()\n");
+                return ret;
+            }
+
+            if (encode(filtered_frame) < 0) return -1;
+        }
+        return 0;
+    };
+
+    bool failed = false;
+    while(!failed && av_read_frame(decoder_fmt_ctx, in_packet) >= 0 && decoder_ctx->frame_number < 200) {
         if (in_packet->stream_index != video_stream_idx) {
+            av_packet_unref(in_packet);
             continue;
         }
 
@@ -174,63 +296,35 @@ int main(int argc, char* argv[])
                 break;
             } else if (ret < 0) {
                 fprintf(stderr, "encoder: avcodec_receive_frame() \n");
-                return ret;
-            }
-
-            // filtering
-            if((ret = av_buffersrc_add_frame_flags(src_filter_ctx, in_frame, AV_BUFFERSRC_FLAG_PUSH)) < 0) {
-                fprintf(stderr, "av_buffersrc_add_frame_flags()\n");
+                failed = true;
                 break;
             }
-            while(ret >= 0) {
-                av_frame_unref(filtered_frame);
-                ret = av_buffersink_get_frame_flags(sink_filter_ctx, filtered_frame, AV_BUFFERSINK_FLAG_NO_REQUEST);
-                if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-                    break;
-                }
-                else if (ret < 0) {
-                    fprintf(stderr, "av_buffersink_get_frame_flags()\n");
-                    return ret;
-                }
 
-                //
-                filtered_frame->pict_type = AV_PICTURE_TYPE_NONE;
-
-                // encoding
-                ret = avcodec_send_frame(encoder_ctx, filtered_frame);
-                while(ret >= 0) {
-                    av_packet_unref(out_packet);
-                    ret = avcodec_receive_packet(encoder_ctx, out_packet);
-                    if(ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-                        break;
-                    } else if(ret < 0) {
-                        fprintf(stderr, "encoder: avcodec_receive_packet()\n");
-                        return -1;
-                    }
-
-                    out_packet->stream_index = 0;
-                    av_packet_rescale_ts(out_packet, decoder_fmt_ctx->streams[video_stream_idx]->time_base, encoder_fmt_ctx->streams[0]->time_base);
-                    LOG(INFO) << fmt::format("[ENCODING] frame = {:>4d}, pts = {:>6d}, dts = {:>6d}, size = {:>6d}",
-                                             decoder_ctx->frame_number, out_packet->pts, out_packet->dts, out_packet->size);
-
-                    if (av_interleaved_write_frame(encoder_fmt_ctx, out_packet) != 0) {
-                        LOG(ERROR) << "encoder: av_interleaved_write_frame()";
-                        return -1;
-                    }
-                }
+            if (filter(in_frame) < 0) {
+                failed = true;
+                break;
             }
         }
         av_packet_unref(in_packet);
     }
 
-    av_packet_free(&in_packet);
-    av_frame_free(&in_frame);
-    av_packet_free(&out_packet);
-    av_frame_free(&filtered_frame);
+    // EOF of the filter graph, the filtered frames and the encoder are flushed
+    if (!failed) filter(nullptr);
+
+    if (stage) {
+        // the stage never sees the EOF after a failure
+        if (failed) stage->stop();
+        if (encode_thread.joinable()) encode_thread.join();
+        stage->stop();
+
+        LOG(INFO) << fmt::format("[FILTER STAGE] {} frames, busy = {:.3f}s", stage->frames(),
+                                 stage->busy() / 1000000.0);
+        if (stage->failed()) failed = true;
+    }
 
     av_write_trailer(encoder_fmt_ctx);
     if (encoder_fmt_ctx && !(encoder_fmt_ctx->oformat->flags & AVFMT_NOFILE))
         avio_closep(&encoder_fmt_ctx->pb);
 
-    return 0;
+    return failed ? -1 : 0;
 }
\ No newline at end of file
@@ -5,16 +5,21 @@
 #include <string>
 #include <thread>
 #include <atomic>
+#include <chrono>
+#include <deque>
+#include <memory>
 
 extern "C" {
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
+#include <libavutil/channel_layout.h>
 #include <libavutil/opt.h>
 #include <libavutil/time.h>
 }
 
 #include "defer.h"
 #include "logging.h"
+#include "notifier.h"
 #include "ringvector.h"
 #include "fmt/format.h"
 
@@ -22,7 +27,6 @@ class Decoder {
 public:
     Decoder()
     {
-        packet_ = av_packet_alloc();
         video_frame_ = av_frame_alloc();
         audio_frame_ = av_frame_alloc();
     }
@@ -36,20 +40,26 @@ public:
         avcodec_free_context(&video_decode_ctx_);
         avcodec_free_context(&audio_decode_ctx_);
 
-        av_packet_free(&packet_);
+        for (auto pending : { &video_pending_, &audio_pending_ }) {
+            for (auto& packet : pending->packets) av_packet_free(&packet);
+        }
         av_frame_free(&video_frame_);
         av_frame_free(&audio_frame_);
     }
 
-    int open(const std::string& filename)
+    // audio: decode the audio stream if any, its frames must be popped by the consumer
+    int open(const std::string& filename, bool audio = false)
     {
         LOG(INFO) << filename;
         CHECK(avformat_open_input(&fmt_ctx_, filename.c_str(), nullptr, nullptr) >= 0);
         CHECK(avformat_find_stream_info(fmt_ctx_, nullptr) >= 0);
 
         video_stream_idx_ = av_find_best_stream(fmt_ctx_, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
-        audio_stream_idx_ = av_find_best_stream(fmt_ctx_, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
-        CHECK(video_stream_idx_ >= 0 || audio_stream_idx_ >= 0);
+        audio_stream_idx_ = -1;
+        if (audio) {
+            audio_stream_idx_ = av_find_best_stream(fmt_ctx_, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
+        }
+        CHECK(video_stream_idx_ >= 0);
 
         // decoder
         LOG(INFO) << fmt_ctx_->streams[video_stream_idx_]->codecpar->codec_id;
@@ -66,6 +76,18 @@ public:
         av_dict_set(&decoder_options, "threads", "auto", AV_DICT_DONT_OVERWRITE);
         CHECK(avcodec_open2(video_decode_ctx_, video_decoder, &decoder_options) >= 0);
 
+        if (audio_stream_idx_ >= 0) {
+            auto audio_stream  = fmt_ctx_->streams[audio_stream_idx_];
+            auto audio_decoder = avcodec_find_decoder(audio_stream->codecpar->codec_id);
+            CHECK_NOTNULL(audio_decoder);
+
+            audio_decode_ctx_ = avcodec_alloc_context3(audio_decoder);
+            CHECK_NOTNULL(audio_decode_ctx_);
+            CHECK(avcodec_parameters_to_context(audio_decode_ctx_, audio_stream->codecpar) >= 0);
+            audio_decode_ctx_->pkt_timebase = audio_stream->time_base;
+            CHECK(avcodec_open2(audio_decode_ctx_, audio_decoder, nullptr) >= 0);
+        }
+
         av_dump_format(fmt_ctx_, 0, filename.c_str(), 0);
         LOG(INFO) << fmt::format("[ INPUT] {}: {}x{}, fps = {}/{}, tbr = {}/{}, tbc = {}/{}, tbn = {}/{}\n",
                                  filename,
@@ -78,6 +100,10 @@ public:
         return 0;
     }
 
+    // Each stream stalls on its own ring only: the packets of a stream whose ring is full are kept in its
+    // queue, and the demuxer keeps reading while the other stream starves. Otherwise, with coarsely
+    // interleaved files, a full video ring stops the reading while the audio graph waits for this input's
+    // audio, and the audio graph stops draining the other inputs that the video graph waits for.
     void decode_thread()
     {
         LOG(INFO) << "[DECODER THREAD @ " << std::this_thread::get_id() << "] START";
@@ -86,70 +112,35 @@ public:
         if (video_stream_idx_ < 0) eof_ |= 0x01;
         if (audio_stream_idx_ < 0) eof_ |= 0x02;
 
-        while(running_ && !(eof_ & 0b0100)) {
-            if (video_frame_buffer_.full() || audio_frame_buffer_.full()) {
-                av_usleep(20000);
-                continue;
-            }
+        while (running_ && (eof_ & 0b0011) != 0b0011) {
+            const auto seq = ready_->seq();
 
-            av_packet_unref(packet_);
-            int ret = av_read_frame(fmt_ctx_, packet_);
-            if (ret < 0) {
-                if ((ret == AVERROR_EOF || avio_feof(fmt_ctx_->pb)) && !(eof_ & 0b0100)) {
-                    LOG(INFO) << "[DECODER THREAD] PUT NULL PACKET TO FLUSH DECODERS";
-                    av_packet_unref(packet_);
-                    eof_ |= 0b0100;
-                }
-                else {
-                    LOG(ERROR) << "[DECODER THREAD] read frame failed";
-                    break;
-                }
-            }
+            // not short-circuited, both streams are decoded
+            bool progress = decode(AVMEDIA_TYPE_VIDEO, video_frame_buffer_) |
+                            decode(AVMEDIA_TYPE_AUDIO, audio_frame_buffer_);
 
-            // video packet
-            if (packet_->stream_index == video_stream_idx_ || (eof_ & 0b0100)) {
-                ret = avcodec_send_packet(video_decode_ctx_, packet_);
-                while (ret >= 0) {
-                    av_frame_unref(video_frame_);
-                    ret = avcodec_receive_frame(video_decode_ctx_, video_frame_);
-                    if (ret == AVERROR(EAGAIN)) {
-                        break;
-                    }
-                    else if (ret == AVERROR_EOF) { // fully flushed, exit
-                        LOG(INFO) << "[DECODER THREAD @ " << std::this_thread::get_id() << "] VIDEO EOF";
-                        eof_ |= 0x01;
-                        break;
-                    }
-                    else if (ret < 0) { // error, exit
-                        LOG(ERROR) << "[DECODER THREAD @ " << std::this_thread::get_id() << "] legitimate decoding errors";
-                        running_ = false;
-                        break;
-                    }
-
-                    LOG(INFO) << "[DECODER THREAD @ " << std::this_thread::get_id() << "] pts = " << video_frame_->pts
-                              << ", frame = " << video_decode_ctx_->frame_number;
-
-                    while (video_frame_buffer_.full() && running_) {
-                        av_usleep(20000);
-                    }
-                    video_frame_buffer_.push([this](AVFrame *frame) {
-                        av_frame_unref(frame);
-                        av_frame_move_ref(frame, video_frame_);
-                    });
-                }
+            // the queues are bounded, the read-ahead stops if a stream is not popped for too long
+            if (running_ && !(eof_ & 0b0100) && starving() && video_pending_.packets.size() < MAX_PENDING &&
+                audio_pending_.packets.size() < MAX_PENDING) {
+                read();
+                progress = true;
             }
 
-            // audio packet
-            if(packet_->stream_index == audio_stream_idx_ || (eof_ & 0b0100)) {
-                // TODO:
-            }
+            // until a frame is popped
+            if (!progress && running_) ready_->wait(seq, std::chrono::milliseconds(20));
         }
 
-        if (video_stream_idx_ >= 0) video_frame_buffer_.push([](AVFrame *nil) { av_frame_unref(nil); });
-        if (audio_stream_idx_ >= 0) audio_frame_buffer_.push([](AVFrame *nil) { av_frame_unref(nil); });
+        for (auto pending : { &video_pending_, &audio_pending_ }) {
+            for (auto& packet : pending->packets) av_packet_free(&packet);
+            pending->packets.clear();
+        }
+
+        if (video_stream_idx_ >= 0) push_nil(video_frame_buffer_);
+        if (audio_stream_idx_ >= 0) push_nil(audio_frame_buffer_);
 
         running_ = false;
         eof_ = 0b0111;
+        ready_->notify();
     }
 
     std::string filter_args()
@@ -163,8 +154,202 @@ public:
         );
     }
 
+    // the frames are retimed before the filters, e.g. one frame every 1 / frame_rate of the mosaic
+    std::string filter_args(AVRational time_base, AVRational frame_rate)
+    {
+        const auto sar = video_decode_ctx_->sample_aspect_ratio;
+        return fmt::format("video_size={}x{}:pix_fmt={}:time_base={}/{}:frame_rate={}/{}:"
+                           "pixel_aspect={}/{}",
+                           video_decode_ctx_->width, video_decode_ctx_->height, video_decode_ctx_->pix_fmt,
+                           time_base.num, time_base.den, frame_rate.num, frame_rate.den, sar.num, sar.den);
+    }
+
+    AVRational time_base() const { return fmt_ctx_->streams[video_stream_idx_]->time_base; }
+
     bool eof() const { return eof_ == 0b0111; }
 
+    bool has_audio() const { return audio_stream_idx_ >= 0; }
+
+    std::string audio_filter_args() const
+    {
+        auto audio_stream = fmt_ctx_->streams[audio_stream_idx_];
+        return fmt::format("time_base={}/{}:sample_rate={}:sample_fmt={}:channel_layout={}",
+                           audio_stream->time_base.num, audio_stream->time_base.den,
+                           audio_decode_ctx_->sample_rate,
+                           av_get_sample_fmt_name(audio_decode_ctx_->sample_fmt),
+                           channel_layout_str(audio_decode_ctx_));
+    }
+
+    int sample_rate() const { return audio_decode_ctx_ ? audio_decode_ctx_->sample_rate : 0; }
+
+    bool empty(AVMediaType type) const
+    {
+        return type == AVMEDIA_TYPE_AUDIO ? audio_frame_buffer_.empty() : video_frame_buffer_.empty();
+    }
+
+    // the frame moved to 'frame', false: EOF of the stream
+    bool pop(AVMediaType type, AVFrame *frame)
+    {
+        const auto move = [frame](AVFrame *popped) {
+            av_frame_unref(frame);
+            av_frame_move_ref(frame, popped);
+        };
+
+        if (type == AVMEDIA_TYPE_AUDIO) {
+            audio_frame_buffer_.pop(move);
+            return frame->nb_samples > 0;
+        }
+
+        video_frame_buffer_.pop(move);
+        return frame->width || frame->height;
+    }
+
+    static std::string channel_layout_str(const AVCodecContext *ctx)
+    {
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57, 28, 100)
+        char buffer[64]{};
+        av_channel_layout_describe(&ctx->ch_layout, buffer, sizeof(buffer));
+        return buffer;
+#else
+        const uint64_t layout =
+            ctx->channel_layout ? ctx->channel_layout : av_get_default_channel_layout(ctx->channels);
+        return fmt::format("0x{:x}", layout);
+#endif
+    }
+
+    // notified when a frame is pushed by the decoder, and by the consumer when a frame is popped,
+    // shared by all the decoders of the same consumer, must be set before decode_thread()
+    void set_notifier(std::shared_ptr<Notifier> ready) { ready_ = std::move(ready); }
+
+    // the packets read but not sent to the decoder yet, nullptr: flush,
+    // receiving: the decoder may have more frames of the packets sent
+    struct Pending
+    {
+        std::deque<AVPacket *> packets{};
+        bool receiving{ false };
+    };
+
+    // packets of a stream read ahead while its ring is full
+    static constexpr size_t MAX_PENDING = 512;
+
+    // a stream not at EOF with room in its ring, and nothing to decode
+    bool starving() const
+    {
+        return (!(eof_ & 0x01) && !video_frame_buffer_.full() && video_pending_.packets.empty() &&
+                !video_pending_.receiving) ||
+               (!(eof_ & 0x02) && !audio_frame_buffer_.full() && audio_pending_.packets.empty() &&
+                !audio_pending_.receiving);
+    }
+
+    // one packet into the queue of its stream, the flush packets are queued at EOF
+    void read()
+    {
+        AVPacket *packet = av_packet_alloc();
+        if (!packet) {
+            running_ = false;
+            return;
+        }
+
+        const int ret = av_read_frame(fmt_ctx_, packet);
+        if (ret < 0) {
+            av_packet_free(&packet);
+            if (ret == AVERROR_EOF || avio_feof(fmt_ctx_->pb)) {
+                LOG(INFO) << "[DECODER THREAD] PUT NULL PACKET TO FLUSH DECODERS";
+                eof_ |= 0b0100;
+                if (video_stream_idx_ >= 0) video_pending_.packets.push_back(nullptr);
+                if (audio_stream_idx_ >= 0) audio_pending_.packets.push_back(nullptr);
+            }
+            else {
+                LOG(ERROR) << "[DECODER THREAD] read frame failed";
+                running_ = false;
+            }
+            return;
+        }
+
+        if (packet->stream_index == video_stream_idx_)
+            video_pending_.packets.push_back(packet);
+        else if (audio_stream_idx_ >= 0 && packet->stream_index == audio_stream_idx_)
+            audio_pending_.packets.push_back(packet);
+        else
+            av_packet_free(&packet);
+    }
+
+    // decodes the queued packets of the stream until its ring is full, false: nothing done
+    template<typename Ring> bool decode(AVMediaType type, Ring& ring)
+    {
+        const bool video    = (type == AVMEDIA_TYPE_VIDEO);
+        const uint8_t eof   = video ? 0x01 : 0x02;
+        AVCodecContext *ctx = video ? video_decode_ctx_ : audio_decode_ctx_;
+        AVFrame *decoded    = video ? video_frame_ : audio_frame_;
+        Pending& pending    = video ? video_pending_ : audio_pending_;
+
+        bool progress = false;
+        while (running_ && !(eof_ & eof) && !ring.full()) {
+            if (!pending.receiving) {
+                if (pending.packets.empty()) break;
+
+                AVPacket *packet = pending.packets.front();
+                pending.packets.pop_front();
+
+                // the invalid packets are skipped
+                const int ret = avcodec_send_packet(ctx, packet);
+                pending.receiving = (ret >= 0);
+                if (ret < 0 && !packet) eof_ |= eof;
+                av_packet_free(&packet);
+
+                progress = true;
+                continue;
+            }
+
+            av_frame_unref(decoded);
+            const int ret = avcodec_receive_frame(ctx, decoded);
+            if (ret == AVERROR(EAGAIN)) {
+                pending.receiving = false;
+                continue;
+            }
+            else if (ret == AVERROR_EOF) { // fully flushed
+                LOG(INFO) << "[DECODER THREAD @ " << std::this_thread::get_id() << "] "
+                          << (video ? "VIDEO" : "AUDIO") << " EOF";
+                pending.receiving = false;
+                eof_ |= eof;
+                break;
+            }
+            else if (ret < 0) { // error, exit
+                LOG(ERROR) << "[DECODER THREAD @ " << std::this_thread::get_id() << "] "
+                           << (video ? "video" : "audio") << " decoding error";
+                running_ = false;
+                break;
+            }
+
+            if (video) {
+                LOG(INFO) << "[DECODER THREAD @ " << std::this_thread::get_id() << "] pts = "
+                          << decoded->pts << ", frame = " << ctx->frame_number;
+            }
+            else {
+                decoded->pts = decoded->best_effort_timestamp;
+            }
+
+            ring.push([decoded](AVFrame *frame) {
+                av_frame_unref(frame);
+                av_frame_move_ref(frame, decoded);
+            });
+            ready_->notify();
+            progress = true;
+        }
+        return progress;
+    }
+
+    // the EOF of the stream, after the frames queued are popped, unless stopped or failed
+    template<typename Ring> void push_nil(Ring& ring)
+    {
+        auto seq = ready_->seq();
+        while (ring.full() && running_) {
+            ready_->wait(seq, std::chrono::milliseconds(20));
+            seq = ready_->seq();
+        }
+        ring.push([](AVFrame *nil) { av_frame_unref(nil); });
+    }
+
 //private:
     std::atomic<bool> running_{false};
     std::atomic<uint8_t> eof_{ 0x00 };
@@ -176,7 +361,10 @@ public:
     AVCodecContext * video_decode_ctx_{nullptr};
     AVCodecContext * audio_decode_ctx_{nullptr};
 
-    AVPacket *packet_{nullptr};
+    std::shared_ptr<Notifier> ready_{ std::make_shared<Notifier>() };
+
+    Pending video_pending_{};
+    Pending audio_pending_{};
     AVFrame * video_frame_{nullptr};
     AVFrame * audio_frame_{nullptr};
 
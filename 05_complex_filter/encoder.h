@@ -5,41 +5,58 @@
 #include <string>
 #include <thread>
 #include <atomic>
+#include <cstdlib>
 
 extern "C" {
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
+#include <libavutil/channel_layout.h>
 #include <libavutil/opt.h>
 #include <libavutil/time.h>
 }
 
+#include "boundedqueue.h"
 #include "defer.h"
 #include "logging.h"
 #include "ringvector.h"
 #include "fmt/format.h"
 
-
+// The video frames are encoded on a worker thread, and the packets of all the streams are written by
+// another one, so a slow encoder (e.g. a stall of libx265 on its lookahead) never blocks the filtering,
+// and through the full ring buffers, the decoders, unless its frame queue is full.
+//
+//  filter thread --encode_frame()--> [frames] --> encode thread --> [packets] --> mux thread
+//  audio thread  --encode_audio_frame()---------------------------> [packets] --^
 class Encoder {
 public:
-    Encoder()
+    // queue_size: max video frames waiting for the encoder
+    explicit Encoder(size_t queue_size = 8)
+        : frames_(queue_size, [](AVFrame **frame) { av_frame_free(frame); }),
+          packets_(queue_size * 4, [](AVPacket **packet) { av_packet_free(packet); })
     {
         packet_ = av_packet_alloc();
+        audio_packet_ = av_packet_alloc();
     }
     ~Encoder()
     {
-        av_write_trailer(fmt_ctx_);
+        wait();
+
+        if (fmt_ctx_) av_write_trailer(fmt_ctx_);
 
-        avformat_free_context(fmt_ctx_);
         if (fmt_ctx_ && !(fmt_ctx_->oformat->flags & AVFMT_NOFILE))
             avio_closep(&fmt_ctx_->pb);
+        avformat_free_context(fmt_ctx_);
 
         avcodec_free_context(&video_encode_ctx_);
         avcodec_free_context(&audio_encode_ctx_);
 
         av_packet_free(&packet_);
+        av_packet_free(&audio_packet_);
     }
 
-    int open(const std::string& filename, int w, int h, AVPixelFormat format, AVRational sar, AVRational framerate, AVRational time_base)
+    // sample_rate: of the audio stream encoded by the 'aac' in stereo, 0: no audio
+    int open(const std::string& filename, int w, int h, AVPixelFormat format, AVRational sar, AVRational framerate, AVRational time_base,
+             int sample_rate = 0)
     {
         CHECK(avformat_alloc_output_context2(&fmt_ctx_, nullptr, nullptr, filename.c_str()) >= 0);
 
@@ -74,6 +91,8 @@ public:
         CHECK(avcodec_open2(video_encode_ctx_, video_encoder, &encoder_options) >= 0);
         CHECK(avcodec_parameters_from_context(fmt_ctx_->streams[video_stream_idx_]->codecpar, video_encode_ctx_) >= 0);
 
+        if (sample_rate > 0) CHECK(open_audio(sample_rate) >= 0);
+
         if(!(fmt_ctx_->oformat->flags & AVFMT_NOFILE)) {
             CHECK(avio_open(&fmt_ctx_->pb, filename.c_str(), AVIO_FLAG_WRITE) >= 0);
         }
@@ -81,17 +100,135 @@ public:
         CHECK(avformat_write_header(fmt_ctx_, nullptr) >= 0);
 
         av_dump_format(fmt_ctx_, 0, filename.c_str(), 1);
+
+        streams_       = audio_encode_ctx_ ? 2 : 1;
+        encode_thread_ = std::thread([this]() { encode_thread(); });
+        mux_thread_    = std::thread([this]() { mux_thread(); });
+        return 0;
+    }
+
+    // the references of the frame are moved into the queue, the frame is unreferenced, and blocks while the
+    // queue is full, nullptr or an empty frame: EOF, the encoder is flushed,
+    // < 0: the encoder is failed or flushed, the frame is not taken
+    int encode_frame(AVFrame *frame)
+    {
+        AVFrame *queued = nullptr;
+        if (frame && (frame->width || frame->height)) {
+            if (queued = av_frame_alloc(); !queued) return AVERROR(ENOMEM);
+            av_frame_move_ref(queued, frame);
+        }
+
+        if (!frames_.push(queued)) {
+            if (queued) av_frame_move_ref(frame, queued);
+            av_frame_free(&queued);
+            return AVERROR_EXIT;
+        }
         return 0;
     }
 
-    int encode_frame(AVFrame * frame)
+    // the encoder is flushed, and all the packets are written
+    void wait()
+    {
+        // the queued frames are still encoded after close()
+        frames_.close();
+        if (encode_thread_.joinable()) encode_thread_.join();
+
+        packets_.close();
+        if (mux_thread_.joinable()) mux_thread_.join();
+    }
+
+    bool failed() const { return failed_; }
+
+    std::string str() const
+    {
+        return fmt::format("[ENCODER] frames: {}, packets: {}, encoding: {:.3f}s, muxing: {:.3f}s",
+                           frames_encoded_, packets_written_, encoding_ / 1000000.0, muxing_ / 1000000.0);
+    }
+
+private:
+    void encode_thread()
+    {
+        LOG(INFO) << "[ENCODE THREAD @ " << std::this_thread::get_id() << "] START";
+
+        while (auto frame = frames_.pop()) {
+            AVFrame *queued = frame.value();
+            const bool eof  = !queued;
+
+            const int64_t start = av_gettime_relative();
+            const int ret       = encode(queued);
+            encoding_ += av_gettime_relative() - start;
+            av_frame_free(&queued);
+
+            if (eof) break;
+            if (ret < 0 && ret != AVERROR(EAGAIN)) {
+                failed_ = true;
+                break;
+            }
+            frames_encoded_++;
+        }
+
+        // the producer is not blocked by a full queue any more
+        frames_.close();
+        frames_.clear();
+        finish_stream();
+
+        LOG(INFO) << "[ENCODE THREAD @ " << std::this_thread::get_id() << "] EXITED";
+    }
+
+    void mux_thread()
     {
-        frame->pict_type = AV_PICTURE_TYPE_NONE;
+        LOG(INFO) << "[MUX THREAD @ " << std::this_thread::get_id() << "] START";
+
+        while (auto packet = packets_.pop()) {
+            AVPacket *queued = packet.value();
+
+            const int64_t start = av_gettime_relative();
+            const int ret       = av_interleaved_write_frame(fmt_ctx_, queued);
+            muxing_ += av_gettime_relative() - start;
+            av_packet_free(&queued);
+
+            if (ret != 0) {
+                LOG(ERROR) << "av_interleaved_write_frame()";
+                failed_ = true;
+                packets_.close();
+                frames_.close();
+                break;
+            }
+            packets_written_++;
+        }
+
+        LOG(INFO) << "[MUX THREAD @ " << std::this_thread::get_id() << "] EXITED";
+    }
+
+    // the video and the audio streams, the mux thread exits after both of them are flushed
+    void finish_stream()
+    {
+        if (--streams_ == 0) packets_.close();
+    }
+
+    // the packet is moved to the mux thread
+    int write(AVPacket *packet)
+    {
+        AVPacket *queued = av_packet_alloc();
+        if (!queued) return AVERROR(ENOMEM);
+
+        av_packet_move_ref(queued, packet);
+        if (!packets_.push(queued)) {
+            av_packet_free(&queued);
+            return AVERROR_EXIT;
+        }
+        return 0;
+    }
 
-        if((!frame->width && !frame->height))
+    // nullptr: flush
+    int encode(AVFrame *frame)
+    {
+        if (frame) frame->pict_type = AV_PICTURE_TYPE_NONE;
+
+        if(!frame)
             LOG(INFO) << "[ENCODER] NULL";
 
-        int ret = avcodec_send_frame(video_encode_ctx_, (!frame->width && !frame->height) ? nullptr : frame);
+        int ret = avcodec_send_frame(video_encode_ctx_, frame);
         while(ret >= 0) {
             av_packet_unref(packet_);
             ret = avcodec_receive_packet(video_encode_ctx_, packet_);
@@ -112,14 +249,124 @@ public:
             LOG(INFO) << fmt::format("[ENCODER] pts = {}, frame = {}", packet_->pts, video_encode_ctx_->frame_number);
             av_packet_rescale_ts(packet_, video_encode_ctx_->time_base, fmt_ctx_->streams[video_stream_idx_]->time_base);
 
-            if (av_interleaved_write_frame(fmt_ctx_, packet_) != 0) {
-                LOG(ERROR) << "av_interleaved_write_frame()";
+            if (write(packet_) != 0) {
+                LOG(ERROR) << "[ENCODER] the mux thread is stopped";
                 return -1;
             }
         }
 
         return ret;
     }
+
+public:
+
+    // the pts in 1 / sample_rate, nullptr or no samples: flush the audio encoder, called once,
+    // called on the audio thread, the packets are muxed with the video ones on the mux thread
+    int encode_audio_frame(AVFrame *frame)
+    {
+        const bool flush = !frame || !frame->nb_samples;
+        LOG_IF(INFO, flush) << "[AUDIO ENCODER] NULL";
+        defer(if (flush) finish_stream());
+
+        int ret = avcodec_send_frame(audio_encode_ctx_, flush ? nullptr : frame);
+        while (ret >= 0) {
+            av_packet_unref(audio_packet_);
+            ret = avcodec_receive_packet(audio_encode_ctx_, audio_packet_);
+            if (ret == AVERROR(EAGAIN)) {
+                break;
+            }
+            else if (ret == AVERROR_EOF) {
+                LOG(INFO) << "[AUDIO ENCODER] EOF";
+                break;
+            }
+            else if (ret < 0) {
+                LOG(ERROR) << "[AUDIO ENCODER] avcodec_receive_packet()";
+                return -1;
+            }
+
+            audio_packet_->stream_index = audio_stream_idx_;
+            av_packet_rescale_ts(audio_packet_, audio_encode_ctx_->time_base,
+                                 fmt_ctx_->streams[audio_stream_idx_]->time_base);
+
+            if (write(audio_packet_) != 0) {
+                LOG(ERROR) << "[AUDIO ENCODER] the mux thread is stopped";
+                return -1;
+            }
+        }
+
+        return ret;
+    }
+
+    bool has_audio() const { return audio_encode_ctx_ != nullptr; }
+
+    // the samples accepted by the audio encoder, for the 'aformat' at the end of the audio filters
+    std::string aformat() const
+    {
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57, 28, 100)
+        char layout[64]{};
+        av_channel_layout_describe(&audio_encode_ctx_->ch_layout, layout, sizeof(layout));
+#else
+        const auto layout = fmt::format("0x{:x}", audio_encode_ctx_->channel_layout);
+#endif
+        return fmt::format("aformat=sample_fmts={}:sample_rates={}:channel_layouts={}",
+                           av_get_sample_fmt_name(audio_encode_ctx_->sample_fmt),
+                           audio_encode_ctx_->sample_rate, layout);
+    }
+
+    // 0: any size
+    int audio_frame_size() const
+    {
+        if (audio_encode_ctx_->codec->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE) return 0;
+        return audio_encode_ctx_->frame_size;
+    }
+
+    AVRational audio_time_base() const { return audio_encode_ctx_->time_base; }
+
+private:
+    int open_audio(int sample_rate)
+    {
+        auto audio_encoder = avcodec_find_encoder_by_name("aac");
+        if (!audio_encoder) return -1;
+
+        audio_encode_ctx_ = avcodec_alloc_context3(audio_encoder);
+        if (!audio_encode_ctx_) return -1;
+
+        // the supported sample rate closest to the input one
+        if (audio_encoder->supported_samplerates) {
+            int selected = audio_encoder->supported_samplerates[0];
+            for (auto ptr = audio_encoder->supported_samplerates; *ptr; ptr++) {
+                if (std::abs(*ptr - sample_rate) < std::abs(selected - sample_rate)) selected = *ptr;
+            }
+            sample_rate = selected;
+        }
+
+        audio_encode_ctx_->sample_rate = sample_rate;
+        audio_encode_ctx_->sample_fmt  = audio_encoder->sample_fmts ? audio_encoder->sample_fmts[0]
+                                                                    : AV_SAMPLE_FMT_FLTP;
+        audio_encode_ctx_->bit_rate    = 128000;
+        audio_encode_ctx_->time_base   = { 1, sample_rate };
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57, 28, 100)
+        av_channel_layout_default(&audio_encode_ctx_->ch_layout, 2);
+#else
+        audio_encode_ctx_->channels       = 2;
+        audio_encode_ctx_->channel_layout = AV_CH_LAYOUT_STEREO;
+#endif
+
+        if (fmt_ctx_->oformat->flags & AVFMT_GLOBALHEADER) {
+            audio_encode_ctx_->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+        }
+
+        if (avcodec_open2(audio_encode_ctx_, audio_encoder, nullptr) < 0) return -1;
+
+        auto stream = avformat_new_stream(fmt_ctx_, nullptr);
+        if (!stream) return -1;
+
+        audio_stream_idx_ = stream->index;
+        stream->time_base = audio_encode_ctx_->time_base;
+        return avcodec_parameters_from_context(stream->codecpar, audio_encode_ctx_);
+    }
+
+public:
 //private:
     AVFormatContext * fmt_ctx_{nullptr};
     AVCodecContext * video_encode_ctx_{nullptr};
@@ -129,6 +376,19 @@ public:
     int audio_stream_idx_{ -1 };
 
     AVPacket * packet_{nullptr};
+    AVPacket * audio_packet_{nullptr};
+
+    BoundedQueue<AVFrame *> frames_;   // nullptr: EOF
+    BoundedQueue<AVPacket *> packets_; // of all the streams
+    std::thread encode_thread_{};
+    std::thread mux_thread_{};
+    std::atomic<int> streams_{ 0 };    // not flushed yet
+
+    std::atomic<bool> failed_{ false };
+    std::atomic<int64_t> frames_encoded_{ 0 };
+    std::atomic<int64_t> packets_written_{ 0 };
+    std::atomic<int64_t> encoding_{ 0 }; // us
+    std::atomic<int64_t> muxing_{ 0 };   // us
 };
 
 #endif //!_05_ENCODER_H
\ No newline at end of file
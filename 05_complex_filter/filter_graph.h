@@ -5,6 +5,7 @@
 #include <string>
 #include <thread>
 #include <atomic>
+#include <memory>
 
 extern "C" {
 #include <libavformat/avformat.h>
@@ -17,33 +18,28 @@ extern "C" {
 }
 
 #include "defer.h"
+#include "livefilter.h"
 #include "logging.h"
 #include "ringvector.h"
 #include "fmt/format.h"
 
+// The filter graphs of all the inputs, reconfigurable while the frames are flowing, see LiveFilterGraph.
+//
+// The video and the audio have a graph and a sink each, e.g. the overlay of the videos and the amix of the
+// audios, so they are filtered on their own threads, the audio is not serialized with the video filters.
 class ComplexFilter {
 public:
-    ComplexFilter()
-    {
-        filter_graph_ = avfilter_graph_alloc();
-    }
-
-    ~ComplexFilter()
-    {
-        avfilter_graph_free(&filter_graph_);
-    }
+    // threads: slice threads of the filters, 0: auto, 1: no threading,
+    // cache: the graphs are taken from, nullptr: built on every create() / reconfigure()
+    explicit ComplexFilter(int threads = 0, std::shared_ptr<FilterGraphCache> cache = nullptr)
+        : threads_(threads), cache_(std::move(cache))
+    {}
 
     int create_buffersrc(const std::string& args)
     {
         LOG(INFO) << "create buffersrc for: " << args;
 
-        const AVFilter *buffersrc = avfilter_get_by_name("buffer");
-        CHECK_NOTNULL(buffersrc);
-
-        AVFilterContext * filter_ctx = nullptr;
-        CHECK(avfilter_graph_create_filter(&filter_ctx, buffersrc, "in", args.c_str(), nullptr, filter_graph_) >= 0);
-
-        buffersrc_ctxs_.push_back(filter_ctx);
+        args_.push_back(args);
         return 0;
     }
 
@@ -51,52 +47,85 @@ public:
     {
         LOG(INFO) << "create filter for: " << descr;
 
-        const AVFilter *buffersink = avfilter_get_by_name("buffersink");
-        CHECK_NOTNULL(buffersink);
+        graph_ = std::make_unique<LiveFilterGraph>(AVMEDIA_TYPE_VIDEO, args_,
+                                                   std::vector{ AV_PIX_FMT_YUV420P }, threads_, cache_);
+        CHECK(graph_->create(descr) >= 0);
 
-        enum AVPixelFormat pix_fmts[] = { AV_PIX_FMT_YUV420P, AV_PIX_FMT_NONE };
-        CHECK(avfilter_graph_create_filter(&buffersink_ctx_, buffersink, "sink", nullptr, nullptr, filter_graph_) >= 0);
-        CHECK(av_opt_set_int_list(buffersink_ctx_, "pix_fmts", pix_fmts, AV_PIX_FMT_NONE, AV_OPT_SEARCH_CHILDREN) >= 0);
-
-        AVFilterInOut* inputs = nullptr;
-        AVFilterInOut* outputs = nullptr;
-        CHECK(avfilter_graph_parse2(filter_graph_, descr.c_str(), &inputs, &outputs) >= 0);
-
-        int i = 0;
-        for (auto ptr = inputs; ptr; ptr = ptr->next, i++) {
-            CHECK(avfilter_link(buffersrc_ctxs_[i], 0, ptr->filter_ctx, ptr->pad_idx) >= 0);
-        }
+        return 0;
+    }
 
-        for (auto ptr = outputs; ptr; ptr = ptr->next) {
-            CHECK(avfilter_link(ptr->filter_ctx, ptr->pad_idx, buffersink_ctx_, 0) >= 0);
-        }
+    // the i-th audio input is the i-th input with audio, "[i]" / "[i:a]" in the audio description
+    int create_abuffersrc(const std::string& args)
+    {
+        LOG(INFO) << "create abuffersrc for: " << args;
 
-        CHECK(avfilter_graph_config(filter_graph_, nullptr) >= 0);
+        aargs_.push_back(args);
+        return 0;
+    }
 
-        char * graph = avfilter_graph_dump(filter_graph_, nullptr);
-        CHECK_NOTNULL(graph);
+    // e.g. "amix=inputs=2:duration=longest", "amerge=inputs=2", empty: the first audio input,
+    // aformat: the format of the encoder, appended to the description,
+    // frame_size: samples of every frame, e.g. of the encoder, 0: any
+    int create_audio(const std::string& descr, const std::string& aformat, int frame_size)
+    {
+        if (aargs_.empty()) return 0;
 
-        LOG(INFO) << "graph >>>> \n%s\n" << graph;
+        const auto full = descr.empty() ? aformat : descr + "," + aformat;
+        LOG(INFO) << "create audio filter for: " << full;
 
-        avfilter_inout_free(&inputs);
-        avfilter_inout_free(&outputs);
+        // the audio filters are cheap, no slice threads
+        audio_ = std::make_unique<LiveFilterGraph>(AVMEDIA_TYPE_AUDIO, aargs_,
+                                                   std::vector<AVPixelFormat>{}, 1, cache_);
+        CHECK(audio_->create(full) >= 0);
+        audio_->set_frame_size(frame_size);
 
         return 0;
     }
 
-    AVRational time_base() const { return av_buffersink_get_time_base(buffersink_ctx_); }
-    AVRational sample_aspect_ratio() const { return av_buffersink_get_sample_aspect_ratio(buffersink_ctx_); }
-    int height() const { return av_buffersink_get_h(buffersink_ctx_); }
-    int width() const { return av_buffersink_get_w(buffersink_ctx_); }
-    AVRational framerate() const { return av_buffersink_get_frame_rate(buffersink_ctx_); }
-    AVPixelFormat format() const { return (AVPixelFormat)av_buffersink_get_format(buffersink_ctx_); }
+    // a parameter of a running filter, applied before the next frame
+    void send_command(const std::string& target, const std::string& cmd, const std::string& arg)
+    {
+        graph_->send_command(target, cmd, arg);
+    }
+
+    // a new topology, built in the background and swapped in at a frame boundary, the output size and
+    // format must not change, the encoder is not reopened
+    void reconfigure(const std::string& descr) { graph_->reconfigure(descr); }
+
+    // the frame of the i-th input, nullptr: EOF
+    int add_frame(size_t i, AVFrame *frame) { return graph_->add_frame(i, frame); }
+    int get_frame(AVFrame *frame) { return graph_->get_frame(frame); }
+
+    // > 0: the graph is waiting for a frame of the i-th input
+    unsigned nb_failed_requests(size_t i) const { return graph_->nb_failed_requests(i); }
+
+    // the audio graph, called on the audio thread only
+    bool has_audio() const { return audio_ != nullptr; }
+    int add_audio_frame(size_t i, AVFrame *frame) { return audio_->add_frame(i, frame); }
+    int get_audio_frame(AVFrame *frame) { return audio_->get_frame(frame); }
+    unsigned audio_nb_failed_requests(size_t i) const { return audio_->nb_failed_requests(i); }
+    AVRational audio_time_base() const { return av_buffersink_get_time_base(audio_->buffersink()); }
+
+    AVRational time_base() const { return av_buffersink_get_time_base(graph_->buffersink()); }
+    AVRational sample_aspect_ratio() const
+    {
+        return av_buffersink_get_sample_aspect_ratio(graph_->buffersink());
+    }
+    int height() const { return av_buffersink_get_h(graph_->buffersink()); }
+    int width() const { return av_buffersink_get_w(graph_->buffersink()); }
+    AVRational framerate() const { return av_buffersink_get_frame_rate(graph_->buffersink()); }
+    AVPixelFormat format() const { return (AVPixelFormat)av_buffersink_get_format(graph_->buffersink()); }
 
     //private:
     std::atomic<bool> running_{false};
 
-    AVFilterGraph * filter_graph_{nullptr};
-    std::vector<AVFilterContext*> buffersrc_ctxs_{};
-    AVFilterContext* buffersink_ctx_{ nullptr };
+    int threads_{ 0 };
+    std::shared_ptr<FilterGraphCache> cache_{};
+    std::vector<std::string> args_{};
+    std::unique_ptr<LiveFilterGraph> graph_{};
+
+    std::vector<std::string> aargs_{};
+    std::unique_ptr<LiveFilterGraph> audio_{};
 };
 
 #endif //!_05_FILTER_GRAPH_H
\ No newline at end of file
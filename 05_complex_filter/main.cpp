@@ -1,108 +1,332 @@
+extern "C" {
+#include <libavutil/parseutils.h>
+}
+
+#include "argsparser.h"
 #include "encoder.h"
 #include "decoder.h"
 #include "filter_graph.h"
+#include "filterstage.h"
+#include "mosaic.h"
+#include "scheduler.h"
+
+#include <algorithm>
+#include <memory>
 
 int main(int argc, char* argv[])
 {
-    if (argc < 4) {
-        LOG(ERROR) << "complex_filter -i <input-watermark> -i <input-video> <output>";
+    Logger::init(argv[0]);
+
+    args::parser parser("complex_filter -i <input-watermark> -i <input-video> -o <output> [--stage]");
+    parser.add("-i", std::vector<std::string>{}, "the input files, the watermark first");
+    parser.add("-o", "", "the output file");
+    parser.add("--threads", 0, "slice threads of the filter graph, 0: auto, 1: no threading");
+    parser.add("--stage", false, "run the filter graph on its own thread, and encode on another one");
+    parser.add("--queue", 8, "max frames queued before and after the filter thread of --stage");
+    parser.add("--toggle", 0.0, "toggle the watermark every N seconds without restarting, 0: disabled");
+    parser.add("--cache", 0, "graphs built in advance for every description, 0: no cache");
+    parser.add("--af", "", "the audio filters of the inputs with audio, default: amix of all of them");
+    parser.add("--an", false, "no audio");
+    parser.add("--encqueue", 8, "max frames queued before the encoder thread");
+    parser.add("--mosaic", false, "tile all the inputs in a grid instead of the watermark, no audio");
+    parser.add("--cell", "320x180", "the size of a tile of --mosaic");
+    parser.add("--fps", 25, "the frame rate of --mosaic");
+    parser.add("--latency", 200, "ms --mosaic waits for the slow inputs before repeating their frames");
+    parser.parse(argc, argv);
+
+    const auto input_files = parser.get<std::vector<std::string>>("i", {});
+    const auto output_file = parser.get<std::string>("o", "");
+    const bool mosaic_mode = parser.get<bool>("mosaic", false);
+    if (input_files.size() < (mosaic_mode ? 1 : 2) || output_file.empty()) {
+        LOG(ERROR) << parser.help();
         return -1;
     }
 
-    std::vector<std::string> input_files;
-    std::string output_file;
-
     std::vector<std::shared_ptr<Decoder>> decoders;
+    auto ready = std::make_shared<Notifier>(); // frames pushed / popped by any of the decoders
     std::vector<std::thread> threads;
-    ComplexFilter filter;
-    Encoder encoder;
+    std::shared_ptr<FilterGraphCache> cache{};
+    if (const auto spares = parser.get<int64_t>("cache", 0); spares > 0) {
+        cache = std::make_shared<FilterGraphCache>(static_cast<size_t>(spares));
+    }
+    ComplexFilter filter(static_cast<int>(parser.get<int64_t>("threads", 0)), cache);
+    Encoder encoder(static_cast<size_t>(parser.get<int64_t>("encqueue", 8)));
 
-    for (int i = 1; i < argc; i++){
-        if (std::strcmp("-i", argv[i]) == 0 && i + 1 < argc && argv[i+1][0] != '-') {
-            input_files.emplace_back(argv[i+1]);
-            i++;
-        }
-        else if (output_file.empty()){
-            output_file = argv[i];
-        }
-        else {
-            LOG(ERROR) << "complex_filter -i <input-1> -i <input-2> <output>";
-            return -1;
-        }
+    // the audio is decoded only if the output can store it
+    const auto oformat = av_guess_format(nullptr, output_file.c_str(), nullptr);
+    const bool audio   = !parser.get<bool>("an", false) && !mosaic_mode && oformat &&
+                       oformat->audio_codec != AV_CODEC_ID_NONE;
+    std::vector<std::shared_ptr<Decoder>> audio_decoders; // the inputs of the audio graph
+
+    // --mosaic: the inputs are retimed to the frames of the grid, one frame of every input per output frame
+    const AVRational fps{ static_cast<int>(parser.get<int64_t>("fps", 25)), 1 };
+    int cell_w = 0, cell_h = 0;
+    if (mosaic_mode) {
+        CHECK(fps.num > 0);
+        const auto cell = parser.get<std::string>("cell", "320x180");
+        CHECK(av_parse_video_size(&cell_w, &cell_h, cell.c_str()) >= 0);
     }
 
     // open input files
     for(auto& input: input_files) {
         auto decoder = std::make_shared<Decoder>();
-        CHECK(decoder->open(input) >= 0);
+        CHECK(decoder->open(input, audio) >= 0);
+        decoder->set_notifier(ready);
         decoders.push_back(decoder);
 
-        filter.create_buffersrc(decoder->filter_args());
+        filter.create_buffersrc(mosaic_mode ? decoder->filter_args(av_inv_q(fps), fps)
+                                            : decoder->filter_args());
+
+        if (decoder->has_audio()) {
+            filter.create_abuffersrc(decoder->audio_filter_args());
+            audio_decoders.push_back(decoder);
+        }
     }
 
     // create filter graph
-    const std::string filter_complex = "[0:v] scale=128:-1:flags=lanczos [s];[1:v][s]overlay=10:10";
+    const std::string filter_complex =
+        mosaic_mode ? Mosaic::layout(decoders.size(), cell_w, cell_h)
+                    : "[0:v] scale=128:-1:flags=lanczos [s];[1:v][s]overlay=10:10";
     filter.create(filter_complex);
-    LOG(INFO) << fmt::format(R"( -- same as : ffmpeg -i {} -i {} -filter_complex "{}" {})", input_files[0], input_files[1], filter_complex, output_file);
+    if (!mosaic_mode) {
+        LOG(INFO) << fmt::format(R"( -- same as : ffmpeg -i {} -i {} -filter_complex "{}" {})", input_files[0], input_files[1], filter_complex, output_file);
+    }
 
     // open output file
-    encoder.open(output_file, filter.width(), filter.height(), filter.format(), filter.sample_aspect_ratio(), filter.framerate(), filter.time_base());
+    encoder.open(output_file, filter.width(), filter.height(), filter.format(), filter.sample_aspect_ratio(), filter.framerate(), filter.time_base(),
+                 audio_decoders.empty() ? 0 : audio_decoders[0]->sample_rate());
 
+    // the audio graph, converted to the format of the encoder
+    if (encoder.has_audio()) {
+        auto afilter = parser.get<std::string>("af", "");
+        if (afilter.empty() && audio_decoders.size() > 1) {
+            afilter = fmt::format("amix=inputs={}:duration=longest", audio_decoders.size());
+        }
+        filter.create_audio(afilter, encoder.aformat(), encoder.audio_frame_size());
+    }
+
+    // running before the threads start, a stop is never overwritten
     for (auto & decoder : decoders) {
-        threads.emplace_back(std::thread([&](){ decoder->running_ = true; decoder->decode_thread(); }));
+        decoder->running_ = true;
+        threads.emplace_back(std::thread([&](){ decoder->decode_thread(); }));
+    }
+
+    // the audio is filtered and encoded on its own thread, in parallel with the video
+    if (filter.has_audio()) {
+        threads.emplace_back([&]() {
+            LOG(INFO) << "[AUDIO THREAD @ " << std::this_thread::get_id() << "] START";
+
+            InputScheduler scheduler(AVMEDIA_TYPE_AUDIO, audio_decoders, ready);
+            const auto requests = [&](size_t i) { return filter.audio_nb_failed_requests(i); };
+
+            AVFrame *aframe   = av_frame_alloc();
+            AVFrame *filtered = av_frame_alloc();
+            defer(av_frame_free(&aframe); av_frame_free(&filtered));
+
+            // the graph is drained or failed, the rest of the audio is popped and dropped, so the decoders
+            // are never blocked by a full audio queue, e.g. amix=duration=shortest
+            bool ended = false;
+            while (!scheduler.done()) {
+                const auto seq = ready->seq();
+                const int i    = scheduler.next(ended ? InputScheduler::Requests{} : requests);
+                if (i < 0) {
+                    scheduler.wait(seq);
+                    continue;
+                }
+
+                const bool eof = !scheduler.pop(i, aframe);
+                if (ended) continue;
+
+                int ret = filter.add_audio_frame(i, eof ? nullptr : aframe);
+                while (ret >= 0) {
+                    av_frame_unref(filtered);
+                    ret = filter.get_audio_frame(filtered);
+                    if (ret < 0) break;
+
+                    const auto tb = filter.audio_time_base();
+                    filtered->pts = av_rescale_q(filtered->pts, tb, encoder.audio_time_base());
+                    if (encoder.encode_audio_frame(filtered) < 0) {
+                        ret = AVERROR(EINVAL);
+                        break;
+                    }
+                }
+
+                if (ret == AVERROR_EOF) {
+                    LOG(INFO) << "[AUDIO THREAD] EOF";
+                    ended = true;
+                }
+                else if (ret < 0 && ret != AVERROR(EAGAIN)) {
+                    LOG(ERROR) << "[AUDIO THREAD] filtering / encoding error: " << ret;
+                    ended = true;
+                }
+            }
+
+            // flush the audio encoder
+            encoder.encode_audio_frame(nullptr);
+
+            LOG(INFO) << scheduler.str();
+            LOG(INFO) << "[AUDIO THREAD @ " << std::this_thread::get_id() << "] EXITED";
+        });
+    }
+
+    // --stage: the graph runs on its own thread, the filtered frames go to the encoder from another one
+    std::unique_ptr<FilterStage> stage{};
+    if (parser.get<bool>("stage", false)) {
+        stage = std::make_unique<FilterStage>(
+            [&](size_t i, AVFrame *queued) { return filter.add_frame(i, queued); },
+            [&](AVFrame *filtered) { return filter.get_frame(filtered); },
+            static_cast<size_t>(parser.get<int64_t>("queue", 8)));
+        stage->start();
+
+        threads.emplace_back([&]() {
+            LOG(INFO) << "[STAGE OUTPUT THREAD @ " << std::this_thread::get_id() << "] START";
+            while (auto filtered = stage->pop()) {
+                const int ret = encoder.encode_frame(filtered.value());
+                av_frame_free(&filtered.value());
+                if (ret < 0) {
+                    stage->stop();
+                    break;
+                }
+            }
+
+            // flush the encoder
+            encoder.encode_frame(nullptr);
+            LOG(INFO) << "[STAGE OUTPUT THREAD @ " << std::this_thread::get_id() << "] EXITED";
+        });
+    }
+
+    filter.running_ = true;
+
+    // --toggle: the watermark is removed / added by swapping the graph, the watermark input is consumed by
+    // a nullsink while it is off, and replayed into the graph when it is on again
+    if (const auto toggle = parser.get<double>("toggle", 0.0); toggle > 0 && !mosaic_mode) {
+        threads.emplace_back([&, toggle]() {
+            bool marked = true;
+            int64_t next = av_gettime_relative() + static_cast<int64_t>(toggle * AV_TIME_BASE);
+            while (filter.running_) {
+                if (av_gettime_relative() < next) {
+                    av_usleep(10000);
+                    continue;
+                }
+
+                marked = !marked;
+                filter.reconfigure(marked ? filter_complex : "[1:v]null");
+                next += static_cast<int64_t>(toggle * AV_TIME_BASE);
+            }
+        });
     }
 
     LOG(INFO) << "[FILTER THREAD] START @ " << std::this_thread::get_id();
     AVFrame * frame = av_frame_alloc();
     AVFrame * filtered_frame = av_frame_alloc();
+    std::vector<bool> eofs(decoders.size(), false);
 
-    filter.running_ = true;
-    while(filter.running_) {
-        for(size_t i = 0; i < decoders.size(); i++) {
-            if (decoders[i]->video_frame_buffer_.empty()) {
-                if (!decoders[i]->eof())
-                    av_usleep(20000);
-                continue;
+    // the input the graph is waiting for is fed first, and the thread sleeps until a frame is decoded
+    InputScheduler scheduler(AVMEDIA_TYPE_VIDEO, decoders, ready);
+    const auto requests = [&](size_t i) { return filter.nb_failed_requests(i); };
+
+    // --mosaic: every input is fed once per output frame, the slow ones repeat their last frame
+    std::unique_ptr<Mosaic> mosaic{};
+    std::vector<AVFrame *> tiles{};
+    if (mosaic_mode) {
+        mosaic = std::make_unique<Mosaic>(decoders, ready, fps, parser.get<int64_t>("latency", 200) * 1000);
+    }
+
+    // the frame of the i-th input into the graph, nullptr: EOF of the input
+    const auto feed = [&](size_t i, AVFrame *input) {
+        // handed to the filter thread, stopped once all the inputs are EOF
+        if (stage) {
+            AVFrame *queued = input ? av_frame_clone(input) : nullptr;
+            if (!stage->push(i, queued)) {
+                av_frame_free(&queued);
+                filter.running_ = false;
+                return;
             }
 
-            decoders[i]->video_frame_buffer_.pop([&](AVFrame * popped) {
-                av_frame_unref(frame);
-                av_frame_move_ref(frame, popped);
-            });
+            if (!input) eofs[i] = true;
+            filter.running_ = !std::all_of(eofs.begin(), eofs.end(), [](bool e) { return e; });
+            return;
+        }
 
-            int ret = av_buffersrc_add_frame_flags(filter.buffersrc_ctxs_[i], (!frame->width && !frame->height) ? nullptr : frame, AV_BUFFERSRC_FLAG_PUSH);
-            while(ret >= 0) {
+        // the failed requests of the buffersrcs are updated by draining the graph
+        int ret = filter.add_frame(i, input);
+        while(ret >= 0) {
+            av_frame_unref(filtered_frame);
+            ret = filter.get_frame(filtered_frame);
+            if (ret == AVERROR(EAGAIN)) {
+                break;
+            }
+            else if (ret == AVERROR_EOF) {
+                LOG(INFO) << "[FILTER THREAD] EOF";
                 av_frame_unref(filtered_frame);
-                ret = av_buffersink_get_frame(filter.buffersink_ctx_, filtered_frame);
-                if (ret == AVERROR(EAGAIN)) {
-                    break;
-                }
-                else if (ret == AVERROR_EOF) {
-                    LOG(INFO) << "[FILTER THREAD] EOF";
-                    av_frame_unref(filtered_frame);
-                    filter.running_ = false;
-                }
-                else if (ret < 0) {
-                    LOG(ERROR) << "av_buffersink_get_frame_flags()";
-                    filter.running_ = false;
-                    break;
-                }
+                filter.running_ = false;
+            }
+            else if (ret < 0) {
+                LOG(ERROR) << "av_buffersink_get_frame_flags()";
+                filter.running_ = false;
+                break;
+            }
+
+            // the references are moved to the encoder thread, an empty frame at EOF flushes it
+            if (encoder.encode_frame(filtered_frame) < 0) {
+                LOG(ERROR) << "[FILTER THREAD] the encoder is stopped";
+                filter.running_ = false;
+                break;
+            }
+        }
+    };
+
+    while(filter.running_) {
+        if (mosaic) {
+            if (!mosaic->next(tiles)) {
+                for (size_t i = 0; i < decoders.size() && filter.running_; i++) feed(i, nullptr);
+                break;
+            }
 
-                encoder.encode_frame(filtered_frame);
+            for (size_t i = 0; i < tiles.size(); i++) {
+                if (filter.running_) feed(i, tiles[i]);
+                av_frame_free(&tiles[i]);
             }
+            continue;
         }
+
+        const auto seq = ready->seq();
+        const int i    = scheduler.next(stage ? InputScheduler::Requests{} : requests);
+        if (i < 0) {
+            scheduler.wait(seq);
+            continue;
+        }
+
+        feed(i, scheduler.pop(i, frame) ? frame : nullptr);
     }
 
+    // the decoders are stopped whether the graph is at EOF or failed, a longer input may still have frames
+    // in a full ring that nothing pops any more
+    for (auto& decoder : decoders) decoder->running_ = false;
+    ready->notify();
+
     for (auto& thread : threads) {
         if (thread.joinable()) {
             thread.join();
         }
     }
 
+    if (stage) {
+        stage->stop();
+        LOG(INFO) << fmt::format("[FILTER STAGE] {} frames, busy = {:.3f}s", stage->frames(),
+                                 stage->busy() / 1000000.0);
+    }
+
+    // the queued frames are encoded and written before the trailer
+    encoder.wait();
+
+    LOG(INFO) << (mosaic ? mosaic->str() : scheduler.str());
+    LOG(INFO) << encoder.str();
+    if (cache) LOG(INFO) << cache->str();
     LOG(INFO) << "EXITED";
 
     av_frame_free(&filtered_frame);
     av_frame_free(&frame);
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,228 @@
+#ifndef _05_MOSAIC_H
+#define _05_MOSAIC_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <memory>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libavutil/imgutils.h>
+#include <libavutil/time.h>
+}
+
+#include "decoder.h"
+#include "notifier.h"
+#include "fmt/format.h"
+
+// The frames of N inputs aligned on the ticks of one output clock, for the xstack of a video wall.
+//
+// Every input is rebased to its first frame. For the tick at T seconds, the frame of an input is the last
+// one starting at or before T, known once a frame after T is decoded. The tick is emitted when all the
+// inputs are known, or when the latency budget has passed since the first of them was known: the inputs
+// still behind, e.g. a stalled live feed, repeat their last frame instead of blocking the grid, and the
+// inputs without any frame yet show black. Every input gets exactly one frame per tick, so the framesync of
+// the xstack never waits.
+//
+// The frames are references to the decoded buffers, the repeated ones included, nothing is copied.
+class Mosaic {
+public:
+    // latency: us of wall clock a tick waits for the slow inputs
+    Mosaic(std::vector<std::shared_ptr<Decoder>> decoders, std::shared_ptr<Notifier> ready,
+           AVRational framerate, int64_t latency)
+        : ready_(std::move(ready)), framerate_(framerate), latency_(latency)
+    {
+        for (auto& decoder : decoders) {
+            Input input{};
+            input.decoder   = decoder;
+            input.time_base = decoder->time_base();
+            input.current   = av_frame_alloc();
+            input.black     = black_frame(decoder->video_decode_ctx_);
+            inputs_.push_back(input);
+        }
+    }
+
+    Mosaic(const Mosaic&) = delete;
+    Mosaic& operator=(const Mosaic&) = delete;
+
+    ~Mosaic()
+    {
+        for (auto& input : inputs_) {
+            av_frame_free(&input.current);
+            av_frame_free(&input.next);
+            av_frame_free(&input.black);
+        }
+    }
+
+    // the xstack of n inputs in a grid of cells, every input scaled into its cell, the aspect ratio kept
+    static std::string layout(size_t n, int cell_w, int cell_h)
+    {
+        const auto cols = static_cast<size_t>(std::ceil(std::sqrt(static_cast<double>(n))));
+        const auto rows = (n + cols - 1) / cols;
+
+        std::string chains{};
+        std::string pads{};
+        std::string positions{};
+        for (size_t i = 0; i < n; i++) {
+            chains += fmt::format("[{0}:v]scale={1}:{2}:force_original_aspect_ratio=decrease,"
+                                  "pad={1}:{2}:(ow-iw)/2:(oh-ih)/2,setsar=1,format=yuv420p[c{0}];",
+                                  i, cell_w, cell_h);
+            pads += fmt::format("[c{}]", i);
+            positions += fmt::format("{}{}_{}", i ? "|" : "", (i % cols) * cell_w, (i / cols) * cell_h);
+        }
+
+        // the empty cells of the last row
+        const auto fill = n < rows * cols ? ":fill=black" : "";
+        return fmt::format("{}{}xstack=inputs={}:layout={}{}", chains, pads, n, positions, fill);
+    }
+
+    // one frame of every input for the next tick, owned by the caller, pts: the tick in 1 / framerate,
+    // false: all the inputs are EOF
+    bool next(std::vector<AVFrame *>& frames)
+    {
+        const double tick = tick_ / av_q2d(framerate_);
+
+        int64_t due = AV_NOPTS_VALUE; // the first input is known
+        while (true) {
+            const auto seq = ready_->seq();
+
+            size_t known = 0;
+            size_t eofs  = 0;
+            for (auto& input : inputs_) {
+                if (fill(input, tick)) known++;
+                if (input.eof) eofs++;
+            }
+
+            if (eofs == inputs_.size()) return false;
+            if (known == inputs_.size()) break;
+
+            const int64_t now = av_gettime_relative();
+            if (known > 0 && due == AV_NOPTS_VALUE) due = now;
+            if (due != AV_NOPTS_VALUE && now - due >= latency_) {
+                late_++;
+                break;
+            }
+
+            // until a frame is decoded, or the latency budget of the tick is used up
+            const int64_t timeout =
+                due == AV_NOPTS_VALUE ? 100000 : std::max<int64_t>(1000, due + latency_ - now);
+            ready_->wait(seq, std::chrono::microseconds(timeout));
+        }
+
+        frames.resize(inputs_.size(), nullptr);
+        for (size_t i = 0; i < inputs_.size(); i++) {
+            auto& input = inputs_[i];
+
+            // the last frame again, or black
+            if (!input.eof && !(input.next && seconds(input, input.next) > tick)) input.repeated++;
+
+            frames[i]        = av_frame_alloc();
+            const auto shown = input.current->buf[0] ? input.current : input.black;
+            if (!frames[i] || av_frame_ref(frames[i], shown) < 0) return false;
+
+            frames[i]->pts       = tick_;
+            frames[i]->pict_type = AV_PICTURE_TYPE_NONE;
+        }
+
+        tick_++;
+        return true;
+    }
+
+    std::string str() const
+    {
+        std::string repeated{};
+        for (size_t i = 0; i < inputs_.size(); i++) {
+            repeated += fmt::format("{}#{}: {}", i ? ", " : "", i, inputs_[i].repeated);
+        }
+        return fmt::format("[MOSAIC] ticks: {}, late ticks: {}, repeated {}", tick_, late_, repeated);
+    }
+
+private:
+    struct Input
+    {
+        std::shared_ptr<Decoder> decoder{};
+        AVRational time_base{ 1, AV_TIME_BASE };
+        int64_t first{ AV_NOPTS_VALUE }; // the first timestamp, the origin of the input
+
+        AVFrame *current{ nullptr };     // the last frame at or before the tick
+        AVFrame *next{ nullptr };        // the first frame after the tick, nullptr: not decoded yet
+        AVFrame *black{ nullptr };       // before the first frame
+        bool eof{ false };
+
+        int64_t repeated{ 0 };
+    };
+
+    static int64_t timestamp(const AVFrame *frame)
+    {
+        return frame->pts != AV_NOPTS_VALUE ? frame->pts : frame->best_effort_timestamp;
+    }
+
+    static double seconds(const Input& input, const AVFrame *frame)
+    {
+        const int64_t ts = timestamp(frame);
+        if (ts == AV_NOPTS_VALUE || input.first == AV_NOPTS_VALUE) return 0.0;
+        return static_cast<double>(ts - input.first) * av_q2d(input.time_base);
+    }
+
+    // pops the frames of the input up to the tick, true: the frame of the input at the tick is known
+    bool fill(Input& input, double tick)
+    {
+        while (!input.eof) {
+            if (input.next) {
+                if (seconds(input, input.next) > tick) return true;
+
+                av_frame_unref(input.current);
+                av_frame_move_ref(input.current, input.next);
+                av_frame_free(&input.next);
+                continue;
+            }
+
+            if (input.decoder->empty(AVMEDIA_TYPE_VIDEO)) return false;
+
+            AVFrame *frame = av_frame_alloc();
+            if (!frame) return false;
+
+            const bool got = input.decoder->pop(AVMEDIA_TYPE_VIDEO, frame);
+            ready_->notify(); // room for the decoder
+
+            if (!got) {
+                av_frame_free(&frame);
+                input.eof = true;
+                break;
+            }
+
+            if (input.first == AV_NOPTS_VALUE) input.first = timestamp(frame);
+            input.next = frame;
+        }
+        return true;
+    }
+
+    static AVFrame *black_frame(const AVCodecContext *ctx)
+    {
+        AVFrame *frame = av_frame_alloc();
+        if (!frame) return nullptr;
+
+        frame->width  = ctx->width;
+        frame->height = ctx->height;
+        frame->format = ctx->pix_fmt;
+        if (av_frame_get_buffer(frame, 0) < 0) return frame;
+
+        ptrdiff_t linesizes[4]{};
+        for (int i = 0; i < 4; i++) linesizes[i] = frame->linesize[i];
+        av_image_fill_black(frame->data, linesizes, ctx->pix_fmt, ctx->color_range, ctx->width,
+                            ctx->height);
+        return frame;
+    }
+
+    std::shared_ptr<Notifier> ready_{};
+    AVRational framerate_{ 25, 1 };
+    int64_t latency_{ 200000 };
+
+    std::vector<Input> inputs_{};
+    int64_t tick_{ 0 };
+    int64_t late_{ 0 };
+};
+
+#endif //!_05_MOSAIC_H
@@ -0,0 +1,126 @@
+#ifndef _05_SCHEDULER_H
+#define _05_SCHEDULER_H
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libavutil/avutil.h>
+#include <libavutil/time.h>
+}
+
+#include "decoder.h"
+#include "notifier.h"
+#include "fmt/format.h"
+
+// Picks the input of the complex filter to feed next, and blocks until one is ready.
+//
+// After the filtered frames are drained, av_buffersrc_get_nb_failed_requests() tells which buffersrcs the
+// graph asked for frames and did not get any, e.g. the overlay waits for the main video but has enough
+// frames of the watermark. The queued frame of the input asked the most is fed, the inputs not asked for
+// are not fed, and their frames do not pile up in the graph. When none of the inputs asked for has a frame
+// queued, the filtering thread sleeps until a decoder notifies a new frame, not for a fixed time.
+//
+// Without a graph to ask, e.g. the graph runs on the FilterStage thread, the ready inputs are fed in turns.
+// The video and the audio streams have a scheduler each, the i-th input of the graph is the i-th decoder.
+class InputScheduler {
+public:
+    // the failed requests of the i-th input of the graph
+    using Requests = std::function<unsigned(size_t)>;
+
+    InputScheduler(AVMediaType type, std::vector<std::shared_ptr<Decoder>> decoders,
+                   std::shared_ptr<Notifier> ready)
+        : type_(type), decoders_(std::move(decoders)), ready_(std::move(ready)),
+          eofs_(decoders_.size(), false), fed_(decoders_.size(), 0)
+    {}
+
+    // the input to pop a frame from, -1: none of the inputs needed has a frame queued,
+    // requests: of the graph, empty: any ready input
+    int next(const Requests& requests)
+    {
+        int best         = -1;
+        unsigned wanted  = 0;
+        bool waiting     = false; // some input is asked for but has no frame yet
+        const auto count = decoders_.size();
+
+        for (size_t n = 0; n < count; n++) {
+            // starts after the last fed one, so the ties are fed in turns
+            const size_t i = (last_ + 1 + n) % count;
+            if (eofs_[i]) continue;
+
+            const unsigned asked = requests ? requests(i) : 0;
+            const bool queued    = !decoders_[i]->empty(type_);
+
+            if (asked > 0 && !queued) waiting = true;
+            if (!queued) continue;
+
+            if (best < 0 || asked > wanted) {
+                best   = static_cast<int>(i);
+                wanted = asked;
+            }
+        }
+
+        // only the inputs not asked for are ready,
+        // they are fed only when the graph asks for nothing, e.g. at the start
+        if (best >= 0 && wanted == 0 && waiting) return -1;
+        return best;
+    }
+
+    // the frame of the input, the decoder is notified that there is room for the next one,
+    // false: EOF of the input
+    bool pop(size_t i, AVFrame *frame)
+    {
+        const bool got = decoders_[i]->pop(type_, frame);
+        ready_->notify();
+
+        last_ = i;
+        fed_[i]++;
+
+        if (!got) eofs_[i] = true;
+        return got;
+    }
+
+    // all the inputs are EOF
+    bool done() const
+    {
+        return std::all_of(eofs_.begin(), eofs_.end(), [](bool eof) { return eof; });
+    }
+
+    // until a frame is pushed after 'seq', the timeout only bounds the time to see a stop
+    void wait(uint64_t seq)
+    {
+        const int64_t start = av_gettime_relative();
+        ready_->wait(seq, std::chrono::milliseconds(100));
+
+        waits_++;
+        waited_ += av_gettime_relative() - start;
+    }
+
+    std::string str() const
+    {
+        std::string fed{};
+        for (size_t i = 0; i < fed_.size(); i++) {
+            fed += fmt::format("{}#{}: {}", i ? ", " : "", i, fed_[i]);
+        }
+        return fmt::format("[SCHEDULER] {} fed {}, waits: {}, waited: {:.3f}s",
+                           av_get_media_type_string(type_), fed, waits_, waited_ / 1000000.0);
+    }
+
+private:
+    AVMediaType type_{ AVMEDIA_TYPE_VIDEO };
+    std::vector<std::shared_ptr<Decoder>> decoders_{};
+    std::shared_ptr<Notifier> ready_{};
+
+    std::vector<bool> eofs_{};
+    size_t last_{ 0 };
+
+    std::vector<int64_t> fed_{};
+    int64_t waits_{ 0 };
+    int64_t waited_{ 0 }; // us
+};
+
+#endif //!_05_SCHEDULER_H
@@ -0,0 +1,290 @@
+extern "C" {
+#include <libavutil/mathematics.h>
+#include <libavutil/pixfmt.h>
+}
+#include "defer.h"
+#include "delta.h"
+#include "gifwriter.h"
+#include "simd.h"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <thread>
+
+namespace
+{
+    // the first and the last columns of the row different from the canvas, false: the same
+    bool span_scalar(const uint32_t *row, const uint32_t *canvas, int width, int& first, int& last)
+    {
+        int x = 0;
+        while (x < width && row[x] == canvas[x]) x++;
+        if (x == width) return false;
+
+        first = x;
+        for (last = width - 1; row[last] == canvas[last];) last--;
+        return true;
+    }
+
+#ifdef GEN_GIF_X86
+    TARGET_SSE41 bool span_sse41(const uint32_t *row, const uint32_t *canvas, int width, int& first,
+                                 int& last)
+    {
+        int x    = 0;
+        int mask = 0; // the lanes different
+        for (; x + 4 <= width; x += 4) {
+            const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + x));
+            const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(canvas + x));
+            mask            = ~_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(a, b))) & 0xf;
+            if (mask) break;
+        }
+        if (!mask) {
+            while (x < width && row[x] == canvas[x]) x++;
+            if (x == width) return false;
+        }
+        first = x + (mask ? std::countr_zero(static_cast<unsigned>(mask)) : 0);
+
+        // from the end, the first column stops the search
+        int end = width;
+        for (; end - 4 >= first; end -= 4) {
+            const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + end - 4));
+            const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(canvas + end - 4));
+            mask            = ~_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(a, b))) & 0xf;
+            if (mask) {
+                last = end - 4 + std::bit_width(static_cast<unsigned>(mask)) - 1;
+                return true;
+            }
+        }
+        for (last = end - 1; row[last] == canvas[last];) last--;
+        return true;
+    }
+
+    TARGET_AVX2 bool span_avx2(const uint32_t *row, const uint32_t *canvas, int width, int& first,
+                               int& last)
+    {
+        int x    = 0;
+        int mask = 0;
+        for (; x + 8 <= width; x += 8) {
+            const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(row + x));
+            const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(canvas + x));
+            mask            = ~_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(a, b))) & 0xff;
+            if (mask) break;
+        }
+        if (!mask) {
+            while (x < width && row[x] == canvas[x]) x++;
+            if (x == width) return false;
+        }
+        first = x + (mask ? std::countr_zero(static_cast<unsigned>(mask)) : 0);
+
+        int end = width;
+        for (; end - 8 >= first; end -= 8) {
+            const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(row + end - 8));
+            const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(canvas + end - 8));
+            mask            = ~_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(a, b))) & 0xff;
+            if (mask) {
+                last = end - 8 + std::bit_width(static_cast<unsigned>(mask)) - 1;
+                return true;
+            }
+        }
+        for (last = end - 1; row[last] == canvas[last];) last--;
+        return true;
+    }
+#endif
+
+    bool span(Simd simd, const uint32_t *row, const uint32_t *canvas, int width, int& first, int& last)
+    {
+        switch (simd) {
+#ifdef GEN_GIF_X86
+        case Simd::avx2: return span_avx2(row, canvas, width, first, last);
+        case Simd::sse41: return span_sse41(row, canvas, width, first, last);
+#endif
+        default: return span_scalar(row, canvas, width, first, last);
+        }
+    }
+
+    // the squared error of the mapped frame to the RGB24 one
+    uint64_t mapping_error(const AVFrame *rgb, const AVFrame *pal8)
+    {
+        const auto palette = reinterpret_cast<const uint32_t *>(pal8->data[1]);
+
+        uint64_t error = 0;
+        for (int y = 0; y < rgb->height; y++) {
+            const uint8_t *src = rgb->data[0] + static_cast<ptrdiff_t>(y) * rgb->linesize[0];
+            const uint8_t *idx = pal8->data[0] + static_cast<ptrdiff_t>(y) * pal8->linesize[0];
+            for (int x = 0; x < rgb->width; x++, src += 3) {
+                const uint32_t color = palette[idx[x]];
+                const int dr         = src[0] - static_cast<int>((color >> 16) & 0xff);
+                const int dg         = src[1] - static_cast<int>((color >> 8) & 0xff);
+                const int db         = src[2] - static_cast<int>(color & 0xff);
+                error += static_cast<uint64_t>(dr * dr + dg * dg + db * db);
+            }
+        }
+        return error;
+    }
+
+    AVFrame *alloc_pal8(const AVFrame *rgb)
+    {
+        AVFrame *pal8 = av_frame_alloc();
+        if (!pal8) return nullptr;
+
+        pal8->width  = rgb->width;
+        pal8->height = rgb->height;
+        pal8->format = AV_PIX_FMT_PAL8;
+        if (av_frame_get_buffer(pal8, 0) < 0) av_frame_free(&pal8);
+        return pal8;
+    }
+
+    // worker(t, count) on 'count' threads, the items are taken in turns: t, t + count, ...
+    template<typename Worker> void run(size_t items, int threads, Worker&& worker)
+    {
+        const size_t count = std::clamp<size_t>(threads, 1, std::max<size_t>(items, 1));
+
+        std::vector<std::thread> workers{};
+        for (size_t t = 0; t < count; t++) workers.emplace_back(worker, t, count);
+        for (auto& w : workers) w.join();
+    }
+
+    struct Image
+    {
+        Rect rect{};
+        std::vector<uint8_t> indices{}; // of the rect
+        const Palette *palette{ nullptr };
+        bool local{ false };
+        int transparent{ -1 };
+        int delay{ 0 };
+    };
+} // namespace
+
+int encode_delta(const std::vector<AVFrame *>& frames, AVRational time_base, const Palette& global,
+                 const std::vector<Palette>& locals, const DeltaOptions& options, std::string& gif,
+                 DeltaStats& stats)
+{
+    const bool single = !locals.empty();
+    if (frames.empty() || (single && locals.size() != frames.size())) return -1;
+
+    const int width  = frames[0]->width;
+    const int height = frames[0]->height;
+    for (const auto& frame : frames) {
+        if (frame->width != width || frame->height != height) return -1;
+    }
+
+    const Simd simd = std::min(options.simd, detect_simd());
+    stats           = {};
+
+    // quantized to the global palette, or to the own one of the frame if the gain is high enough
+    std::vector<AVFrame *> mapped(frames.size(), nullptr);
+    defer(for (auto& frame : mapped) av_frame_free(&frame));
+    std::vector<uint8_t> local(frames.size(), 0);
+    std::atomic<bool> failed{ false };
+
+    run(frames.size(), options.threads, [&](size_t t, size_t count) {
+        Quantizer quantizer(global, simd);
+        for (size_t i = t; i < frames.size() && !failed; i += count) {
+            mapped[i] = alloc_pal8(frames[i]);
+            if (!mapped[i]) {
+                failed = true;
+                break;
+            }
+            quantizer.map(frames[i], mapped[i], options.dither, options.bayer_scale);
+            if (!single) continue;
+
+            AVFrame *own = alloc_pal8(frames[i]);
+            if (!own) {
+                failed = true;
+                break;
+            }
+            Quantizer(locals[i], simd).map(frames[i], own, options.dither, options.bayer_scale);
+
+            const auto error     = static_cast<double>(mapping_error(frames[i], mapped[i]));
+            const auto own_error = static_cast<double>(mapping_error(frames[i], own));
+            if (error - own_error > options.gain * error) {
+                std::swap(mapped[i], own);
+                local[i] = 1;
+            }
+            av_frame_free(&own);
+        }
+    });
+    if (failed) return AVERROR(ENOMEM);
+
+    // the colors of the images drawn, alpha 0 is no color of the palettes, the first frame is all changed
+    std::vector<uint32_t> canvas(static_cast<size_t>(width) * height, 0);
+    std::vector<uint32_t> colors(canvas.size(), 0);
+
+    std::vector<Image> images{};
+    for (size_t i = 0; i < frames.size(); i++) {
+        const AVFrame *pal8 = mapped[i];
+        const auto palette  = reinterpret_cast<const uint32_t *>(pal8->data[1]);
+        const Palette& used = local[i] ? locals[i] : global;
+
+        // 1/100s, rounded from the start, the last frame lasts one tick
+        const int64_t pts  = frames[i]->pts;
+        const int64_t next = (i + 1 < frames.size()) ? frames[i + 1]->pts : pts + 1;
+        const auto delay   = static_cast<int>(av_rescale_q(next, time_base, { 1, 100 }) -
+                                              av_rescale_q(pts, time_base, { 1, 100 }));
+        stats.pixels += canvas.size();
+
+        int left = width, right = -1, top = -1, bottom = -1;
+        for (int y = 0; y < height; y++) {
+            const uint8_t *idx = pal8->data[0] + static_cast<ptrdiff_t>(y) * pal8->linesize[0];
+            uint32_t *row      = colors.data() + static_cast<size_t>(y) * width;
+            for (int x = 0; x < width; x++) row[x] = palette[idx[x]];
+
+            int first = 0, last = 0;
+            if (span(simd, row, canvas.data() + static_cast<size_t>(y) * width, width, first, last)) {
+                left   = std::min(left, first);
+                right  = std::max(right, last);
+                top    = (top < 0) ? y : top;
+                bottom = y;
+            }
+        }
+
+        // nothing changed, the previous image lasts longer
+        if (top < 0) {
+            images.back().delay += delay;
+            stats.merged++;
+            continue;
+        }
+
+        Image image{};
+        image.rect        = { left, top, right - left + 1, bottom - top + 1 };
+        image.palette     = &used;
+        image.local       = local[i];
+        image.transparent = (!used.empty() && used.size() < 256) ? static_cast<int>(used.size()) : -1;
+        image.delay       = delay;
+        image.indices.resize(static_cast<size_t>(image.rect.width) * image.rect.height);
+
+        uint8_t *dst = image.indices.data();
+        for (int y = top; y <= bottom; y++) {
+            const uint8_t *idx = pal8->data[0] + static_cast<ptrdiff_t>(y) * pal8->linesize[0];
+            for (int x = left; x <= right; x++, dst++) {
+                const size_t p = static_cast<size_t>(y) * width + x;
+                *dst           = idx[x];
+                if (image.transparent >= 0 && colors[p] == canvas[p]) {
+                    *dst = static_cast<uint8_t>(image.transparent);
+                    stats.transparent++;
+                }
+                canvas[p] = colors[p];
+            }
+        }
+
+        stats.dirty += image.indices.size();
+        stats.locals += image.local ? 1 : 0;
+        images.push_back(std::move(image));
+    }
+    stats.frames = images.size();
+
+    std::vector<std::string> blocks(images.size());
+    run(images.size(), options.threads, [&](size_t t, size_t count) {
+        for (size_t i = t; i < images.size(); i += count) {
+            const auto& image = images[i];
+
+            blocks[i] = gif_image(image.indices.data(), image.rect.width, image.rect, *image.palette,
+                                  image.local, image.transparent, image.delay);
+        }
+    });
+
+    gif = gif_header(width, height, global);
+    for (const auto& block : blocks) gif += block;
+    gif.push_back(GIF_TRAILER);
+    return 0;
+}
@@ -0,0 +1,47 @@
+#ifndef _06_DELTA_H
+#define _06_DELTA_H
+
+extern "C" {
+#include <libavutil/frame.h>
+#include <libavutil/rational.h>
+}
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "palette.h"
+#include "quantizer.h"
+
+struct DeltaOptions
+{
+    Dither dither{ Dither::none };
+    int bayer_scale{ 2 };
+    Simd simd{ Simd::scalar };
+    double gain{ 0.1 }; // a frame uses its own palette if the squared error is lower by this ratio at least
+    int threads{ 1 };
+};
+
+struct DeltaStats
+{
+    uint64_t frames{ 0 };      // the images written
+    uint64_t merged{ 0 };      // the frames not changed, their delays are added to the previous images
+    uint64_t locals{ 0 };      // the images with their own palettes
+    uint64_t pixels{ 0 };      // of all the frames
+    uint64_t dirty{ 0 };       // of the rects written
+    uint64_t transparent{ 0 }; // of the rects, not changed
+};
+
+// Writes the RGB24 frames as a GIF of changed rects, without the GIF encoder of FFmpeg.
+//
+// The frames are quantized on 'threads' threads in turns. With 'locals' (one palette per frame), a frame
+// is mapped to both the global palette and its own one, and uses its own one only if the gain is high
+// enough, the global palette needs no local color table and keeps the static pixels the same indices.
+//
+// The frames are compared with the canvas, the colors of the previous images drawn, in order: the rows
+// are compared 8 (AVX2) or 4 (SSE4.1) pixels at a time from both ends, the changed columns and rows are
+// the rect of the image, the pixels of the rect not changed are transparent. The images are LZW coded
+// in parallel. 'global' and 'locals' have 255 colors at most, the transparent index is the next one.
+int encode_delta(const std::vector<AVFrame *>& frames, AVRational time_base, const Palette& global,
+                 const std::vector<Palette>& locals, const DeltaOptions& options, std::string& gif,
+                 DeltaStats& stats);
+
+#endif //!_06_DELTA_H
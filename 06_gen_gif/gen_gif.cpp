@@ -0,0 +1,614 @@
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavfilter/buffersink.h>
+#include <libavfilter/buffersrc.h>
+#include <libavformat/avformat.h>
+#include <libavutil/adler32.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/time.h>
+}
+#include "argsparser.h"
+#include "defer.h"
+#include "delta.h"
+#include "filtercache.h"
+#include "fmt/format.h"
+#include "logging.h"
+#include "palette.h"
+#include "quantizer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <fstream>
+#include <memory>
+#include <thread>
+
+namespace
+{
+    // the parameters cut by the size target
+    struct Settings
+    {
+        int fps{ 10 };
+        int width{ 480 };
+        int colors{ 256 };
+    };
+
+    // the frames of a try are converted to the fps, width and RGB24 of the try
+    std::string resample_descr(const Settings& settings)
+    {
+        return fmt::format("fps={},scale={}:-1:flags=lanczos", settings.fps, settings.width);
+    }
+
+    // all the video frames of the input, decoded once and converted to the fps and width of the first try,
+    // which are the highest of all the tries, the later tries convert the cached frames further down,
+    // max_bytes: of the cached frames, 0: no limit, args: of the buffersrc of the cached frames
+    int decode(const std::string& filename, const Settings& settings, int threads, int64_t max_bytes,
+               std::vector<AVFrame *>& frames, int64_t& bytes, std::string& args)
+    {
+        AVFormatContext *fmt_ctx = nullptr;
+        if (avformat_open_input(&fmt_ctx, filename.c_str(), nullptr, nullptr) < 0) return -1;
+        defer(avformat_close_input(&fmt_ctx));
+
+        if (avformat_find_stream_info(fmt_ctx, nullptr) < 0) return -1;
+        const int idx = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+        if (idx < 0) return -1;
+
+        AVStream *stream     = fmt_ctx->streams[idx];
+        const AVCodec *codec = avcodec_find_decoder(stream->codecpar->codec_id);
+        if (!codec) return -1;
+
+        AVCodecContext *decoder_ctx = avcodec_alloc_context3(codec);
+        defer(avcodec_free_context(&decoder_ctx));
+        if (!decoder_ctx || avcodec_parameters_to_context(decoder_ctx, stream->codecpar) < 0) return -1;
+
+        AVDictionary *options = nullptr;
+        av_dict_set(&options, "threads", "auto", AV_DICT_DONT_OVERWRITE);
+        defer(av_dict_free(&options));
+        if (avcodec_open2(decoder_ctx, codec, &options) < 0) return -1;
+
+        AVPacket *packet = av_packet_alloc();
+        AVFrame *frame   = av_frame_alloc();
+        defer(av_packet_free(&packet); av_frame_free(&frame));
+        if (!packet || !frame) return AVERROR(ENOMEM);
+
+        // created with the first decoded frame, the size and format are known only then
+        FilterGraph g{};
+        const AVRational fr = av_guess_frame_rate(fmt_ctx, stream, nullptr);
+
+        const auto drain = [&]() {
+            int ret = 0;
+            while ((ret = av_buffersink_get_frame(g.sink, frame)) >= 0) {
+                bytes += av_image_get_buffer_size(static_cast<AVPixelFormat>(frame->format), frame->width,
+                                                  frame->height, 1);
+                if (max_bytes > 0 && bytes > max_bytes) {
+                    LOG(ERROR) << fmt::format("[DECODER] the frames exceed {} MiB, lower --fps, --width "
+                                              "or raise --cache", max_bytes / 1048576);
+                    return AVERROR(ENOMEM);
+                }
+
+                AVFrame *cached = av_frame_alloc();
+                if (!cached) return AVERROR(ENOMEM);
+
+                av_frame_move_ref(cached, frame);
+                frames.push_back(cached);
+            }
+            return (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) ? 0 : ret;
+        };
+
+        // the decoded frames are moved into the graph, only the converted ones are kept
+        const auto receive = [&]() {
+            int ret = 0;
+            while ((ret = avcodec_receive_frame(decoder_ctx, frame)) >= 0) {
+                frame->pts = frame->best_effort_timestamp;
+
+                if (!g.graph) {
+                    const AVRational sar = frame->sample_aspect_ratio;
+                    const auto src_args  = fmt::format(
+                        "video_size={}x{}:pix_fmt={}:time_base={}/{}:pixel_aspect={}/{}:frame_rate={}/{}",
+                        frame->width, frame->height, frame->format, stream->time_base.num,
+                        stream->time_base.den, sar.num, std::max(1, sar.den), fr.num, fr.den);
+                    if (build_filter_graph(g, AVMEDIA_TYPE_VIDEO, resample_descr(settings), { src_args },
+                                           { AV_PIX_FMT_RGB24, AV_PIX_FMT_NONE }, threads) < 0) {
+                        return -1;
+                    }
+                }
+
+                if (av_buffersrc_add_frame(g.srcs[0], frame) < 0) return -1;
+                if ((ret = drain()) < 0) return ret;
+            }
+            return (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) ? 0 : ret;
+        };
+
+        while (av_read_frame(fmt_ctx, packet) >= 0) {
+            defer(av_packet_unref(packet));
+            if (packet->stream_index != idx) continue;
+
+            if (avcodec_send_packet(decoder_ctx, packet) < 0) {
+                LOG(ERROR) << "[DECODER] decoding error.";
+                return -1;
+            }
+            if (const int ret = receive(); ret < 0) return ret;
+        }
+        if (avcodec_send_packet(decoder_ctx, nullptr) < 0 || receive() < 0 || !g.graph) return -1;
+        if (av_buffersrc_add_frame(g.srcs[0], nullptr) < 0 || drain() < 0 || frames.empty()) return -1;
+
+        const AVRational tb   = av_buffersink_get_time_base(g.sink);
+        const AVRational rate = av_buffersink_get_frame_rate(g.sink);
+        const AVRational sar  = frames[0]->sample_aspect_ratio;
+        args = fmt::format("video_size={}x{}:pix_fmt={}:time_base={}/{}:pixel_aspect={}/{}:"
+                           "frame_rate={}/{}",
+                           frames[0]->width, frames[0]->height, static_cast<int>(AV_PIX_FMT_RGB24), tb.num,
+                           tb.den, sar.num, std::max(1, sar.den), rate.num, rate.den);
+        return 0;
+    }
+
+    // the cached frames converted to the frame rate and width of the try, the cached frames are referenced
+    int resample(const std::vector<AVFrame *>& source, const std::string& args, const Settings& settings,
+                 int threads, std::vector<AVFrame *>& frames, AVRational& time_base)
+    {
+        FilterGraph g{};
+        const std::vector<AVPixelFormat> pix_fmts{ AV_PIX_FMT_RGB24, AV_PIX_FMT_NONE };
+        const auto descr = resample_descr(settings);
+        if (build_filter_graph(g, AVMEDIA_TYPE_VIDEO, descr, { args }, pix_fmts, threads) < 0) return -1;
+        time_base = av_buffersink_get_time_base(g.sink);
+
+        AVFrame *frame = av_frame_alloc();
+        defer(av_frame_free(&frame));
+        if (!frame) return AVERROR(ENOMEM);
+
+        const auto drain = [&]() {
+            int ret = 0;
+            while ((ret = av_buffersink_get_frame(g.sink, frame)) >= 0) {
+                AVFrame *converted = av_frame_alloc();
+                if (!converted) return AVERROR(ENOMEM);
+
+                av_frame_move_ref(converted, frame);
+                frames.push_back(converted);
+            }
+            return (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) ? 0 : ret;
+        };
+
+        for (const auto& cached : source) {
+            if (av_buffersrc_add_frame_flags(g.srcs[0], cached, AV_BUFFERSRC_FLAG_KEEP_REF) < 0 ||
+                drain() < 0) {
+                return -1;
+            }
+        }
+        return (av_buffersrc_add_frame(g.srcs[0], nullptr) < 0 || drain() < 0) ? -1 : 0;
+    }
+
+    // the bytes written into the dynamic buffer, which is freed
+    std::string close_dyn_buf(AVIOContext *& pb)
+    {
+        uint8_t *buffer = nullptr;
+        const int size  = avio_close_dyn_buf(pb, &buffer);
+        pb              = nullptr;
+
+        std::string data(reinterpret_cast<const char *>(buffer), std::max(0, size));
+        av_free(buffer);
+        return data;
+    }
+
+    // paletteuse of the frames and the palettes, mapped: the PAL8 frames
+    int paletteuse_lavfi(const std::vector<AVFrame *>& frames, AVRational time_base,
+                         const std::vector<Palette>& palettes, const std::string& paletteuse, int threads,
+                         std::vector<AVFrame *>& mapped)
+    {
+        const AVFrame *first = frames[0];
+        const AVRational sar = first->sample_aspect_ratio;
+        const auto args      = fmt::format("video_size={}x{}:pix_fmt={}:time_base={}/{}:pixel_aspect={}/{}",
+                                           first->width, first->height, static_cast<int>(AV_PIX_FMT_RGB24),
+                                           time_base.num, time_base.den, sar.num, std::max(1, sar.den));
+        const auto palette_args =
+            fmt::format("video_size=16x16:pix_fmt={}:time_base={}/{}:pixel_aspect=1/1",
+                        static_cast<int>(AV_PIX_FMT_RGB32), time_base.num, time_base.den);
+
+        FilterGraph g{};
+        if (build_filter_graph(g, AVMEDIA_TYPE_VIDEO, "[0:v][1:v]" + paletteuse, { args, palette_args },
+                               { AV_PIX_FMT_PAL8, AV_PIX_FMT_NONE }, threads) < 0) {
+            return -1;
+        }
+
+        AVFrame *frame = av_frame_alloc();
+        defer(av_frame_free(&frame));
+        if (!frame) return AVERROR(ENOMEM);
+
+        const auto drain = [&]() {
+            int ret = 0;
+            while ((ret = av_buffersink_get_frame(g.sink, frame)) >= 0) {
+                AVFrame *pal8 = av_frame_alloc();
+                if (!pal8) return AVERROR(ENOMEM);
+
+                av_frame_move_ref(pal8, frame);
+                mapped.push_back(pal8);
+            }
+            return (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) ? 0 : ret;
+        };
+
+        // single: every frame with its own palette, the other modes: one palette for all the frames
+        const bool single = palettes.size() > 1;
+        for (size_t i = 0; i < frames.size(); i++) {
+            if (i == 0 || single) {
+                AVFrame *palette = palette_frame(palettes[single ? i : 0], frames[i]->pts);
+                const int ret    = palette ? av_buffersrc_add_frame(g.srcs[1], palette) : AVERROR(ENOMEM);
+                av_frame_free(&palette);
+                if (ret < 0) return ret;
+            }
+
+            if (av_buffersrc_add_frame_flags(g.srcs[0], frames[i], AV_BUFFERSRC_FLAG_KEEP_REF) < 0 ||
+                drain() < 0) {
+                return -1;
+            }
+        }
+
+        if (av_buffersrc_add_frame(g.srcs[1], nullptr) < 0 ||
+            av_buffersrc_add_frame(g.srcs[0], nullptr) < 0) {
+            return -1;
+        }
+        return drain();
+    }
+
+    // the native counterpart of paletteuse_lavfi(), the frames are mapped on 'threads' threads in turns,
+    // every thread has its own quantizer, of every frame for single, mapped: the PAL8 frames
+    int paletteuse_native(const std::vector<AVFrame *>& frames, const std::vector<Palette>& palettes,
+                          Dither dither, int bayer_scale, Simd simd, int threads,
+                          std::vector<AVFrame *>& mapped)
+    {
+        const bool single  = palettes.size() > 1;
+        const size_t count = std::clamp<size_t>(threads, 1, frames.size());
+
+        mapped.assign(frames.size(), nullptr);
+        std::atomic<bool> failed{ false };
+
+        std::vector<std::thread> workers{};
+        for (size_t t = 0; t < count; t++) {
+            workers.emplace_back([&, t]() {
+                std::unique_ptr<Quantizer> quantizer{};
+                for (size_t i = t; i < frames.size() && !failed; i += count) {
+                    if (!quantizer || single) {
+                        quantizer = std::make_unique<Quantizer>(palettes[single ? i : 0], simd);
+                    }
+
+                    AVFrame *pal8 = av_frame_alloc();
+                    if (!pal8) {
+                        failed = true;
+                        break;
+                    }
+
+                    pal8->width  = frames[i]->width;
+                    pal8->height = frames[i]->height;
+                    pal8->format = AV_PIX_FMT_PAL8;
+                    mapped[i]    = pal8;
+                    if (av_frame_get_buffer(pal8, 0) < 0) {
+                        failed = true;
+                        break;
+                    }
+
+                    quantizer->map(frames[i], pal8, dither, bayer_scale);
+                    pal8->pts                 = frames[i]->pts;
+                    pal8->sample_aspect_ratio = frames[i]->sample_aspect_ratio;
+                }
+            });
+        }
+        for (auto& worker : workers) worker.join();
+
+        return failed ? AVERROR(ENOMEM) : 0;
+    }
+
+    // the GIF encoder, the whole file is kept in 'gif'
+    int write_gif(const std::vector<AVFrame *>& mapped, AVRational time_base, std::string& gif)
+    {
+        const AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_GIF);
+        if (!codec || mapped.empty()) return -1;
+
+        AVCodecContext *encoder_ctx = avcodec_alloc_context3(codec);
+        defer(avcodec_free_context(&encoder_ctx));
+        if (!encoder_ctx) return AVERROR(ENOMEM);
+
+        encoder_ctx->width               = mapped[0]->width;
+        encoder_ctx->height              = mapped[0]->height;
+        encoder_ctx->pix_fmt             = AV_PIX_FMT_PAL8;
+        encoder_ctx->sample_aspect_ratio = mapped[0]->sample_aspect_ratio;
+        encoder_ctx->time_base           = time_base;
+        if (avcodec_open2(encoder_ctx, codec, nullptr) < 0) return -1;
+
+        // the muxer writes into memory, the size of the try is known before anything is written to the disk
+        AVFormatContext *fmt_ctx = nullptr;
+        if (avformat_alloc_output_context2(&fmt_ctx, nullptr, "gif", nullptr) < 0) return -1;
+        defer(avformat_free_context(fmt_ctx));
+
+        AVStream *stream = avformat_new_stream(fmt_ctx, nullptr);
+        if (!stream || avcodec_parameters_from_context(stream->codecpar, encoder_ctx) < 0) return -1;
+        stream->time_base = encoder_ctx->time_base;
+
+        if (avio_open_dyn_buf(&fmt_ctx->pb) < 0) return AVERROR(ENOMEM);
+        defer(if (fmt_ctx->pb) close_dyn_buf(fmt_ctx->pb));
+        if (avformat_write_header(fmt_ctx, nullptr) < 0) return -1;
+
+        AVPacket *packet = av_packet_alloc();
+        defer(av_packet_free(&packet));
+        if (!packet) return AVERROR(ENOMEM);
+
+        const auto write = [&](const AVFrame *f) {
+            int ret = avcodec_send_frame(encoder_ctx, f);
+            while (ret >= 0) {
+                ret = avcodec_receive_packet(encoder_ctx, packet);
+                if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) return 0;
+                if (ret < 0) break;
+
+                packet->stream_index = 0;
+                av_packet_rescale_ts(packet, encoder_ctx->time_base, stream->time_base);
+                ret = av_interleaved_write_frame(fmt_ctx, packet);
+            }
+            LOG(ERROR) << "[ENCODER] encoding error.";
+            return ret;
+        };
+
+        for (const auto& frame : mapped) {
+            if (write(frame) < 0) return -1;
+        }
+        if (write(nullptr) < 0 || av_write_trailer(fmt_ctx) < 0) return -1;
+
+        gif = close_dyn_buf(fmt_ctx->pb);
+        return 0;
+    }
+
+    uint32_t checksum(const std::vector<AVFrame *>& mapped)
+    {
+        unsigned long adler = 1;
+        for (const auto& frame : mapped) {
+            for (int y = 0; y < frame->height; y++) {
+                const uint8_t *row = frame->data[0] + static_cast<ptrdiff_t>(y) * frame->linesize[0];
+                adler              = av_adler32_update(adler, row, frame->width);
+            }
+        }
+        return static_cast<uint32_t>(adler);
+    }
+
+    // paletteuse and the native quantizer of every instruction set, with the same frames and palettes
+    void benchmark(const std::vector<AVFrame *>& frames, AVRational time_base,
+                   const std::vector<Palette>& palettes, int bayer_scale, int threads)
+    {
+        struct Run
+        {
+            std::string name{};
+            bool native{ false };
+            Simd simd{ Simd::scalar };
+            int threads{ 1 };
+        };
+
+        std::vector<Run> runs{ { "paletteuse", false, Simd::scalar, threads } };
+        for (int simd = 0; simd <= static_cast<int>(detect_simd()); simd++) {
+            const auto name = fmt::format("native {}", simd_name(static_cast<Simd>(simd)));
+            runs.push_back({ name, true, static_cast<Simd>(simd), threads });
+        }
+        runs.push_back({ fmt::format("native {}", simd_name(detect_simd())), true, detect_simd(), 1 });
+
+        const int single = palettes.size() > 1 ? 1 : 0;
+        for (const auto dither : { Dither::none, Dither::bayer }) {
+            const auto paletteuse = fmt::format("paletteuse=dither={}:bayer_scale={}:new={}",
+                                                dither_name(dither), bayer_scale, single);
+            for (const auto& run : runs) {
+                std::vector<AVFrame *> mapped{};
+                defer(for (auto& frame : mapped) av_frame_free(&frame));
+
+                const int64_t start = av_gettime_relative();
+                int ret = 0;
+                if (run.native) {
+                    ret = paletteuse_native(frames, palettes, dither, bayer_scale, run.simd, run.threads,
+                                            mapped);
+                }
+                else {
+                    ret = paletteuse_lavfi(frames, time_base, palettes, paletteuse, run.threads, mapped);
+                }
+                const int64_t quantized = av_gettime_relative();
+
+                std::string gif{};
+                if (ret < 0 || write_gif(mapped, time_base, gif) < 0) {
+                    LOG(ERROR) << "[BENCH] " << run.name << " failed";
+                    continue;
+                }
+
+                LOG(INFO) << fmt::format("[BENCH] {:<14} {:>2} threads, dither = {:<5}: {:>7.3f}s, "
+                                         "{:>6} KiB, adler32 = {:08x}",
+                                         run.name, run.threads, dither_name(dither),
+                                         (quantized - start) / 1000000.0, gif.size() / 1024,
+                                         checksum(mapped));
+            }
+        }
+    }
+
+    // the settings of the next try, the size is about linear in the frame rate and in the area, the colors
+    // cut the size the least and are cut the last, ratio: the target / the size, false: nothing left to cut
+    bool shrink(Settings& settings, double ratio, const Settings& limits)
+    {
+        ratio *= 0.95; // the size is not exactly linear
+
+        if (settings.fps > limits.fps) {
+            const auto fps = static_cast<int>(std::floor(settings.fps * ratio));
+            settings.fps   = std::max(limits.fps, std::min(settings.fps - 1, fps));
+            return true;
+        }
+
+        if (settings.width > limits.width) {
+            const auto width = static_cast<int>(std::floor(settings.width * std::sqrt(ratio))) & ~1;
+            settings.width   = std::max(limits.width, std::min(settings.width - 2, width));
+            return true;
+        }
+
+        if (settings.colors > limits.colors) {
+            settings.colors = std::max(limits.colors, settings.colors / 2);
+            return true;
+        }
+
+        return false;
+    }
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    Logger::init(argv[0]);
+
+    args::parser parser("gen_gif -i <input> -o <output.gif> [--fps 10] [--width 480] [--size 2048]");
+    parser.add("-i", "", "the input file");
+    parser.add("-o", "", "the output GIF");
+    parser.add("--fps", 10, "the frame rate of the GIF");
+    parser.add("--width", 480, "the width of the GIF, the height keeps the aspect ratio, 0: of the input");
+    parser.add("--colors", 256, "max colors of the palette, 2 ~ 256");
+    parser.add("--stats", "full", "the pixels of the palette: full, diff, single (a palette per frame)");
+    parser.add("--dither", "sierra2_4a", "dither of paletteuse: bayer, heckbert, floyd_steinberg, sierra2, "
+                                         "sierra2_4a, none");
+    parser.add("--bayer", 2, "bayer_scale of the bayer dither, 0 ~ 5");
+    parser.add("--diff", false, "paletteuse diff_mode=rectangle, only the changed rectangle is dithered");
+    parser.add("--threads", 0, "threads counting the palette and slice threads of the filters, 0: auto");
+    parser.add("--size", 0, "KiB, the target size, the fps, width and colors are cut until the GIF fits");
+    parser.add("--minfps", 5, "the lowest frame rate of --size");
+    parser.add("--minwidth", 160, "the lowest width of --size");
+    parser.add("--mincolors", 32, "the lowest colors of --size");
+    parser.add("--tries", 8, "max tries of --size");
+    parser.add("--quantizer", "lavfi", "lavfi: paletteuse, native: the SIMD quantizer, no / bayer dither");
+    parser.add("--simd", "auto", "the instruction set of the native quantizer: scalar, sse4.1, avx2, auto");
+    parser.add("--delta", false, "only the changed rects, the rest transparent, the native quantizer");
+    parser.add("--gain", 0.1, "--delta --stats single: min error ratio cut by the palette of a frame");
+    parser.add("--cache", 2048, "MiB, max of the frames cached at the fps and width of the first try");
+    parser.add("--bench", false, "paletteuse vs the native quantizer on the first try, no -o needed");
+    parser.parse(argc, argv);
+
+    const auto in    = parser.get<std::string>("i", "");
+    const auto out   = parser.get<std::string>("o", "");
+    const bool bench = parser.get<bool>("bench", false);
+    CHECK(!in.empty() && (!out.empty() || bench)) << parser.help();
+
+    int threads = static_cast<int>(parser.get<int64_t>("threads", 0));
+    if (threads <= 0) threads = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+
+    const auto stats      = parse_stats_mode(parser.get<std::string>("stats", "full"));
+    const auto bayer      = static_cast<int>(parser.get<int64_t>("bayer", 2));
+    const auto paletteuse = fmt::format("paletteuse=dither={}:bayer_scale={}:diff_mode={}:new={}",
+                                        parser.get<std::string>("dither", "sierra2_4a"), bayer,
+                                        parser.get<bool>("diff", false) ? "rectangle" : "none",
+                                        stats == StatsMode::single ? 1 : 0);
+    const int64_t target  = parser.get<int64_t>("size", 0) * 1024;
+
+    // --quantizer native: --diff is not supported, the error diffusion dithers are replaced by bayer
+    // --delta: the frames are quantized natively and written without the GIF encoder
+    const bool delta  = parser.get<bool>("delta", false);
+    const bool native = delta || parser.get<std::string>("quantizer", "lavfi") == "native";
+    const auto simd   = parse_simd(parser.get<std::string>("simd", "auto"));
+    const auto dither =
+        native ? parse_dither(parser.get<std::string>("dither", "sierra2_4a")) : Dither::none;
+
+    Settings settings{};
+    settings.fps    = static_cast<int>(parser.get<int64_t>("fps", 10));
+    settings.width  = std::max(0, static_cast<int>(parser.get<int64_t>("width", 480)));
+    settings.colors = static_cast<int>(parser.get<int64_t>("colors", 256));
+    settings.colors = std::clamp(settings.colors, 2, delta ? 255 : 256); // --delta: the transparent index
+    CHECK(settings.fps > 0) << parser.help();
+
+    // the input is decoded once, at the fps and width of the first try (scale=0: the input width), every
+    // try converts the cached frames
+    std::vector<AVFrame *> source{};
+    defer(for (auto& frame : source) av_frame_free(&frame));
+
+    std::string args{};
+    int64_t bytes       = 0;
+    const int64_t cache = parser.get<int64_t>("cache", 2048) * 1048576;
+    const int64_t t0    = av_gettime_relative();
+    CHECK(decode(in, settings, threads, cache, source, bytes, args) >= 0) << "failed to decode " << in;
+    LOG(INFO) << fmt::format("[DECODER] {} frames, {:.1f}MiB cached, {:.3f}s", source.size(),
+                             bytes / 1048576.0, (av_gettime_relative() - t0) / 1000000.0);
+
+    if (settings.width == 0) settings.width = source[0]->width;
+
+    Settings limits{};
+    limits.fps    = std::min(settings.fps, static_cast<int>(parser.get<int64_t>("minfps", 5)));
+    limits.width  = std::min(settings.width, static_cast<int>(parser.get<int64_t>("minwidth", 160)));
+    limits.colors = std::min(settings.colors, static_cast<int>(parser.get<int64_t>("mincolors", 32)));
+
+    // the smallest GIF of the tries
+    std::string best{};
+    const auto tries = std::max<int64_t>(1, parser.get<int64_t>("tries", 8));
+    for (int64_t n = 0; n < tries; n++) {
+        std::vector<AVFrame *> frames{};
+        defer(for (auto& frame : frames) av_frame_free(&frame));
+
+        const int64_t start = av_gettime_relative();
+
+        AVRational time_base{};
+        CHECK(resample(source, args, settings, threads, frames, time_base) >= 0 && !frames.empty());
+        const int64_t resampled = av_gettime_relative();
+
+        const auto palettes = gen_palettes(frames, stats, settings.colors, threads);
+
+        // --delta: the palettes of the frames are used only if they gain enough over the global one
+        Palette global{};
+        if (delta) {
+            global = (stats == StatsMode::single)
+                         ? gen_palettes(frames, StatsMode::full, settings.colors, threads)[0]
+                         : palettes[0];
+        }
+        const int64_t counted = av_gettime_relative();
+
+        if (bench) {
+            benchmark(frames, time_base, palettes, bayer, threads);
+            return 0;
+        }
+
+        std::string gif{};
+        int64_t quantized = 0;
+        if (delta) {
+            // quantized and encoded together, the time is of both
+            const DeltaOptions options{ dither, bayer, simd, parser.get<double>("gain", 0.1), threads };
+            const auto locals = (stats == StatsMode::single) ? palettes : std::vector<Palette>{};
+            DeltaStats ds{};
+            CHECK(encode_delta(frames, time_base, global, locals, options, gif, ds) >= 0);
+            quantized = av_gettime_relative();
+
+            LOG(INFO) << fmt::format("[DELTA] {} images, {} frames not changed, {} local palettes, "
+                                     "rects: {:.1f}% of the pixels, {:.1f}% transparent",
+                                     ds.frames, ds.merged, ds.locals, 100.0 * ds.dirty / ds.pixels,
+                                     ds.dirty ? 100.0 * ds.transparent / ds.dirty : 0.0);
+        }
+        else {
+            std::vector<AVFrame *> mapped{};
+            defer(for (auto& frame : mapped) av_frame_free(&frame));
+            if (native) {
+                CHECK(paletteuse_native(frames, palettes, dither, bayer, simd, threads, mapped) >= 0);
+            }
+            else {
+                CHECK(paletteuse_lavfi(frames, time_base, palettes, paletteuse, threads, mapped) >= 0);
+            }
+            quantized = av_gettime_relative();
+
+            CHECK(write_gif(mapped, time_base, gif) >= 0);
+        }
+        const int64_t encoded = av_gettime_relative();
+
+        const auto quantizer = delta    ? fmt::format("delta {}", simd_name(simd))
+                               : native ? fmt::format("native {}", simd_name(simd))
+                                        : std::string{ "paletteuse" };
+        LOG(INFO) << fmt::format("[GIF] #{}: {}fps, {}x{}, {} colors, {}: {} KiB | scale: {:.3f}s, "
+                                 "palette: {:.3f}s ({} threads), {}: {:.3f}s, encode: {:.3f}s",
+                                 n, settings.fps, frames[0]->width, frames[0]->height, settings.colors,
+                                 stats_mode_name(stats), gif.size() / 1024, (resampled - start) / 1000000.0,
+                                 (counted - resampled) / 1000000.0, threads, quantizer,
+                                 (quantized - counted) / 1000000.0, (encoded - quantized) / 1000000.0);
+
+        const auto size = static_cast<int64_t>(gif.size());
+        if (best.empty() || gif.size() < best.size()) best = std::move(gif);
+
+        if (target <= 0 || size <= target) break;
+
+        if (n + 1 == tries || !shrink(settings, static_cast<double>(target) / size, limits)) {
+            LOG(WARNING) << fmt::format("[GIF] {} KiB is not reached, the smallest one is written",
+                                        target / 1024);
+            break;
+        }
+    }
+
+    std::ofstream file(out, std::ios::binary);
+    CHECK(file.write(best.data(), static_cast<std::streamsize>(best.size()))) << "failed to write " << out;
+    LOG(INFO) << fmt::format("[GIF] {}: {} KiB", out, best.size() / 1024);
+
+    return 0;
+}
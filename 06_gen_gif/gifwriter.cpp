@@ -0,0 +1,184 @@
+#include "gifwriter.h"
+
+#include <algorithm>
+#include <vector>
+
+namespace
+{
+    constexpr int MAX_CODES = 4096; // 12 bits
+
+    void put16(std::string& out, int value)
+    {
+        out.push_back(static_cast<char>(value & 0xff));
+        out.push_back(static_cast<char>((value >> 8) & 0xff));
+    }
+
+    // RGB, the entries after the palette are black
+    void put_table(std::string& out, const Palette& palette, int bits)
+    {
+        for (size_t i = 0; i < (size_t{ 1 } << bits); i++) {
+            const uint32_t color = i < palette.size() ? palette[i] : 0;
+            out.push_back(static_cast<char>((color >> 16) & 0xff));
+            out.push_back(static_cast<char>((color >> 8) & 0xff));
+            out.push_back(static_cast<char>(color & 0xff));
+        }
+    }
+
+    // the codes packed from the lowest bit, in sub-blocks of 255 bytes at most
+    class CodeWriter
+    {
+    public:
+        explicit CodeWriter(std::string& out) : out_(out) {}
+
+        void put(int code, int bits)
+        {
+            acc_ |= static_cast<uint32_t>(code) << count_;
+            count_ += bits;
+            for (; count_ >= 8; count_ -= 8, acc_ >>= 8) byte(acc_ & 0xff);
+        }
+
+        // the last bits, the last sub-block and the block terminator
+        void flush()
+        {
+            if (count_ > 0) byte(acc_ & 0xff);
+            if (size_ > 0) {
+                out_.push_back(static_cast<char>(size_));
+                out_.append(block_, size_);
+            }
+            out_.push_back(0);
+        }
+
+    private:
+        void byte(uint32_t value)
+        {
+            block_[size_++] = static_cast<char>(value);
+            if (size_ == 255) {
+                out_.push_back(static_cast<char>(size_));
+                out_.append(block_, size_);
+                size_ = 0;
+            }
+        }
+
+        std::string& out_;
+        char block_[255]{};
+        int size_{ 0 };
+        uint32_t acc_{ 0 };
+        int count_{ 0 };
+    };
+
+    // the code size grows after a code is written if the next code does not fit, and the table is cleared
+    // when it is full, the same as giflib and as the decoders expect
+    void lzw(std::string& out, const uint8_t *indices, ptrdiff_t linesize, int width, int height,
+             int min_bits)
+    {
+        const int clear = 1 << min_bits;
+        const int eoi   = clear + 1;
+
+        // (prefix code << 8 | index) -> code, 0: none, only the keys set are reset on clear
+        thread_local std::vector<uint16_t> dict(MAX_CODES << 8, 0);
+        thread_local std::vector<uint32_t> keys{};
+        const auto reset = [&]() {
+            for (const auto key : keys) dict[key] = 0;
+            keys.clear();
+        };
+
+        CodeWriter writer(out);
+        int next = eoi + 1;
+        int bits = min_bits + 1;
+        const auto put = [&](int code) {
+            writer.put(code, bits);
+            if (next >= (1 << bits) && bits < 12) bits++;
+        };
+
+        put(clear);
+        int prefix = indices[0];
+        for (int y = 0; y < height; y++) {
+            const uint8_t *row = indices + y * linesize;
+            for (int x = (y == 0) ? 1 : 0; x < width; x++) {
+                const uint32_t key = (static_cast<uint32_t>(prefix) << 8) | row[x];
+                if (dict[key]) {
+                    prefix = dict[key];
+                    continue;
+                }
+
+                put(prefix);
+                if (next >= MAX_CODES - 1) {
+                    put(clear);
+                    reset();
+                    next = eoi + 1;
+                    bits = min_bits + 1;
+                }
+                else {
+                    dict[key] = static_cast<uint16_t>(next++);
+                    keys.push_back(key);
+                }
+                prefix = row[x];
+            }
+        }
+        put(prefix);
+        put(eoi);
+        writer.flush();
+        reset();
+    }
+} // namespace
+
+int table_bits(size_t colors)
+{
+    int bits = 1;
+    while (bits < 8 && (size_t{ 1 } << bits) < colors) bits++;
+    return bits;
+}
+
+std::string gif_header(int width, int height, const Palette& global, int loops)
+{
+    const int bits = table_bits(global.size() + 1);
+
+    std::string out{ "GIF89a" };
+    put16(out, width);
+    put16(out, height);
+    out.push_back(static_cast<char>(0x80 | ((bits - 1) << 4) | (bits - 1))); // the global color table
+    out.push_back(0);                                                         // background color
+    out.push_back(0);                                                         // pixel aspect ratio
+    put_table(out, global, bits);
+
+    out.push_back(0x21);
+    out.push_back(static_cast<char>(0xff));
+    out.push_back(0x0b);
+    out += "NETSCAPE2.0";
+    out.push_back(0x03);
+    out.push_back(0x01);
+    put16(out, loops);
+    out.push_back(0);
+    return out;
+}
+
+std::string gif_image(const uint8_t *indices, ptrdiff_t linesize, const Rect& rect, const Palette& palette,
+                      bool local, int transparent, int delay)
+{
+    const int bits = table_bits(palette.size() + 1);
+
+    std::string out{};
+
+    // graphic control extension, do not dispose
+    out.push_back(0x21);
+    out.push_back(static_cast<char>(0xf9));
+    out.push_back(0x04);
+    out.push_back(static_cast<char>((1 << 2) | (transparent >= 0 ? 1 : 0)));
+    put16(out, std::clamp(delay, 0, 0xffff));
+    out.push_back(static_cast<char>(std::max(transparent, 0)));
+    out.push_back(0);
+
+    // image descriptor
+    out.push_back(0x2c);
+    put16(out, rect.x);
+    put16(out, rect.y);
+    put16(out, rect.width);
+    put16(out, rect.height);
+    out.push_back(static_cast<char>(local ? (0x80 | (bits - 1)) : 0));
+    if (local) put_table(out, palette, bits);
+
+    const int min_bits = std::max(2, bits);
+    out.push_back(static_cast<char>(min_bits));
+    lzw(out, indices, linesize, rect.width, rect.height, min_bits);
+    return out;
+}
@@ -0,0 +1,38 @@
+#ifndef _06_GIF_WRITER_H
+#define _06_GIF_WRITER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include "palette.h"
+
+// a region of the logical screen, in pixels
+struct Rect
+{
+    int x{ 0 };
+    int y{ 0 };
+    int width{ 0 };
+    int height{ 0 };
+};
+
+// The blocks of a GIF89a file, gif_header() + gif_image() * n + GIF_TRAILER.
+//
+// The images are encoded on their own and may be encoded in parallel. Every image is drawn over the
+// previous ones (disposal method 1), its pixels of the transparent index keep the pixels under them. The
+// color tables have one entry more than the palettes, the transparent index is the size of the palette.
+constexpr char GIF_TRAILER = 0x3b;
+
+// the bits of a color table of 'colors' entries, 1 ~ 8
+int table_bits(size_t colors);
+
+// the header, the logical screen with the global color table and the NETSCAPE2.0 extension,
+// loops: 0 forever
+std::string gif_header(int width, int height, const Palette& global, int loops = 0);
+
+// one image: the graphic control extension, the image descriptor, the local color table and the LZW data,
+// indices: the top-left pixel of the rect, palette: the global one or of the image (local = true),
+// transparent: < 0 none, delay: 1/100s
+std::string gif_image(const uint8_t *indices, ptrdiff_t linesize, const Rect& rect, const Palette& palette,
+                      bool local, int transparent, int delay);
+
+#endif //!_06_GIF_WRITER_H
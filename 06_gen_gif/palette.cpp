@@ -0,0 +1,230 @@
+extern "C" {
+#include <libavutil/frame.h>
+#include <libavutil/pixfmt.h>
+}
+#include "logging.h"
+#include "palette.h"
+
+#include <algorithm>
+#include <cmath>
+#include <thread>
+
+namespace
+{
+    struct Color
+    {
+        uint8_t rgb[3]{}; // 6 bits
+        uint64_t count{ 0 };
+    };
+
+    // a set of colors of the histogram, replaced by their mean in the palette
+    struct Box
+    {
+        size_t begin{ 0 };
+        size_t end{ 0 };
+        uint64_t weight{ 0 };
+        double mean[3]{};
+        double score{ -1 }; // the squared error of the colors to the mean, < 0: one color, not split
+        int axis{ 0 };      // the channel of the largest error
+    };
+
+    // 6 bits to 8 bits, 0 -> 0, 63 -> 255
+    int expand(int value) { return (value << 2) | (value >> 4); }
+
+    Box make_box(const std::vector<Color>& colors, size_t begin, size_t end)
+    {
+        Box box{};
+        box.begin = begin;
+        box.end   = end;
+
+        double sum[3]{};
+        double squares[3]{};
+        for (size_t i = begin; i < end; i++) {
+            const auto weight = static_cast<double>(colors[i].count);
+            for (int c = 0; c < 3; c++) {
+                const double value = expand(colors[i].rgb[c]);
+                sum[c] += weight * value;
+                squares[c] += weight * value * value;
+            }
+            box.weight += colors[i].count;
+        }
+
+        double errors[3]{};
+        for (int c = 0; c < 3; c++) {
+            box.mean[c] = sum[c] / static_cast<double>(box.weight);
+            errors[c]   = squares[c] - box.mean[c] * sum[c];
+        }
+
+        box.axis = static_cast<int>(std::max_element(errors, errors + 3) - errors);
+        if (end - begin > 1) box.score = errors[0] + errors[1] + errors[2];
+        return box;
+    }
+} // namespace
+
+StatsMode parse_stats_mode(const std::string& mode)
+{
+    if (mode == "full") return StatsMode::full;
+    if (mode == "diff") return StatsMode::diff;
+    if (mode == "single") return StatsMode::single;
+
+    LOG(WARNING) << "[PALETTE] unknown stats mode '" << mode << "', full is used";
+    return StatsMode::full;
+}
+
+const char *stats_mode_name(StatsMode mode)
+{
+    switch (mode) {
+    case StatsMode::full: return "full";
+    case StatsMode::diff: return "diff";
+    case StatsMode::single: return "single";
+    default: return "unknown";
+    }
+}
+
+void Histogram::add(const AVFrame *frame, const AVFrame *prev)
+{
+    if (prev && (prev->width != frame->width || prev->height != frame->height)) prev = nullptr;
+
+    constexpr int shift = 8 - BITS;
+    for (int y = 0; y < frame->height; y++) {
+        const uint8_t *p = frame->data[0] + static_cast<ptrdiff_t>(y) * frame->linesize[0];
+        const uint8_t *q = prev ? prev->data[0] + static_cast<ptrdiff_t>(y) * prev->linesize[0] : nullptr;
+
+        for (int x = 0; x < frame->width * 3; x += 3) {
+            if (q && p[x] == q[x] && p[x + 1] == q[x + 1] && p[x + 2] == q[x + 2]) continue;
+
+            const int idx =
+                ((p[x] >> shift) << (BITS * 2)) | ((p[x + 1] >> shift) << BITS) | (p[x + 2] >> shift);
+            counts_[idx]++;
+            pixels_++;
+        }
+    }
+}
+
+void Histogram::merge(const Histogram& other)
+{
+    for (size_t i = 0; i < counts_.size(); i++) counts_[i] += other.counts_[i];
+    pixels_ += other.pixels_;
+}
+
+void Histogram::clear()
+{
+    std::fill(counts_.begin(), counts_.end(), 0);
+    pixels_ = 0;
+}
+
+// the box with the largest error is split at the weighted median of its widest channel, until there are
+// max_colors boxes or every box is a single color
+Palette Histogram::palette(int max_colors) const
+{
+    constexpr int mask = (1 << BITS) - 1;
+
+    std::vector<Color> colors{};
+    for (int idx = 0; idx < SIZE; idx++) {
+        if (!counts_[idx]) continue;
+
+        Color color{};
+        color.rgb[0] = static_cast<uint8_t>(idx >> (BITS * 2));
+        color.rgb[1] = static_cast<uint8_t>((idx >> BITS) & mask);
+        color.rgb[2] = static_cast<uint8_t>(idx & mask);
+        color.count  = counts_[idx];
+        colors.push_back(color);
+    }
+    if (colors.empty()) return {};
+
+    std::vector<Box> boxes{ make_box(colors, 0, colors.size()) };
+    while (boxes.size() < static_cast<size_t>(max_colors)) {
+        const auto it = std::max_element(boxes.begin(), boxes.end(),
+                                         [](const Box& a, const Box& b) { return a.score < b.score; });
+        if (it->score <= 0) break;
+
+        const Box box = *it;
+        std::sort(colors.begin() + box.begin, colors.begin() + box.end,
+                  [axis = box.axis](const Color& a, const Color& b) { return a.rgb[axis] < b.rgb[axis]; });
+
+        // both halves have one color at least
+        uint64_t weight = colors[box.begin].count;
+        size_t median   = box.begin + 1;
+        while (median < box.end - 1 && weight < box.weight / 2) weight += colors[median++].count;
+
+        *it = make_box(colors, box.begin, median);
+        boxes.push_back(make_box(colors, median, box.end));
+    }
+
+    Palette palette{};
+    for (const auto& box : boxes) {
+        uint32_t color = 0xff000000;
+        for (int c = 0; c < 3; c++) {
+            const auto value = static_cast<uint32_t>(std::clamp<long>(std::lround(box.mean[c]), 0, 255));
+            color |= value << (16 - 8 * c);
+        }
+        palette.push_back(color);
+    }
+    return palette;
+}
+
+std::vector<Palette> gen_palettes(const std::vector<AVFrame *>& frames, StatsMode mode, int max_colors,
+                                  int threads)
+{
+    if (frames.empty()) return {};
+
+    const size_t count = std::clamp<size_t>(threads, 1, frames.size());
+    std::vector<std::thread> workers{};
+
+    if (mode == StatsMode::single) {
+        std::vector<Palette> palettes(frames.size());
+        for (size_t t = 0; t < count; t++) {
+            workers.emplace_back([&, t]() {
+                Histogram histogram{};
+                for (size_t i = t; i < frames.size(); i += count) {
+                    histogram.clear();
+                    histogram.add(frames[i]);
+                    palettes[i] = histogram.palette(max_colors);
+                }
+            });
+        }
+        for (auto& worker : workers) worker.join();
+        return palettes;
+    }
+
+    // the first frame of a segment is compared with the last one of the previous segment,
+    // the merged histogram is the same as counted on one thread
+    std::vector<Histogram> histograms(count);
+    for (size_t t = 0; t < count; t++) {
+        workers.emplace_back([&, t]() {
+            const size_t begin = frames.size() * t / count;
+            const size_t end   = frames.size() * (t + 1) / count;
+            for (size_t i = begin; i < end; i++) {
+                const AVFrame *prev = (mode == StatsMode::diff && i > 0) ? frames[i - 1] : nullptr;
+                histograms[t].add(frames[i], prev);
+            }
+        });
+    }
+    for (auto& worker : workers) worker.join();
+
+    for (size_t t = 1; t < count; t++) histograms[0].merge(histograms[t]);
+    return { histograms[0].palette(max_colors) };
+}
+
+AVFrame *palette_frame(const Palette& palette, int64_t pts)
+{
+    AVFrame *frame = av_frame_alloc();
+    if (!frame) return nullptr;
+
+    frame->width  = 16;
+    frame->height = 16;
+    frame->format = AV_PIX_FMT_RGB32;
+    if (av_frame_get_buffer(frame, 0) < 0) {
+        av_frame_free(&frame);
+        return nullptr;
+    }
+
+    // the entries not used repeat the last color
+    for (size_t i = 0; i < 256; i++) {
+        const uint32_t color = palette.empty() ? 0xff000000 : palette[std::min(i, palette.size() - 1)];
+        reinterpret_cast<uint32_t *>(frame->data[0] + (i / 16) * frame->linesize[0])[i % 16] = color;
+    }
+
+    frame->pts = pts;
+    return frame;
+}
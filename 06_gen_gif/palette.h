@@ -0,0 +1,63 @@
+#ifndef _06_PALETTE_H
+#define _06_PALETTE_H
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// the pixels counted, the same as the stats_mode of palettegen
+enum class StatsMode
+{
+    full,   // all the pixels of all the frames, one palette
+    diff,   // the pixels changed since the previous frame, one palette, the static background not favored
+    single, // all the pixels of every frame, one palette per frame
+};
+
+StatsMode parse_stats_mode(const std::string& mode);
+
+const char *stats_mode_name(StatsMode mode);
+
+// 0xAARRGGBB, the pixels of AV_PIX_FMT_RGB32
+using Palette = std::vector<uint32_t>;
+
+// The colors of RGB24 frames, 6 bits per channel.
+//
+// The histograms of the segments of a video are counted on their own threads and merged, the sum is the
+// histogram of the whole video.
+class Histogram
+{
+public:
+    static constexpr int BITS = 6;
+    static constexpr int SIZE = 1 << (BITS * 3);
+
+    Histogram() : counts_(SIZE, 0) {}
+
+    // the pixels of 'frame', prev: only the pixels changed since 'prev', nullptr: all of them
+    void add(const AVFrame *frame, const AVFrame *prev = nullptr);
+
+    void merge(const Histogram& other);
+
+    void clear();
+
+    uint64_t pixels() const { return pixels_; }
+
+    // median cut of the colors, max_colors at most
+    Palette palette(int max_colors) const;
+
+private:
+    std::vector<uint64_t> counts_{};
+    uint64_t pixels_{ 0 };
+};
+
+// full / diff: one palette of all the frames, the frames are split into 'threads' segments counted in
+// parallel, single: one palette per frame, the frames are counted on 'threads' threads in turns
+std::vector<Palette> gen_palettes(const std::vector<AVFrame *>& frames, StatsMode mode, int max_colors,
+                                  int threads);
+
+// the 16x16 AV_PIX_FMT_RGB32 frame of the palette, the input of paletteuse
+AVFrame *palette_frame(const Palette& palette, int64_t pts);
+
+#endif //!_06_PALETTE_H
@@ -0,0 +1,274 @@
+extern "C" {
+#include <libavutil/cpu.h>
+#include <libavutil/frame.h>
+}
+#include "logging.h"
+#include "quantizer.h"
+#include "simd.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+
+namespace
+{
+    constexpr int32_t FAR = 4095; // the padding entries, farther than any color of 0 ~ 255
+
+    // 6 bits to 8 bits, 0 -> 0, 63 -> 255
+    int expand(int value) { return (value << 2) | (value >> 4); }
+
+    // the same matrix as paletteuse
+    int dither_value(int p)
+    {
+        const int q = p ^ (p >> 3);
+        return ((p & 4) >> 2) | ((q & 4) >> 1) | ((p & 2) << 1) | ((q & 2) << 2) | ((p & 1) << 4) |
+               ((q & 1) << 5);
+    }
+
+    int nearest_scalar(const int32_t *pr, const int32_t *pg, const int32_t *pb, int count, int r, int g,
+                       int b)
+    {
+        int best    = 0;
+        int32_t min = INT32_MAX;
+        for (int i = 0; i < count; i++) {
+            const int32_t dr = pr[i] - r;
+            const int32_t dg = pg[i] - g;
+            const int32_t db = pb[i] - b;
+            const int32_t d  = dr * dr + dg * dg + db * db;
+            if (d < min) {
+                min  = d;
+                best = i;
+            }
+        }
+        return best;
+    }
+
+    void dither_scalar(const uint8_t *src, uint8_t *dst, int width, const int8_t *offsets)
+    {
+        for (int x = 0; x < width; x++) {
+            const int offset = offsets[x & 7];
+            for (int c = 0; c < 3; c++) {
+                dst[3 * x + c] = static_cast<uint8_t>(std::clamp(src[3 * x + c] + offset, 0, 255));
+            }
+        }
+    }
+
+#ifdef GEN_GIF_X86
+    // the lowest index of the smallest distance of the lanes
+    int reduce(const int32_t *mins, const int32_t *idxs, int lanes)
+    {
+        int best = 0;
+        for (int i = 1; i < lanes; i++) {
+            if (mins[i] < mins[best] || (mins[i] == mins[best] && idxs[i] < idxs[best])) best = i;
+        }
+        return idxs[best];
+    }
+
+    TARGET_SSE41 int nearest_sse41(const int32_t *pr, const int32_t *pg, const int32_t *pb, int count,
+                                   int r, int g, int b)
+    {
+        const __m128i vr   = _mm_set1_epi32(r);
+        const __m128i vg   = _mm_set1_epi32(g);
+        const __m128i vb   = _mm_set1_epi32(b);
+        const __m128i step = _mm_set1_epi32(4);
+
+        __m128i min = _mm_set1_epi32(INT32_MAX);
+        __m128i idx = _mm_setzero_si128();
+        __m128i cur = _mm_setr_epi32(0, 1, 2, 3);
+        for (int i = 0; i < count; i += 4) {
+            // no lambdas, they are not compiled for the instruction set of the kernel
+            const __m128i dr = _mm_sub_epi32(_mm_load_si128(reinterpret_cast<const __m128i *>(pr + i)), vr);
+            const __m128i dg = _mm_sub_epi32(_mm_load_si128(reinterpret_cast<const __m128i *>(pg + i)), vg);
+            const __m128i db = _mm_sub_epi32(_mm_load_si128(reinterpret_cast<const __m128i *>(pb + i)), vb);
+            const __m128i d2 = _mm_add_epi32(_mm_mullo_epi32(dr, dr), _mm_mullo_epi32(dg, dg));
+            const __m128i d  = _mm_add_epi32(d2, _mm_mullo_epi32(db, db));
+
+            // strictly less, the lower index of a lane is kept on ties
+            const __m128i less = _mm_cmplt_epi32(d, min);
+            min                = _mm_blendv_epi8(min, d, less);
+            idx                = _mm_blendv_epi8(idx, cur, less);
+            cur                = _mm_add_epi32(cur, step);
+        }
+
+        alignas(16) int32_t mins[4];
+        alignas(16) int32_t idxs[4];
+        _mm_store_si128(reinterpret_cast<__m128i *>(mins), min);
+        _mm_store_si128(reinterpret_cast<__m128i *>(idxs), idx);
+        return reduce(mins, idxs, 4);
+    }
+
+    TARGET_AVX2 int nearest_avx2(const int32_t *pr, const int32_t *pg, const int32_t *pb, int count,
+                                 int r, int g, int b)
+    {
+        const __m256i vr   = _mm256_set1_epi32(r);
+        const __m256i vg   = _mm256_set1_epi32(g);
+        const __m256i vb   = _mm256_set1_epi32(b);
+        const __m256i step = _mm256_set1_epi32(8);
+
+        __m256i min = _mm256_set1_epi32(INT32_MAX);
+        __m256i idx = _mm256_setzero_si256();
+        __m256i cur = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+        for (int i = 0; i < count; i += 8) {
+            const __m256i r8 = _mm256_load_si256(reinterpret_cast<const __m256i *>(pr + i));
+            const __m256i g8 = _mm256_load_si256(reinterpret_cast<const __m256i *>(pg + i));
+            const __m256i b8 = _mm256_load_si256(reinterpret_cast<const __m256i *>(pb + i));
+            const __m256i dr = _mm256_sub_epi32(r8, vr);
+            const __m256i dg = _mm256_sub_epi32(g8, vg);
+            const __m256i db = _mm256_sub_epi32(b8, vb);
+            const __m256i d2 = _mm256_add_epi32(_mm256_mullo_epi32(dr, dr), _mm256_mullo_epi32(dg, dg));
+            const __m256i d  = _mm256_add_epi32(d2, _mm256_mullo_epi32(db, db));
+
+            const __m256i less = _mm256_cmpgt_epi32(min, d);
+            min                = _mm256_blendv_epi8(min, d, less);
+            idx                = _mm256_blendv_epi8(idx, cur, less);
+            cur                = _mm256_add_epi32(cur, step);
+        }
+
+        alignas(32) int32_t mins[8];
+        alignas(32) int32_t idxs[8];
+        _mm256_store_si256(reinterpret_cast<__m256i *>(mins), min);
+        _mm256_store_si256(reinterpret_cast<__m256i *>(idxs), idx);
+        return reduce(mins, idxs, 8);
+    }
+
+    // 16 pixels, 48 bytes, at a time, the offsets of 8 pixels repeat twice
+    TARGET_SSE41 void dither_sse41(const uint8_t *src, uint8_t *dst, int width, const int8_t *offsets)
+    {
+        alignas(16) uint8_t adds[48];
+        alignas(16) uint8_t subs[48];
+        for (int i = 0; i < 48; i++) {
+            const int offset = offsets[(i / 3) & 7];
+            adds[i]          = static_cast<uint8_t>(std::max(offset, 0));
+            subs[i]          = static_cast<uint8_t>(std::max(-offset, 0));
+        }
+
+        int x = 0;
+        for (; x + 16 <= width; x += 16) {
+            for (int i = 0; i < 48; i += 16) {
+                const __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 3 * x + i));
+                const __m128i a = _mm_load_si128(reinterpret_cast<const __m128i *>(adds + i));
+                const __m128i s = _mm_load_si128(reinterpret_cast<const __m128i *>(subs + i));
+                const __m128i d = _mm_subs_epu8(_mm_adds_epu8(p, a), s);
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 3 * x + i), d);
+            }
+        }
+
+        // x is a multiple of 8, the offsets of the rest start from the first one
+        dither_scalar(src + 3 * x, dst + 3 * x, width - x, offsets);
+    }
+#endif
+} // namespace
+
+Dither parse_dither(const std::string& dither)
+{
+    if (dither == "none") return Dither::none;
+    if (dither == "bayer") return Dither::bayer;
+
+    LOG(WARNING) << "[QUANTIZER] dither '" << dither << "' is not supported, bayer is used";
+    return Dither::bayer;
+}
+
+const char *dither_name(Dither dither)
+{
+    switch (dither) {
+    case Dither::none: return "none";
+    case Dither::bayer: return "bayer";
+    default: return "unknown";
+    }
+}
+
+Simd detect_simd()
+{
+#ifdef GEN_GIF_X86
+    const int flags = av_get_cpu_flags();
+    if (flags & AV_CPU_FLAG_AVX2) return Simd::avx2;
+    if (flags & AV_CPU_FLAG_SSE4) return Simd::sse41;
+#endif
+    return Simd::scalar;
+}
+
+Simd parse_simd(const std::string& simd)
+{
+    if (simd == "scalar") return Simd::scalar;
+    if (simd == "sse4.1") return std::min(Simd::sse41, detect_simd());
+    if (simd == "avx2") return std::min(Simd::avx2, detect_simd());
+
+    if (simd != "auto") LOG(WARNING) << "[QUANTIZER] unknown instruction set '" << simd << "', auto used";
+    return detect_simd();
+}
+
+const char *simd_name(Simd simd)
+{
+    switch (simd) {
+    case Simd::scalar: return "scalar";
+    case Simd::sse41: return "sse4.1";
+    case Simd::avx2: return "avx2";
+    default: return "unknown";
+    }
+}
+
+Quantizer::Quantizer(const Palette& palette, Simd simd)
+    : simd_(std::min(simd, detect_simd())), table_(1 << 18, 0xffff)
+{
+    count_  = std::clamp(static_cast<int>(palette.size()), 1, 256);
+    padded_ = (count_ + 7) & ~7;
+
+    for (int i = 0; i < 256; i++) {
+        // an empty palette is black
+        colors_[i] = palette.empty() ? 0xff000000 : palette[std::min<size_t>(i, palette.size() - 1)];
+
+        r_[i] = i < count_ ? static_cast<int32_t>((colors_[i] >> 16) & 0xff) : FAR;
+        g_[i] = i < count_ ? static_cast<int32_t>((colors_[i] >> 8) & 0xff) : FAR;
+        b_[i] = i < count_ ? static_cast<int32_t>(colors_[i] & 0xff) : FAR;
+    }
+}
+
+uint8_t Quantizer::search(int r, int g, int b)
+{
+    searches_++;
+    switch (simd_) {
+#ifdef GEN_GIF_X86
+    case Simd::avx2: return static_cast<uint8_t>(nearest_avx2(r_, g_, b_, padded_, r, g, b));
+    case Simd::sse41: return static_cast<uint8_t>(nearest_sse41(r_, g_, b_, padded_, r, g, b));
+#endif
+    default: return static_cast<uint8_t>(nearest_scalar(r_, g_, b_, count_, r, g, b));
+    }
+}
+
+void Quantizer::map(const AVFrame *rgb, AVFrame *pal8, Dither dither, int bayer_scale)
+{
+    int8_t offsets[64]{};
+    if (dither == Dither::bayer) {
+        bayer_scale     = std::clamp(bayer_scale, 0, 5);
+        const int delta = 1 << (5 - bayer_scale);
+        for (int i = 0; i < 64; i++) {
+            offsets[i] = static_cast<int8_t>((dither_value(i) >> bayer_scale) - delta);
+        }
+    }
+
+    row_.resize(static_cast<size_t>(rgb->width) * 3);
+    for (int y = 0; y < rgb->height; y++) {
+        const uint8_t *src = rgb->data[0] + static_cast<ptrdiff_t>(y) * rgb->linesize[0];
+        uint8_t *dst       = pal8->data[0] + static_cast<ptrdiff_t>(y) * pal8->linesize[0];
+
+        if (dither == Dither::bayer) {
+#ifdef GEN_GIF_X86
+            if (simd_ != Simd::scalar)
+                dither_sse41(src, row_.data(), rgb->width, offsets + (y & 7) * 8);
+            else
+#endif
+                dither_scalar(src, row_.data(), rgb->width, offsets + (y & 7) * 8);
+            src = row_.data();
+        }
+
+        for (int x = 0; x < rgb->width; x++, src += 3) {
+            const int cell = ((src[0] >> 2) << 12) | ((src[1] >> 2) << 6) | (src[2] >> 2);
+            if (table_[cell] == 0xffff) {
+                table_[cell] = search(expand(src[0] >> 2), expand(src[1] >> 2), expand(src[2] >> 2));
+            }
+            dst[x] = static_cast<uint8_t>(table_[cell]);
+        }
+    }
+
+    std::memcpy(pal8->data[1], colors_, sizeof(colors_));
+}
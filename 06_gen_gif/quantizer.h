@@ -0,0 +1,76 @@
+#ifndef _06_QUANTIZER_H
+#define _06_QUANTIZER_H
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "palette.h"
+
+enum class Dither
+{
+    none,
+    bayer, // ordered, the 8x8 Bayer matrix of paletteuse
+};
+
+// "none" / "bayer", the error diffusion dithers of paletteuse are not supported, bayer is used
+Dither parse_dither(const std::string& dither);
+
+const char *dither_name(Dither dither);
+
+// the instruction sets of the quantizer, from the slowest
+enum class Simd
+{
+    scalar,
+    sse41,
+    avx2,
+};
+
+// the best one supported by the CPU
+Simd detect_simd();
+
+// "scalar" / "sse4.1" / "avx2", not above the one of the CPU, "auto": detect_simd()
+Simd parse_simd(const std::string& simd);
+
+const char *simd_name(Simd simd);
+
+// Maps RGB24 frames to a palette, the native counterpart of paletteuse.
+//
+// The nearest color of a pixel is searched once per 6-bit per channel cell, for the first pixel of the
+// cell, and kept in a 64x64x64 table, the other pixels of the cell are looked up. The search compares the
+// color of the cell, as counted by the Histogram, with 8 (AVX2) or 4 (SSE4.1) colors of the palette at a
+// time, the ties go to the lower index, so all the instruction sets map to the same indices. The Bayer
+// dither adds the matrix to the pixels before the lookup, 16 pixels at a time with saturation.
+//
+// The table is filled while mapping, a quantizer is used by one thread only.
+class Quantizer
+{
+public:
+    Quantizer(const Palette& palette, Simd simd);
+
+    // rgb: AV_PIX_FMT_RGB24, pal8: AV_PIX_FMT_PAL8 of the same size, the palette is written to data[1]
+    void map(const AVFrame *rgb, AVFrame *pal8, Dither dither, int bayer_scale);
+
+    // the cells searched, the rest of the pixels are looked up
+    uint64_t searches() const { return searches_; }
+
+private:
+    uint8_t search(int r, int g, int b);
+
+    Simd simd_{ Simd::scalar };
+
+    uint32_t colors_[256]{};
+    int count_{ 0 };  // of the palette
+    int padded_{ 0 }; // the count rounded up to 8, the padding entries are farther than any color
+    alignas(32) int32_t r_[256]{};
+    alignas(32) int32_t g_[256]{};
+    alignas(32) int32_t b_[256]{};
+
+    std::vector<uint16_t> table_{}; // 0xffff: not searched yet
+    std::vector<uint8_t> row_{};    // the dithered row
+    uint64_t searches_{ 0 };
+};
+
+#endif //!_06_QUANTIZER_H
@@ -0,0 +1,18 @@
+#ifndef _06_SIMD_H
+#define _06_SIMD_H
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define GEN_GIF_X86 1
+#include <immintrin.h>
+#endif
+
+// the kernels are compiled for their instruction sets, and called only if the CPU supports them
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+#define TARGET_AVX2  __attribute__((target("avx2")))
+#else
+#define TARGET_SSE41
+#define TARGET_AVX2
+#endif
+
+#endif //!_06_SIMD_H
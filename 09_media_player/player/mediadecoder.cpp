@@ -43,14 +43,9 @@ bool MediaDecoder::open(const std::string& name,
         av_dict_set(&input_options, key.c_str(), value.c_str(), 0);
     }
 
-    // open input
-    if (avformat_open_input(&fmt_ctx_, name.c_str(), input_fmt, &input_options) < 0) {
-        LOG(ERROR) << "avformat_open_input";
-        return false;
-    }
-
-    if (avformat_find_stream_info(fmt_ctx_, nullptr) < 0) {
-        LOG(ERROR) << "avformat_find_stream_info";
+    // open input, the stream info of a local file is restored from the probe cache if possible
+    if (open_input(&fmt_ctx_, name, input_fmt, &input_options, probe_options_) < 0) {
+        LOG(ERROR) << "open_input";
         return false;
     }
 
@@ -172,20 +167,6 @@ bool MediaDecoder::open(const std::string& name,
 
 bool MediaDecoder::create_filters()
 {
-    // filters
-    filter_graph_ = avfilter_graph_alloc();
-    if (!filter_graph_) {
-        LOG(ERROR) << "avfilter_graph_alloc";
-        return false;
-    }
-
-    const AVFilter* buffersrc = avfilter_get_by_name("buffer");
-    const AVFilter* buffersink = avfilter_get_by_name("buffersink");
-    if (!buffersrc || !buffersink) {
-        LOG(ERROR) << "avfilter_get_by_name";
-        return false;
-    }
-
     AVStream* video_stream = fmt_ctx_->streams[video_stream_index_];
     std::string args = fmt::format(
             "video_size={}x{}:pix_fmt={}:time_base={}/{}:pixel_aspect={}/{}",
@@ -196,60 +177,31 @@ bool MediaDecoder::create_filters()
 
     LOG(INFO) << "[DECODER] " << "buffersrc args : " << args;
 
-    if (avfilter_graph_create_filter(&buffersrc_ctx_, buffersrc, "in", args.c_str(), nullptr, filter_graph_) < 0) {
-        LOG(ERROR) << "avfilter_graph_create_filter(buffersrc)";
+    // reconfigurable while playing
+    filter_ = std::make_unique<LiveFilterGraph>(AVMEDIA_TYPE_VIDEO, std::vector{ args },
+                                                std::vector{ pix_fmt_ }, 0, filter_cache_);
+    if (filter_->create(filters_descr_) < 0) {
+        LOG(ERROR) << "[DECODER] failed to create the filter graph: " << filters_descr_;
+        filter_.reset();
         return false;
     }
-    if (avfilter_graph_create_filter(&buffersink_ctx_, buffersink, "out", nullptr, nullptr, filter_graph_) < 0) {
-        LOG(ERROR) << "avfilter_graph_create_filter(buffersink)";
-        return false;
-    }
-    enum AVPixelFormat pix_fmts[] = { pix_fmt_, AV_PIX_FMT_NONE };
-    if (av_opt_set_int_list(buffersink_ctx_, "pix_fmts", pix_fmts, AV_PIX_FMT_NONE, AV_OPT_SEARCH_CHILDREN) < 0) {
-        LOG(ERROR) << "av_opt_set_int_list";
-        return false;
-    }
-
-    if (filters_descr_.length() > 0) {
-        AVFilterInOut* inputs = nullptr;
-        AVFilterInOut* outputs = nullptr;
-        defer(avfilter_inout_free(&inputs));
-        defer(avfilter_inout_free(&outputs));
-        if (avfilter_graph_parse2(filter_graph_, filters_descr_.c_str(), &inputs, &outputs) < 0) {
-            LOG(ERROR) << "avfilter_graph_parse2";
-            return false;
-        }
-
-        for (auto ptr = inputs; ptr; ptr = ptr->next) {
-            if (avfilter_link(buffersrc_ctx_, 0, ptr->filter_ctx, ptr->pad_idx) != 0) {
-                LOG(ERROR) << "avfilter_link";
-                return false;
-            }
-        }
+    return true;
+}
 
-        for (auto ptr = outputs; ptr; ptr = ptr->next) {
-            if (avfilter_link(ptr->filter_ctx, ptr->pad_idx, buffersink_ctx_, 0) != 0) {
-                LOG(ERROR) << "avfilter_link";
-                return false;
-            }
-        }
-    }
-    else {
-        if (avfilter_link(buffersrc_ctx_, 0, buffersink_ctx_, 0) != 0) {
-            LOG(ERROR) << "avfilter_link";
-            return false;
-        }
-    }
+void MediaDecoder::send_filter_command(const std::string& target, const std::string& cmd,
+                                       const std::string& arg)
+{
+    if (!filter_) return;
+    filter_->send_command(target, cmd, arg);
+}
 
-    if (avfilter_graph_config(filter_graph_, nullptr) < 0) {
-        LOG(ERROR) << "avfilter_graph_config(filter_graph_, nullptr)";
-        return false;
-    }
+void MediaDecoder::set_filters(const std::string& filters_descr)
+{
+    if (!filter_) return;
 
-    LOG(INFO) << "[ENCODER] " << "filter graph @{";
-    LOG(INFO) << "\n" << avfilter_graph_dump(filter_graph_, nullptr);
-    LOG(INFO) << "[ENCODER] " << "@}";
-    return true;
+    LOG(INFO) << fmt::format("[DECODER] filters = \"{}\" -> \"{}\"", filters_descr_, filters_descr);
+    filters_descr_ = filters_descr;
+    filter_->reconfigure(filters_descr);
 }
 
 void MediaDecoder::read_thread_f()
@@ -343,14 +295,14 @@ void MediaDecoder::video_thread_f()
                                         av_rescale_q(av_gettime_relative() - first_pts_, { 1, AV_TIME_BASE }, fmt_ctx_->streams[video_packet_->stream_index]->time_base) :
                                         decoded_video_frame_->pts - fmt_ctx_->streams[video_packet_->stream_index]->start_time;
 
-            if (av_buffersrc_add_frame_flags(buffersrc_ctx_, decoded_video_frame_, AV_BUFFERSRC_FLAG_PUSH) < 0) {
-                LOG(ERROR) << "av_buffersrc_add_frame(buffersrc_ctx_, frame_)";
+            if (filter_->add_frame(0, decoded_video_frame_) < 0) {
+                LOG(ERROR) << "[DECODER] failed to add the frame to the filter graph";
                 break;
             }
 
             while (true) {
                 av_frame_unref(filtered_frame_);
-                if (av_buffersink_get_frame_flags(buffersink_ctx_, filtered_frame_, AV_BUFFERSINK_FLAG_NO_REQUEST) < 0) {
+                if (filter_->get_frame(filtered_frame_, AV_BUFFERSINK_FLAG_NO_REQUEST) < 0) {
                     break;
                 }
 
@@ -461,7 +413,8 @@ void MediaDecoder::close()
 
     first_pts_ = AV_NOPTS_VALUE;
 
-    avfilter_graph_free(&filter_graph_);
+    filter_.reset();
+    if (filter_cache_) LOG(INFO) << filter_cache_->str();
 
     av_packet_free(&packet_);
     av_packet_free(&video_packet_);
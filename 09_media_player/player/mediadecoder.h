@@ -15,11 +15,14 @@ extern "C" {
 #include <mutex>
 #include <thread>
 #include <map>
+#include <memory>
 #include <condition_variable>
 #include "ringvector.h"
 #include "ringbuffer.h"
 #include "defer.h"
+#include "livefilter.h"
 #include "logging.h"
+#include "probe.h"
 
 const int BUFFER_SIZE = 20;
 
@@ -34,6 +37,16 @@ public:
               const std::map<std::string, std::string>& options);
     bool create_filters();
 
+    // while playing, without reopening: a parameter of a running filter, e.g. ("hue", "h", "90"),
+    // or a new filter graph swapped in at a frame boundary, e.g. "hflip"
+    void send_filter_command(const std::string& target, const std::string& cmd, const std::string& arg);
+    void set_filters(const std::string& filters_descr);
+
+    // must be set before open()
+    void set_probe_options(const ProbeOptions& probe) { probe_options_ = probe; }
+    // the filter graphs are taken from, e.g. the toggled ones, or the ones of the files reopened
+    void set_filter_cache(std::shared_ptr<FilterGraphCache> cache) { filter_cache_ = std::move(cache); }
+
     bool opened() { return opened_; }
     bool running() { return running_; }
     bool paused() { return paused_; }
@@ -132,9 +145,9 @@ private:
     std::function<std::pair<int64_t, bool>(RingBuffer&)> audio_callback_{ [](RingBuffer&) { return std::pair{0, false}; } };
 
     std::string filters_descr_;
-    AVFilterGraph* filter_graph_{ nullptr };
-    AVFilterContext* buffersrc_ctx_{ nullptr };
-    AVFilterContext* buffersink_ctx_{ nullptr };
+    ProbeOptions probe_options_{};
+    std::shared_ptr<FilterGraphCache> filter_cache_{};
+    std::unique_ptr<LiveFilterGraph> filter_{};
 };
 
 #endif // !PLAYER_MEDIA_DECODER
@@ -1,6 +1,7 @@
 #include "videoplayer.h"
 #include "ringbuffer.h"
 #include <QMessageBox>
+#include <filesystem>
 
 VideoPlayer::VideoPlayer(QWidget* parent)
         : QWidget(parent)
@@ -10,6 +11,12 @@ VideoPlayer::VideoPlayer(QWidget* parent)
     frame_ = av_frame_alloc();
 
     decoder_ = std::make_unique<MediaDecoder>();
+    // reopening a played file skips the probing
+    decoder_->set_probe_options({
+        .cache_dir = (std::filesystem::temp_directory_path() / "ffmpeg-examples-probe").string(),
+    });
+    // the hflip toggled on / off is swapped in without building the graph again
+    decoder_->set_filter_cache(std::make_shared<FilterGraphCache>());
 
     audio_player_ = new AudioPlayer(this);
 
@@ -61,9 +68,27 @@ bool VideoPlayer::play(const std::string& name, const std::string& fmt, const st
            QSize( decoder_->width(), decoder_->height())
     );
 
+    filter_descr_ = filter_descr;
+    flipped_      = false;
+
     decoder_->start();
 
     QWidget::setWindowTitle(QString::fromStdString(name));
 
     return true;
 }
+
+void VideoPlayer::keyPressEvent(QKeyEvent *event)
+{
+    if (event->key() != Qt::Key_H) {
+        QWidget::keyPressEvent(event);
+        return;
+    }
+
+    flipped_ = !flipped_;
+    if (!flipped_) {
+        decoder_->set_filters(filter_descr_);
+        return;
+    }
+    decoder_->set_filters(filter_descr_.empty() ? "hflip" : filter_descr_ + ",hflip");
+}
@@ -2,6 +2,7 @@
 #define PLAYER_VIDEO_PLAYER_H
 
 #include <QWidget>
+#include <QKeyEvent>
 #include <QPainter>
 #include <QImage>
 #include "mediadecoder.h"
@@ -29,9 +30,15 @@ protected:
         }
     }
 
+    // H: hflip on / off, the filter graph is swapped while playing
+    void keyPressEvent(QKeyEvent *event) override;
+
     std::unique_ptr<MediaDecoder> decoder_{ nullptr };
     AudioPlayer * audio_player_{nullptr};
 
+    std::string filter_descr_{};
+    bool flipped_{ false };
+
     AVFrame *frame_{ nullptr };
     std::mutex mtx_;
 };
@@ -456,7 +456,7 @@ namespace args
                         args_[key.value()].is_default = false;
 
                         // set value for boolean option while not offer a value
-                        if ((i + 1 < argc && parse_key(argv[i+1]))) {
+                        if (i + 1 >= argc || parse_key(argv[i+1])) {
                             if (args_[key.value()].type == value_t::boolean) {
                                 args_[key.value()].value = true;
                             }
@@ -471,7 +471,7 @@ namespace args
                     // assign default value for the undeclared key on unlimited mode
                     // the undeclared key can only be bool, std::string or promoted to std::vector<std::string>
                     if (!args_.contains(key.value()) && unlimited_) {
-                        args_[key.value()] = (i + 1 < argc && parse_key(argv[i+1])) ?
+                        args_[key.value()] = (i + 1 >= argc || parse_key(argv[i+1])) ?
                                              arg_t{ .type=value_t::boolean, .value=true } :
                                              arg_t{ .type=value_t::string, .value={} };
                         continue;
@@ -0,0 +1,124 @@
+#ifndef FFMPEG_EXAMPLES_BOUNDED_QUEUE_H
+#define FFMPEG_EXAMPLES_BOUNDED_QUEUE_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <optional>
+
+// Blocking FIFO queue with a fixed capacity.
+//
+// Unlike the RingVector, it never overwrites the queued values: the producer waits while the queue is full,
+// and the consumer waits while the queue is empty. close() wakes up both of them, the consumer can still
+// pop the queued values after the queue is closed.
+template<class T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity, std::function<void(T*)> deallocate = [](T*) {})
+        : capacity_(std::max<size_t>(1, capacity)), deallocate_(std::move(deallocate))
+    {}
+
+    BoundedQueue(const BoundedQueue&) = delete;
+    BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+    ~BoundedQueue() { clear(); }
+
+    // false if the queue is closed, the value is not taken and still owned by the caller
+    bool push(T value)
+    {
+        std::unique_lock lock(mtx_);
+        not_full_.wait(lock, [this]() { return closed_ || queue_.size() < capacity_; });
+        if (closed_) return false;
+
+        queue_.push_back(std::move(value));
+        not_empty_.notify_one();
+        return true;
+    }
+
+    // std::nullopt if the queue is closed and drained
+    std::optional<T> pop()
+    {
+        std::unique_lock lock(mtx_);
+        not_empty_.wait(lock, [this]() { return closed_ || !queue_.empty(); });
+        if (queue_.empty()) return std::nullopt;
+
+        return pop_wo_lock();
+    }
+
+    // std::nullopt if the queue is empty
+    std::optional<T> try_pop()
+    {
+        std::lock_guard lock(mtx_);
+        if (queue_.empty()) return std::nullopt;
+
+        return pop_wo_lock();
+    }
+
+    // no more values can be pushed
+    void close()
+    {
+        std::lock_guard lock(mtx_);
+        closed_ = true;
+        not_full_.notify_all();
+        not_empty_.notify_all();
+    }
+
+    void clear()
+    {
+        std::lock_guard lock(mtx_);
+        for (auto& value : queue_) {
+            deallocate_(&value);
+        }
+        queue_.clear();
+        not_full_.notify_all();
+    }
+
+    size_t size() const
+    {
+        std::lock_guard lock(mtx_);
+        return queue_.size();
+    }
+
+    bool empty() const
+    {
+        std::lock_guard lock(mtx_);
+        return queue_.empty();
+    }
+
+    bool full() const
+    {
+        std::lock_guard lock(mtx_);
+        return queue_.size() >= capacity_;
+    }
+
+    bool closed() const
+    {
+        std::lock_guard lock(mtx_);
+        return closed_;
+    }
+
+    size_t capacity() const { return capacity_; }
+
+private:
+    T pop_wo_lock()
+    {
+        T value = std::move(queue_.front());
+        queue_.pop_front();
+        not_full_.notify_one();
+        return value;
+    }
+
+    const size_t capacity_;
+    std::function<void(T*)> deallocate_{ [](T*) {} };
+
+    std::deque<T> queue_{};
+    bool closed_{ false };
+
+    mutable std::mutex mtx_;
+    std::condition_variable not_full_;
+    std::condition_variable not_empty_;
+};
+
+#endif // !FFMPEG_EXAMPLES_BOUNDED_QUEUE_H
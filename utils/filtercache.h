@@ -0,0 +1,398 @@
+#ifndef FFMPEG_EXAMPLES_FILTER_CACHE_H
+#define FFMPEG_EXAMPLES_FILTER_CACHE_H
+
+extern "C" {
+#include <libavfilter/avfilter.h>
+#include <libavfilter/buffersink.h>
+#include <libavfilter/buffersrc.h>
+#include <libavutil/opt.h>
+#include <libavutil/time.h>
+}
+#include <algorithm>
+#include <cctype>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "defer.h"
+#include "filterstage.h"
+#include "fmt/format.h"
+#include "logging.h"
+
+// A configured graph: the buffersrcs "in{i}" -> the description -> the buffersink "out",
+// of the video (buffer / buffersink) or the audio (abuffer / abuffersink).
+struct FilterGraph
+{
+    FilterGraph() = default;
+    FilterGraph(const FilterGraph&) = delete;
+    FilterGraph& operator=(const FilterGraph&) = delete;
+    ~FilterGraph() { avfilter_graph_free(&graph); }
+
+    AVFilterGraph *graph{ nullptr };
+    std::vector<AVFilterContext *> srcs{};
+    AVFilterContext *sink{ nullptr };
+    std::string descr{};
+};
+
+// Builds and configures the graph of the description.
+//
+// args: the buffersrc args of every input, pix_fmts: accepted by the video buffersink, AV_PIX_FMT_NONE
+// terminated, empty: any, the audio formats are set by an 'aformat' of the description. The labels "[N]" /
+// "[N:v]" / "[N:a]" of the description select the inputs, the unlabeled ones take the unused inputs in
+// order, and the inputs not used at all are consumed by the nullsinks.
+inline int build_filter_graph(FilterGraph& g, AVMediaType type, const std::string& descr,
+                              const std::vector<std::string>& args,
+                              const std::vector<AVPixelFormat>& pix_fmts, int threads)
+{
+    const bool audio = type == AVMEDIA_TYPE_AUDIO;
+
+    g.descr = descr;
+    if (g.graph = avfilter_graph_alloc(); !g.graph) return AVERROR(ENOMEM);
+
+    // before any filter is created
+    set_filter_threads(g.graph, threads);
+
+    const AVFilter *buffersrc = avfilter_get_by_name(audio ? "abuffer" : "buffer");
+    for (size_t i = 0; i < args.size(); i++) {
+        AVFilterContext *src = nullptr;
+        const auto name      = fmt::format("in{}", i);
+        const int ret        = avfilter_graph_create_filter(&src, buffersrc, name.c_str(), args[i].c_str(),
+                                                            nullptr, g.graph);
+        if (ret < 0) {
+            LOG(ERROR) << "[FILTER GRAPH] failed to create the buffersrc: " << args[i];
+            return AVERROR(EINVAL);
+        }
+        g.srcs.push_back(src);
+    }
+
+    const AVFilter *buffersink = avfilter_get_by_name(audio ? "abuffersink" : "buffersink");
+    if (avfilter_graph_create_filter(&g.sink, buffersink, "out", nullptr, nullptr, g.graph) < 0) {
+        LOG(ERROR) << "[FILTER GRAPH] failed to create the buffersink";
+        return AVERROR(EINVAL);
+    }
+    if (!audio && !pix_fmts.empty() && av_opt_set_int_list(g.sink, "pix_fmts", pix_fmts.data(),
+                                                           AV_PIX_FMT_NONE, AV_OPT_SEARCH_CHILDREN) < 0) {
+        LOG(ERROR) << "[FILTER GRAPH] failed to set the pixel formats of the buffersink";
+        return AVERROR(EINVAL);
+    }
+
+    std::vector<bool> linked(g.srcs.size(), false);
+    if (descr.empty()) {
+        if (g.srcs.size() != 1 || avfilter_link(g.srcs[0], 0, g.sink, 0) < 0) return AVERROR(EINVAL);
+        linked[0] = true;
+    }
+    else {
+        AVFilterInOut *inputs  = nullptr;
+        AVFilterInOut *outputs = nullptr;
+        defer(avfilter_inout_free(&inputs); avfilter_inout_free(&outputs));
+        if (avfilter_graph_parse2(g.graph, descr.c_str(), &inputs, &outputs) < 0) {
+            LOG(ERROR) << "[FILTER GRAPH] failed to parse \"" << descr << "\"";
+            return AVERROR(EINVAL);
+        }
+
+        size_t next = 0;
+        for (auto ptr = inputs; ptr; ptr = ptr->next) {
+            size_t idx = g.srcs.size();
+            if (ptr->name && std::isdigit(static_cast<unsigned char>(ptr->name[0]))) {
+                idx = std::strtoul(ptr->name, nullptr, 10);
+            }
+            else {
+                while (next < linked.size() && linked[next]) next++;
+                idx = next;
+            }
+
+            if (idx >= g.srcs.size() || linked[idx] ||
+                avfilter_link(g.srcs[idx], 0, ptr->filter_ctx, ptr->pad_idx) < 0) {
+                LOG(ERROR) << "[FILTER GRAPH] no input for [" << (ptr->name ? ptr->name : "") << "]";
+                return AVERROR(EINVAL);
+            }
+            linked[idx] = true;
+        }
+
+        if (!outputs || outputs->next ||
+            avfilter_link(outputs->filter_ctx, outputs->pad_idx, g.sink, 0) < 0) {
+            LOG(ERROR) << "[FILTER GRAPH] one output expected: \"" << descr << "\"";
+            return AVERROR(EINVAL);
+        }
+    }
+
+    // the inputs not used by this graph
+    for (size_t i = 0; i < linked.size(); i++) {
+        if (linked[i]) continue;
+
+        AVFilterContext *nullsink = nullptr;
+        const auto name           = fmt::format("unused{}", i);
+        if (avfilter_graph_create_filter(&nullsink, avfilter_get_by_name(audio ? "anullsink" : "nullsink"),
+                                         name.c_str(), nullptr, nullptr, g.graph) < 0 ||
+            avfilter_link(g.srcs[i], 0, nullsink, 0) < 0) {
+            return AVERROR(EINVAL);
+        }
+    }
+
+    if (avfilter_graph_config(g.graph, nullptr) < 0) {
+        LOG(ERROR) << "[FILTER GRAPH] failed to configure \"" << descr << "\"";
+        return AVERROR(EINVAL);
+    }
+    return 0;
+}
+
+// Configured graphs ready to be used, keyed by the description and the formats of the inputs.
+//
+// Parsing the description, allocating the filters and negotiating the formats cost the same every time a
+// source with the same formats starts. A graph can not be rewound after its EOF, libavfilter has no reset,
+// so the cache keeps spare graphs instead: acquire() returns a spare built in advance (a hit), or builds
+// one on the calling thread (a miss), and then builds the next spares of the key on a background thread.
+// The used graphs are freed by their owners. The descriptions which failed to build fail again at once.
+//
+// The keys used least recently are evicted over 'max_keys'. All the members are thread-safe.
+class FilterGraphCache {
+public:
+    struct Stats
+    {
+        int64_t hits{ 0 };
+        int64_t misses{ 0 };
+        int64_t failures{ 0 };   // acquired, but failed to build
+        int64_t offloaded{ 0 };  // us, the build time of the hits, moved to the background thread
+        int64_t building{ 0 };   // us, spent on building, in the foreground and in the background
+    };
+
+    // spares: graphs built in advance for every key, max_keys: of the descriptions and formats kept
+    explicit FilterGraphCache(size_t spares = 1, size_t max_keys = 16)
+        : spares_(std::max<size_t>(spares, 1)), max_keys_(std::max<size_t>(max_keys, 1))
+    {}
+
+    FilterGraphCache(const FilterGraphCache&) = delete;
+    FilterGraphCache& operator=(const FilterGraphCache&) = delete;
+
+    ~FilterGraphCache()
+    {
+        {
+            std::lock_guard lock(mtx_);
+            running_ = false;
+        }
+        cv_.notify_all();
+        if (builder_.joinable()) builder_.join();
+    }
+
+    // a configured graph for the inputs, nullptr: failed to build
+    std::unique_ptr<FilterGraph> acquire(AVMediaType type, const std::string& descr,
+                                         const std::vector<std::string>& args,
+                                         const std::vector<AVPixelFormat>& pix_fmts, int threads)
+    {
+        const auto key = make_key(type, descr, args, pix_fmts, threads);
+
+        std::unique_lock lock(mtx_);
+
+        auto& entry = entries_[key];
+        if (entry.descr.empty() && entry.args.empty()) {
+            entry.type     = type;
+            entry.descr    = descr;
+            entry.args     = args;
+            entry.pix_fmts = pix_fmts;
+            entry.threads  = threads;
+        }
+        entry.used = ++ticks_;
+
+        if (entry.failed) {
+            stats_.failures++;
+            return nullptr;
+        }
+
+        if (!entry.spares.empty()) {
+            auto graph = std::move(entry.spares.front());
+            entry.spares.pop_front();
+
+            stats_.hits++;
+            stats_.offloaded += entry.cost();
+            refill(key, entry);
+            return graph;
+        }
+
+        stats_.misses++;
+        lock.unlock();
+
+        const int64_t start = av_gettime_relative();
+        auto graph          = std::make_unique<FilterGraph>();
+        const int ret       = build_filter_graph(*graph, type, descr, args, pix_fmts, threads);
+        const int64_t took  = av_gettime_relative() - start;
+
+        lock.lock();
+        stats_.building += took;
+        if (ret < 0) stats_.failures++;
+
+        // evicted or cleared while building
+        auto found = entries_.find(key);
+        if (found == entries_.end()) {
+            if (ret < 0) return nullptr;
+            return graph;
+        }
+
+        found->second.record(took);
+        if (ret < 0) {
+            found->second.failed = true;
+            return nullptr;
+        }
+
+        refill(key, found->second);
+        evict();
+        return graph;
+    }
+
+    // drops the spares and the failed descriptions
+    void clear()
+    {
+        std::lock_guard lock(mtx_);
+        entries_.clear();
+        jobs_.clear();
+    }
+
+    Stats stats() const
+    {
+        std::lock_guard lock(mtx_);
+        return stats_;
+    }
+
+    std::string str() const
+    {
+        const auto s        = stats();
+        const auto acquired = s.hits + s.misses;
+        return fmt::format("[FILTER CACHE] hits: {}, misses: {}, failures: {}, hit rate: {:.1f}%, "
+                           "offloaded: {:.3f}ms, building: {:.3f}ms",
+                           s.hits, s.misses, s.failures, acquired ? s.hits * 100.0 / acquired : 0.0,
+                           s.offloaded / 1000.0, s.building / 1000.0);
+    }
+
+private:
+    struct Entry
+    {
+        AVMediaType type{ AVMEDIA_TYPE_VIDEO };
+        std::string descr{};
+        std::vector<std::string> args{};
+        std::vector<AVPixelFormat> pix_fmts{};
+        int threads{ 0 };
+
+        std::deque<std::unique_ptr<FilterGraph>> spares{};
+        size_t queued{ 0 };     // spares to be built in the background
+        bool failed{ false };
+        uint64_t used{ 0 };     // the tick of the last acquire()
+
+        int64_t built{ 0 };     // graphs built
+        int64_t took{ 0 };      // us, by all of them
+
+        void record(int64_t us)
+        {
+            built++;
+            took += us;
+        }
+
+        // us, the average build time
+        int64_t cost() const { return built ? took / built : 0; }
+    };
+
+    static std::string make_key(AVMediaType type, const std::string& descr,
+                                const std::vector<std::string>& args,
+                                const std::vector<AVPixelFormat>& pix_fmts, int threads)
+    {
+        // the args of the buffersrc carry the video_size, pix_fmt, time_base and pixel_aspect,
+        // or the sample_rate, sample_fmt and channel_layout
+        auto key = fmt::format("{}|{}|{}", static_cast<int>(type), descr, threads);
+        for (const auto& arg : args) key += "|" + arg;
+        key += "|";
+        for (const auto& fmt : pix_fmts) key += fmt::format("{},", static_cast<int>(fmt));
+        return key;
+    }
+
+    // with the lock
+    void refill(const std::string& key, Entry& entry)
+    {
+        while (entry.spares.size() + entry.queued < spares_) {
+            entry.queued++;
+            jobs_.push_back(key);
+        }
+
+        if (!jobs_.empty()) {
+            if (!builder_.joinable()) builder_ = std::thread([this]() { build_spares(); });
+            cv_.notify_one();
+        }
+    }
+
+    // with the lock
+    void evict()
+    {
+        while (entries_.size() > max_keys_) {
+            auto lru = std::min_element(entries_.begin(), entries_.end(), [](const auto& l, const auto& r) {
+                return l.second.used < r.second.used;
+            });
+            jobs_.erase(std::remove(jobs_.begin(), jobs_.end(), lru->first), jobs_.end());
+            entries_.erase(lru);
+        }
+    }
+
+    void build_spares()
+    {
+        LOG(INFO) << "[FILTER CACHE @ " << std::this_thread::get_id() << "] START";
+
+        std::unique_lock lock(mtx_);
+        while (true) {
+            cv_.wait(lock, [this]() { return !running_ || !jobs_.empty(); });
+            if (!running_) break;
+
+            const auto key = jobs_.front();
+            jobs_.pop_front();
+
+            auto found = entries_.find(key);
+            if (found == entries_.end()) continue;
+
+            const auto type     = found->second.type;
+            const auto descr    = found->second.descr;
+            const auto args     = found->second.args;
+            const auto pix_fmts = found->second.pix_fmts;
+            const auto threads  = found->second.threads;
+
+            lock.unlock();
+            const int64_t start = av_gettime_relative();
+            auto graph          = std::make_unique<FilterGraph>();
+            const int ret       = build_filter_graph(*graph, type, descr, args, pix_fmts, threads);
+            const int64_t took  = av_gettime_relative() - start;
+            lock.lock();
+
+            stats_.building += took;
+
+            // evicted or cleared while building
+            found = entries_.find(key);
+            if (found == entries_.end()) continue;
+
+            auto& entry = found->second;
+            entry.queued = entry.queued ? entry.queued - 1 : 0;
+            entry.record(took);
+            if (ret < 0) {
+                entry.failed = true;
+                continue;
+            }
+            entry.spares.push_back(std::move(graph));
+        }
+
+        LOG(INFO) << "[FILTER CACHE @ " << std::this_thread::get_id() << "] EXITED";
+    }
+
+    const size_t spares_{ 1 };
+    const size_t max_keys_{ 16 };
+
+    mutable std::mutex mtx_;
+    std::condition_variable cv_;
+    bool running_{ true };
+    uint64_t ticks_{ 0 };
+
+    std::map<std::string, Entry> entries_{};
+    std::deque<std::string> jobs_{}; // the keys of the spares to build
+    std::thread builder_{};
+
+    Stats stats_{};
+};
+
+#endif // !FFMPEG_EXAMPLES_FILTER_CACHE_H
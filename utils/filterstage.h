@@ -0,0 +1,149 @@
+#ifndef FFMPEG_EXAMPLES_FILTER_STAGE_H
+#define FFMPEG_EXAMPLES_FILTER_STAGE_H
+
+extern "C" {
+#include <libavfilter/avfilter.h>
+#include <libavfilter/buffersink.h>
+#include <libavfilter/buffersrc.h>
+#include <libavutil/time.h>
+}
+#include <atomic>
+#include <functional>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "boundedqueue.h"
+#include "logging.h"
+
+// Slice threads of the filters in the graph, e.g. scale and overlay split every frame into slices.
+// The threads of the graph are created with its first filter, so this must be called before any filter
+// is created. 0: one thread per core, 1: no threading.
+inline void set_filter_threads(AVFilterGraph *graph, int threads)
+{
+    graph->nb_threads  = threads;
+    graph->thread_type = threads == 1 ? 0 : AVFILTER_THREAD_SLICE;
+}
+
+// Runs a configured filter graph on its own thread, between two bounded frame queues.
+//
+// The producers push the frames of every buffersrc into one queue, and the consumer pops the frames of the
+// buffersink from the other, so the filtering never runs inline on the decoding or encoding thread. A heavy
+// graph is then a pipeline stage of its own, instead of capping the fps of the thread calling it.
+class FilterStage {
+public:
+    using Input = std::pair<size_t, AVFrame *>; // the index of the buffersrc, the frame
+
+    // av_buffersrc_add_frame() / av_buffersink_get_frame() of a graph which may be swapped, e.g. the
+    // LiveFilterGraph, called on the stage thread only
+    using AddFrame = std::function<int(size_t, AVFrame *)>;
+    using GetFrame = std::function<int(AVFrame *)>;
+
+    FilterStage(AddFrame add_frame, GetFrame get_frame, size_t queue_size)
+        : add_frame_(std::move(add_frame)), get_frame_(std::move(get_frame)),
+          inputs_(queue_size, [](Input *input) { av_frame_free(&input->second); }),
+          outputs_(queue_size, [](AVFrame **frame) { av_frame_free(frame); })
+    {}
+
+    FilterStage(std::vector<AVFilterContext *> buffersrcs, AVFilterContext *buffersink, size_t queue_size)
+        : FilterStage(
+              [buffersrcs](size_t idx, AVFrame *frame) {
+                  return av_buffersrc_add_frame_flags(buffersrcs[idx], frame, AV_BUFFERSRC_FLAG_PUSH);
+              },
+              [buffersink](AVFrame *frame) { return av_buffersink_get_frame(buffersink, frame); },
+              queue_size)
+    {}
+
+    FilterStage(const FilterStage&) = delete;
+    FilterStage& operator=(const FilterStage&) = delete;
+
+    ~FilterStage() { stop(); }
+
+    void start()
+    {
+        thread_ = std::thread([this]() { run(); });
+    }
+
+    // takes the frame, nullptr: EOF of the input,
+    // false: the stage is stopped, the frame is still owned by the caller
+    bool push(size_t input, AVFrame *frame) { return inputs_.push({ input, frame }); }
+
+    // the filtered frame owned by the caller, std::nullopt: the graph is drained or failed
+    std::optional<AVFrame *> pop() { return outputs_.pop(); }
+
+    void stop()
+    {
+        inputs_.close();
+        outputs_.close();
+        if (thread_.joinable()) thread_.join();
+    }
+
+    bool failed() const { return failed_; }
+    int64_t frames() const { return frames_; }
+    int64_t busy() const { return busy_; } // us, filtering only
+
+private:
+    void run()
+    {
+        LOG(INFO) << "[FILTER STAGE @ " << std::this_thread::get_id() << "] START";
+
+        while (auto input = inputs_.pop()) {
+            auto [idx, frame] = input.value();
+
+            const int64_t start = av_gettime_relative();
+
+            int ret = add_frame_(idx, frame);
+            av_frame_free(&frame);
+            if (ret >= 0) ret = drain();
+            busy_ += av_gettime_relative() - start;
+
+            if (ret == AVERROR_EOF || ret == AVERROR_EXIT) break;
+            if (ret < 0) {
+                LOG(ERROR) << "[FILTER STAGE] filtering error: " << ret;
+                failed_ = true;
+                break;
+            }
+        }
+
+        // wakes up the producers and the consumer
+        inputs_.close();
+        outputs_.close();
+
+        LOG(INFO) << "[FILTER STAGE @ " << std::this_thread::get_id() << "] EXITED, " << frames_
+                  << " frames";
+    }
+
+    // 0: more input needed, AVERROR_EOF: all the inputs are drained, AVERROR_EXIT: stopped
+    int drain()
+    {
+        while (true) {
+            AVFrame *filtered = av_frame_alloc();
+            if (!filtered) return AVERROR(ENOMEM);
+
+            const int ret = get_frame_(filtered);
+            if (ret < 0) {
+                av_frame_free(&filtered);
+                return ret == AVERROR(EAGAIN) ? 0 : ret;
+            }
+
+            frames_++;
+            if (!outputs_.push(filtered)) {
+                av_frame_free(&filtered);
+                return AVERROR_EXIT;
+            }
+        }
+    }
+
+    AddFrame add_frame_{};
+    GetFrame get_frame_{};
+
+    BoundedQueue<Input> inputs_;
+    BoundedQueue<AVFrame *> outputs_;
+
+    std::thread thread_{};
+    std::atomic<bool> failed_{ false };
+    std::atomic<int64_t> frames_{ 0 };
+    std::atomic<int64_t> busy_{ 0 };
+};
+
+#endif // !FFMPEG_EXAMPLES_FILTER_STAGE_H
@@ -0,0 +1,172 @@
+#ifndef FFMPEG_EXAMPLES_INTERLEAVER_H
+#define FFMPEG_EXAMPLES_INTERLEAVER_H
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavutil/avutil.h>
+}
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <vector>
+#include "fmt/format.h"
+#include "logging.h"
+
+struct InterleaveOptions
+{
+    int64_t max_delay{ 10 * AV_TIME_BASE }; // microseconds between the oldest and the newest queued packets
+    int64_t max_bytes{ 64 * 1024 * 1024 };  // bytes of all the queued packets
+};
+
+// Packet interleaver in front of the muxer, with bounded memory.
+//
+// av_interleaved_write_frame() queues the packets until every stream has one, so its queue grows without
+// limit while one stream lags behind, e.g. the sparse subtitles, or the audio muxed far ahead of the video.
+// The interleaver does the same, but once the queued packets exceed 'max_delay' or 'max_bytes', the oldest
+// one is written without waiting for the lagging streams. The packets are written by av_write_frame()
+// in the dts order, the muxer itself does not buffer anything.
+class Interleaver
+{
+public:
+    struct Stats
+    {
+        int64_t packets{ 0 };
+        int64_t peak_packets{ 0 }; // queued packets of this stream
+        int64_t peak_bytes{ 0 };   // queued bytes of this stream
+        int64_t wait_bytes{ 0 };   // max bytes of all the streams queued while waiting for this stream
+        int64_t wait_delay{ 0 };   // max microseconds queued while waiting for this stream
+        int64_t forced{ 0 };       // packets written without waiting for this stream
+    };
+
+    Interleaver(AVFormatContext *fmt_ctx, const InterleaveOptions& options)
+        : fmt_ctx_(fmt_ctx), options_(options), queues_(fmt_ctx->nb_streams),
+          queued_bytes_(fmt_ctx->nb_streams), stats_(fmt_ctx->nb_streams)
+    {}
+
+    Interleaver(const Interleaver&) = delete;
+    Interleaver& operator=(const Interleaver&) = delete;
+
+    ~Interleaver()
+    {
+        for (auto& queue : queues_) {
+            for (auto& packet : queue) {
+                av_packet_free(&packet);
+            }
+        }
+    }
+
+    // same as av_interleaved_write_frame(), takes the ownership of the packet reference,
+    // the packet is blank on return
+    int write(AVPacket *packet)
+    {
+        const int idx = packet->stream_index;
+        CHECK(idx >= 0 && idx < static_cast<int>(queues_.size()));
+
+        stats_[idx].packets++;
+
+        // no timestamp to be ordered by
+        if (packet->dts == AV_NOPTS_VALUE && packet->pts == AV_NOPTS_VALUE) {
+            const int ret = av_write_frame(fmt_ctx_, packet);
+            av_packet_unref(packet);
+            return ret;
+        }
+
+        AVPacket *queued = av_packet_alloc();
+        if (!queued) return AVERROR(ENOMEM);
+        av_packet_move_ref(queued, packet);
+
+        newest_ = std::max(newest_, timestamp(queued));
+        bytes_ += queued->size;
+
+        queues_[idx].push_back(queued);
+        queued_bytes_[idx] += queued->size;
+        stats_[idx].peak_packets = std::max<int64_t>(stats_[idx].peak_packets, queues_[idx].size());
+        stats_[idx].peak_bytes   = std::max(stats_[idx].peak_bytes, queued_bytes_[idx]);
+
+        return drain(false);
+    }
+
+    // write all the queued packets, e.g. at the end of the file or before cutting a segment
+    int flush() { return drain(true); }
+
+    size_t bytes() const { return bytes_; }
+
+    const std::vector<Stats>& stats() const { return stats_; }
+
+    void log_stats(const std::string& name) const
+    {
+        for (size_t i = 0; i < stats_.size(); i++) {
+            const auto& s = stats_[i];
+            LOG(INFO) << fmt::format("[INTERLEAVE] {} #{} {:>8}: packets = {}, peak = {} / {} bytes, "
+                                     "waited for = {} bytes / {:.3f}s, forced = {}",
+                                     name, i,
+                                     av_get_media_type_string(fmt_ctx_->streams[i]->codecpar->codec_type),
+                                     s.packets, s.peak_packets, s.peak_bytes, s.wait_bytes,
+                                     s.wait_delay / 1000000.0, s.forced);
+        }
+    }
+
+private:
+    // dts in AV_TIME_BASE
+    int64_t timestamp(const AVPacket *packet) const
+    {
+        return av_rescale_q(packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts,
+                            fmt_ctx_->streams[packet->stream_index]->time_base, AV_TIME_BASE_Q);
+    }
+
+    int drain(bool force)
+    {
+        while (true) {
+            // the stream with the oldest packet
+            int next = -1;
+            for (size_t i = 0; i < queues_.size(); i++) {
+                if (!queues_[i].empty() &&
+                    (next < 0 || timestamp(queues_[i].front()) < timestamp(queues_[next].front()))) {
+                    next = static_cast<int>(i);
+                }
+            }
+            if (next < 0) return 0;
+
+            // the order is guaranteed only if every stream has a packet queued
+            if (!force) {
+                const int64_t delay = newest_ - timestamp(queues_[next].front());
+                const bool overflow =
+                    delay > options_.max_delay || static_cast<int64_t>(bytes_) > options_.max_bytes;
+
+                bool waiting = false;
+                for (size_t i = 0; i < queues_.size(); i++) {
+                    if (!queues_[i].empty()) continue;
+
+                    waiting              = true;
+                    stats_[i].wait_bytes = std::max<int64_t>(stats_[i].wait_bytes, bytes_);
+                    stats_[i].wait_delay = std::max(stats_[i].wait_delay, delay);
+                    if (overflow) stats_[i].forced++;
+                }
+
+                if (waiting && !overflow) return 0;
+            }
+
+            AVPacket *packet = queues_[next].front();
+            queues_[next].pop_front();
+            bytes_ -= packet->size;
+            queued_bytes_[next] -= packet->size;
+
+            // av_write_frame() does not take the ownership of the packet
+            const int ret = av_write_frame(fmt_ctx_, packet);
+            av_packet_free(&packet);
+            if (ret < 0) return ret;
+        }
+    }
+
+    AVFormatContext *fmt_ctx_{ nullptr };
+    InterleaveOptions options_{};
+
+    std::vector<std::deque<AVPacket *>> queues_{};
+    std::vector<int64_t> queued_bytes_{};
+    size_t bytes_{ 0 };
+    int64_t newest_{ AV_NOPTS_VALUE }; // AV_TIME_BASE
+
+    std::vector<Stats> stats_{};
+};
+
+#endif // !FFMPEG_EXAMPLES_INTERLEAVER_H
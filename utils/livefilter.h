@@ -0,0 +1,257 @@
+#ifndef FFMPEG_EXAMPLES_LIVE_FILTER_H
+#define FFMPEG_EXAMPLES_LIVE_FILTER_H
+
+extern "C" {
+#include <libavfilter/avfilter.h>
+#include <libavfilter/buffersink.h>
+#include <libavfilter/buffersrc.h>
+#include <libavutil/opt.h>
+#include <libavutil/time.h>
+}
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+#include "filtercache.h"
+#include "fmt/format.h"
+#include "logging.h"
+
+// A filter graph reconfigured while the frames are flowing, without reopening the decoders or encoders.
+//
+//  - send_command(): the parameters of a running filter, e.g. the position of an overlay, by
+//    avfilter_graph_send_command() on the filtering thread before the next frame
+//  - reconfigure(): a new topology, e.g. a watermark toggled on / off. The new graph is built on a
+//    background thread, and swapped in at the next frame boundary. The old graph is closed and drained, its
+//    frames are returned by get_frame() before the ones of the new graph, so no frame in flight is dropped.
+//
+// The video inputs ended before the swap, e.g. a still watermark, are replayed into the new graph with
+// their last frame. The inputs not used by a graph are consumed by the nullsinks, and the labels "[N]" /
+// "[N:v]" of the description select the inputs, the unlabeled ones take the unused inputs in order.
+//
+// add_frame() / get_frame() are called on the filtering thread, the others on any thread.
+class LiveFilterGraph {
+public:
+    // type: of the buffersrcs and the buffersink, args: the buffersrc args of every input,
+    // pix_fmts: accepted by the video buffersink, empty: any,
+    // cache: the graphs are taken from, e.g. shared by the sources of the same formats, nullptr: no cache
+    LiveFilterGraph(AVMediaType type, std::vector<std::string> args, std::vector<AVPixelFormat> pix_fmts,
+                    int threads = 0, std::shared_ptr<FilterGraphCache> cache = nullptr)
+        : type_(type), args_(std::move(args)), pix_fmts_(std::move(pix_fmts)), threads_(threads),
+          cache_(std::move(cache)), eofs_(args_.size(), false)
+    {
+        if (!pix_fmts_.empty()) pix_fmts_.push_back(AV_PIX_FMT_NONE);
+
+        for (size_t i = 0; i < args_.size(); i++) {
+            lasts_.push_back(av_frame_alloc());
+        }
+    }
+
+    LiveFilterGraph(const LiveFilterGraph&) = delete;
+    LiveFilterGraph& operator=(const LiveFilterGraph&) = delete;
+
+    ~LiveFilterGraph()
+    {
+        if (builder_.joinable()) builder_.join();
+
+        for (auto& frame : lasts_) {
+            av_frame_free(&frame);
+        }
+    }
+
+    // the first graph, taken from the cache or built on the calling thread
+    int create(const std::string& descr)
+    {
+        const int64_t start = av_gettime_relative();
+
+        auto graph = build(descr);
+        if (!graph) return AVERROR(EINVAL);
+
+        LOG(INFO) << fmt::format("[LIVE FILTER] \"{}\" ready in {:.3f}ms", descr,
+                                 (av_gettime_relative() - start) / 1000.0);
+
+        char *dump = avfilter_graph_dump(graph->graph, nullptr);
+        LOG(INFO) << "[LIVE FILTER] graph >>>> \n" << (dump ? dump : "");
+        av_free(dump);
+
+        current_ = std::move(graph);
+        if (frame_size_ > 0) av_buffersink_set_frame_size(current_->sink, frame_size_);
+        return 0;
+    }
+
+    // the audio frames of the buffersink have 'frame_size' samples, e.g. the frame size of the encoder,
+    // kept by the graphs swapped in later, filtering thread only
+    void set_frame_size(int frame_size)
+    {
+        frame_size_ = frame_size;
+        if (current_ && frame_size_ > 0) av_buffersink_set_frame_size(current_->sink, frame_size_);
+    }
+
+    // applied to the current graph before the next frame, e.g. ("overlay", "x", "20")
+    void send_command(const std::string& target, const std::string& cmd, const std::string& arg)
+    {
+        std::lock_guard lock(mtx_);
+        commands_.emplace_back(target, cmd, arg);
+    }
+
+    // build the graph in the background, and swap it in before the next frame,
+    // the current graph is kept if the new one fails to build
+    void reconfigure(const std::string& descr)
+    {
+        // one build at a time
+        if (builder_.joinable()) builder_.join();
+
+        builder_ = std::thread([this, descr]() {
+            const int64_t start = av_gettime_relative();
+
+            auto graph = build(descr);
+            if (!graph) {
+                LOG(ERROR) << "[LIVE FILTER] failed to build \"" << descr << "\", the current one is kept";
+                return;
+            }
+
+            LOG(INFO) << fmt::format("[LIVE FILTER] \"{}\" ready in {:.3f}ms", descr,
+                                     (av_gettime_relative() - start) / 1000.0);
+
+            // replaces the one not swapped in yet
+            std::lock_guard lock(mtx_);
+            pending_ = std::move(graph);
+        });
+    }
+
+    // takes the frame, nullptr: EOF of the input
+    int add_frame(size_t input, AVFrame *frame)
+    {
+        if (!current_ || input >= args_.size()) return AVERROR(EINVAL);
+
+        apply();
+
+        if (frame && type_ == AVMEDIA_TYPE_VIDEO) {
+            av_frame_unref(lasts_[input]);
+            if (const int ret = av_frame_ref(lasts_[input], frame); ret < 0) return ret;
+        }
+        else if (!frame) {
+            eofs_[input] = true;
+        }
+
+        return av_buffersrc_add_frame_flags(current_->srcs[input], frame, AV_BUFFERSRC_FLAG_PUSH);
+    }
+
+    // the frames of the old graph first, flags: of av_buffersink_get_frame_flags()
+    int get_frame(AVFrame *frame, int flags = 0)
+    {
+        if (!current_) return AVERROR(EINVAL);
+
+        if (old_) {
+            // all the inputs are closed, the remaining frames are requested until EOF
+            const int ret = av_buffersink_get_frame_flags(old_->sink, frame, 0);
+            if (ret >= 0) return ret;
+            if (ret != AVERROR_EOF && ret != AVERROR(EAGAIN)) return ret;
+
+            LOG(INFO) << "[LIVE FILTER] \"" << old_->descr << "\" drained";
+            old_.reset();
+        }
+
+        return av_buffersink_get_frame_flags(current_->sink, frame, flags);
+    }
+
+    // the frames requested by the current graph from the input since its last frame, i.e. the graph is
+    // waiting for it, filtering thread only
+    unsigned nb_failed_requests(size_t input) const
+    {
+        if (!current_ || input >= current_->srcs.size()) return 0;
+        return av_buffersrc_get_nb_failed_requests(current_->srcs[input]);
+    }
+
+    // the output of the current graph
+    AVFilterContext *buffersink() const { return current_ ? current_->sink : nullptr; }
+    int64_t swaps() const { return swaps_; }
+
+private:
+    using Command = std::tuple<std::string, std::string, std::string>;
+
+    // from the cache if any, nullptr: failed
+    std::unique_ptr<FilterGraph> build(const std::string& descr) const
+    {
+        if (cache_) return cache_->acquire(type_, descr, args_, pix_fmts_, threads_);
+
+        auto graph = std::make_unique<FilterGraph>();
+        if (build_filter_graph(*graph, type_, descr, args_, pix_fmts_, threads_) < 0) return nullptr;
+        return graph;
+    }
+
+    // the pending graph and commands, at a frame boundary
+    void apply()
+    {
+        std::unique_ptr<FilterGraph> pending{};
+        std::vector<Command> commands{};
+        {
+            std::lock_guard lock(mtx_);
+            // the previous old graph is still draining, swapped at the next frame
+            if (!old_) pending = std::move(pending_);
+            commands.swap(commands_);
+        }
+
+        if (pending) swap(std::move(pending));
+
+        for (const auto& [target, cmd, arg] : commands) {
+            char res[256]{};
+            const int ret = avfilter_graph_send_command(current_->graph, target.c_str(), cmd.c_str(),
+                                                        arg.c_str(), res, sizeof(res), 0);
+            LOG_IF(WARNING, ret < 0) << fmt::format("[LIVE FILTER] {} {} {}: failed", target, cmd, arg);
+            LOG_IF(INFO, ret >= 0) << fmt::format("[LIVE FILTER] {} {} {}: {}", target, cmd, arg, res);
+        }
+    }
+
+    void swap(std::unique_ptr<FilterGraph> graph)
+    {
+        // closed, the frames buffered by the filters are returned before the ones of the new graph
+        for (size_t i = 0; i < current_->srcs.size(); i++) {
+            if (!eofs_[i]) av_buffersrc_add_frame_flags(current_->srcs[i], nullptr, 0);
+        }
+
+        // the ended inputs of the new graph
+        for (size_t i = 0; i < graph->srcs.size(); i++) {
+            if (!eofs_[i]) continue;
+
+            // the audio samples are not repeated
+            if (type_ == AVMEDIA_TYPE_VIDEO && lasts_[i]->buf[0]) {
+                AVFrame *last = av_frame_clone(lasts_[i]);
+                av_buffersrc_add_frame_flags(graph->srcs[i], last, 0);
+                av_frame_free(&last);
+            }
+            av_buffersrc_add_frame_flags(graph->srcs[i], nullptr, 0);
+        }
+
+        LOG(INFO) << "[LIVE FILTER] \"" << current_->descr << "\" -> \"" << graph->descr << "\"";
+
+        old_     = std::move(current_);
+        current_ = std::move(graph);
+        if (frame_size_ > 0) av_buffersink_set_frame_size(current_->sink, frame_size_);
+        swaps_++;
+    }
+
+    const AVMediaType type_{ AVMEDIA_TYPE_VIDEO };
+    const std::vector<std::string> args_;
+    std::vector<AVPixelFormat> pix_fmts_{};
+    const int threads_{ 0 };
+    std::shared_ptr<FilterGraphCache> cache_{};
+
+    // filtering thread only
+    std::unique_ptr<FilterGraph> current_{};
+    std::unique_ptr<FilterGraph> old_{};  // draining
+    int frame_size_{ 0 };
+    std::vector<bool> eofs_{};
+    std::vector<AVFrame *> lasts_{}; // the last frame of every input
+    std::atomic<int64_t> swaps_{ 0 };
+
+    // shared with the control threads
+    std::mutex mtx_;
+    std::unique_ptr<FilterGraph> pending_{};
+    std::vector<Command> commands_{};
+    std::thread builder_{};
+};
+
+#endif // !FFMPEG_EXAMPLES_LIVE_FILTER_H
@@ -0,0 +1,47 @@
+#ifndef FFMPEG_EXAMPLES_NOTIFIER_H
+#define FFMPEG_EXAMPLES_NOTIFIER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+// Wakes up the threads waiting for something to change, e.g. a frame pushed into or popped from a queue
+// which has no blocking interface of its own, like the RingVector.
+//
+// The waiter reads seq() before checking its condition, and waits for a notify() after it, so a notify()
+// between the check and the wait is never lost:
+//
+//      for (auto seq = ready.seq(); !condition(); seq = ready.seq()) ready.wait(seq, timeout);
+class Notifier {
+public:
+    uint64_t seq() const
+    {
+        std::lock_guard lock(mtx_);
+        return seq_;
+    }
+
+    void notify()
+    {
+        {
+            std::lock_guard lock(mtx_);
+            seq_++;
+        }
+        cv_.notify_all();
+    }
+
+    // false: timed out, not notified after 'seq'
+    template<class Rep, class Period>
+    bool wait(uint64_t seq, const std::chrono::duration<Rep, Period>& timeout)
+    {
+        std::unique_lock lock(mtx_);
+        return cv_.wait_for(lock, timeout, [&]() { return seq_ != seq; });
+    }
+
+private:
+    mutable std::mutex mtx_;
+    std::condition_variable cv_;
+    uint64_t seq_{ 0 };
+};
+
+#endif // !FFMPEG_EXAMPLES_NOTIFIER_H
@@ -0,0 +1,358 @@
+#ifndef FFMPEG_EXAMPLES_PROBE_H
+#define FFMPEG_EXAMPLES_PROBE_H
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/time.h>
+}
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include "defer.h"
+#include "fmt/format.h"
+#include "logging.h"
+
+struct ProbeOptions
+{
+    int64_t probesize{ 0 };       // bytes read while probing, 0: the default of ffmpeg (5MB)
+    int64_t analyzeduration{ 0 }; // microseconds analyzed while probing, 0: the default of ffmpeg
+    std::string cache_dir{};      // persistent cache of the stream information, empty: disabled
+};
+
+// Cached stream information of a local file, keyed by the path, size and modification time of the file.
+//
+// avformat_find_stream_info() may decode several seconds of media to fill the codec parameters that are
+// not in the header of the file. The parameters are saved after the first probing, and restored when the
+// same file is opened again, so that avformat_find_stream_info() can be skipped.
+namespace probe
+{
+    // invalidate the cache files written by other versions of ffmpeg
+    constexpr uint32_t CACHE_MAGIC   = 0x46505243; // 'FPRC'
+    constexpr uint32_t CACHE_VERSION = LIBAVCODEC_VERSION_INT ^ LIBAVFORMAT_VERSION_INT;
+
+    struct CacheKey
+    {
+        std::string path{};
+        uintmax_t size{};
+        int64_t mtime{};
+    };
+
+    inline std::optional<CacheKey> cache_key(const std::string& filename)
+    {
+        std::error_code ec;
+        const auto path = std::filesystem::canonical(filename, ec);
+        if (ec || !std::filesystem::is_regular_file(path, ec)) return std::nullopt;
+
+        const auto size  = std::filesystem::file_size(path, ec);
+        const auto mtime = std::filesystem::last_write_time(path, ec);
+        if (ec) return std::nullopt;
+
+        return CacheKey{ path.string(), size, static_cast<int64_t>(mtime.time_since_epoch().count()) };
+    }
+
+    inline std::filesystem::path cache_path(const std::string& dir, const CacheKey& key)
+    {
+        const auto hash = std::hash<std::string>{}(key.path);
+        return std::filesystem::path(dir) / fmt::format("{:016x}.probe", hash);
+    }
+
+    template<class T>
+    requires std::is_trivially_copyable_v<T>
+    void put(std::ostream& out, const T& value)
+    {
+        out.write(reinterpret_cast<const char *>(&value), sizeof(T));
+    }
+
+    template<class T>
+    requires std::is_trivially_copyable_v<T>
+    bool get(std::istream& in, T& value)
+    {
+        return !!in.read(reinterpret_cast<char *>(&value), sizeof(T));
+    }
+
+    inline void put(std::ostream& out, const std::string& str)
+    {
+        put(out, static_cast<uint32_t>(str.size()));
+        out.write(str.data(), static_cast<std::streamsize>(str.size()));
+    }
+
+    inline bool get(std::istream& in, std::string& str)
+    {
+        uint32_t size = 0;
+        if (!get(in, size) || size > 4096) return false;
+        str.resize(size);
+        return !!in.read(str.data(), size);
+    }
+
+    inline void put_params(std::ostream& out, const AVStream *stream)
+    {
+        const AVCodecParameters *params = stream->codecpar;
+
+        put(out, params->codec_type);
+        put(out, params->codec_id);
+        put(out, params->codec_tag);
+        put(out, params->format);
+        put(out, params->bit_rate);
+        put(out, params->bits_per_coded_sample);
+        put(out, params->bits_per_raw_sample);
+        put(out, params->profile);
+        put(out, params->level);
+        put(out, params->width);
+        put(out, params->height);
+        put(out, params->sample_aspect_ratio);
+        put(out, params->field_order);
+        put(out, params->color_range);
+        put(out, params->color_primaries);
+        put(out, params->color_trc);
+        put(out, params->color_space);
+        put(out, params->chroma_location);
+        put(out, params->video_delay);
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57, 28, 100)
+        put(out, params->ch_layout.nb_channels);
+        const bool native = params->ch_layout.order == AV_CHANNEL_ORDER_NATIVE;
+        put(out, native ? params->ch_layout.u.mask : uint64_t{});
+#else
+        put(out, params->channels);
+        put(out, params->channel_layout);
+#endif
+        put(out, params->sample_rate);
+        put(out, params->block_align);
+        put(out, params->frame_size);
+        put(out, params->initial_padding);
+        put(out, params->trailing_padding);
+        put(out, params->seek_preroll);
+
+        put(out, params->extradata_size);
+        out.write(reinterpret_cast<const char *>(params->extradata), params->extradata_size);
+
+        put(out, stream->time_base);
+        put(out, stream->avg_frame_rate);
+        put(out, stream->r_frame_rate);
+        put(out, stream->sample_aspect_ratio);
+        put(out, stream->start_time);
+        put(out, stream->duration);
+    }
+
+    // the cached information of a stream, read into a copy and applied only after the whole cache is read
+    struct StreamInfo
+    {
+        using ParamsPtr = std::unique_ptr<AVCodecParameters, void (*)(AVCodecParameters *)>;
+
+        ParamsPtr params{ nullptr, [](AVCodecParameters *p) { avcodec_parameters_free(&p); } };
+        AVRational avg_frame_rate{};
+        AVRational r_frame_rate{};
+        AVRational sample_aspect_ratio{};
+        int64_t start_time{};
+        int64_t duration{};
+    };
+
+    inline bool get_params(std::istream& in, const AVStream *stream, StreamInfo& info)
+    {
+        // the fields not cached are kept as the demuxer set them
+        info.params.reset(avcodec_parameters_alloc());
+        if (!info.params || avcodec_parameters_copy(info.params.get(), stream->codecpar) < 0) return false;
+
+        AVCodecParameters *params = info.params.get();
+
+        AVMediaType codec_type{};
+        AVCodecID codec_id{};
+        if (!get(in, codec_type) || !get(in, codec_id)) return false;
+
+        // the stream created by the demuxer must be the same one
+        if (codec_type != params->codec_type || codec_id != params->codec_id) return false;
+
+        bool ok = get(in, params->codec_tag) && get(in, params->format) && get(in, params->bit_rate) &&
+                  get(in, params->bits_per_coded_sample) && get(in, params->bits_per_raw_sample) &&
+                  get(in, params->profile) && get(in, params->level) && get(in, params->width) &&
+                  get(in, params->height) && get(in, params->sample_aspect_ratio) &&
+                  get(in, params->field_order) && get(in, params->color_range) &&
+                  get(in, params->color_primaries) && get(in, params->color_trc) &&
+                  get(in, params->color_space) && get(in, params->chroma_location) &&
+                  get(in, params->video_delay);
+
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT(57, 28, 100)
+        int channels   = 0;
+        uint64_t mask  = 0;
+        ok             = ok && get(in, channels) && get(in, mask);
+        av_channel_layout_uninit(&params->ch_layout);
+        if (mask) {
+            av_channel_layout_from_mask(&params->ch_layout, mask);
+        }
+        else if (channels > 0) {
+            av_channel_layout_default(&params->ch_layout, channels);
+        }
+#else
+        ok = ok && get(in, params->channels) && get(in, params->channel_layout);
+#endif
+
+        ok = ok && get(in, params->sample_rate) && get(in, params->block_align) &&
+             get(in, params->frame_size) && get(in, params->initial_padding) &&
+             get(in, params->trailing_padding) && get(in, params->seek_preroll);
+
+        int extradata_size = 0;
+        if (!ok || !get(in, extradata_size)) return false;
+        if (extradata_size < 0 || extradata_size > (1 << 24)) return false;
+
+        av_freep(&params->extradata);
+        params->extradata_size = 0;
+        if (extradata_size > 0) {
+            params->extradata =
+                static_cast<uint8_t *>(av_mallocz(extradata_size + AV_INPUT_BUFFER_PADDING_SIZE));
+            if (!params->extradata) return false;
+
+            params->extradata_size = extradata_size;
+            if (!in.read(reinterpret_cast<char *>(params->extradata), extradata_size)) return false;
+        }
+
+        AVRational time_base{};
+        ok = get(in, time_base) && get(in, info.avg_frame_rate) && get(in, info.r_frame_rate) &&
+             get(in, info.sample_aspect_ratio) && get(in, info.start_time) && get(in, info.duration);
+
+        return ok && av_cmp_q(time_base, stream->time_base) == 0;
+    }
+
+    inline bool save(const std::string& dir, const CacheKey& key, const AVFormatContext *fmt_ctx)
+    {
+        std::error_code ec;
+        std::filesystem::create_directories(dir, ec);
+
+        // written to a temporary file first, the other processes never read a partial cache
+        const auto path = cache_path(dir, key);
+        const auto tmp  = std::filesystem::path(path).concat(fmt::format(".{}.tmp", av_gettime()));
+        {
+            std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+            if (!out) return false;
+
+            put(out, CACHE_MAGIC);
+            put(out, CACHE_VERSION);
+            put(out, key.path);
+            put(out, key.size);
+            put(out, key.mtime);
+
+            put(out, fmt_ctx->nb_streams);
+            put(out, fmt_ctx->start_time);
+            put(out, fmt_ctx->duration);
+            put(out, fmt_ctx->bit_rate);
+            for (unsigned int i = 0; i < fmt_ctx->nb_streams; i++) {
+                put_params(out, fmt_ctx->streams[i]);
+            }
+
+            if (!out.flush()) {
+                out.close();
+                std::filesystem::remove(tmp, ec);
+                return false;
+            }
+        }
+
+        // the temporary files of the failed saves are not left in the cache directory
+        std::filesystem::rename(tmp, path, ec);
+        if (!ec) return true;
+
+        std::filesystem::remove(tmp, ec);
+        return false;
+    }
+
+    inline bool load(const std::string& dir, const CacheKey& key, AVFormatContext *fmt_ctx)
+    {
+        std::ifstream in(cache_path(dir, key), std::ios::binary);
+        if (!in) return false;
+
+        uint32_t magic = 0, version = 0;
+        CacheKey cached{};
+        if (!get(in, magic) || !get(in, version) || magic != CACHE_MAGIC || version != CACHE_VERSION ||
+            !get(in, cached.path) || !get(in, cached.size) || !get(in, cached.mtime)) {
+            return false;
+        }
+
+        if (cached.path != key.path || cached.size != key.size || cached.mtime != key.mtime) return false;
+
+        // the streams which are only found while probing, e.g. some mpegts streams, are not created yet
+        unsigned int nb_streams = 0;
+        if (!get(in, nb_streams) || nb_streams != fmt_ctx->nb_streams) return false;
+
+        int64_t start_time = 0, duration = 0, bit_rate = 0;
+        if (!get(in, start_time) || !get(in, duration) || !get(in, bit_rate)) return false;
+
+        // a truncated or corrupted cache leaves the context as the demuxer opened it
+        std::vector<StreamInfo> streams(nb_streams);
+        for (unsigned int i = 0; i < nb_streams; i++) {
+            if (!get_params(in, fmt_ctx->streams[i], streams[i])) return false;
+        }
+
+        for (unsigned int i = 0; i < nb_streams; i++) {
+            AVStream *stream = fmt_ctx->streams[i];
+            if (avcodec_parameters_copy(stream->codecpar, streams[i].params.get()) < 0) return false;
+
+            stream->avg_frame_rate      = streams[i].avg_frame_rate;
+            stream->r_frame_rate        = streams[i].r_frame_rate;
+            stream->sample_aspect_ratio = streams[i].sample_aspect_ratio;
+            stream->start_time          = streams[i].start_time;
+            stream->duration            = streams[i].duration;
+        }
+
+        fmt_ctx->start_time = start_time;
+        fmt_ctx->duration   = duration;
+        fmt_ctx->bit_rate   = bit_rate;
+        return true;
+    }
+} // namespace probe
+
+// avformat_open_input() + avformat_find_stream_info() with bounded probing and the stream information cache
+inline int open_input(AVFormatContext **fmt_ctx, const std::string& filename,
+                      const AVInputFormat *input_fmt, AVDictionary **options,
+                      const ProbeOptions& probe_options)
+{
+    const int64_t start = av_gettime_relative();
+
+    AVDictionary *input_options = nullptr;
+    defer(av_dict_free(&input_options));
+    if (options) av_dict_copy(&input_options, *options, 0);
+
+    if (probe_options.probesize > 0) {
+        av_dict_set_int(&input_options, "probesize", probe_options.probesize, 0);
+    }
+    if (probe_options.analyzeduration > 0) {
+        av_dict_set_int(&input_options, "analyzeduration", probe_options.analyzeduration, 0);
+    }
+
+#if LIBAVFORMAT_VERSION_MAJOR >= 59
+    int ret = avformat_open_input(fmt_ctx, filename.c_str(), input_fmt, &input_options);
+#else
+    int ret = avformat_open_input(fmt_ctx, filename.c_str(), const_cast<AVInputFormat *>(input_fmt),
+                                  &input_options);
+#endif
+    if (ret < 0) return ret;
+
+    if (options) {
+        av_dict_free(options);
+        av_dict_copy(options, input_options, 0);
+    }
+
+    const auto key = probe_options.cache_dir.empty() ? std::nullopt : probe::cache_key(filename);
+    if (key && probe::load(probe_options.cache_dir, key.value(), *fmt_ctx)) {
+        LOG(INFO) << fmt::format("[PROBE] {}: cached, {:.3f}ms", filename,
+                                 (av_gettime_relative() - start) / 1000.0);
+        return 0;
+    }
+
+    if ((ret = avformat_find_stream_info(*fmt_ctx, nullptr)) < 0) {
+        avformat_close_input(fmt_ctx);
+        return ret;
+    }
+
+    if (key && !probe::save(probe_options.cache_dir, key.value(), *fmt_ctx)) {
+        LOG(WARNING) << "[PROBE] failed to save the stream information to " << probe_options.cache_dir;
+    }
+
+    LOG(INFO) << fmt::format("[PROBE] {}: probed, {:.3f}ms", filename,
+                             (av_gettime_relative() - start) / 1000.0);
+    return 0;
+}
+
+#endif // !FFMPEG_EXAMPLES_PROBE_H
@@ -0,0 +1,26 @@
+#ifndef FFMPEG_EXAMPLES_TIMESTAMP_H
+#define FFMPEG_EXAMPLES_TIMESTAMP_H
+
+extern "C" {
+#include <libavcodec/packet.h>
+#include <libavutil/avutil.h>
+}
+#include <cstdint>
+
+// The muxers reject a dts not greater than the previous one of the stream, e.g. at the joints of the
+// inputs or chunks concatenated. A non-monotonic dts is bumped to 'last_dts' + 1, and the pts to the dts
+// if it becomes lower. 'last_dts' is updated, AV_NOPTS_VALUE: the first packet of the stream.
+// true: the dts is adjusted
+inline bool fix_monotonic_dts(AVPacket *packet, int64_t& last_dts)
+{
+    bool fixed = false;
+    if (packet->dts != AV_NOPTS_VALUE && last_dts != AV_NOPTS_VALUE && packet->dts <= last_dts) {
+        packet->dts = last_dts + 1;
+        if (packet->pts != AV_NOPTS_VALUE && packet->pts < packet->dts) packet->pts = packet->dts;
+        fixed = true;
+    }
+    if (packet->dts != AV_NOPTS_VALUE) last_dts = packet->dts;
+    return fixed;
+}
+
+#endif // !FFMPEG_EXAMPLES_TIMESTAMP_H